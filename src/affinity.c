@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * where event loops run.  cpu_affinity picks a cpu for each
+ * loop ("compact", "scatter" across NUMA nodes, or an explicit
+ * list), and each loop thread pins itself there.  A loop's
+ * memory comes from its own node when libnuma is around.  With
+ * several pinned loops, a socket filter steers each connection
+ * to the loop on the cpu that received it.  Exec workers are
+ * forked from a loop and loosened to every cpu on its node.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#ifdef HAVE_LIBNUMA
+# include <numa.h>
+#endif
+
+#include "main.h"
+#include "debug.h"
+#include "affinity.h"
+
+static cpu_set_t g_affinity_allowed;      /* what we were started with */
+static int *g_affinity_cpus = NULL;       /* cpu per loop, -1 if unpinned */
+static int *g_affinity_nodes = NULL;      /* node per loop, -1 if unknown */
+static int g_affinity_loops = 0;
+#ifdef HAVE_LIBNUMA
+static int g_affinity_numa = FALSE;       /* libnuma is usable */
+#endif
+
+/**
+ * NUMA node a cpu belongs to, from sysfs
+ *
+ * @param cpu cpu number
+ * @returns node number, or -1 if we can't tell
+ */
+static int affinity_cpu_node(int cpu) {
+    char path[64];
+    struct dirent *de;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if(!(dir = opendir(path)))
+        return -1;
+
+    while((de = readdir(dir))) {
+        if(!strncmp(de->d_name, "node", 4) && isdigit((unsigned char)de->d_name[4])) {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+/**
+ * parse a cpu list like "0,2,4-7", keeping the order given
+ *
+ * @param list cpu list
+ * @param cpus filled in with cpu numbers
+ * @param max size of cpus
+ * @returns number of cpus, or -1 on a parse error
+ */
+static int affinity_parse_list(char *list, int *cpus, int max) {
+    char *p = list, *end;
+    long first, last;
+    int count = 0;
+
+    while(*p) {
+        first = strtol(p, &end, 10);
+        if(end == p || first < 0)
+            return -1;
+
+        last = first;
+        if(*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first)
+                return -1;
+        }
+
+        for(; first <= last; first++) {
+            if(first >= CPU_SETSIZE)
+                return -1;
+
+            if(!CPU_ISSET(first, &g_affinity_allowed)) {
+                WARN("cpu %ld isn't available to us, skipping", first);
+                continue;
+            }
+
+            if(count < max)
+                cpus[count++] = (int)first;
+        }
+
+        if(*end == ',')
+            end++;
+        else if(*end)
+            return -1;
+
+        p = end;
+    }
+
+    return count;
+}
+
+/**
+ * work out which cpu each loop runs on
+ *
+ * @param policy "none", "compact", "scatter", "auto" or a cpu list
+ * @param loops number of event loops
+ * @param threaded whether the loops are threads (for "auto")
+ * @returns TRUE on success, FALSE on a bad policy
+ */
+int affinity_init(char *policy, int loops, int threaded) {
+    int usable[CPU_SETSIZE];
+    int nodes[CPU_SETSIZE];
+    int node_ids[CPU_SETSIZE];
+    int node_count = 0;
+    int count = 0;
+    int cpu, index, node, nth, seen;
+
+    if(sched_getaffinity(0, sizeof(g_affinity_allowed), &g_affinity_allowed) < 0) {
+        ERROR("Cannot get cpu affinity: %s", strerror(errno));
+        return FALSE;
+    }
+
+#ifdef HAVE_LIBNUMA
+    g_affinity_numa = (numa_available() != -1);
+#endif
+
+    g_affinity_loops = loops;
+    g_affinity_cpus = (int *)malloc(loops * sizeof(int));
+    g_affinity_nodes = (int *)malloc(loops * sizeof(int));
+    if(!g_affinity_cpus || !g_affinity_nodes) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    for(index = 0; index < loops; index++)
+        g_affinity_cpus[index] = g_affinity_nodes[index] = -1;
+
+    if(!strcasecmp(policy, "auto"))
+        policy = threaded ? "compact" : "none";
+
+    if(!strcasecmp(policy, "none"))
+        return TRUE;
+
+    if(!strcasecmp(policy, "compact") || !strcasecmp(policy, "scatter")) {
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &g_affinity_allowed))
+                usable[count++] = cpu;
+        }
+    } else {
+        count = affinity_parse_list(policy, usable, CPU_SETSIZE);
+        if(count == -1) {
+            ERROR("Bad cpu_affinity: %s", policy);
+            return FALSE;
+        }
+    }
+
+    if(!count) {
+        WARN("No usable cpus for cpu_affinity %s, not pinning", policy);
+        return TRUE;
+    }
+
+    for(index = 0; index < count; index++) {
+        nodes[index] = affinity_cpu_node(usable[index]);
+
+        for(node = 0; node < node_count; node++) {
+            if(node_ids[node] == nodes[index])
+                break;
+        }
+        if(node == node_count)
+            node_ids[node_count++] = nodes[index];
+    }
+
+    for(index = 0; index < loops; index++) {
+        if(strcasecmp(policy, "scatter") || node_count < 2) {
+            nth = index % count;
+        } else {
+            /* the (index / node_count)th cpu on node index % node_count */
+            node = node_ids[index % node_count];
+            seen = 0;
+            for(nth = 0; nth < count; nth++) {
+                if(nodes[nth] == node)
+                    seen++;
+            }
+
+            seen = (index / node_count) % seen;
+            for(nth = 0; nth < count; nth++) {
+                if(nodes[nth] == node && !seen--)
+                    break;
+            }
+        }
+
+        g_affinity_cpus[index] = usable[nth];
+        g_affinity_nodes[index] = nodes[nth];
+        INFO("Loop %d on cpu %d (node %d)", index, usable[nth], nodes[nth]);
+    }
+
+    return TRUE;
+}
+
+/**
+ * cpu a loop is pinned to
+ *
+ * @param loop_id loop number
+ * @returns cpu, or -1 if not pinned
+ */
+int affinity_cpu(int loop_id) {
+    if(!g_affinity_cpus || loop_id >= g_affinity_loops)
+        return -1;
+
+    return g_affinity_cpus[loop_id];
+}
+
+/**
+ * NUMA node a loop runs on
+ *
+ * @param loop_id loop number
+ * @returns node, or -1 if not pinned (or unknown)
+ */
+int affinity_node(int loop_id) {
+    if(!g_affinity_nodes || loop_id >= g_affinity_loops)
+        return -1;
+
+    return g_affinity_nodes[loop_id];
+}
+
+/**
+ * pin the calling thread to its loop's cpu, and have it
+ * allocate from its own node from here on
+ *
+ * @param loop_id loop number
+ */
+void affinity_pin(int loop_id) {
+    cpu_set_t cpus;
+    int cpu = affinity_cpu(loop_id);
+    int err;
+
+    if(cpu == -1)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if((err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))) {
+        WARN("Could not pin loop %d to cpu %d: %s", loop_id, cpu, strerror(err));
+        return;
+    }
+
+#ifdef HAVE_LIBNUMA
+    /* in case we were started under an interleave policy */
+    if(g_affinity_numa)
+        numa_set_localalloc();
+#endif
+}
+
+/**
+ * loosen a forked helper process from its loop's cpu to every
+ * cpu on the loop's node, so exec'd programs don't all fight
+ * over one core but still stay near the loop they serve
+ *
+ * @param loop_id loop the process works for
+ */
+void affinity_release(int loop_id) {
+    cpu_set_t cpus;
+    int node = affinity_node(loop_id);
+    int cpu;
+
+    if(affinity_cpu(loop_id) == -1)
+        return;
+
+    CPU_ZERO(&cpus);
+    if(node != -1) {
+        for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &g_affinity_allowed) && affinity_cpu_node(cpu) == node)
+                CPU_SET(cpu, &cpus);
+        }
+    }
+
+    if(!CPU_COUNT(&cpus))
+        memcpy(&cpus, &g_affinity_allowed, sizeof(cpus));
+
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+/**
+ * tell the kernel which cpu a loop's listener belongs to
+ *
+ * @param fd listening socket
+ * @param loop_id loop the listener belongs to
+ */
+void affinity_listen(int fd, int loop_id) {
+#ifdef SO_INCOMING_CPU
+    int cpu = affinity_cpu(loop_id);
+
+    if(cpu == -1)
+        return;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0)
+        WARN("Cannot set SO_INCOMING_CPU on loop %d: %s", loop_id, strerror(errno));
+#endif
+}
+
+/**
+ * steer each new connection in a reuseport group to the loop
+ * pinned to the cpu that took its packets.  Connections on
+ * cpus without a loop are spread by cpu number.  The listeners
+ * must have joined the group in loop order.
+ *
+ * @param fd any listener in the group
+ * @param loops number of listeners (and loops)
+ * @returns TRUE if steering is in place, FALSE otherwise
+ */
+int affinity_steer(int fd, int loops) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter *code;
+    struct sock_fprog prog;
+    int index, len = 0;
+    int res;
+
+    if(loops < 2 || affinity_cpu(0) == -1)
+        return FALSE;
+
+    /* with loops sharing cpus, the kernel's hash does as well */
+    for(index = 1; index < loops; index++) {
+        for(len = 0; len < index; len++) {
+            if(affinity_cpu(index) == affinity_cpu(len)) {
+                DEBUG("Loops share cpus, not steering connections");
+                return FALSE;
+            }
+        }
+    }
+    len = 0;
+
+    code = (struct sock_filter *)calloc(2 * loops + 3, sizeof(struct sock_filter));
+    if(!code) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                               SKF_AD_OFF + SKF_AD_CPU);
+    for(index = 0; index < loops; index++) {
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                   affinity_cpu(index), 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, index);
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, loops);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = len;
+    prog.filter = code;
+
+    res = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    free(code);
+
+    if(res < 0) {
+        WARN("Cannot steer connections by cpu: %s", strerror(errno));
+        return FALSE;
+    }
+
+    INFO("Steering connections to the loop on their cpu");
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * allocate zeroed memory on a NUMA node, when we can
+ *
+ * @param size bytes to allocate
+ * @param node node to allocate on, or -1 for anywhere
+ * @returns memory, or NULL on error
+ */
+void *affinity_alloc(size_t size, int node) {
+#ifdef HAVE_LIBNUMA
+    if(g_affinity_numa)
+        return node == -1 ? numa_alloc_local(size) : numa_alloc_onnode(size, node);
+#endif
+
+    return calloc(1, size);
+}
+
+/**
+ * free memory from affinity_alloc()
+ *
+ * @param ptr memory to free
+ * @param size size it was allocated with
+ */
+void affinity_free(void *ptr, size_t size) {
+    if(!ptr)
+        return;
+
+#ifdef HAVE_LIBNUMA
+    if(g_affinity_numa) {
+        numa_free(ptr, size);
+        return;
+    }
+#endif
+
+    free(ptr);
+}
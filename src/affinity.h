@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <stddef.h>
+
+/*
+ * where event loops (and their exec workers) run, and where
+ * their memory comes from.  The policy is one of:
+ *
+ *   none      no pinning at all
+ *   compact   loop N on the Nth usable cpu
+ *   scatter   loops spread round-robin across NUMA nodes
+ *   <list>    explicit cpus, like "0,2,4-7", used in order
+ *   auto      compact when running threads, none otherwise
+ */
+
+extern int affinity_init(char *policy, int loops, int threaded);
+extern int affinity_cpu(int loop_id);
+extern int affinity_node(int loop_id);
+extern void affinity_pin(int loop_id);
+extern void affinity_release(int loop_id);
+extern void affinity_listen(int fd, int loop_id);
+extern int affinity_steer(int fd, int loops);
+extern void *affinity_alloc(size_t size, int node);
+extern void affinity_free(void *ptr, size_t size);
+
+#endif /* _AFFINITY_H_ */
@@ -0,0 +1,558 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * file contents shared between every client downloading the
+ * same file.  Chunks are loaded on first use, attached to
+ * client output buffers by reference (no copy), and freed
+ * when the last buffer holding them drains.  Files that fit
+ * are kept in a table keyed by device and inode, and checked
+ * against mtime and size on every open; the table holds at
+ * most max_bytes of loaded chunks, least recently opened
+ * files going first.  Files too big for that, or pushed out
+ * of it, stay in the table only while someone is sending
+ * them, and their chunks only while some client output still
+ * holds them -- a crowd downloading the same big file at the
+ * same time still reads each chunk once.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "debug.h"
+#include "chunk.h"
+
+#define CHUNK_HASH_SIZE 1024
+
+static pthread_mutex_t g_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static chunk_file_t *g_chunk_hash[CHUNK_HASH_SIZE];
+static chunk_file_t *g_chunk_lru_head = NULL;   /* most recently opened */
+static chunk_file_t *g_chunk_lru_tail = NULL;
+static size_t g_chunk_bytes = 0;                /* loaded by cached files */
+static size_t g_chunk_max = 0;
+
+/**
+ * make a chunk for the caller to fill in.  It must not change
+ * once it has been shared.
+ *
+ * @param len bytes of data
+ * @returns chunk with one reference, or NULL
+ */
+chunk_t *chunk_new(size_t len) {
+    chunk_t *chunk;
+
+    chunk = (chunk_t *)malloc(sizeof(chunk_t) + len);
+    if(!chunk) {
+        ERROR("malloc");
+        return NULL;
+    }
+
+    chunk->refs = 1;
+    chunk->file = NULL;
+    chunk->index = 0;
+    chunk->len = len;
+    return chunk;
+}
+
+static void chunk_file_unref(chunk_file_t *file);
+
+/**
+ * drop a reference to a chunk
+ *
+ * @param chunk chunk to release
+ */
+void chunk_unref(chunk_t *chunk) {
+    chunk_file_t *file;
+
+    if(__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    /* an uncached file's slot doesn't hold a reference; empty
+     * it unless someone's already loaded a new one */
+    if((file = chunk->file)) {
+        pthread_mutex_lock(&g_chunk_lock);
+        if(file->chunks[chunk->index] == chunk)
+            file->chunks[chunk->index] = NULL;
+        chunk_file_unref(file);
+        pthread_mutex_unlock(&g_chunk_lock);
+    }
+
+    free(chunk);
+}
+
+/**
+ * take a reference to a chunk from a file's slot, unless it's
+ * already on its way out.  Called with the lock held.
+ */
+static int chunk_ref_live(chunk_t *chunk) {
+    int refs = __atomic_load_n(&chunk->refs, __ATOMIC_RELAXED);
+
+    while(refs) {
+        if(__atomic_compare_exchange_n(&chunk->refs, &refs, refs + 1, FALSE,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * a client output buffer is done with a chunk
+ */
+static void on_chunk_drained(const void *data, size_t len, void *extra) {
+    chunk_unref((chunk_t *)extra);
+}
+
+/**
+ * attach a chunk to a client's output.  The buffer takes its
+ * own reference.
+ *
+ * @param chunk chunk to send
+ * @param output client output buffer
+ * @returns TRUE on success, FALSE otherwise
+ */
+int chunk_add(chunk_t *chunk, struct evbuffer *output) {
+    if(!chunk->len)
+        return TRUE;
+
+    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+    if(evbuffer_add_reference(output, chunk->data, chunk->len,
+                              on_chunk_drained, chunk) < 0) {
+        chunk_unref(chunk);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static uint32_t chunk_hash(dev_t dev, ino_t ino) {
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+
+    return (uint32_t)key & (CHUNK_HASH_SIZE - 1);
+}
+
+/**
+ * let go of every chunk a cached file holds.  Called with the
+ * lock held.
+ */
+static void chunk_file_release(chunk_file_t *file) {
+    int index;
+
+    /* files too big to cache never get a chunk table */
+    if(!file->chunks)
+        return;
+
+    for(index = 0; index < file->chunk_count; index++) {
+        if(file->chunks[index]) {
+            chunk_unref(file->chunks[index]);
+            file->chunks[index] = NULL;
+        }
+    }
+
+    if(file->cached)
+        g_chunk_bytes -= file->loaded;
+    file->loaded = 0;
+}
+
+/**
+ * make a file unfindable.  Called with the lock held.
+ */
+static void chunk_file_unhash(chunk_file_t *file) {
+    chunk_file_t **pf;
+
+    if(!file->hashed)
+        return;
+
+    for(pf = &g_chunk_hash[chunk_hash(file->dev, file->ino)]; *pf;
+        pf = &(*pf)->hash_next) {
+        if(*pf == file) {
+            *pf = file->hash_next;
+            break;
+        }
+    }
+
+    file->hashed = FALSE;
+}
+
+/**
+ * drop a reference to a file.  Called with the lock held.
+ */
+static void chunk_file_unref(chunk_file_t *file) {
+    if(__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    /* nobody's sending it and no slot's still filled */
+    chunk_file_unhash(file);
+    free(file->chunks);
+    free(file);
+}
+
+static void chunk_lru_unlink(chunk_file_t *file) {
+    if(file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        g_chunk_lru_head = file->lru_next;
+
+    if(file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        g_chunk_lru_tail = file->lru_prev;
+
+    file->lru_next = file->lru_prev = NULL;
+}
+
+static void chunk_lru_push(chunk_file_t *file) {
+    file->lru_prev = NULL;
+    file->lru_next = g_chunk_lru_head;
+    if(g_chunk_lru_head)
+        g_chunk_lru_head->lru_prev = file;
+    else
+        g_chunk_lru_tail = file;
+    g_chunk_lru_head = file;
+}
+
+/**
+ * stop keeping a file's chunks, and drop the cache's
+ * reference.  Anyone still sending it carries on sharing it
+ * as an uncached file.  Called with the lock held.
+ */
+static void chunk_cache_evict(chunk_file_t *file) {
+    if(!file->cached)
+        return;
+
+    chunk_lru_unlink(file);
+    chunk_file_release(file);
+    file->cached = FALSE;
+    chunk_file_unref(file);
+}
+
+/**
+ * take a file out of the table altogether.  Called with the
+ * lock held.
+ */
+static void chunk_cache_remove(chunk_file_t *file) {
+    chunk_file_unhash(file);
+    chunk_cache_evict(file);
+}
+
+/**
+ * push files out until we're back under the limit.  Called
+ * with the lock held.
+ */
+static void chunk_cache_trim(void) {
+    while(g_chunk_bytes > g_chunk_max && g_chunk_lru_tail) {
+        DEBUG("Dropping cached file %lu from memory",
+              (unsigned long)g_chunk_lru_tail->ino);
+        chunk_cache_evict(g_chunk_lru_tail);
+    }
+}
+
+/**
+ * set up the shared file table
+ *
+ * @param max_bytes most file data to keep loaded (0 for none)
+ * @returns TRUE on success, FALSE otherwise
+ */
+int chunk_cache_init(size_t max_bytes) {
+    g_chunk_max = max_bytes;
+    return TRUE;
+}
+
+/**
+ * empty the shared file table.  Files still being sent go
+ * away when their clients do.
+ */
+void chunk_cache_deinit(void) {
+    int bucket;
+
+    pthread_mutex_lock(&g_chunk_lock);
+    for(bucket = 0; bucket < CHUNK_HASH_SIZE; bucket++) {
+        while(g_chunk_hash[bucket])
+            chunk_cache_remove(g_chunk_hash[bucket]);
+    }
+    pthread_mutex_unlock(&g_chunk_lock);
+}
+
+/**
+ * get the shared copy of an open file, making one if there
+ * isn't a current one
+ *
+ * @param fd open file
+ * @param st fstat() of fd
+ * @returns referenced file, to be chunk_file_close()d, or NULL
+ */
+chunk_file_t *chunk_file_open(int fd, struct stat *st) {
+    chunk_file_t *file;
+    uint32_t bucket = chunk_hash(st->st_dev, st->st_ino);
+
+    pthread_mutex_lock(&g_chunk_lock);
+
+    for(file = g_chunk_hash[bucket]; file; file = file->hash_next) {
+        if(file->dev == st->st_dev && file->ino == st->st_ino)
+            break;
+    }
+
+    if(file) {
+        if(file->size == st->st_size &&
+           file->mtime.tv_sec == st->st_mtim.tv_sec &&
+           file->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&file->senders, 1, __ATOMIC_RELAXED);
+            if(file->cached) {
+                chunk_lru_unlink(file);
+                chunk_lru_push(file);
+            }
+            pthread_mutex_unlock(&g_chunk_lock);
+            return file;
+        }
+
+        /* changed on disk -- anyone still sending the old one
+         * carries on with what they have */
+        chunk_cache_remove(file);
+    }
+
+    file = (chunk_file_t *)calloc(1, sizeof(chunk_file_t));
+    if(!file) {
+        pthread_mutex_unlock(&g_chunk_lock);
+        ERROR("malloc");
+        return NULL;
+    }
+
+    file->refs = 1;
+    file->senders = 1;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime = st->st_mtim;
+    file->chunk_count = (int)((st->st_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+    /* without a slot table it's just sent privately */
+    if(file->chunk_count &&
+       (file->chunks = (chunk_t **)calloc(file->chunk_count, sizeof(chunk_t *)))) {
+        file->hashed = TRUE;
+        file->hash_next = g_chunk_hash[bucket];
+        g_chunk_hash[bucket] = file;
+
+        if((size_t)st->st_size <= g_chunk_max) {
+            file->cached = TRUE;
+            file->refs++;
+            chunk_lru_push(file);
+        }
+    }
+
+    pthread_mutex_unlock(&g_chunk_lock);
+    return file;
+}
+
+/**
+ * take another reference to an open file
+ *
+ * @param file file from chunk_file_open()
+ * @returns file
+ */
+chunk_file_t *chunk_file_ref(chunk_file_t *file) {
+    pthread_mutex_lock(&g_chunk_lock);
+    file->refs++;
+    __atomic_add_fetch(&file->senders, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_chunk_lock);
+    return file;
+}
+
+/**
+ * done with a file (its chunks may still be draining)
+ *
+ * @param file file from chunk_file_open()
+ */
+void chunk_file_close(chunk_file_t *file) {
+    if(!file)
+        return;
+
+    pthread_mutex_lock(&g_chunk_lock);
+    __atomic_sub_fetch(&file->senders, 1, __ATOMIC_RELAXED);
+    chunk_file_unref(file);
+    pthread_mutex_unlock(&g_chunk_lock);
+}
+
+/**
+ * is anyone else sending this file?  Counts every open of
+ * the same file, cached or not, until it changes on disk.
+ *
+ * @param file file from chunk_file_open()
+ * @returns TRUE if more than one client has it open
+ */
+int chunk_file_shared(chunk_file_t *file) {
+    return __atomic_load_n(&file->senders, __ATOMIC_RELAXED) > 1;
+}
+
+/**
+ * read a chunk of a file from disk
+ */
+static chunk_t *chunk_load(chunk_file_t *file, int fd, int index) {
+    chunk_t *chunk;
+    off_t offset = (off_t)index * CHUNK_SIZE;
+    size_t len = CHUNK_SIZE;
+    ssize_t got;
+
+    if(file->size - offset < (off_t)len)
+        len = (size_t)(file->size - offset);
+
+    if(!(chunk = chunk_new(len)))
+        return NULL;
+
+    chunk->len = 0;
+
+    while(chunk->len < len) {
+        got = pread(fd, chunk->data + chunk->len, len - chunk->len,
+                    offset + chunk->len);
+        if(got < 0 && errno == EINTR)
+            continue;
+
+        if(got < 0) {
+            free(chunk);
+            return NULL;
+        }
+
+        if(!got)  /* file shrank */
+            break;
+
+        chunk->len += got;
+    }
+
+    return chunk;
+}
+
+/**
+ * attach one chunk of a file to a client's output, loading
+ * it if nobody has yet
+ *
+ * @param file file from chunk_file_open()
+ * @param fd the client's open fd for the file
+ * @param index chunk to send
+ * @param output client output buffer
+ * @returns bytes attached, 0 at end of file, -1 on error
+ */
+ssize_t chunk_file_add(chunk_file_t *file, int fd, int index,
+                       struct evbuffer *output) {
+    chunk_t *chunk = NULL;
+    chunk_t *loaded;
+
+    if(index >= file->chunk_count)
+        return 0;
+
+    pthread_mutex_lock(&g_chunk_lock);
+    if(file->chunks && (chunk = file->chunks[index]) && !chunk_ref_live(chunk))
+        chunk = NULL;
+    pthread_mutex_unlock(&g_chunk_lock);
+
+    if(!chunk) {
+        /* read outside the lock -- if someone else loads the
+         * same chunk meanwhile, theirs wins */
+        if(!(loaded = chunk_load(file, fd, index)))
+            return -1;
+
+        pthread_mutex_lock(&g_chunk_lock);
+        if(file->chunks && (chunk = file->chunks[index]) && chunk_ref_live(chunk)) {
+            free(loaded);
+        } else {
+            chunk = loaded;
+            if(file->chunks && chunk->len) {
+                file->chunks[index] = chunk;
+                if(file->cached) {
+                    __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+                    file->loaded += chunk->len;
+                    g_chunk_bytes += chunk->len;
+                    chunk_cache_trim();
+                } else {
+                    /* the slot's only good while someone holds it */
+                    chunk->file = file;
+                    chunk->index = index;
+                    file->refs++;
+                }
+            }
+        }
+        pthread_mutex_unlock(&g_chunk_lock);
+    }
+
+    if(!chunk->len) {
+        chunk_unref(chunk);
+        return 0;
+    }
+
+    if(evbuffer_add_reference(output, chunk->data, chunk->len,
+                              on_chunk_drained, chunk) < 0) {
+        chunk_unref(chunk);
+        return -1;
+    }
+
+    return (ssize_t)chunk->len;
+}
+
+/**
+ * load one chunk of a file into the table ahead of anyone
+ * asking for it.  Files too big for the table are left alone.
+ *
+ * @param file file from chunk_file_open()
+ * @param fd open fd for the file
+ * @param index chunk to load
+ * @returns bytes read from disk (0 if there was nothing to do),
+ *          -1 on error
+ */
+ssize_t chunk_file_warm(chunk_file_t *file, int fd, int index) {
+    chunk_t *chunk;
+    ssize_t len;
+
+    if(index >= file->chunk_count)
+        return 0;
+
+    pthread_mutex_lock(&g_chunk_lock);
+    if(!file->cached || file->chunks[index]) {
+        pthread_mutex_unlock(&g_chunk_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&g_chunk_lock);
+
+    if(!(chunk = chunk_load(file, fd, index)))
+        return -1;
+
+    len = (ssize_t)chunk->len;
+
+    pthread_mutex_lock(&g_chunk_lock);
+    if(file->cached && !file->chunks[index] && chunk->len) {
+        /* the table keeps the load's reference */
+        file->chunks[index] = chunk;
+        file->loaded += chunk->len;
+        g_chunk_bytes += chunk->len;
+        chunk_cache_trim();
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&g_chunk_lock);
+
+    if(chunk)
+        chunk_unref(chunk);
+
+    return len;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <event.h>
+
+#define CHUNK_SIZE (64 * 1024)
+
+/* a piece of a file's contents.  Never changes once loaded;
+ * every client output buffer it's attached to holds a
+ * reference, and the last one to drain frees it. */
+typedef struct chunk_t {
+    int refs;
+    struct chunk_file_t *file;       /* uncached file it's a slot of */
+    int index;                       /* which slot */
+    size_t len;
+    char data[];
+} chunk_t;
+
+/* a file, split into chunks that are loaded as someone needs
+ * them.  Shared by every client downloading the same file, as
+ * long as it doesn't change under us. */
+typedef struct chunk_file_t {
+    int refs;                        /* clients, the cache, uncached chunks */
+    int senders;                     /* clients, whether it's cached or not */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int chunk_count;
+    chunk_t **chunks;                /* NULL until loaded */
+    size_t loaded;                   /* bytes in chunks */
+
+    int cached;                      /* kept after its clients go */
+    int hashed;                      /* findable in the table */
+    struct chunk_file_t *hash_next;
+    struct chunk_file_t *lru_next;
+    struct chunk_file_t *lru_prev;
+} chunk_file_t;
+
+extern chunk_t *chunk_new(size_t len);
+extern void chunk_unref(chunk_t *chunk);
+extern int chunk_add(chunk_t *chunk, struct evbuffer *output);
+
+extern int chunk_cache_init(size_t max_bytes);
+extern void chunk_cache_deinit(void);
+extern chunk_file_t *chunk_file_open(int fd, struct stat *st);
+extern chunk_file_t *chunk_file_ref(chunk_file_t *file);
+extern void chunk_file_close(chunk_file_t *file);
+extern int chunk_file_shared(chunk_file_t *file);
+extern ssize_t chunk_file_add(chunk_file_t *file, int fd, int index,
+                              struct evbuffer *output);
+extern ssize_t chunk_file_warm(chunk_file_t *file, int fd, int index);
+
+#endif /* _CHUNK_H_ */
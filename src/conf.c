@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "debug.h"
+#include "conf.h"
+#include "proxy.h"
+
+#define MAX_CONF_LINE 1024
+
+typedef enum conf_type_t {
+    CONF_INT,
+    CONF_PORT,
+    CONF_SIZE,      /* bytes, with optional k/m/g suffix */
+    CONF_STRING,
+    CONF_HANDLER
+} conf_type_t;
+
+typedef struct conf_option_t {
+    char *name;
+    conf_type_t type;
+    size_t offset;
+    int (*handler_fn)(char *value);  /* CONF_HANDLER only, may repeat */
+} conf_option_t;
+
+#define CONF_OPTION(name, type) { #name, type, offsetof(gopher_conf_t, name), NULL }
+#define CONF_HANDLER(name, fn) { #name, CONF_HANDLER, 0, fn }
+
+/* scalar settings we know how to read.  Anything else in the
+ * config file (dispatchers, etc) is skipped for now. */
+static conf_option_t conf_options[] = {
+    CONF_OPTION(port, CONF_PORT),
+    CONF_OPTION(base_dir, CONF_STRING),
+    CONF_OPTION(server_name, CONF_STRING),
+    CONF_OPTION(unpriv_user, CONF_STRING),
+    CONF_OPTION(debug_level, CONF_INT),
+    CONF_OPTION(drop_core, CONF_INT),
+    CONF_OPTION(socket_backlog, CONF_INT),
+    CONF_OPTION(threads, CONF_INT),
+    CONF_OPTION(steal_margin, CONF_INT),
+    CONF_OPTION(cpu_affinity, CONF_STRING),
+    CONF_OPTION(io_engine, CONF_STRING),
+    CONF_OPTION(serve_http, CONF_INT),
+    CONF_OPTION(gplus_admin, CONF_STRING),
+    CONF_OPTION(gplus_cache_size, CONF_INT),
+    CONF_OPTION(tls_port, CONF_INT),
+    CONF_OPTION(tls_cert, CONF_STRING),
+    CONF_OPTION(tls_key, CONF_STRING),
+    CONF_OPTION(tls_session_cache, CONF_INT),
+    CONF_OPTION(file_cache_size, CONF_SIZE),
+    CONF_OPTION(readahead_max, CONF_SIZE),
+    CONF_OPTION(readahead_budget, CONF_SIZE),
+    CONF_OPTION(readahead_dontneed_size, CONF_SIZE),
+    CONF_OPTION(send_low_watermark, CONF_SIZE),
+    CONF_OPTION(send_high_watermark, CONF_SIZE),
+    CONF_OPTION(hotset_file, CONF_STRING),
+    CONF_OPTION(hotset_size, CONF_INT),
+    CONF_OPTION(hotset_interval, CONF_INT),
+    CONF_OPTION(hotset_warmup_bytes, CONF_SIZE),
+    CONF_OPTION(hotset_warmup_rate, CONF_SIZE),
+    CONF_OPTION(fs_threads, CONF_INT),
+    CONF_OPTION(negcache_size, CONF_INT),
+    CONF_OPTION(dir_index_path, CONF_STRING),
+    CONF_OPTION(dir_index_threshold, CONF_INT),
+    CONF_OPTION(dir_page_size, CONF_INT),
+    CONF_OPTION(search_selector, CONF_STRING),
+    CONF_OPTION(search_index, CONF_STRING),
+    CONF_OPTION(search_max_file_size, CONF_SIZE),
+    CONF_OPTION(search_max_results, CONF_INT),
+    CONF_OPTION(pack_file, CONF_STRING),
+    CONF_OPTION(exec_workers, CONF_INT),
+    CONF_OPTION(exec_queue, CONF_INT),
+    CONF_HANDLER(proxy, proxy_conf),
+    CONF_OPTION(proxy_max_conns, CONF_INT),
+    CONF_OPTION(proxy_queue, CONF_INT),
+    CONF_OPTION(proxy_dns_ttl, CONF_INT),
+    CONF_OPTION(proxy_fail_ttl, CONF_INT),
+    CONF_OPTION(request_timeout, CONF_INT),
+    CONF_OPTION(write_timeout, CONF_INT),
+    CONF_OPTION(connection_timeout, CONF_INT),
+    CONF_OPTION(max_clients, CONF_INT),
+    CONF_OPTION(max_output_bytes, CONF_SIZE),
+    CONF_OPTION(overload_action, CONF_STRING),
+    CONF_OPTION(ratelimit_rate, CONF_INT),
+    CONF_OPTION(ratelimit_burst, CONF_INT),
+    CONF_OPTION(ratelimit_slots, CONF_INT),
+    CONF_OPTION(stats_selector, CONF_STRING),
+    CONF_OPTION(stats_top, CONF_INT),
+    CONF_OPTION(stats_half_life, CONF_INT),
+    CONF_OPTION(trace_ring_size, CONF_INT),
+    CONF_OPTION(trace_slow_ms, CONF_INT),
+    CONF_OPTION(loop_memory_budget, CONF_SIZE),
+    CONF_OPTION(client_output_budget, CONF_SIZE),
+    { NULL, CONF_INT, 0, NULL }
+};
+
+/**
+ * adjust bracket depth for a line of a compound value, ignoring
+ * anything inside of double quotes
+ *
+ * @param line line to scan
+ * @param depth current nesting depth
+ * @returns new nesting depth
+ */
+static int conf_depth(char *line, int depth) {
+    int quoted = FALSE;
+
+    for(; *line; line++) {
+        if(*line == '"')
+            quoted = !quoted;
+        if(quoted)
+            continue;
+        if(*line == '[' || *line == '{')
+            depth++;
+        if(*line == ']' || *line == '}')
+            depth--;
+    }
+
+    return depth;
+}
+
+/**
+ * set a single scalar option
+ *
+ * @param key option name
+ * @param value unquoted option value
+ * @returns TRUE on success, FALSE on bad value
+ */
+static int conf_set(char *key, char *value) {
+    conf_option_t *opt;
+    char *end;
+    long val;
+    unsigned long long size;
+    int shift;
+    void *dst;
+
+    for(opt = conf_options; opt->name; opt++) {
+        if(!strcmp(opt->name, key))
+            break;
+    }
+
+    if(!opt->name) {
+        DEBUG("Ignoring unknown config option %s", key);
+        return TRUE;
+    }
+
+    dst = (void*)((char*)&config + opt->offset);
+
+    switch(opt->type) {
+    case CONF_HANDLER:
+        return opt->handler_fn(value);
+    case CONF_STRING:
+        *(char**)dst = strdup(value);
+        if(!*(char**)dst) {
+            ERROR("malloc error");
+            return FALSE;
+        }
+        break;
+    case CONF_SIZE:
+        errno = 0;
+        shift = 0;
+        size = strtoull(value, &end, 0);
+        switch(tolower((unsigned char)*end)) {
+        case 'g':
+            shift = 30;
+            end++;
+            break;
+        case 'm':
+            shift = 20;
+            end++;
+            break;
+        case 'k':
+            shift = 10;
+            end++;
+            break;
+        default:
+            break;
+        }
+
+        /* strtoull() takes "-1" as a very big number */
+        if(errno || end == value || *end || strchr(value, '-') ||
+           size > (unsigned long long)SIZE_MAX >> shift) {
+            ERROR("Bad size for %s: %s", key, value);
+            return FALSE;
+        }
+
+        size <<= shift;
+
+        *(size_t*)dst = (size_t)size;
+        break;
+    case CONF_INT:
+    case CONF_PORT:
+        errno = 0;
+        val = strtol(value, &end, 0);
+        if(errno || end == value || *end) {
+            ERROR("Bad numeric value for %s: %s", key, value);
+            return FALSE;
+        }
+
+        if(opt->type == CONF_PORT) {
+            if(val < 1 || val > 65535) {
+                ERROR("Bad port for %s: %ld", key, val);
+                return FALSE;
+            }
+            *(uint16_t*)dst = (uint16_t)val;
+        } else {
+            *(int*)dst = (int)val;
+        }
+        break;
+    }
+
+    return TRUE;
+}
+
+/**
+ * read scalar "key = value" settings from the config file
+ * into the global config
+ *
+ * @param file config file to read
+ * @param must_exist whether a missing file is an error
+ * @returns TRUE on success, FALSE otherwise
+ */
+int conf_read(char *file, int must_exist) {
+    FILE *fp;
+    char line[MAX_CONF_LINE];
+    char *key, *value, *end;
+    int depth = 0;
+    int lineno = 0;
+    int retval = TRUE;
+
+    fp = fopen(file, "r");
+    if(!fp) {
+        if(errno == ENOENT && !must_exist) {
+            INFO("No config file %s, using defaults", file);
+            return TRUE;
+        }
+        ERROR("Cannot open config file %s: %s", file, strerror(errno));
+        return FALSE;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        if(depth) {
+            depth = conf_depth(line, depth);
+            continue;
+        }
+
+        key = line;
+        while(isspace(*key))
+            key++;
+
+        if(!*key || *key == '#')
+            continue;
+
+        value = strchr(key, '=');
+        if(!value) {
+            ERROR("Syntax error in %s, line %d", file, lineno);
+            retval = FALSE;
+            break;
+        }
+
+        end = value;
+        *value++ = '\0';
+        while(end > key && isspace(end[-1]))
+            *--end = '\0';
+
+        while(isspace(*value))
+            value++;
+
+        if(*value == '[' || *value == '{') {
+            /* compound value -- not ours */
+            depth = conf_depth(value, 0);
+            continue;
+        }
+
+        end = value + strlen(value);
+        while(end > value && isspace(end[-1]))
+            *--end = '\0';
+
+        if(*value == '"' && end - value > 1 && end[-1] == '"') {
+            end[-1] = '\0';
+            value++;
+        }
+
+        if(!conf_set(key, value)) {
+            ERROR("Bad config value in %s, line %d", file, lineno);
+            retval = FALSE;
+            break;
+        }
+    }
+
+    fclose(fp);
+    return retval;
+}
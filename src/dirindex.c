@@ -0,0 +1,826 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * paged menus for very large directories.
+ *
+ * A directory with more than dir_index_threshold entries is
+ * sorted and rendered once into an index file under
+ * dir_index_path: a header, a table of page offsets, then each
+ * page's menu lines (with links to the pages either side)
+ * back to back.  The file is mapped, so serving "dir/?page=N"
+ * is a lookup in the offset table and a reference to that
+ * slice -- nothing is read or formatted per request.
+ *
+ * Index files outlive the server and are picked up again at
+ * startup if the directory hasn't changed.  While running,
+ * indexed directories are watched with inotify and rebuilt by
+ * a background thread shortly after they change, with the old
+ * build served until the new one is ready.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "dirindex.h"
+#include "response.h"
+
+#define DIRINDEX_MAGIC "EGDIDX2"
+#define DIRINDEX_DEBOUNCE_MS 1000
+#define DIRINDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                             IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct dirindex_header_t {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint64_t entry_count;
+    uint32_t render_hash;    /* of the selector and menu tail used */
+    uint32_t pad;
+} dirindex_header_t;
+
+/* an indexed directory */
+typedef struct dirindex_dir_t {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+    int wd;
+    int dirty;
+    uint64_t due;             /* ms, when dirty */
+    dirindex_t *current;
+    struct dirindex_dir_t *next;
+} dirindex_dir_t;
+
+static pthread_mutex_t g_dirindex_lock = PTHREAD_MUTEX_INITIALIZER;
+static dirindex_dir_t *g_dirindex_dirs = NULL;
+static char *g_dirindex_path = NULL;
+static int g_dirindex_threshold = 0;
+static int g_dirindex_page_size = 0;
+static int g_dirindex_fd = -1;
+static int g_dirindex_wake[2] = { -1, -1 };
+static pthread_t g_dirindex_thread;
+static int g_dirindex_started = FALSE;
+
+static uint64_t dirindex_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* by name, past the item type */
+static int dirindex_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a + 1, *(char * const *)b + 1);
+}
+
+/**
+ * the selector for a directory, without trailing slashes,
+ * so "" for the root
+ *
+ * @param path directory, under base_dir
+ * @param selector buffer for the selector
+ * @param len size of selector
+ */
+void dirindex_selector(char *path, char *selector, size_t len) {
+    char *p = path + strlen(config.base_dir);
+    size_t sel_len;
+
+    while(p[0] == '/' && p[1] == '/')
+        p++;
+
+    snprintf(selector, len, "%s", p);
+    sel_len = strlen(selector);
+    while(sel_len && selector[sel_len - 1] == '/')
+        selector[--sel_len] = '\0';
+}
+
+static uint32_t dirindex_render_hash(char *selector) {
+    uint32_t hash = 2166136261U;
+    const char *tail;
+    size_t len;
+
+    while(*selector) {
+        hash ^= (unsigned char)*selector++;
+        hash *= 16777619U;
+    }
+
+    tail = response_menu_tail(&len);
+    while(len--) {
+        hash ^= (unsigned char)*tail++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void dirindex_file(dev_t dev, ino_t ino, char *file, size_t len) {
+    snprintf(file, len, "%s/%llx-%llx.idx", g_dirindex_path,
+             (unsigned long long)dev, (unsigned long long)ino);
+}
+
+/**
+ * map an index file, checking it was built for this directory
+ * as it is now
+ *
+ * @returns index, or NULL if it's missing or stale
+ */
+static dirindex_t *dirindex_map(char *file, struct stat *st, uint32_t render_hash) {
+    dirindex_header_t *header;
+    dirindex_t *index;
+    struct stat fst;
+    void *map;
+    int fd;
+
+    if((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+
+    if(fstat(fd, &fst) == -1 || fst.st_size < (off_t)sizeof(dirindex_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, fst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    header = (dirindex_header_t *)map;
+    if(memcmp(header->magic, DIRINDEX_MAGIC, sizeof(header->magic)) ||
+       header->dev != (uint64_t)st->st_dev ||
+       header->ino != (uint64_t)st->st_ino ||
+       header->mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+       header->mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+       header->page_size != (uint32_t)g_dirindex_page_size ||
+       header->render_hash != render_hash ||
+       !header->page_count ||
+       sizeof(dirindex_header_t) + (header->page_count + 1) * sizeof(uint64_t) >
+       (uint64_t)fst.st_size) {
+        munmap(map, fst.st_size);
+        return NULL;
+    }
+
+    if(!(index = (dirindex_t *)calloc(1, sizeof(dirindex_t)))) {
+        munmap(map, fst.st_size);
+        return NULL;
+    }
+
+    index->refs = 1;
+    index->map = map;
+    index->map_len = fst.st_size;
+    index->page_count = header->page_count;
+    index->offsets = (const uint64_t *)(header + 1);
+
+    if(index->offsets[index->page_count] > index->map_len) {
+        dirindex_unref(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+/**
+ * write one page of menu lines
+ */
+static void dirindex_write_page(FILE *fp, char **names, size_t count,
+                                uint32_t page, uint32_t page_count,
+                                char *selector) {
+    const char *tail;
+    size_t tail_len, index;
+
+    tail = response_menu_tail(&tail_len);
+
+    for(index = 0; index < count; index++) {
+        fprintf(fp, "%c%s\t%s/%s", names[index][0], names[index] + 1,
+                selector, names[index] + 1);
+        fwrite(tail, 1, tail_len, fp);
+    }
+
+    fprintf(fp, "iPage %u of %u\t\t\t\n\r", page + 1, page_count);
+
+    if(page > 0) {
+        fprintf(fp, "1Previous page\t%s/?page=%u", selector, page);
+        fwrite(tail, 1, tail_len, fp);
+    }
+
+    if(page + 1 < page_count) {
+        fprintf(fp, "1Next page\t%s/?page=%u", selector, page + 2);
+        fwrite(tail, 1, tail_len, fp);
+    }
+}
+
+/**
+ * sort a directory's entries and write them out as an index
+ *
+ * @returns the new index, or NULL on failure
+ */
+static dirindex_t *dirindex_write(char *path, struct stat *st,
+                                  char **names, size_t count) {
+    char selector[PATH_MAX], file[PATH_MAX], tmp[PATH_MAX + 32];
+    dirindex_header_t header;
+    uint64_t *offsets;
+    uint32_t page;
+    dirindex_t *index;
+    size_t first;
+    FILE *fp;
+    int fd;
+
+    dirindex_selector(path, selector, sizeof(selector));
+    dirindex_file(st->st_dev, st->st_ino, file, sizeof(file));
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx", file, getpid(),
+             (unsigned long)pthread_self());
+
+    qsort(names, count, sizeof(char *), dirindex_cmp);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DIRINDEX_MAGIC, sizeof(header.magic));
+    header.dev = st->st_dev;
+    header.ino = st->st_ino;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.page_size = g_dirindex_page_size;
+    header.page_count = count ? (count + g_dirindex_page_size - 1) / g_dirindex_page_size : 1;
+    header.entry_count = count;
+    header.render_hash = dirindex_render_hash(selector);
+
+    offsets = (uint64_t *)calloc(header.page_count + 1, sizeof(uint64_t));
+    if(!offsets)
+        return NULL;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 || !(fp = fdopen(fd, "w"))) {
+        WARN("Cannot write %s: %s", tmp, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        free(offsets);
+        return NULL;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(offsets, sizeof(uint64_t), header.page_count + 1, fp);
+
+    for(page = 0; page < header.page_count; page++) {
+        offsets[page] = ftello(fp);
+        first = (size_t)page * g_dirindex_page_size;
+        dirindex_write_page(fp, names + first,
+                            MIN(count - first, (size_t)g_dirindex_page_size),
+                            page, header.page_count, selector);
+    }
+    offsets[page] = ftello(fp);
+
+    fseeko(fp, sizeof(header), SEEK_SET);
+    fwrite(offsets, sizeof(uint64_t), header.page_count + 1, fp);
+    free(offsets);
+
+    if(ferror(fp) | fclose(fp) || rename(tmp, file) == -1) {
+        WARN("Cannot write %s: %s", file, strerror(errno));
+        unlink(tmp);
+        return NULL;
+    }
+
+    if(!(index = dirindex_map(file, st, header.render_hash)))
+        return NULL;
+
+    DEBUG("Indexed %s: %zu entries, %u pages", path, count, index->page_count);
+    return index;
+}
+
+/**
+ * start tracking a directory, keeping whichever build got
+ * here first.  Takes over the caller's ref on index.
+ *
+ * @returns a ref on the current build
+ */
+static dirindex_t *dirindex_track(char *path, struct stat *st, dirindex_t *index) {
+    dirindex_dir_t *dir;
+    struct stat now;
+    int wd, changed;
+
+    /* watch first, so nothing slips by between the build and the watch */
+    wd = inotify_add_watch(g_dirindex_fd, path, DIRINDEX_WATCH_MASK);
+    if(wd == -1) {
+        WARN("Cannot watch %s: %s", path, strerror(errno));
+        return index;
+    }
+
+    /* changed while we were building? */
+    changed = stat(path, &now) == -1 ||
+        now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+        now.st_mtim.tv_nsec != st->st_mtim.tv_nsec;
+
+    pthread_mutex_lock(&g_dirindex_lock);
+    for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+        if(dir->dev == st->st_dev && dir->ino == st->st_ino) {
+            dirindex_unref(index);
+            index = dir->current;
+            __atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&g_dirindex_lock);
+            return index;
+        }
+    }
+
+    if(!(dir = (dirindex_dir_t *)calloc(1, sizeof(dirindex_dir_t))) ||
+       !(dir->path = strdup(path))) {
+        pthread_mutex_unlock(&g_dirindex_lock);
+        free(dir);
+        return index;
+    }
+
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->wd = wd;
+    dir->current = index;
+    __atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+
+    if(changed) {
+        dir->dirty = TRUE;
+        dir->due = dirindex_now();
+    }
+
+    dir->next = g_dirindex_dirs;
+    g_dirindex_dirs = dir;
+    pthread_mutex_unlock(&g_dirindex_lock);
+
+    /* let the indexer pick up the watch (and any rebuild) */
+    if(write(g_dirindex_wake[1], "", 1) == -1)
+        DEBUG("Indexer already awake");
+
+    return index;
+}
+
+/**
+ * rebuild an index that's gone stale.  Indexer thread only.
+ */
+static void dirindex_rebuild(dirindex_dir_t *dir) {
+    dirindex_t *index, *old;
+    struct stat st;
+    size_t count;
+    char **names;
+    int err;
+
+    if(stat(dir->path, &st) == -1 || st.st_dev != dir->dev || st.st_ino != dir->ino)
+        return;
+
+    if(!(names = dirindex_scan(dir->path, &count, &err)))
+        return;
+
+    index = dirindex_write(dir->path, &st, names, count);
+    dirindex_free_names(names, count);
+
+    if(!index)
+        return;
+
+    pthread_mutex_lock(&g_dirindex_lock);
+    old = dir->current;
+    dir->current = index;
+    pthread_mutex_unlock(&g_dirindex_lock);
+
+    dirindex_unref(old);
+}
+
+/**
+ * stop tracking a directory that went away.  Indexer thread
+ * only.
+ */
+static void dirindex_drop(dirindex_dir_t *dir, int rm) {
+    dirindex_dir_t **pd;
+    char file[PATH_MAX];
+
+    pthread_mutex_lock(&g_dirindex_lock);
+    for(pd = &g_dirindex_dirs; *pd; pd = &(*pd)->next) {
+        if(*pd == dir) {
+            *pd = dir->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_dirindex_lock);
+
+    if(rm)
+        inotify_rm_watch(g_dirindex_fd, dir->wd);
+
+    dirindex_file(dir->dev, dir->ino, file, sizeof(file));
+    unlink(file);
+
+    dirindex_unref(dir->current);
+    free(dir->path);
+    free(dir);
+}
+
+/**
+ * indexer thread: turns inotify events into (debounced)
+ * rebuilds
+ */
+static void *dirindex_thread(void *arg) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd[2];
+    dirindex_dir_t *dir;
+    uint64_t now, due;
+    int timeout;
+    ssize_t len;
+    char *p;
+
+    pfd[0].fd = g_dirindex_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_dirindex_wake[0];
+    pfd[1].events = POLLIN;
+
+    while(1) {
+        /* sleep until the next rebuild is due, or something happens */
+        due = 0;
+        pthread_mutex_lock(&g_dirindex_lock);
+        for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+            if(dir->dirty && (!due || dir->due < due))
+                due = dir->due;
+        }
+        pthread_mutex_unlock(&g_dirindex_lock);
+
+        now = dirindex_now();
+        timeout = !due ? -1 : (due > now ? (int)(due - now) : 0);
+
+        if(poll(pfd, 2, timeout) == -1 && errno != EINTR)
+            break;
+
+        if(pfd[1].revents) {
+            if(read(g_dirindex_wake[0], buffer, sizeof(buffer)) == 0)
+                break;    /* closed -- time to go */
+        }
+
+        while((len = read(g_dirindex_fd, buffer, sizeof(buffer))) > 0) {
+            for(p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ev->len) {
+                ev = (struct inotify_event *)p;
+
+                /* events were dropped, so any of them could be stale */
+                if(ev->mask & IN_Q_OVERFLOW) {
+                    WARN("Directory change queue overflowed, reindexing everything");
+                    pthread_mutex_lock(&g_dirindex_lock);
+                    for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+                        if(!dir->dirty) {
+                            dir->dirty = TRUE;
+                            dir->due = dirindex_now() + DIRINDEX_DEBOUNCE_MS;
+                        }
+                    }
+                    pthread_mutex_unlock(&g_dirindex_lock);
+                    continue;
+                }
+
+                pthread_mutex_lock(&g_dirindex_lock);
+                for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+                    if(dir->wd == ev->wd)
+                        break;
+                }
+
+                if(dir && !(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) &&
+                   !dir->dirty) {
+                    /* a burst of changes only costs one rebuild */
+                    dir->dirty = TRUE;
+                    dir->due = dirindex_now() + DIRINDEX_DEBOUNCE_MS;
+                }
+                pthread_mutex_unlock(&g_dirindex_lock);
+
+                if(dir && (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))) {
+                    DEBUG("No longer indexing %s", dir->path);
+                    dirindex_drop(dir, !(ev->mask & IN_IGNORED));
+                }
+            }
+        }
+
+        /* only this thread removes dirs, so they stay put unlocked */
+        now = dirindex_now();
+        do {
+            pthread_mutex_lock(&g_dirindex_lock);
+            for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+                if(dir->dirty && dir->due <= now)
+                    break;
+            }
+            if(dir)
+                dir->dirty = FALSE;
+            pthread_mutex_unlock(&g_dirindex_lock);
+
+            if(dir)
+                dirindex_rebuild(dir);
+        } while(dir);
+    }
+
+    return NULL;
+}
+
+/**
+ * set up directory indexing.  Must be called after
+ * response_init, and after any forking is done.
+ *
+ * @param index_dir where index files live
+ * @param threshold entries a directory needs to be indexed (0 disables)
+ * @param page_size menu entries per page
+ * @returns TRUE on success, FALSE otherwise
+ */
+int dirindex_init(char *index_dir, int threshold, int page_size) {
+    if(threshold <= 0)
+        return TRUE;
+
+    if(page_size < 1) {
+        ERROR("dir_page_size must be at least 1");
+        return FALSE;
+    }
+
+    if(access(index_dir, W_OK | X_OK) == -1) {
+        WARN("Cannot write to %s (%s), not indexing large directories",
+             index_dir, strerror(errno));
+        return TRUE;
+    }
+
+    g_dirindex_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(g_dirindex_fd == -1) {
+        WARN("Cannot watch directories (%s), not indexing large directories",
+             strerror(errno));
+        return TRUE;
+    }
+
+    if(pipe2(g_dirindex_wake, O_NONBLOCK | O_CLOEXEC) == -1 ||
+       !(g_dirindex_path = strdup(index_dir))) {
+        ERROR("Cannot set up directory indexer: %s", strerror(errno));
+        dirindex_deinit();
+        return FALSE;
+    }
+
+    g_dirindex_threshold = threshold;
+    g_dirindex_page_size = page_size;
+
+    if(pthread_create(&g_dirindex_thread, NULL, dirindex_thread, NULL)) {
+        ERROR("Cannot start directory indexer");
+        dirindex_deinit();
+        return FALSE;
+    }
+
+    g_dirindex_started = TRUE;
+    return TRUE;
+}
+
+/**
+ * stop the indexer.  Index files are left for next time.
+ */
+void dirindex_deinit(void) {
+    dirindex_dir_t *dir;
+
+    g_dirindex_threshold = 0;
+
+    if(g_dirindex_wake[1] != -1) {
+        close(g_dirindex_wake[1]);
+        g_dirindex_wake[1] = -1;
+    }
+
+    if(g_dirindex_started) {
+        pthread_join(g_dirindex_thread, NULL);
+        g_dirindex_started = FALSE;
+    }
+
+    while((dir = g_dirindex_dirs)) {
+        g_dirindex_dirs = dir->next;
+        dirindex_unref(dir->current);
+        free(dir->path);
+        free(dir);
+    }
+
+    if(g_dirindex_wake[0] != -1) {
+        close(g_dirindex_wake[0]);
+        g_dirindex_wake[0] = -1;
+    }
+
+    if(g_dirindex_fd != -1) {
+        close(g_dirindex_fd);
+        g_dirindex_fd = -1;
+    }
+
+    free(g_dirindex_path);
+    g_dirindex_path = NULL;
+}
+
+/**
+ * an entry's name after its item type, following symlinks
+ */
+static char *dirindex_name(DIR *dir, struct dirent *de) {
+    struct stat st;
+    char type = '0';
+    char *name;
+
+    if(de->d_type == DT_DIR)
+        type = '1';
+    else if((de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) &&
+            fstatat(dirfd(dir), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode))
+        type = '1';
+
+    if(!(name = (char *)malloc(strlen(de->d_name) + 2)))
+        return NULL;
+
+    name[0] = type;
+    strcpy(name + 1, de->d_name);
+    return name;
+}
+
+/**
+ * read the (visible) entries of a directory
+ *
+ * @param path directory to read
+ * @param count set to the number of entries
+ * @param err set to an errno on failure
+ * @returns entry names, each after its item type ('0' or '1'),
+ *          or NULL on failure
+ */
+char **dirindex_scan(char *path, size_t *count, int *err) {
+    char **names = NULL, **grown;
+    size_t size = 0;
+    struct dirent *de;
+    DIR *dir;
+
+    *count = 0;
+
+    if(!(dir = opendir(path))) {
+        *err = errno;
+        return NULL;
+    }
+
+    while((de = readdir(dir))) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        if(*count == size) {
+            size = size ? size * 2 : 64;
+            if(!(grown = (char **)realloc(names, size * sizeof(char *))))
+                break;
+            names = grown;
+        }
+
+        if(!(names[*count] = dirindex_name(dir, de)))
+            break;
+        (*count)++;
+    }
+
+    closedir(dir);
+
+    if(de) {
+        dirindex_free_names(names, *count);
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    /* an empty directory is still a success */
+    if(!names && !(names = (char **)malloc(sizeof(char *)))) {
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    return names;
+}
+
+/**
+ * free what dirindex_scan returned
+ */
+void dirindex_free_names(char **names, size_t count) {
+    size_t index;
+
+    for(index = 0; index < count; index++)
+        free(names[index]);
+    free(names);
+}
+
+/**
+ * is a directory this size worth indexing?
+ */
+int dirindex_wanted(size_t count) {
+    return g_dirindex_threshold && count >= (size_t)g_dirindex_threshold;
+}
+
+/**
+ * find the index for a directory, if it's been indexed,
+ * either in this run or (unchanged) in an earlier one
+ *
+ * @param path directory
+ * @param st its stat
+ * @returns a ref on its index, or NULL if it isn't indexed
+ */
+dirindex_t *dirindex_get(char *path, struct stat *st) {
+    char selector[PATH_MAX], file[PATH_MAX];
+    dirindex_t *index = NULL;
+    dirindex_dir_t *dir;
+
+    if(!g_dirindex_threshold)
+        return NULL;
+
+    pthread_mutex_lock(&g_dirindex_lock);
+    for(dir = g_dirindex_dirs; dir; dir = dir->next) {
+        if(dir->dev == st->st_dev && dir->ino == st->st_ino) {
+            index = dir->current;
+            __atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_dirindex_lock);
+
+    if(index)
+        return index;
+
+    dirindex_selector(path, selector, sizeof(selector));
+    dirindex_file(st->st_dev, st->st_ino, file, sizeof(file));
+    if(!(index = dirindex_map(file, st, dirindex_render_hash(selector))))
+        return NULL;
+
+    DEBUG("Using existing index for %s", path);
+    return dirindex_track(path, st, index);
+}
+
+/**
+ * index a directory that turned out to be large
+ *
+ * @param path directory
+ * @param st its stat, from before it was read
+ * @param names its entries, sorted in place
+ * @param count number of entries
+ * @returns a ref on its index, or NULL on failure
+ */
+dirindex_t *dirindex_create(char *path, struct stat *st,
+                            char **names, size_t count) {
+    dirindex_t *index;
+
+    if(!(index = dirindex_write(path, st, names, count)))
+        return NULL;
+
+    return dirindex_track(path, st, index);
+}
+
+/**
+ * drop a ref on an index
+ */
+void dirindex_unref(dirindex_t *index) {
+    if(!index || __atomic_sub_fetch(&index->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    munmap(index->map, index->map_len);
+    free(index);
+}
+
+static void dirindex_cleanup(const void *data, size_t len, void *arg) {
+    dirindex_unref((dirindex_t *)arg);
+}
+
+/**
+ * queue a page of an index, by reference
+ *
+ * @param index directory index
+ * @param page page number, from 1
+ * @param output buffer to add it to
+ * @returns TRUE on success, FALSE if there's no such page
+ */
+int dirindex_add(dirindex_t *index, int page, struct evbuffer *output) {
+    uint64_t start, end;
+
+    if(page < 1 || (uint32_t)page > index->page_count)
+        return FALSE;
+
+    start = index->offsets[page - 1];
+    end = index->offsets[page];
+
+    __atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+    if(evbuffer_add_reference(output, (char *)index->map + start, end - start,
+                              dirindex_cleanup, index)) {
+        dirindex_unref(index);
+        return FALSE;
+    }
+
+    return TRUE;
+}
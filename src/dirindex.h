@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <event.h>
+
+/* one build of a large directory's paged menu, mapped from
+ * its index file */
+typedef struct dirindex_t {
+    int refs;
+    void *map;
+    size_t map_len;
+    uint32_t page_count;
+    const uint64_t *offsets;  /* page_count + 1, into map */
+} dirindex_t;
+
+extern int dirindex_init(char *index_dir, int threshold, int page_size);
+extern void dirindex_deinit(void);
+extern void dirindex_selector(char *path, char *selector, size_t len);
+extern char **dirindex_scan(char *path, size_t *count, int *err);
+extern void dirindex_free_names(char **names, size_t count);
+extern int dirindex_wanted(size_t count);
+extern dirindex_t *dirindex_get(char *path, struct stat *st);
+extern dirindex_t *dirindex_create(char *path, struct stat *st,
+                                   char **names, size_t count);
+extern void dirindex_unref(dirindex_t *index);
+extern int dirindex_add(dirindex_t *index, int page, struct evbuffer *output);
+
+#endif /* _DIRINDEX_H_ */
@@ -0,0 +1,462 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * edge-triggered epoll engine for client connections.
+ *
+ * By default each client gets a bufferevent, and libevent
+ * re-arms its read and write events as buffers fill and drain.
+ * With io_engine set to "epoll", a loop instead keeps its
+ * client sockets in an epoll set of its own, registered once
+ * for everything edge-triggered.  That set is just one more fd
+ * on the loop's event base, so timers, relays, exec pipes and
+ * posted work all carry on exactly as before.
+ *
+ * When the set fires we take up to EDGE_BATCH events per
+ * epoll_wait, note what each client can now do, and put it on
+ * the loop's ready list (linked through the client itself).
+ * The ready list is then worked through: readable clients get
+ * read_fn, which must read until EAGAIN; writable ones have
+ * their output written straight from the evbuffer until it's
+ * empty or the socket is full, and get write_fn once it's down
+ * to their low watermark -- the same contract as a bufferevent
+ * write watermark.  Clients that still have work go back on the
+ * end of the list, and only what was on the list at the start
+ * is handled per pass, so one fast client can't starve the
+ * loop.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "edge.h"
+
+#define EDGE_BATCH 64
+
+/* client edge_flags */
+#define EDGE_READABLE 0x01   /* read edge not yet consumed */
+#define EDGE_WRITABLE 0x02   /* socket has room */
+#define EDGE_READING  0x04   /* wants read_fn */
+#define EDGE_WRITING  0x08   /* wants write_fn */
+#define EDGE_ERROR    0x10   /* error or hangup */
+#define EDGE_QUEUED   0x20   /* on the ready list */
+
+typedef struct edge_t {
+    loop_t *loop;
+    int epoll_fd;
+    struct event ev_epoll;   /* the epoll set is readable */
+    struct event ev_kick;    /* ready list has work */
+    int kicked;
+    int running;             /* working through the ready list */
+    client_t *ready_head;
+    client_t *ready_tail;
+
+    uint64_t waits;          /* for the shutdown summary */
+    uint64_t events;
+    uint64_t writes;
+} edge_t;
+
+static void (*g_edge_read)(client_t *client) = NULL;
+static void (*g_edge_write)(client_t *client) = NULL;
+static void (*g_edge_error)(client_t *client, int eof) = NULL;
+
+/**
+ * is the epoll engine built in?
+ *
+ * @returns TRUE if so, FALSE otherwise
+ */
+int edge_available(void) {
+#ifdef HAVE_SYS_EPOLL_H
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static void edge_unlink(edge_t *edge, client_t *client) {
+    if(client->edge_prev)
+        client->edge_prev->edge_next = client->edge_next;
+    else
+        edge->ready_head = client->edge_next;
+
+    if(client->edge_next)
+        client->edge_next->edge_prev = client->edge_prev;
+    else
+        edge->ready_tail = client->edge_prev;
+
+    client->edge_prev = client->edge_next = NULL;
+    client->edge_flags &= ~EDGE_QUEUED;
+}
+
+/**
+ * does a client have something for us to do?
+ */
+static int edge_has_work(client_t *client) {
+    unsigned int flags = client->edge_flags;
+
+    if(flags & EDGE_ERROR)
+        return TRUE;
+    if((flags & (EDGE_READABLE | EDGE_READING)) == (EDGE_READABLE | EDGE_READING))
+        return TRUE;
+    return (flags & EDGE_WRITABLE) && evbuffer_get_length(client->output);
+}
+
+/**
+ * put a client on the end of the ready list, if it has work and
+ * isn't there already
+ */
+static void edge_schedule(edge_t *edge, client_t *client) {
+    if((client->edge_flags & EDGE_QUEUED) || !edge_has_work(client))
+        return;
+
+    client->edge_flags |= EDGE_QUEUED;
+    client->edge_next = NULL;
+    client->edge_prev = edge->ready_tail;
+    if(edge->ready_tail)
+        edge->ready_tail->edge_next = client;
+    else
+        edge->ready_head = client;
+    edge->ready_tail = client;
+
+    /* from outside a pass, make sure one happens */
+    if(!edge->running && !edge->kicked) {
+        edge->kicked = TRUE;
+        event_active(&edge->ev_kick, EV_READ, 1);
+    }
+}
+
+/**
+ * write as much output as the socket will take
+ *
+ * @returns bytes written, or -1 on error
+ */
+static ssize_t edge_flush(edge_t *edge, client_t *client) {
+    ssize_t total = 0;
+    int res;
+
+    while(evbuffer_get_length(client->output)) {
+        res = evbuffer_write(client->output, client->fd);
+        if(res < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* wait for the next edge */
+                client->edge_flags &= ~EDGE_WRITABLE;
+                break;
+            }
+            return -1;
+        }
+
+        if(!res)
+            break;
+
+        total += res;
+        edge->writes++;
+    }
+
+    return total;
+}
+
+/**
+ * do whatever a ready client needs.  Any callback may free the
+ * client, so it's never touched after one.
+ */
+static void edge_dispatch(edge_t *edge, client_t *client) {
+    unsigned int flags = client->edge_flags;
+    ssize_t written;
+
+    if(flags & EDGE_ERROR) {
+        g_edge_error(client, FALSE);
+        return;
+    }
+
+    if((flags & (EDGE_READABLE | EDGE_READING)) == (EDGE_READABLE | EDGE_READING)) {
+        client->edge_flags &= ~EDGE_READABLE;
+        /* anything left to write gets done next time round */
+        edge_schedule(edge, client);
+        g_edge_read(client);
+        return;
+    }
+
+    if(!(flags & EDGE_WRITABLE))
+        return;
+
+    if((written = edge_flush(edge, client)) < 0) {
+        g_edge_error(client, FALSE);
+        return;
+    }
+
+    if(written && (client->edge_flags & EDGE_WRITING) &&
+       evbuffer_get_length(client->output) <= client->edge_lowat) {
+        edge_schedule(edge, client);
+        g_edge_write(client);
+        return;
+    }
+
+    edge_schedule(edge, client);
+}
+
+/**
+ * take what the epoll set has for us, then work the ready list
+ */
+static void on_edge(int fd, short event, void *arg) {
+    edge_t *edge = (edge_t *)arg;
+    struct epoll_event events[EDGE_BATCH];
+    client_t *client;
+    int count, index, pending;
+
+    edge->kicked = FALSE;
+
+    do {
+        count = epoll_wait(edge->epoll_fd, events, EDGE_BATCH, 0);
+        if(count < 0) {
+            if(errno != EINTR)
+                ERROR("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        edge->waits++;
+        edge->events += count;
+
+        for(index = 0; index < count; index++) {
+            client = (client_t *)events[index].data.ptr;
+
+            if(events[index].events & (EPOLLIN | EPOLLRDHUP))
+                client->edge_flags |= EDGE_READABLE;
+            if(events[index].events & EPOLLOUT)
+                client->edge_flags |= EDGE_WRITABLE;
+            if(events[index].events & EPOLLERR)
+                client->edge_flags |= EDGE_ERROR;
+            if(events[index].events & EPOLLHUP) {
+                /* a reader finds out for itself */
+                client->edge_flags |= (client->edge_flags & EDGE_READING) ?
+                    EDGE_READABLE : EDGE_ERROR;
+            }
+
+            edge_schedule(edge, client);
+        }
+    } while(count == EDGE_BATCH);
+
+    /* only what's ready now -- anything requeued waits a turn */
+    for(pending = 0, client = edge->ready_head; client; client = client->edge_next)
+        pending++;
+
+    edge->running = TRUE;
+    while(pending-- && (client = edge->ready_head)) {
+        edge_unlink(edge, client);
+        edge_dispatch(edge, client);
+    }
+    edge->running = FALSE;
+
+    if(edge->ready_head && !edge->kicked) {
+        edge->kicked = TRUE;
+        event_active(&edge->ev_kick, EV_READ, 1);
+    }
+}
+
+/**
+ * give a loop its own epoll set for clients
+ *
+ * @param loop loop to set up
+ * @param read_fn client socket is readable (read until EAGAIN)
+ * @param write_fn client output is down to its low watermark
+ * @param error_fn client socket failed
+ * @returns TRUE on success, FALSE otherwise
+ */
+int edge_init(loop_t *loop,
+              void (*read_fn)(client_t *client),
+              void (*write_fn)(client_t *client),
+              void (*error_fn)(client_t *client, int eof)) {
+    edge_t *edge;
+
+    edge = (edge_t *)calloc(1, sizeof(edge_t));
+    if(!edge) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    edge->loop = loop;
+    edge->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(edge->epoll_fd == -1) {
+        ERROR("Could not create epoll set for loop %d: %s", loop->id, strerror(errno));
+        free(edge);
+        return FALSE;
+    }
+
+    g_edge_read = read_fn;
+    g_edge_write = write_fn;
+    g_edge_error = error_fn;
+
+    event_set(&edge->ev_epoll, edge->epoll_fd, EV_READ | EV_PERSIST, on_edge, edge);
+    event_base_set(loop->base, &edge->ev_epoll);
+    event_add(&edge->ev_epoll, NULL);
+
+    event_set(&edge->ev_kick, -1, 0, on_edge, edge);
+    event_base_set(loop->base, &edge->ev_kick);
+
+    loop->edge = edge;
+    return TRUE;
+}
+
+/**
+ * drop a loop's epoll set
+ *
+ * @param loop loop to tear down
+ */
+void edge_deinit(loop_t *loop) {
+    edge_t *edge = loop->edge;
+
+    if(!edge)
+        return;
+
+    if(edge->waits)
+        INFO("Loop %d: %llu epoll waits, %llu events (%.1f per wait), %llu writes",
+             loop->id, (unsigned long long)edge->waits,
+             (unsigned long long)edge->events,
+             (double)edge->events / edge->waits,
+             (unsigned long long)edge->writes);
+
+    event_del(&edge->ev_epoll);
+    event_del(&edge->ev_kick);
+    close(edge->epoll_fd);
+    free(edge);
+    loop->edge = NULL;
+}
+
+/**
+ * start handling a new client.  It gets an output buffer, and
+ * read_fn as soon as there's anything to read.
+ *
+ * @param client client on a loop with an epoll set
+ * @returns TRUE on success, FALSE otherwise
+ */
+int edge_add(client_t *client) {
+    edge_t *edge = client->loop->edge;
+    struct epoll_event ev;
+
+    if(!(client->output = evbuffer_new())) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    client->edge_flags = EDGE_READING | EDGE_WRITABLE;
+    client->edge_prev = client->edge_next = NULL;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = client;
+
+    if(epoll_ctl(edge->epoll_fd, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+        ERROR("Could not watch fd %d: %s", client->fd, strerror(errno));
+        evbuffer_free(client->output);
+        client->output = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * stop handling a client.  Must happen before its fd is closed,
+ * since a copy of it may live on (in an exec worker, say).  The
+ * output buffer is left for the caller.
+ *
+ * @param client client from edge_add()
+ */
+void edge_del(client_t *client) {
+    edge_t *edge = client->loop->edge;
+
+    epoll_ctl(edge->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+
+    if(client->edge_flags & EDGE_QUEUED)
+        edge_unlink(edge, client);
+    client->edge_flags = 0;
+}
+
+/**
+ * turn read callbacks on or off
+ *
+ * @param client client from edge_add()
+ * @param enable TRUE to get read_fn, FALSE to stop
+ */
+void edge_read(client_t *client, int enable) {
+    if(enable) {
+        client->edge_flags |= EDGE_READING;
+        edge_schedule(client->loop->edge, client);
+    } else {
+        client->edge_flags &= ~EDGE_READING;
+    }
+}
+
+/**
+ * send a client's output, calling write_fn once there's no more
+ * than lowat of it left
+ *
+ * @param client client from edge_add()
+ * @param lowat write watermark
+ */
+void edge_write(client_t *client, size_t lowat) {
+    client->edge_lowat = lowat;
+    client->edge_flags |= EDGE_WRITING;
+    edge_schedule(client->loop->edge, client);
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+int edge_init(loop_t *loop,
+              void (*read_fn)(client_t *client),
+              void (*write_fn)(client_t *client),
+              void (*error_fn)(client_t *client, int eof)) {
+    ERROR("The epoll engine isn't available on this platform");
+    return FALSE;
+}
+
+void edge_deinit(loop_t *loop) {
+}
+
+int edge_add(client_t *client) {
+    return FALSE;
+}
+
+void edge_del(client_t *client) {
+}
+
+void edge_read(client_t *client, int enable) {
+}
+
+void edge_write(client_t *client, size_t lowat) {
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
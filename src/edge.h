@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _EDGE_H_
+#define _EDGE_H_
+
+#include <stddef.h>
+
+#include "loop.h"
+#include "plugin.h"
+
+extern int edge_available(void);
+extern int edge_init(loop_t *loop,
+                     void (*read_fn)(client_t *client),
+                     void (*write_fn)(client_t *client),
+                     void (*error_fn)(client_t *client, int eof));
+extern void edge_deinit(loop_t *loop);
+extern int edge_add(client_t *client);
+extern void edge_del(client_t *client);
+extern void edge_read(client_t *client, int enable);
+extern void edge_write(client_t *client, size_t lowat);
+
+#endif /* _EDGE_H_ */
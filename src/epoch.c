@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "main.h"
+#include "debug.h"
+#include "epoch.h"
+
+#define EPOCH_MAX_THREADS 256
+
+/* one per registered thread, on its own cache line */
+typedef struct epoch_record_t {
+    uint64_t epoch;     /* global epoch seen on entry */
+    int active;         /* inside a read section */
+    char pad[64 - sizeof(uint64_t) - sizeof(int)];
+} epoch_record_t;
+
+typedef struct epoch_limbo_t {
+    void *ptr;
+    void (*free_fn)(void *ptr);
+    uint64_t epoch;     /* global epoch when retired */
+    struct epoch_limbo_t *next;
+} epoch_limbo_t;
+
+static epoch_record_t g_epoch_records[EPOCH_MAX_THREADS];
+static int g_epoch_threads = 0;
+static uint64_t g_epoch = 1;
+
+static __thread epoch_record_t *t_epoch_record = NULL;
+static __thread int t_epoch_nesting = 0;
+static __thread epoch_limbo_t *t_epoch_limbo = NULL;
+static __thread int t_epoch_limbo_count = 0;
+
+/**
+ * register the calling thread as a reader
+ *
+ * @returns TRUE on success, FALSE if there are too many threads
+ */
+int epoch_register(void) {
+    int index;
+
+    if(t_epoch_record)
+        return TRUE;
+
+    index = __atomic_fetch_add(&g_epoch_threads, 1, __ATOMIC_ACQ_REL);
+    if(index >= EPOCH_MAX_THREADS) {
+        ERROR("Too many epoch threads (max %d)", EPOCH_MAX_THREADS);
+        return FALSE;
+    }
+
+    t_epoch_record = &g_epoch_records[index];
+    return TRUE;
+}
+
+/**
+ * start reading shared objects.  Nests.
+ */
+void epoch_enter(void) {
+    if(t_epoch_nesting++)
+        return;
+
+    if(!t_epoch_record && !epoch_register()) {
+        ERROR("Cannot register for epochs, aborting");
+        abort();
+    }
+
+    __atomic_store_n(&t_epoch_record->active, TRUE, __ATOMIC_RELAXED);
+    __atomic_store_n(&t_epoch_record->epoch,
+                     __atomic_load_n(&g_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * done reading shared objects
+ */
+void epoch_exit(void) {
+    if(--t_epoch_nesting)
+        return;
+
+    __atomic_store_n(&t_epoch_record->active, FALSE, __ATOMIC_RELEASE);
+}
+
+/**
+ * move the global epoch along if every active reader has
+ * caught up with it
+ */
+static uint64_t epoch_advance(void) {
+    uint64_t epoch = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    int threads = __atomic_load_n(&g_epoch_threads, __ATOMIC_ACQUIRE);
+    int index;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(index = 0; index < threads && index < EPOCH_MAX_THREADS; index++) {
+        if(__atomic_load_n(&g_epoch_records[index].active, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&g_epoch_records[index].epoch, __ATOMIC_ACQUIRE) != epoch)
+            return epoch;
+    }
+
+    __atomic_compare_exchange_n(&g_epoch, &epoch, epoch + 1, FALSE,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * free whatever the calling thread retired that no reader
+ * can still see.  Called from each loop now and then.
+ */
+void epoch_reclaim(void) {
+    epoch_limbo_t **pl, *limbo;
+    uint64_t epoch;
+
+    if(!t_epoch_limbo)
+        return;
+
+    epoch = epoch_advance();
+
+    /* readers may still be in epoch - 1, so anything retired
+     * before that is unreachable */
+    pl = &t_epoch_limbo;
+    while((limbo = *pl)) {
+        if(limbo->epoch + 2 <= epoch) {
+            *pl = limbo->next;
+            limbo->free_fn(limbo->ptr);
+            free(limbo);
+            t_epoch_limbo_count--;
+        } else {
+            pl = &limbo->next;
+        }
+    }
+}
+
+/**
+ * free an object once every reader that might have seen it
+ * is done.  The object must already be unreachable for new
+ * readers.
+ *
+ * @param ptr object to free
+ * @param free_fn how to free it
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *ptr)) {
+    epoch_limbo_t *limbo;
+
+    if(!ptr)
+        return;
+
+    limbo = (epoch_limbo_t *)malloc(sizeof(epoch_limbo_t));
+    if(!limbo) {
+        /* better to leak than to free under a reader */
+        ERROR("malloc");
+        return;
+    }
+
+    limbo->ptr = ptr;
+    limbo->free_fn = free_fn;
+    limbo->epoch = __atomic_load_n(&g_epoch, __ATOMIC_ACQUIRE);
+    limbo->next = t_epoch_limbo;
+    t_epoch_limbo = limbo;
+    t_epoch_limbo_count++;
+
+    if(t_epoch_limbo_count > 64)
+        epoch_reclaim();
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+/*
+ * epoch based reclamation for caches shared between event
+ * loop threads.  Readers bracket their use of shared pointers
+ * with epoch_enter()/epoch_exit(); writers swap in new objects
+ * and epoch_retire() the old ones, which are freed once no
+ * reader can still be looking at them.
+ */
+
+extern int epoch_register(void);
+extern void epoch_enter(void);
+extern void epoch_exit(void);
+extern void epoch_retire(void *ptr, void (*free_fn)(void *ptr));
+extern void epoch_reclaim(void);
+
+#endif /* _EPOCH_H_ */
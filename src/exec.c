@@ -0,0 +1,952 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * executable selectors, run on a pool of worker processes per
+ * event loop.  Workers are forked by a spawner process that's
+ * started before any threads are, so nothing is ever forked
+ * from the threaded server.  The spawner ignores SIGCHLD, so
+ * the kernel reaps workers as they go, and loops ask it for a
+ * fresh worker when one is lost.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "affinity.h"
+#include "plugin.h"
+#include "loop.h"
+#include "relay.h"
+#include "exec.h"
+
+#define EXEC_MAX_PAYLOAD (PATH_MAX + 2 * MAX_REQUEST_SIZE)
+#define EXEC_MAX_ENV     (EXEC_MAX_PAYLOAD + 32)
+
+typedef struct exec_worker_t {
+    struct exec_pool_t *pool;
+    pid_t pid;
+    int fd;                          /* our end of the socketpair */
+    client_t *client;                /* client being run, if any */
+    struct event ev;
+    struct exec_worker_t *next_idle;
+} exec_worker_t;
+
+typedef struct opaque_exec_t {
+    client_t *client;
+    exec_worker_t *worker;           /* worker running us, if any */
+    relay_t *relay;                  /* worker stdout -> client */
+    int queued;
+    struct opaque_exec_t *next;      /* wait queue */
+} opaque_exec_t;
+
+/* each event loop has its own pool, so workers only ever talk
+ * to the thread that started them */
+typedef struct exec_pool_t {
+    loop_t *loop;
+    exec_worker_t *workers;
+    int worker_count;
+    exec_worker_t *idle;
+    opaque_exec_t *queue_head;
+    opaque_exec_t *queue_tail;
+    int queue_len;
+    int queue_max;
+} exec_pool_t;
+
+extern char **environ;
+
+static int g_exec_chld_pipe[2] = { -1, -1 };
+static int g_exec_spawner_fd = -1;
+static pid_t g_exec_spawner_pid = -1;
+static pthread_mutex_t g_exec_spawner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_worker_read(int fd, short event, void *arg);
+static void exec_worker_idle(exec_worker_t *worker);
+
+/**
+ * send a frame, optionally passing an fd along with it
+ *
+ * @param fd socket to send on
+ * @param type EXEC_FRAME_*
+ * @param payload frame payload (may be NULL)
+ * @param len payload length
+ * @param pass_fd fd to pass, or -1
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int exec_frame_send(int fd, uint32_t type, void *payload,
+                           uint32_t len, int pass_fd) {
+    exec_frame_t frame;
+    struct iovec iov[2];
+    struct msghdr msg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t res;
+
+    frame.type = type;
+    frame.len = len;
+
+    iov[0].iov_base = &frame;
+    iov[0].iov_len = sizeof(frame);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len ? 2 : 1;
+
+    if(pass_fd != -1) {
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    do {
+        res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while(res == -1 && errno == EINTR);
+
+    return res == (ssize_t)(sizeof(frame) + len);
+}
+
+/**
+ * receive a frame, picking up any fd passed along with it
+ *
+ * @param fd socket to read from
+ * @param frame frame header (out)
+ * @param payload payload buffer
+ * @param len size of payload buffer
+ * @param pass_fd passed fd, or -1 (out)
+ * @returns bytes read, 0 on EOF, -1 on error
+ */
+static ssize_t exec_frame_recv(int fd, exec_frame_t *frame, void *payload,
+                               size_t len, int *pass_fd) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    ssize_t res;
+
+    *pass_fd = -1;
+
+    iov[0].iov_base = frame;
+    iov[0].iov_len = sizeof(exec_frame_t);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    do {
+        res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while(res == -1 && errno == EINTR);
+
+    if(res <= 0)
+        return res;
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(pass_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if((size_t)res < sizeof(exec_frame_t) ||
+       frame->len != (size_t)res - sizeof(exec_frame_t)) {
+        ERROR("Short exec frame on fd %d", fd);
+        if(*pass_fd != -1) {
+            close(*pass_fd);
+            *pass_fd = -1;
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    return res;
+}
+
+/**
+ * close everything from lowfd up, so executables don't
+ * inherit client sockets
+ */
+static void exec_close_from(int lowfd) {
+    int fd, max_fd;
+
+#ifdef SYS_close_range
+    if(syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+        return;
+#endif
+
+    max_fd = (int)sysconf(_SC_OPEN_MAX);
+    if(max_fd < 0 || max_fd > 65536)
+        max_fd = 65536;
+
+    for(fd = lowfd; fd < max_fd; fd++)
+        close(fd);
+}
+
+/**
+ * SIGCHLD in a worker -- kick the poll loop
+ */
+static void exec_on_sigchld(int sig) {
+    int saved = errno;
+    char c = 0;
+
+    if(write(g_exec_chld_pipe[1], &c, 1) < 0) {
+        /* pipe full, poll will wake anyway */
+    }
+
+    errno = saved;
+}
+
+/**
+ * run one executable for the server, handing its stdout
+ * back over the control socket, and report when it exits.
+ *
+ * @param fd control socket
+ * @param payload RUN frame payload
+ * @param len payload length
+ */
+static void exec_worker_run(int fd, char *payload, uint32_t len) {
+    char *path, *selector, *query;
+    char env_selector[EXEC_MAX_ENV];
+    char env_query[EXEC_MAX_ENV];
+    char env_script[EXEC_MAX_ENV];
+    char env_port[32];
+    char *envp[6];
+    char *argv[3];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault, sigmask;
+    struct pollfd pfd[2];
+    exec_frame_t frame;
+    char scratch[64];
+    int out[2];
+    int passed;
+    int32_t status;
+    int res;
+    pid_t pid;
+
+    if(!len || payload[len - 1] != '\0')
+        return;
+
+    path = payload;
+    selector = path + strlen(path) + 1;
+    if(selector >= payload + len)
+        return;
+    query = selector + strlen(selector) + 1;
+    if(query >= payload + len)
+        return;
+
+    snprintf(env_selector, sizeof(env_selector), "SELECTOR=%s", selector);
+    snprintf(env_query, sizeof(env_query), "QUERY_STRING=%s", query);
+    snprintf(env_script, sizeof(env_script), "SCRIPT_FILENAME=%s", path);
+    snprintf(env_port, sizeof(env_port), "SERVER_PORT=%d", config.port);
+
+    envp[0] = env_selector;
+    envp[1] = env_query;
+    envp[2] = env_script;
+    envp[3] = env_port;
+    envp[4] = "PATH=/usr/local/bin:/usr/bin:/bin";
+    envp[5] = NULL;
+
+    argv[0] = path;
+    argv[1] = *query ? query : NULL;
+    argv[2] = NULL;
+
+    if(pipe2(out, O_CLOEXEC) < 0) {
+        status = errno;
+        exec_frame_send(fd, EXEC_FRAME_ERROR, &status, sizeof(status), -1);
+        return;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+
+    /* undo whatever signal setup we inherited from the server */
+    sigfillset(&sigdefault);
+    sigemptyset(&sigmask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    res = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+
+    if(res) {
+        close(out[0]);
+        status = res;
+        exec_frame_send(fd, EXEC_FRAME_ERROR, &status, sizeof(status), -1);
+        return;
+    }
+
+    exec_frame_send(fd, EXEC_FRAME_STARTED, NULL, 0, out[0]);
+    close(out[0]);
+
+    /* wait for the child, watching for the server giving up on it */
+    while(waitpid(pid, &res, WNOHANG) != pid) {
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = g_exec_chld_pipe[0];
+        pfd[1].events = POLLIN;
+
+        if(poll(pfd, 2, -1) < 0)
+            continue;
+
+        if(pfd[1].revents) {
+            while(read(g_exec_chld_pipe[0], scratch, sizeof(scratch)) > 0);
+        }
+
+        if(pfd[0].revents) {
+            ssize_t got = exec_frame_recv(fd, &frame, scratch,
+                                          sizeof(scratch), &passed);
+            if(passed != -1)
+                close(passed);
+
+            if(got == 0) {  /* server is gone */
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                _exit(0);
+            }
+
+            if(got > 0 && frame.type == EXEC_FRAME_KILL)
+                kill(pid, SIGKILL);
+        }
+    }
+
+    status = res;
+    exec_frame_send(fd, EXEC_FRAME_DONE, &status, sizeof(status), -1);
+}
+
+/**
+ * main loop of a pooled worker process.  Never returns.
+ *
+ * @param fd control socket
+ * @param loop_id loop the worker serves
+ */
+static void exec_worker_main(int fd, int loop_id) {
+    char payload[EXEC_MAX_PAYLOAD];
+    exec_frame_t frame;
+    struct sigaction sa;
+    ssize_t got;
+    int passed;
+
+    /* the server owns the signals, we just go away when it does */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGPIPE, SIG_DFL);
+#ifdef PR_SET_PDEATHSIG
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+    /* don't keep the loop's core to ourselves */
+    affinity_release(loop_id);
+
+    if(fd != 3) {
+        dup2(fd, 3);
+        fd = 3;
+    }
+    exec_close_from(4);
+
+    if(pipe2(g_exec_chld_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        _exit(EXIT_FAILURE);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = exec_on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    while(1) {
+        got = exec_frame_recv(fd, &frame, payload, sizeof(payload), &passed);
+        if(passed != -1)
+            close(passed);
+
+        if(got == 0)
+            _exit(EXIT_SUCCESS);
+
+        if(got < 0 || frame.type != EXEC_FRAME_RUN)
+            continue;  /* stale kill, or junk */
+
+        exec_worker_run(fd, payload, frame.len);
+    }
+}
+
+/**
+ * main loop of the spawner process: fork a worker for each
+ * loop that asks, and hand back its control socket.  Never
+ * returns.
+ *
+ * @param fd socket to the server
+ */
+static void exec_spawner_main(int fd) {
+    exec_frame_t frame;
+    int32_t loop_id, reply;
+    ssize_t got;
+    int passed;
+    int sv[2];
+    pid_t pid;
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    /* workers are reaped by the kernel as they exit */
+    signal(SIGCHLD, SIG_IGN);
+#ifdef PR_SET_PDEATHSIG
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+
+    if(fd != 3) {
+        dup2(fd, 3);
+        fd = 3;
+    }
+    exec_close_from(4);
+
+    while(1) {
+        got = exec_frame_recv(fd, &frame, &loop_id, sizeof(loop_id), &passed);
+        if(passed != -1)
+            close(passed);
+
+        if(got == 0)
+            _exit(EXIT_SUCCESS);
+
+        if(got < 0 || frame.type != EXEC_FRAME_SPAWN || frame.len != sizeof(loop_id))
+            continue;
+
+        if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            reply = errno;
+            exec_frame_send(fd, EXEC_FRAME_ERROR, &reply, sizeof(reply), -1);
+            continue;
+        }
+
+        if((pid = fork()) == -1) {
+            reply = errno;
+            close(sv[0]);
+            close(sv[1]);
+            exec_frame_send(fd, EXEC_FRAME_ERROR, &reply, sizeof(reply), -1);
+            continue;
+        }
+
+        if(pid == 0) {
+            close(sv[0]);
+            exec_worker_main(sv[1], loop_id);
+            _exit(EXIT_FAILURE);
+        }
+
+        close(sv[1]);
+        reply = pid;
+        exec_frame_send(fd, EXEC_FRAME_SPAWNED, &reply, sizeof(reply), sv[0]);
+        close(sv[0]);
+    }
+}
+
+/**
+ * start the spawner.  Must be called before any threads are
+ * started.
+ *
+ * @param workers exec workers configured (0 disables exec)
+ * @returns TRUE on success, FALSE otherwise
+ */
+int exec_init(int workers) {
+    int sv[2];
+    pid_t pid;
+
+    if(workers <= 0)
+        return TRUE;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        ERROR("Cannot create exec socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    if((pid = fork()) == -1) {
+        ERROR("Cannot fork exec spawner: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return FALSE;
+    }
+
+    if(pid == 0) {
+        exec_spawner_main(sv[1]);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    g_exec_spawner_fd = sv[0];
+    g_exec_spawner_pid = pid;
+
+    DEBUG("Started exec spawner %d", pid);
+    return TRUE;
+}
+
+/**
+ * stop the spawner.  It, and any workers still around, go
+ * when they see their sockets close.
+ */
+void exec_deinit(void) {
+    if(g_exec_spawner_fd == -1)
+        return;
+
+    close(g_exec_spawner_fd);
+    g_exec_spawner_fd = -1;
+    waitpid(g_exec_spawner_pid, NULL, 0);
+    g_exec_spawner_pid = -1;
+}
+
+/**
+ * get a fresh worker from the spawner and add it to the idle
+ * list
+ *
+ * @param worker worker slot to (re)fill
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int exec_worker_spawn(exec_worker_t *worker) {
+    exec_frame_t frame;
+    int32_t loop_id = worker->pool->loop->id;
+    int32_t reply = 0;
+    ssize_t got;
+    int fd;
+
+    pthread_mutex_lock(&g_exec_spawner_lock);
+    if(!exec_frame_send(g_exec_spawner_fd, EXEC_FRAME_SPAWN, &loop_id,
+                        sizeof(loop_id), -1))
+        got = -1;
+    else
+        got = exec_frame_recv(g_exec_spawner_fd, &frame, &reply, sizeof(reply), &fd);
+    pthread_mutex_unlock(&g_exec_spawner_lock);
+
+    if(got <= 0) {
+        ERROR("Cannot talk to exec spawner: %s", got ? strerror(errno) : "gone");
+        return FALSE;
+    }
+
+    if(frame.type != EXEC_FRAME_SPAWNED || fd == -1) {
+        ERROR("Cannot fork exec worker: %s",
+              frame.type == EXEC_FRAME_ERROR ? strerror(reply) : "bad reply");
+        if(fd != -1)
+            close(fd);
+        return FALSE;
+    }
+
+    DEBUG("Started exec worker %d on fd %d", reply, fd);
+
+    worker->pid = reply;
+    worker->fd = fd;
+    worker->client = NULL;
+
+    event_set(&worker->ev, worker->fd, EV_READ | EV_PERSIST,
+              on_worker_read, worker);
+    event_base_set(worker->pool->loop->base, &worker->ev);
+    event_add(&worker->ev, NULL);
+
+    exec_worker_idle(worker);
+    return TRUE;
+}
+
+/**
+ * hand a client's executable to a worker
+ *
+ * @param worker idle worker
+ * @param oe client exec state
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int exec_start(exec_worker_t *worker, opaque_exec_t *oe) {
+    client_t *client = oe->client;
+    char payload[EXEC_MAX_PAYLOAD];
+    size_t path_len, selector_len, query_len;
+    char *query = client->query ? client->query : "";
+
+    path_len = strlen(client->full_path) + 1;
+    selector_len = strlen(client->request) + 1;
+    query_len = strlen(query) + 1;
+
+    if(path_len + selector_len + query_len > sizeof(payload))
+        return FALSE;
+
+    memcpy(payload, client->full_path, path_len);
+    memcpy(payload + path_len, client->request, selector_len);
+    memcpy(payload + path_len + selector_len, query, query_len);
+
+    if(!exec_frame_send(worker->fd, EXEC_FRAME_RUN, payload,
+                        path_len + selector_len + query_len, -1)) {
+        ERROR("Cannot talk to exec worker %d: %s", worker->pid, strerror(errno));
+        return FALSE;
+    }
+
+    DEBUG("Running %s for fd %d on exec worker %d", client->full_path,
+          client->fd, worker->pid);
+
+    worker->client = client;
+    oe->worker = worker;
+    return TRUE;
+}
+
+/**
+ * a worker is free -- give it the next waiting client,
+ * or park it on the idle list.
+ */
+static void exec_worker_idle(exec_worker_t *worker) {
+    exec_pool_t *pool = worker->pool;
+    opaque_exec_t *oe;
+
+    worker->client = NULL;
+
+    while((oe = pool->queue_head)) {
+        pool->queue_head = oe->next;
+        if(!pool->queue_head)
+            pool->queue_tail = NULL;
+        pool->queue_len--;
+        oe->queued = FALSE;
+        oe->next = NULL;
+
+        if(exec_start(worker, oe))
+            return;
+
+        handle_error(oe->client, RESPONSE_EXEC_FAILED);
+    }
+
+    worker->next_idle = pool->idle;
+    pool->idle = worker;
+}
+
+/**
+ * a worker died or hung up on us.  Fail whatever it was
+ * doing and start a fresh one.
+ */
+static void exec_worker_lost(exec_worker_t *worker) {
+    exec_worker_t **pw;
+    opaque_exec_t *oe;
+    client_t *client = worker->client;
+
+    ERROR("Lost exec worker %d", worker->pid);
+
+    /* the spawner reaps it */
+    event_del(&worker->ev);
+    close(worker->fd);
+    worker->fd = -1;
+
+    for(pw = &worker->pool->idle; *pw; pw = &(*pw)->next_idle) {
+        if(*pw == worker) {
+            *pw = worker->next_idle;
+            break;
+        }
+    }
+
+    worker->client = NULL;
+    if(client) {
+        oe = (opaque_exec_t *)client->opaque_client;
+        oe->worker = NULL;
+        if(!oe->relay)
+            handle_error(client, RESPONSE_EXEC_FAILED);
+    }
+
+    exec_worker_spawn(worker);
+}
+
+/**
+ * bytes made it to the client -- it isn't stalled
+ */
+static void on_exec_relay_progress(relay_t *relay, void *arg) {
+    opaque_exec_t *oe = (opaque_exec_t *)arg;
+
+    client_progress(oe->client);
+}
+
+/**
+ * stdout from the executable is fully relayed (or the
+ * client went away).  Either way, we're done.
+ */
+static void on_exec_relay_done(relay_t *relay, int error, void *arg) {
+    opaque_exec_t *oe = (opaque_exec_t *)arg;
+
+    if(error)
+        close_client(oe->client);
+    else
+        client_finish(oe->client);
+}
+
+/**
+ * control frame from a worker
+ */
+static void on_worker_read(int fd, short event, void *arg) {
+    exec_worker_t *worker = (exec_worker_t *)arg;
+    opaque_exec_t *oe = NULL;
+    exec_frame_t frame;
+    int32_t status = 0;
+    int passed;
+    ssize_t got;
+
+    got = exec_frame_recv(fd, &frame, &status, sizeof(status), &passed);
+    if(got <= 0) {
+        exec_worker_lost(worker);
+        return;
+    }
+
+    if(worker->client)
+        oe = (opaque_exec_t *)worker->client->opaque_client;
+
+    switch(frame.type) {
+    case EXEC_FRAME_STARTED:
+        if(!oe || passed == -1)
+            break;
+
+        client_splice_begin(oe->client);
+        oe->relay = relay_new(worker->pool->loop->base, passed, oe->client->fd, on_exec_relay_done, oe);
+        if(!oe->relay)
+            break;
+
+        oe->relay->progress_fn = on_exec_relay_progress;
+        passed = -1;
+        break;
+
+    case EXEC_FRAME_ERROR:
+        ERROR("Exec worker %d could not run: %s", worker->pid, strerror(status));
+        if(oe) {
+            oe->worker = NULL;
+            handle_error(oe->client, RESPONSE_EXEC_FAILED);
+        }
+        exec_worker_idle(worker);
+        break;
+
+    case EXEC_FRAME_DONE:
+        DEBUG("Exec worker %d finished, status %d", worker->pid, status);
+        if(oe)
+            oe->worker = NULL;
+        exec_worker_idle(worker);
+        break;
+
+    default:
+        ERROR("Unexpected exec frame %d from worker %d", frame.type, worker->pid);
+        break;
+    }
+
+    if(passed != -1)
+        close(passed);
+}
+
+/**
+ * start a loop's worker pool.  Must be called after the loop's
+ * event base is set up, and after exec_init().
+ *
+ * @param loop loop the pool belongs to
+ * @param workers number of workers (0 disables exec)
+ * @param queue_max how many requests may wait for a free worker
+ * @returns TRUE on success, FALSE otherwise
+ */
+int exec_pool_init(loop_t *loop, int workers, int queue_max) {
+    exec_pool_t *pool;
+    int index;
+
+    if(workers <= 0)
+        return TRUE;
+
+    pool = (exec_pool_t *)calloc(1, sizeof(exec_pool_t));
+    if(!pool) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    pool->workers = (exec_worker_t *)calloc(workers, sizeof(exec_worker_t));
+    if(!pool->workers) {
+        ERROR("malloc");
+        free(pool);
+        return FALSE;
+    }
+
+    pool->loop = loop;
+    pool->worker_count = workers;
+    pool->queue_max = queue_max;
+    loop->exec = pool;
+
+    for(index = 0; index < workers; index++) {
+        pool->workers[index].pool = pool;
+        pool->workers[index].fd = -1;
+        if(!exec_worker_spawn(&pool->workers[index])) {
+            exec_pool_deinit(loop);
+            return FALSE;
+        }
+    }
+
+    INFO("Started %d exec workers for loop %d", workers, loop->id);
+    return TRUE;
+}
+
+/**
+ * stop a loop's worker pool.  Workers exit when they see their
+ * socket close.
+ *
+ * @param loop loop the pool belongs to
+ */
+void exec_pool_deinit(loop_t *loop) {
+    exec_pool_t *pool = loop->exec;
+    int index;
+
+    if(!pool)
+        return;
+
+    for(index = 0; index < pool->worker_count; index++) {
+        if(pool->workers[index].fd != -1) {
+            event_del(&pool->workers[index].ev);
+            close(pool->workers[index].fd);
+        }
+    }
+
+    free(pool->workers);
+    free(pool);
+    loop->exec = NULL;
+}
+
+/**
+ * is exec support turned on for this loop?
+ */
+int exec_enabled(loop_t *loop) {
+    return loop->exec != NULL;
+}
+
+/**
+ * run an executable selector for a client.  The client's
+ * full_path, request and query are passed to the worker;
+ * output is relayed straight to the client socket.
+ *
+ * @param client client to run for
+ */
+void exec_dispatch(client_t *client) {
+    exec_pool_t *pool = client->loop->exec;
+    exec_worker_t *worker;
+    opaque_exec_t *oe;
+
+    /* output is spliced straight to the socket */
+    if(!client_can_splice(client)) {
+        handle_error(client, RESPONSE_UNSUPPORTED);
+        return;
+    }
+
+    oe = (opaque_exec_t *)calloc(1, sizeof(opaque_exec_t));
+    if(!oe) {
+        handle_error(client, RESPONSE_INTERNAL);
+        return;
+    }
+
+    oe->client = client;
+    client->request_type = TYPE_EXEC;
+    client->opaque_client = oe;
+    client->opaque_bytes = sizeof(opaque_exec_t);
+
+    if((worker = pool->idle)) {
+        pool->idle = worker->next_idle;
+        worker->next_idle = NULL;
+
+        if(!exec_start(worker, oe)) {
+            exec_worker_lost(worker);
+            if(!oe->worker)
+                handle_error(client, RESPONSE_EXEC_FAILED);
+        }
+        return;
+    }
+
+    if(pool->queue_len >= pool->queue_max) {
+        WARN("Exec queue full, rejecting fd %d", client->fd);
+        handle_error(client, RESPONSE_BUSY);
+        return;
+    }
+
+    oe->queued = TRUE;
+    if(pool->queue_tail)
+        pool->queue_tail->next = oe;
+    else
+        pool->queue_head = oe;
+    pool->queue_tail = oe;
+    pool->queue_len++;
+
+    DEBUG("Queued exec for fd %d (%d waiting)", client->fd, pool->queue_len);
+}
+
+/**
+ * release exec state when a client is closed
+ *
+ * @param client client being closed
+ */
+void exec_client_free(client_t *client) {
+    opaque_exec_t *oe = (opaque_exec_t *)client->opaque_client;
+    exec_pool_t *pool = client->loop->exec;
+    opaque_exec_t *cur, *prev;
+
+    if(!oe)
+        return;
+
+    if(oe->worker) {
+        /* let the worker reap it; it'll send DONE when it has */
+        exec_frame_send(oe->worker->fd, EXEC_FRAME_KILL, NULL, 0, -1);
+        oe->worker->client = NULL;
+        oe->worker = NULL;
+    }
+
+    if(oe->queued) {
+        prev = NULL;
+        for(cur = pool->queue_head; cur && cur != oe; cur = cur->next)
+            prev = cur;
+
+        if(cur) {
+            if(prev)
+                prev->next = oe->next;
+            else
+                pool->queue_head = oe->next;
+
+            if(pool->queue_tail == oe)
+                pool->queue_tail = prev;
+
+            pool->queue_len--;
+        }
+    }
+
+    relay_free(oe->relay);
+    free(oe);
+    client->opaque_client = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _EXEC_H_
+#define _EXEC_H_
+
+#include <stdint.h>
+
+#include "loop.h"
+#include "plugin.h"
+
+/*
+ * framed protocol between the server and its pool of exec
+ * workers.  Each frame is a single SOCK_SEQPACKET message.
+ */
+#define EXEC_FRAME_RUN     1  /* server -> worker: path\0selector\0query\0 */
+#define EXEC_FRAME_KILL    2  /* server -> worker: client went away */
+#define EXEC_FRAME_STARTED 3  /* worker -> server: stdout pipe in SCM_RIGHTS */
+#define EXEC_FRAME_ERROR   4  /* worker -> server: int32 errno */
+#define EXEC_FRAME_DONE    5  /* worker -> server: int32 wait status */
+#define EXEC_FRAME_SPAWN   6  /* server -> spawner: int32 loop id */
+#define EXEC_FRAME_SPAWNED 7  /* spawner -> server: int32 pid, socket in SCM_RIGHTS */
+
+typedef struct exec_frame_t {
+    uint32_t type;
+    uint32_t len;  /* payload bytes following the header */
+} exec_frame_t;
+
+extern int exec_init(int workers);
+extern void exec_deinit(void);
+extern int exec_pool_init(loop_t *loop, int workers, int queue_max);
+extern void exec_pool_deinit(loop_t *loop);
+extern int exec_enabled(loop_t *loop);
+extern void exec_dispatch(client_t *client);
+extern void exec_client_free(client_t *client);
+
+#endif /* _EXEC_H_ */
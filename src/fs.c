@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * filesystem lookups, done on a small pool of threads so slow
+ * storage doesn't stall the event loops, and coalesced so that
+ * however many clients ask for a path at once, it is only
+ * looked up once.  The first request for a path starts the
+ * lookup; anyone asking for the same path before it finishes
+ * just waits for the same result.  Results are handed back on
+ * each client's own loop.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "chunk.h"
+#include "dirindex.h"
+#include "gophermap.h"
+#include "gplus.h"
+#include "loop.h"
+#include "plugin.h"
+#include "fs.h"
+#include "negcache.h"
+#include "response.h"
+
+#define FS_HASH_SIZE 256
+
+typedef struct fs_waiter_t {
+    client_t *client;                /* NULL once the client is gone */
+    loop_t *loop;
+    void (*done_fn)(client_t *client, fs_result_t *result);
+    fs_result_t *result;
+    loop_post_t *post;               /* result's way back, made up front */
+    struct fs_waiter_t *next;
+} fs_waiter_t;
+
+/* a lookup under way, and everyone waiting on it */
+typedef struct fs_flight_t {
+    char *path;
+    char *selector;          /* as the first client asked, for negcache */
+    int attrs;               /* GPLUS_INFO or GPLUS_DIR for attributes */
+    uint32_t hash;
+    fs_waiter_t *waiters;
+    struct fs_flight_t *hash_next;
+    struct fs_flight_t *queue_next;
+} fs_flight_t;
+
+static pthread_mutex_t g_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_fs_cond = PTHREAD_COND_INITIALIZER;
+static fs_flight_t *g_fs_table[FS_HASH_SIZE];
+static fs_flight_t *g_fs_queue_head = NULL;
+static fs_flight_t *g_fs_queue_tail = NULL;
+static pthread_t *g_fs_threads = NULL;
+static int g_fs_thread_count = 0;
+static int g_fs_quit = FALSE;
+
+static uint32_t fs_hash(char *path) {
+    uint32_t hash = 2166136261U;
+
+    while(*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * can a selector be joined onto base_dir safely?  A ".."
+ * component could climb out of it, so the whole selector is
+ * refused rather than cleaned up.
+ *
+ * @param selector selector as the client sent it
+ * @returns TRUE if it stays under base_dir, FALSE otherwise
+ */
+int fs_selector_ok(const char *selector) {
+    const char *part;
+    size_t len;
+
+    for(part = selector; *part; part += len) {
+        part += strspn(part, "/");
+        len = strcspn(part, "/");
+        if(len == 2 && part[0] == '.' && part[1] == '.')
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * drop a reference to a lookup result
+ *
+ * @param result result from fs_lookup_now() or a done_fn
+ */
+void fs_result_unref(fs_result_t *result) {
+    if(__atomic_sub_fetch(&result->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    if(result->fd != -1)
+        close(result->fd);
+    chunk_file_close(result->file);
+    if(result->menu)
+        chunk_unref(result->menu);
+    dirindex_unref(result->index);
+    gophermap_unref(result->map);
+    if(result->attrs)
+        chunk_unref(result->attrs);
+    free(result);
+}
+
+/**
+ * render a directory as a gopher menu, or if it's big enough,
+ * index it and hand back the index instead
+ *
+ * @param path directory to list
+ * @param st its stat
+ * @param result where to put the menu or index
+ */
+static void fs_render_dir(char *path, struct stat *st, fs_result_t *result) {
+    char selector[PATH_MAX];
+    const char *tail;
+    size_t tail_len, count, index;
+    struct evbuffer *evb;
+    char **names;
+
+    if(!(names = dirindex_scan(path, &count, &result->err)))
+        return;
+
+    if(dirindex_wanted(count) &&
+       (result->index = dirindex_create(path, st, names, count))) {
+        dirindex_free_names(names, count);
+        return;
+    }
+
+    if(!(evb = evbuffer_new())) {
+        dirindex_free_names(names, count);
+        result->err = ENOMEM;
+        return;
+    }
+
+    dirindex_selector(path, selector, sizeof(selector));
+    tail = response_menu_tail(&tail_len);
+
+    for(index = 0; index < count; index++) {
+        evbuffer_add_printf(evb, "%c%s\t%s/%s", names[index][0], names[index] + 1,
+                            selector, names[index] + 1);
+        evbuffer_add(evb, tail, tail_len);
+    }
+
+    dirindex_free_names(names, count);
+
+    if((result->menu = chunk_new(evbuffer_get_length(evb))))
+        evbuffer_remove(evb, result->menu->data, result->menu->len);
+    else
+        result->err = ENOMEM;
+
+    evbuffer_free(evb);
+}
+
+/**
+ * do the actual filesystem work for a path
+ *
+ * @param path full path to look up
+ * @param selector selector path came from, to remember if it's
+ *        missing, or NULL
+ * @param attrs GPLUS_INFO or GPLUS_DIR for attribute blocks,
+ *        GPLUS_NONE for the item itself
+ * @returns result, or NULL if we're out of memory
+ */
+static fs_result_t *fs_resolve(char *path, char *selector, int attrs) {
+    fs_result_t *result;
+
+    result = (fs_result_t *)calloc(1, sizeof(fs_result_t));
+    if(!result)
+        return NULL;
+
+    result->fd = -1;
+
+    if(stat(path, &result->st) == -1) {
+        result->err = errno;
+        if(result->err == ENOENT && selector)
+            negcache_add(selector, path);
+        return result;
+    }
+
+    if(attrs) {
+        if(!(result->attrs = gplus_attrs(path, attrs, &result->st, &result->err)) &&
+           !result->err)
+            result->err = ENOMEM;
+        return result;
+    }
+
+    if(S_ISDIR(result->st.st_mode)) {
+        /* authored menus first, then big directories from their index */
+        if(!(result->map = gophermap_get(path)) &&
+           !(result->index = dirindex_get(path, &result->st)))
+            fs_render_dir(path, &result->st, result);
+    } else if(S_ISREG(result->st.st_mode)) {
+        /* executables get run, not read */
+        if(config.exec_workers > 0 &&
+           (result->st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+            return result;
+
+        result->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(result->fd == -1) {
+            result->err = errno;
+            return result;
+        }
+
+        if(fstat(result->fd, &result->st) == -1 ||
+           !(result->file = chunk_file_open(result->fd, &result->st)))
+            result->err = errno ? errno : ENOMEM;
+    }
+
+    return result;
+}
+
+/**
+ * back on the client's loop with a result
+ */
+static void on_fs_done(void *arg) {
+    fs_waiter_t *waiter = (fs_waiter_t *)arg;
+    client_t *client = waiter->client;
+
+    if(client) {
+        client->opaque_client = NULL;
+        client->request_type = TYPE_UNKNOWN;
+
+        if(waiter->result) {
+            waiter->done_fn(client, waiter->result);
+        } else {
+            handle_error(client, RESPONSE_INTERNAL);
+        }
+    }
+
+    if(waiter->result)
+        fs_result_unref(waiter->result);
+    free(waiter);
+}
+
+/**
+ * lookup thread
+ */
+static void *fs_thread(void *arg) {
+    fs_flight_t *flight, **pf;
+    fs_waiter_t *waiter, *next;
+    fs_result_t *result;
+    int count;
+
+    pthread_mutex_lock(&g_fs_lock);
+
+    while(!g_fs_quit) {
+        if(!(flight = g_fs_queue_head)) {
+            pthread_cond_wait(&g_fs_cond, &g_fs_lock);
+            continue;
+        }
+
+        g_fs_queue_head = flight->queue_next;
+        if(!g_fs_queue_head)
+            g_fs_queue_tail = NULL;
+        pthread_mutex_unlock(&g_fs_lock);
+
+        result = fs_resolve(flight->path, flight->selector, flight->attrs);
+
+        /* anyone arriving from here on starts a fresh lookup */
+        pthread_mutex_lock(&g_fs_lock);
+        for(pf = &g_fs_table[flight->hash % FS_HASH_SIZE]; *pf; pf = &(*pf)->hash_next) {
+            if(*pf == flight) {
+                *pf = flight->hash_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&g_fs_lock);
+
+        count = 0;
+        for(waiter = flight->waiters; waiter; waiter = waiter->next)
+            count++;
+
+        if(count > 1)
+            DEBUG("Lookup of %s served %d requests", flight->path, count);
+
+        if(result)
+            result->refs = count;
+
+        for(waiter = flight->waiters; waiter; waiter = next) {
+            next = waiter->next;
+            waiter->result = result;
+            loop_post_send(waiter->loop, waiter->post);
+        }
+
+        free(flight->path);
+        free(flight->selector);
+        free(flight);
+
+        pthread_mutex_lock(&g_fs_lock);
+    }
+
+    pthread_mutex_unlock(&g_fs_lock);
+    return NULL;
+}
+
+/**
+ * start the lookup threads.  Must be called after any
+ * forking is done.
+ *
+ * @param threads number of lookup threads
+ * @returns TRUE on success, FALSE otherwise
+ */
+int fs_init(int threads) {
+    if(threads < 1)
+        threads = 1;
+
+    g_fs_threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if(!g_fs_threads) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    g_fs_quit = FALSE;
+    for(g_fs_thread_count = 0; g_fs_thread_count < threads; g_fs_thread_count++) {
+        if(pthread_create(&g_fs_threads[g_fs_thread_count], NULL, fs_thread, NULL)) {
+            ERROR("Could not start lookup thread: %s", strerror(errno));
+            fs_deinit();
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * stop the lookup threads.  Lookups still queued are dropped.
+ */
+void fs_deinit(void) {
+    int index;
+
+    pthread_mutex_lock(&g_fs_lock);
+    g_fs_quit = TRUE;
+    pthread_cond_broadcast(&g_fs_cond);
+    pthread_mutex_unlock(&g_fs_lock);
+
+    for(index = 0; index < g_fs_thread_count; index++)
+        pthread_join(g_fs_threads[index], NULL);
+
+    free(g_fs_threads);
+    g_fs_threads = NULL;
+    g_fs_thread_count = 0;
+}
+
+/**
+ * look up a client's full_path, joining a lookup of the same
+ * path if one is already under way.  done_fn is called on the
+ * client's loop, unless the client is closed first.
+ *
+ * @param client client with full_path set
+ * @param done_fn called with the result
+ */
+void fs_lookup(client_t *client,
+               void (*done_fn)(client_t *client, fs_result_t *result)) {
+    fs_waiter_t *waiter;
+    fs_flight_t *flight;
+    uint32_t hash = fs_hash(client->full_path);
+    int attrs = GPLUS_NONE;
+
+    if(client->gplus == GPLUS_INFO || client->gplus == GPLUS_DIR) {
+        attrs = client->gplus;
+        hash = hash * 31 + attrs;
+    }
+
+    /* anything that can fail, fails here, where the client can
+     * still be told */
+    waiter = (fs_waiter_t *)calloc(1, sizeof(fs_waiter_t));
+    if(!waiter || !(waiter->post = loop_post_new(on_fs_done, waiter))) {
+        free(waiter);
+        handle_error(client, RESPONSE_INTERNAL);
+        return;
+    }
+
+    waiter->client = client;
+    waiter->loop = client->loop;
+    waiter->done_fn = done_fn;
+
+    client->request_type = TYPE_LOOKUP;
+    client->opaque_client = waiter;
+
+    pthread_mutex_lock(&g_fs_lock);
+
+    for(flight = g_fs_table[hash % FS_HASH_SIZE]; flight; flight = flight->hash_next) {
+        if(flight->hash == hash && flight->attrs == attrs &&
+           !strcmp(flight->path, client->full_path))
+            break;
+    }
+
+    if(!flight) {
+        flight = (fs_flight_t *)calloc(1, sizeof(fs_flight_t));
+        if(!flight || !(flight->path = strdup(client->full_path)) ||
+           !(flight->selector = strdup(client->request))) {
+            pthread_mutex_unlock(&g_fs_lock);
+            if(flight)
+                free(flight->path);
+            free(flight);
+            client->request_type = TYPE_UNKNOWN;
+            client->opaque_client = NULL;
+            free(waiter->post);
+            free(waiter);
+            handle_error(client, RESPONSE_INTERNAL);
+            return;
+        }
+
+        flight->attrs = attrs;
+        flight->hash = hash;
+        flight->hash_next = g_fs_table[hash % FS_HASH_SIZE];
+        g_fs_table[hash % FS_HASH_SIZE] = flight;
+
+        if(g_fs_queue_tail)
+            g_fs_queue_tail->queue_next = flight;
+        else
+            g_fs_queue_head = flight;
+        g_fs_queue_tail = flight;
+
+        pthread_cond_signal(&g_fs_cond);
+    }
+
+    waiter->next = flight->waiters;
+    flight->waiters = waiter;
+
+    pthread_mutex_unlock(&g_fs_lock);
+}
+
+/**
+ * look a path up on the calling thread, for work that happens
+ * off the event loops and isn't for any one client
+ *
+ * @param path full path to look up
+ * @returns result to be fs_result_unref()d, or NULL if we're
+ *          out of memory
+ */
+fs_result_t *fs_lookup_now(char *path) {
+    fs_result_t *result;
+
+    if((result = fs_resolve(path, NULL, GPLUS_NONE)))
+        result->refs = 1;
+
+    return result;
+}
+
+/**
+ * a client is closing while its lookup is under way.  The
+ * lookup carries on; its result just goes nowhere.
+ *
+ * @param client client being closed
+ */
+void fs_client_free(client_t *client) {
+    fs_waiter_t *waiter = (fs_waiter_t *)client->opaque_client;
+
+    if(waiter)
+        waiter->client = NULL;
+
+    client->opaque_client = NULL;
+}
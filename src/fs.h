@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _FS_H_
+#define _FS_H_
+
+#include <sys/stat.h>
+
+#include "chunk.h"
+#include "dirindex.h"
+#include "gophermap.h"
+#include "plugin.h"
+
+/* what a lookup found.  Shared by every client that asked for
+ * the same path while it was under way. */
+typedef struct fs_result_t {
+    int refs;
+    int err;                 /* errno from the lookup, 0 on success */
+    struct stat st;
+    int fd;                  /* regular files: open for reading, else -1 */
+    chunk_file_t *file;      /* regular files: shared contents */
+    chunk_t *menu;           /* directories: rendered listing */
+    dirindex_t *index;       /* large directories: paged listing */
+    gophermap_t *map;        /* directories with a gophermap */
+    chunk_t *attrs;          /* Gopher+ attribute requests: the blocks */
+} fs_result_t;
+
+extern int fs_init(int threads);
+extern void fs_deinit(void);
+extern int fs_selector_ok(const char *selector);
+extern void fs_lookup(client_t *client,
+                      void (*done_fn)(client_t *client, fs_result_t *result));
+extern void fs_client_free(client_t *client);
+extern fs_result_t *fs_lookup_now(char *path);
+extern void fs_result_unref(fs_result_t *result);
+
+#endif /* _FS_H_ */
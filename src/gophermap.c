@@ -0,0 +1,443 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * gophermap files: hand written menus.  A directory with a
+ * "gophermap" in it is served as that menu rather than as a
+ * listing of the directory.
+ *
+ * Each line is either a menu item ("Xdisplay<TAB>selector
+ * <TAB>host<TAB>port"), plain text (shown as an info line),
+ * a comment (starting with '#'), or "." to end the map.
+ * Selectors not starting with '/' are relative to the
+ * directory, a missing selector is the display string, and a
+ * missing host/port means this server.
+ *
+ * Maps are compiled once into a table of segments -- literal
+ * bytes, or this server's host/port -- and cached against
+ * their mtime and size, so serving one is just gathering the
+ * segments into the output.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include <event.h>
+#include <event2/buffer.h>
+
+#include "main.h"
+#include "debug.h"
+#include "gophermap.h"
+#include "response.h"
+
+#define GOPHERMAP_CACHE_MAX 1024
+#define GOPHERMAP_BUCKETS 1024
+
+/* what the compiler builds up */
+typedef struct gophermap_build_t {
+    struct evbuffer *literal;
+    gophermap_seg_t *segs;
+    int seg_count;
+    int seg_size;
+    size_t len;
+    int failed;
+} gophermap_build_t;
+
+static pthread_mutex_t g_gophermap_lock = PTHREAD_MUTEX_INITIALIZER;
+static gophermap_t *g_gophermap_hash[GOPHERMAP_BUCKETS];
+static gophermap_t *g_gophermap_ring[GOPHERMAP_CACHE_MAX];   /* by age */
+static int g_gophermap_next = 0;
+
+static gophermap_seg_t *gophermap_seg(gophermap_build_t *build) {
+    gophermap_seg_t *grown;
+
+    if(build->seg_count == build->seg_size) {
+        build->seg_size = build->seg_size ? build->seg_size * 2 : 16;
+        grown = (gophermap_seg_t *)realloc(build->segs,
+                                           build->seg_size * sizeof(gophermap_seg_t));
+        if(!grown) {
+            build->failed = TRUE;
+            return NULL;
+        }
+        build->segs = grown;
+    }
+
+    return &build->segs[build->seg_count++];
+}
+
+/**
+ * add literal bytes, growing the last segment if it was
+ * literal too
+ */
+static void gophermap_literal(gophermap_build_t *build, const char *data, size_t len) {
+    gophermap_seg_t *seg = NULL;
+    size_t off = evbuffer_get_length(build->literal);
+
+    if(!len)
+        return;
+
+    if(build->seg_count && build->segs[build->seg_count - 1].off != GOPHERMAP_TAIL)
+        seg = &build->segs[build->seg_count - 1];
+    else if((seg = gophermap_seg(build))) {
+        seg->off = off;
+        seg->len = 0;
+    }
+
+    if(!seg || evbuffer_add(build->literal, data, len)) {
+        build->failed = TRUE;
+        return;
+    }
+
+    seg->len += len;
+    build->len += len;
+}
+
+static void gophermap_tail(gophermap_build_t *build) {
+    gophermap_seg_t *seg;
+    size_t len;
+
+    if(!(seg = gophermap_seg(build)))
+        return;
+
+    response_menu_tail(&len);
+    seg->off = GOPHERMAP_TAIL;
+    seg->len = len;
+    build->len += len;
+}
+
+/**
+ * compile one line of a gophermap
+ *
+ * @returns FALSE at the end of the map
+ */
+static int gophermap_line(gophermap_build_t *build, char *line, char *selector) {
+    char *display, *sel, *host = NULL, *port = NULL, *p;
+
+    if(!strcmp(line, "."))
+        return FALSE;
+
+    if(line[0] == '#')
+        return TRUE;
+
+    /* plain text */
+    if(!(p = strchr(line, '\t'))) {
+        gophermap_literal(build, "i", 1);
+        gophermap_literal(build, line, strlen(line));
+        gophermap_literal(build, "\t", 1);
+        gophermap_tail(build);
+        return TRUE;
+    }
+
+    display = line;
+    *p++ = '\0';
+    sel = p;
+    if((p = strchr(sel, '\t'))) {
+        *p++ = '\0';
+        host = p;
+        if((p = strchr(host, '\t'))) {
+            *p++ = '\0';
+            port = p;
+            if((p = strchr(port, '\t')))
+                *p = '\0';
+        }
+    }
+
+    if(!display[0])
+        return TRUE;
+
+    if(!*sel)
+        sel = display + 1;
+
+    gophermap_literal(build, display, strlen(display));
+    gophermap_literal(build, "\t", 1);
+
+    /* relative to this directory, unless it's a URL */
+    if(*sel != '/' && strncmp(sel, "URL:", 4)) {
+        gophermap_literal(build, selector, strlen(selector));
+        gophermap_literal(build, "/", 1);
+    }
+    gophermap_literal(build, sel, strlen(sel));
+
+    if(host && *host) {
+        gophermap_literal(build, "\t", 1);
+        gophermap_literal(build, host, strlen(host));
+        gophermap_literal(build, "\t", 1);
+        if(port && *port)
+            gophermap_literal(build, port, strlen(port));
+        else
+            gophermap_literal(build, "70", 2);
+        gophermap_literal(build, "\n\r", 2);
+    } else {
+        gophermap_tail(build);
+    }
+
+    return TRUE;
+}
+
+/**
+ * the selector for a directory, without trailing slashes
+ */
+static void gophermap_selector(char *dir_path, char *selector, size_t len) {
+    char *p = dir_path + strlen(config.base_dir);
+    size_t sel_len;
+
+    while(p[0] == '/' && p[1] == '/')
+        p++;
+
+    snprintf(selector, len, "%s", p);
+    sel_len = strlen(selector);
+    while(sel_len && selector[sel_len - 1] == '/')
+        selector[--sel_len] = '\0';
+}
+
+/**
+ * parse a directory's gophermap
+ *
+ * @param dir_path directory
+ * @param file path to its gophermap
+ * @param st stat of the gophermap
+ * @returns compiled map, or NULL on failure
+ */
+static gophermap_t *gophermap_compile(char *dir_path, char *file, struct stat *st) {
+    char selector[PATH_MAX];
+    gophermap_build_t build;
+    gophermap_t *map;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    FILE *fp;
+
+    if(!(fp = fopen(file, "r")))
+        return NULL;
+
+    gophermap_selector(dir_path, selector, sizeof(selector));
+
+    memset(&build, 0, sizeof(build));
+    if(!(build.literal = evbuffer_new())) {
+        fclose(fp);
+        return NULL;
+    }
+
+    while((len = getline(&line, &line_size, fp)) != -1) {
+        while(len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if(!gophermap_line(&build, line, selector))
+            break;
+    }
+
+    free(line);
+    fclose(fp);
+
+    if(build.failed || !(map = (gophermap_t *)calloc(1, sizeof(gophermap_t)))) {
+        evbuffer_free(build.literal);
+        free(build.segs);
+        return NULL;
+    }
+
+    map->refs = 1;
+    map->dev = st->st_dev;
+    map->ino = st->st_ino;
+    map->mtime = st->st_mtim;
+    map->size = st->st_size;
+    map->segs = build.segs;
+    map->seg_count = build.seg_count;
+    map->len = build.len;
+
+    map->literal = (char *)malloc(evbuffer_get_length(build.literal) + 1);
+    if(!map->literal) {
+        evbuffer_free(build.literal);
+        free(map->segs);
+        free(map);
+        return NULL;
+    }
+    evbuffer_remove(build.literal, map->literal, evbuffer_get_length(build.literal));
+    evbuffer_free(build.literal);
+
+    DEBUG("Compiled %s: %d segments, %zu bytes", file, map->seg_count, map->len);
+    return map;
+}
+
+static void gophermap_free(gophermap_t *map) {
+    free(map->literal);
+    free(map->segs);
+    free(map);
+}
+
+/**
+ * drop a ref on a map
+ */
+void gophermap_unref(gophermap_t *map) {
+    if(map && !__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL))
+        gophermap_free(map);
+}
+
+/**
+ * take a map out of the cache.  Called with the lock held.
+ */
+static void gophermap_evict(gophermap_t *map) {
+    gophermap_t **pm;
+
+    for(pm = &g_gophermap_hash[map->ino % GOPHERMAP_BUCKETS]; *pm; pm = &(*pm)->hash_next) {
+        if(*pm == map) {
+            *pm = map->hash_next;
+            break;
+        }
+    }
+
+    g_gophermap_ring[map->slot] = NULL;
+    gophermap_unref(map);
+}
+
+/**
+ * drop every cached map
+ */
+void gophermap_deinit(void) {
+    int index;
+
+    pthread_mutex_lock(&g_gophermap_lock);
+    for(index = 0; index < GOPHERMAP_CACHE_MAX; index++) {
+        if(g_gophermap_ring[index])
+            gophermap_evict(g_gophermap_ring[index]);
+    }
+    pthread_mutex_unlock(&g_gophermap_lock);
+}
+
+/**
+ * get the compiled gophermap for a directory, compiling it
+ * if it's new or has changed
+ *
+ * @param dir_path directory
+ * @returns a ref on its map, or NULL if it doesn't have one
+ */
+gophermap_t *gophermap_get(char *dir_path) {
+    char file[PATH_MAX];
+    gophermap_t *map, *fresh;
+    struct stat st;
+
+    if(snprintf(file, sizeof(file), "%s/" GOPHERMAP_NAME, dir_path) >= (int)sizeof(file) ||
+       stat(file, &st) == -1 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    pthread_mutex_lock(&g_gophermap_lock);
+    for(map = g_gophermap_hash[st.st_ino % GOPHERMAP_BUCKETS]; map; map = map->hash_next) {
+        if(map->dev == st.st_dev && map->ino == st.st_ino)
+            break;
+    }
+
+    if(map && map->size == st.st_size &&
+       map->mtime.tv_sec == st.st_mtim.tv_sec && map->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&g_gophermap_lock);
+        return map;
+    }
+    pthread_mutex_unlock(&g_gophermap_lock);
+
+    if(!(fresh = gophermap_compile(dir_path, file, &st)))
+        return NULL;
+
+    pthread_mutex_lock(&g_gophermap_lock);
+
+    /* replace whatever was there -- stale, or compiled alongside us */
+    for(map = g_gophermap_hash[st.st_ino % GOPHERMAP_BUCKETS]; map; map = map->hash_next) {
+        if(map->dev == st.st_dev && map->ino == st.st_ino) {
+            gophermap_evict(map);
+            break;
+        }
+    }
+
+    if(g_gophermap_ring[g_gophermap_next])
+        gophermap_evict(g_gophermap_ring[g_gophermap_next]);
+
+    fresh->slot = g_gophermap_next;
+    g_gophermap_ring[fresh->slot] = fresh;
+    g_gophermap_next = (g_gophermap_next + 1) % GOPHERMAP_CACHE_MAX;
+
+    fresh->hash_next = g_gophermap_hash[st.st_ino % GOPHERMAP_BUCKETS];
+    g_gophermap_hash[st.st_ino % GOPHERMAP_BUCKETS] = fresh;
+
+    fresh->refs++;    /* one for the cache, one for the caller */
+    pthread_mutex_unlock(&g_gophermap_lock);
+
+    return fresh;
+}
+
+/**
+ * gather a compiled map's segments into an output buffer
+ *
+ * @param map compiled map
+ * @param output buffer to add it to
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gophermap_add(gophermap_t *map, struct evbuffer *output) {
+    struct evbuffer_iovec vec;
+    const char *tail;
+    size_t tail_len;
+    char *p;
+    int index;
+
+    if(!map->len)
+        return TRUE;
+
+    if(evbuffer_reserve_space(output, map->len, &vec, 1) != 1)
+        return FALSE;
+
+    tail = response_menu_tail(&tail_len);
+    p = (char *)vec.iov_base;
+    for(index = 0; index < map->seg_count; index++) {
+        if(map->segs[index].off == GOPHERMAP_TAIL) {
+            memcpy(p, tail, tail_len);
+            p += tail_len;
+        } else {
+            memcpy(p, map->literal + map->segs[index].off, map->segs[index].len);
+            p += map->segs[index].len;
+        }
+    }
+
+    vec.iov_len = map->len;
+    return evbuffer_commit_space(output, &vec, 1) == 0;
+}
+
+/**
+ * render a directory's gophermap, bypassing the cache
+ *
+ * @param dir_path directory
+ * @param output buffer to render it into
+ * @returns TRUE if the directory had a map, FALSE otherwise
+ */
+int gophermap_render(char *dir_path, struct evbuffer *output) {
+    char file[PATH_MAX];
+    gophermap_t *map;
+    struct stat st;
+    int res;
+
+    if(snprintf(file, sizeof(file), "%s/" GOPHERMAP_NAME, dir_path) >= (int)sizeof(file) ||
+       stat(file, &st) == -1 || !S_ISREG(st.st_mode) ||
+       !(map = gophermap_compile(dir_path, file, &st)))
+        return FALSE;
+
+    res = gophermap_add(map, output);
+    gophermap_unref(map);
+    return res;
+}
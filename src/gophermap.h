@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _GOPHERMAP_H_
+#define _GOPHERMAP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <event.h>
+
+/* a piece of a compiled menu: literal bytes, or the menu tail */
+typedef struct gophermap_seg_t {
+    uint32_t off;            /* into literal, GOPHERMAP_TAIL for the tail */
+    uint32_t len;
+} gophermap_seg_t;
+
+#define GOPHERMAP_TAIL UINT32_MAX
+
+/* a directory's hand written menu */
+#define GOPHERMAP_NAME "gophermap"
+
+/* a gophermap, parsed once */
+typedef struct gophermap_t {
+    int refs;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char *literal;
+    gophermap_seg_t *segs;
+    int seg_count;
+    size_t len;              /* rendered length */
+    struct gophermap_t *hash_next;
+    int slot;
+} gophermap_t;
+
+extern void gophermap_deinit(void);
+extern gophermap_t *gophermap_get(char *dir_path);
+extern void gophermap_unref(gophermap_t *map);
+extern int gophermap_add(gophermap_t *map, struct evbuffer *output);
+extern int gophermap_render(char *dir_path, struct evbuffer *output);
+
+#endif /* _GOPHERMAP_H_ */
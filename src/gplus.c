@@ -0,0 +1,651 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Gopher+ attributes.
+ *
+ * A selector followed by a tab and "!" asks for the item's
+ * attribute block, and "$" asks for the blocks of everything
+ * in a menu: the menu itself, as far as a Gopher+ client is
+ * concerned.  "+" asks for the item with its length up front.
+ *
+ * Working out a block takes a stat and a look at the file to
+ * guess its type, which for a "$" on a big directory is a lot
+ * of work.  So each item's block (everything but its +INFO
+ * line, which depends on how the menu names it) is cached
+ * against its inode, mtime and size, and a menu's blocks are
+ * put together by stat()ing its items and copying out what's
+ * cached.  All of it happens on the lookup threads.
+ *
+ * Gopher+ wants CRLF line endings, so blocks use those rather
+ * than the "\n\r" our menus end lines with.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "dirindex.h"
+#include "fs.h"
+#include "gophermap.h"
+#include "gplus.h"
+#include "http.h"
+#include "plugin.h"
+
+#define GPLUS_BUCKETS 4096
+#define GPLUS_SNIFF_SIZE 512
+
+/* an item's attribute block, less its +INFO line */
+typedef struct gplus_entry_t {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char type;               /* gopher item type we guessed */
+    chunk_t *block;
+    struct gplus_entry_t *hash_next;
+    int slot;
+} gplus_entry_t;
+
+static char *g_gplus_host = NULL;
+static char g_gplus_port[8];
+static char *g_gplus_admin = NULL;
+
+static pthread_mutex_t g_gplus_lock = PTHREAD_MUTEX_INITIALIZER;
+static gplus_entry_t *g_gplus_hash[GPLUS_BUCKETS];
+static gplus_entry_t **g_gplus_ring = NULL;   /* by age */
+static int g_gplus_entries = 0;
+static int g_gplus_next = 0;
+
+/**
+ * set up attribute blocks and their cache
+ *
+ * @param host hostname we put in +INFO lines
+ * @param port port we put in +INFO lines
+ * @param admin who to name in +ADMIN, NULL for root@host
+ * @param entries items to keep blocks for, 0 for no caching
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gplus_init(char *host, uint16_t port, char *admin, int entries) {
+    gplus_deinit();
+
+    if(!(g_gplus_host = strdup(host)))
+        return FALSE;
+
+    snprintf(g_gplus_port, sizeof(g_gplus_port), "%u", port);
+
+    if(admin)
+        g_gplus_admin = strdup(admin);
+    else if(asprintf(&g_gplus_admin, "root@%s", host) < 0)
+        g_gplus_admin = NULL;
+
+    if(!g_gplus_admin) {
+        gplus_deinit();
+        return FALSE;
+    }
+
+    if(entries > 0) {
+        g_gplus_ring = (gplus_entry_t **)calloc(entries, sizeof(gplus_entry_t *));
+        if(!g_gplus_ring) {
+            ERROR("malloc");
+            gplus_deinit();
+            return FALSE;
+        }
+        g_gplus_entries = entries;
+    }
+
+    return TRUE;
+}
+
+/**
+ * take an entry out of the cache.  Called with the lock held.
+ */
+static void gplus_evict(gplus_entry_t *entry) {
+    gplus_entry_t **pe;
+
+    for(pe = &g_gplus_hash[entry->ino % GPLUS_BUCKETS]; *pe; pe = &(*pe)->hash_next) {
+        if(*pe == entry) {
+            *pe = entry->hash_next;
+            break;
+        }
+    }
+
+    g_gplus_ring[entry->slot] = NULL;
+    chunk_unref(entry->block);
+    free(entry);
+}
+
+/**
+ * drop the cache, and everything gplus_init set up
+ */
+void gplus_deinit(void) {
+    int index;
+
+    pthread_mutex_lock(&g_gplus_lock);
+    for(index = 0; index < g_gplus_entries; index++) {
+        if(g_gplus_ring[index])
+            gplus_evict(g_gplus_ring[index]);
+    }
+    pthread_mutex_unlock(&g_gplus_lock);
+
+    free(g_gplus_ring);
+    g_gplus_ring = NULL;
+    g_gplus_entries = 0;
+    g_gplus_next = 0;
+
+    free(g_gplus_host);
+    g_gplus_host = NULL;
+    free(g_gplus_admin);
+    g_gplus_admin = NULL;
+}
+
+/**
+ * note what a Gopher+ client is asking for.  Anything after a
+ * "!" or "$" names the attribute blocks it wants.
+ *
+ * @param client client with its query split off
+ */
+void gplus_parse(client_t *client) {
+    client->gplus = GPLUS_NONE;
+
+    if(client->http || !client->query)
+        return;
+
+    switch(client->query[0]) {
+    case GPLUS_ITEM:
+    case GPLUS_INFO:
+    case GPLUS_DIR:
+        client->gplus = client->query[0];
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * does the start of a file look like text?
+ */
+static int gplus_looks_text(char *path) {
+    unsigned char buf[GPLUS_SNIFF_SIZE];
+    ssize_t len, index;
+    int fd, odd = 0;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return FALSE;
+
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    if(len < 0)
+        return FALSE;
+
+    for(index = 0; index < len; index++) {
+        if(!buf[index])
+            return FALSE;
+        if(buf[index] < 0x20 && !strchr("\t\r\n\f\033", buf[index]))
+            odd++;
+    }
+
+    return odd * 10 <= len;
+}
+
+/**
+ * guess an item's gopher type and MIME type
+ *
+ * @param path item's full path
+ * @param st its stat
+ * @param mime set to its MIME type (may have parameters)
+ * @returns gopher item type
+ */
+static char gplus_type(char *path, struct stat *st, const char **mime) {
+    if(S_ISDIR(st->st_mode)) {
+        *mime = "application/gopher+-menu";
+        return '1';
+    }
+
+    *mime = http_content_type(path);
+
+    if(!strncmp(*mime, "text/html", 9))
+        return 'h';
+    if(!strncmp(*mime, "text/", 5))
+        return '0';
+    if(!strcmp(*mime, "image/gif"))
+        return 'g';
+    if(!strncmp(*mime, "image/", 6))
+        return 'I';
+    if(!strncmp(*mime, "audio/", 6))
+        return 's';
+    if(strcmp(*mime, "application/octet-stream"))
+        return '9';
+
+    /* nothing to go on in the name -- look inside */
+    if(S_ISREG(st->st_mode) && gplus_looks_text(path)) {
+        *mime = "text/plain";
+        return '0';
+    }
+
+    return '9';
+}
+
+/**
+ * work out an item's block
+ *
+ * @param path item's full path
+ * @param st its stat
+ * @param type set to its gopher type
+ * @returns the block, or NULL on failure
+ */
+static chunk_t *gplus_block_build(char *path, struct stat *st, char *type) {
+    char when[64], stamp[16];
+    const char *mime;
+    chunk_t *block;
+    struct tm tm;
+    int mime_len;
+    int len;
+
+    *type = gplus_type(path, st, &mime);
+    mime_len = (int)strcspn(mime, ";");
+
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(when, sizeof(when), "%a %b %e %H:%M:%S %Y", &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+
+    len = snprintf(NULL, 0, "+ADMIN:\r\n Admin: %s\r\n Mod-Date: %s <%s>\r\n"
+                   "+VIEWS:\r\n %.*s: <%lldk>\r\n", g_gplus_admin, when, stamp,
+                   mime_len, mime, (long long)((st->st_size + 1023) / 1024));
+    if(len < 0 || !(block = chunk_new(len + 1)))
+        return NULL;
+
+    if(S_ISDIR(st->st_mode)) {
+        block->len = snprintf(block->data, len + 1,
+                              "+ADMIN:\r\n Admin: %s\r\n Mod-Date: %s <%s>\r\n"
+                              "+VIEWS:\r\n %.*s:\r\n", g_gplus_admin, when, stamp,
+                              mime_len, mime);
+    } else {
+        block->len = snprintf(block->data, len + 1,
+                              "+ADMIN:\r\n Admin: %s\r\n Mod-Date: %s <%s>\r\n"
+                              "+VIEWS:\r\n %.*s: <%lldk>\r\n", g_gplus_admin, when,
+                              stamp, mime_len, mime,
+                              (long long)((st->st_size + 1023) / 1024));
+    }
+
+    return block;
+}
+
+/**
+ * get an item's block, from the cache if it hasn't changed
+ *
+ * @param path item's full path
+ * @param st its stat
+ * @param type set to its gopher type
+ * @returns a ref on the block, or NULL on failure
+ */
+static chunk_t *gplus_block(char *path, struct stat *st, char *type) {
+    gplus_entry_t *entry, *fresh;
+    chunk_t *block;
+
+    if(!g_gplus_entries)
+        return gplus_block_build(path, st, type);
+
+    pthread_mutex_lock(&g_gplus_lock);
+    for(entry = g_gplus_hash[st->st_ino % GPLUS_BUCKETS]; entry; entry = entry->hash_next) {
+        if(entry->dev == st->st_dev && entry->ino == st->st_ino)
+            break;
+    }
+
+    if(entry && entry->size == st->st_size &&
+       entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+       entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+        __atomic_add_fetch(&entry->block->refs, 1, __ATOMIC_RELAXED);
+        *type = entry->type;
+        block = entry->block;
+        pthread_mutex_unlock(&g_gplus_lock);
+        return block;
+    }
+    pthread_mutex_unlock(&g_gplus_lock);
+
+    if(!(block = gplus_block_build(path, st, type)))
+        return NULL;
+
+    if(!(fresh = (gplus_entry_t *)calloc(1, sizeof(gplus_entry_t))))
+        return block;
+
+    fresh->dev = st->st_dev;
+    fresh->ino = st->st_ino;
+    fresh->mtime = st->st_mtim;
+    fresh->size = st->st_size;
+    fresh->type = *type;
+    fresh->block = block;
+
+    pthread_mutex_lock(&g_gplus_lock);
+
+    /* replace whatever was there -- stale, or built alongside us */
+    for(entry = g_gplus_hash[st->st_ino % GPLUS_BUCKETS]; entry; entry = entry->hash_next) {
+        if(entry->dev == st->st_dev && entry->ino == st->st_ino) {
+            gplus_evict(entry);
+            break;
+        }
+    }
+
+    if(g_gplus_ring[g_gplus_next])
+        gplus_evict(g_gplus_ring[g_gplus_next]);
+
+    fresh->slot = g_gplus_next;
+    g_gplus_ring[fresh->slot] = fresh;
+    g_gplus_next = (g_gplus_next + 1) % g_gplus_entries;
+
+    fresh->hash_next = g_gplus_hash[st->st_ino % GPLUS_BUCKETS];
+    g_gplus_hash[st->st_ino % GPLUS_BUCKETS] = fresh;
+
+    /* one for the cache, one for the caller */
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_gplus_lock);
+
+    return block;
+}
+
+/**
+ * add an item's +INFO line and block
+ *
+ * @param evb where the blocks are going
+ * @param path item's full path
+ * @param st its stat
+ * @param display what the menu calls it
+ * @param selector how the menu points at it
+ */
+static void gplus_item(struct evbuffer *evb, char *path, struct stat *st,
+                       const char *display, const char *selector) {
+    chunk_t *block;
+    char type;
+
+    if(!(block = gplus_block(path, st, &type)))
+        return;
+
+    evbuffer_add_printf(evb, "+INFO: %c%s\t%s\t%s\t%s\t+\r\n", type, display,
+                        selector, g_gplus_host, g_gplus_port);
+    evbuffer_add(evb, block->data, block->len);
+    chunk_unref(block);
+}
+
+/**
+ * the blocks for a directory's listing, named the way the
+ * listing names them
+ */
+static void gplus_listing(struct evbuffer *evb, char *path, int *err) {
+    char child[PATH_MAX], dir_selector[PATH_MAX], selector[PATH_MAX];
+    size_t count, index;
+    struct stat st;
+    char **names;
+
+    if(!(names = dirindex_scan(path, &count, err)))
+        return;
+
+    dirindex_selector(path, dir_selector, sizeof(dir_selector));
+
+    for(index = 0; index < count; index++) {
+        if(snprintf(child, sizeof(child), "%s/%s", path, names[index] + 1) >= (int)sizeof(child) ||
+           snprintf(selector, sizeof(selector), "%s/%s", dir_selector,
+                    names[index] + 1) >= (int)sizeof(selector) ||
+           stat(child, &st) == -1)
+            continue;
+
+        gplus_item(evb, child, &st, names[index] + 1, selector);
+    }
+
+    dirindex_free_names(names, count);
+}
+
+/**
+ * the blocks for a gophermap: every line gets a +INFO, and
+ * items on this server get their block too
+ */
+static void gplus_map(struct evbuffer *evb, gophermap_t *map) {
+    char child[PATH_MAX];
+    struct evbuffer *menu;
+    char *line, *field[4];
+    chunk_t *block;
+    struct stat st;
+    size_t len;
+    char type;
+    int index;
+
+    if(!(menu = evbuffer_new()))
+        return;
+
+    if(!gophermap_add(map, menu)) {
+        evbuffer_free(menu);
+        return;
+    }
+
+    while((line = evbuffer_readln(menu, &len, EVBUFFER_EOL_ANY))) {
+        if(!len || !strcmp(line, ".")) {
+            free(line);
+            continue;
+        }
+
+        evbuffer_add_printf(evb, "+INFO: %s\t+\r\n", line);
+
+        field[0] = line;
+        for(index = 1; index < 4; index++) {
+            if(!(field[index] = strchr(field[index - 1], '\t')))
+                break;
+            *field[index]++ = '\0';
+        }
+
+        if(index == 4 && line[0] != 'i' && line[0] != '3' &&
+           !strcmp(field[2], g_gplus_host) && !strcmp(field[3], g_gplus_port) &&
+           fs_selector_ok(field[1]) &&
+           snprintf(child, sizeof(child), "%s/%s", config.base_dir,
+                    field[1]) < (int)sizeof(child) &&
+           stat(child, &st) != -1 && (block = gplus_block(child, &st, &type))) {
+            evbuffer_add(evb, block->data, block->len);
+            chunk_unref(block);
+        }
+
+        free(line);
+    }
+
+    evbuffer_free(menu);
+}
+
+/**
+ * work out the attribute blocks a lookup asked for.  Runs on
+ * the lookup threads.
+ *
+ * @param path full path of the selector
+ * @param kind GPLUS_INFO or GPLUS_DIR
+ * @param st the path's stat
+ * @param err set to an errno on failure
+ * @returns the blocks, or NULL on failure
+ */
+chunk_t *gplus_attrs(char *path, int kind, struct stat *st, int *err) {
+    char *selector, *name;
+    struct evbuffer *evb;
+    gophermap_t *map;
+    chunk_t *attrs;
+
+    /* the same rule handle_request holds every selector to */
+    if(!fs_selector_ok(path + strlen(config.base_dir))) {
+        *err = EACCES;
+        return NULL;
+    }
+
+    if(kind == GPLUS_DIR && !S_ISDIR(st->st_mode)) {
+        *err = ENOTDIR;
+        return NULL;
+    }
+
+    if(!(evb = evbuffer_new())) {
+        *err = ENOMEM;
+        return NULL;
+    }
+
+    if(kind == GPLUS_INFO) {
+        selector = path + strlen(config.base_dir) + 1;
+        name = strrchr(selector, '/');
+        name = name && name[1] ? name + 1 : selector;
+        gplus_item(evb, path, st, name, selector);
+    } else if((map = gophermap_get(path))) {
+        gplus_map(evb, map);
+        gophermap_unref(map);
+    } else {
+        gplus_listing(evb, path, err);
+    }
+
+    if((attrs = chunk_new(evbuffer_get_length(evb))))
+        evbuffer_remove(evb, attrs->data, attrs->len);
+    else
+        *err = ENOMEM;
+
+    evbuffer_free(evb);
+    return attrs;
+}
+
+/**
+ * queue the line a Gopher+ reply starts with
+ *
+ * @param output buffer to queue it on
+ * @param length bytes to follow, or -2 for "until we close"
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gplus_header(struct evbuffer *output, int64_t length) {
+    return evbuffer_add_printf(output, "+%lld\r\n", (long long)length) > 0;
+}
+
+/**
+ * write the "until we close" line straight to a client's
+ * socket, ahead of output spliced to it
+ *
+ * @param fd client's socket
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gplus_splice_header(int fd) {
+    return write(fd, "+-2\r\n", 5) == 5;
+}
+
+/**
+ * is this block one of the ones asked for?
+ *
+ * @param name block name, from its '+' up to its ':'
+ * @param len length of name
+ * @param wanted space separated names, with or without '+'
+ */
+static int gplus_wanted(const char *name, size_t len, const char *wanted) {
+    const char *word;
+    size_t word_len;
+
+    /* everyone needs to know which item a block is for */
+    if(len == 5 && !memcmp(name, "+INFO", 5))
+        return TRUE;
+
+    for(word = wanted; *word; word += word_len) {
+        word += strspn(word, " ");
+        word_len = strcspn(word, " ");
+
+        if(word_len && word[0] != '+' && word_len == len - 1 &&
+           !memcmp(word, name + 1, word_len))
+            return TRUE;
+        if(word_len == len && !memcmp(word, name, len))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * queue attribute blocks, just the ones asked for if any were
+ *
+ * @param attrs blocks from gplus_attrs()
+ * @param wanted block names asked for, "" for all of them
+ * @param output buffer to queue it on
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gplus_add(chunk_t *attrs, const char *wanted, struct evbuffer *output) {
+    const char *line, *end, *next;
+    struct evbuffer *picked;
+    int keep = FALSE;
+    int res;
+
+    if(!*wanted)
+        return gplus_header(output, attrs->len) && chunk_add(attrs, output);
+
+    if(!(picked = evbuffer_new()))
+        return FALSE;
+
+    end = attrs->data + attrs->len;
+    for(line = attrs->data; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+
+        if(*line == '+')
+            keep = gplus_wanted(line, strcspn(line, ":\r\n"), wanted);
+
+        if(keep)
+            evbuffer_add(picked, line, next - line);
+    }
+
+    res = gplus_header(output, evbuffer_get_length(picked)) &&
+          evbuffer_add_buffer(output, picked) == 0;
+
+    evbuffer_free(picked);
+    return res;
+}
+
+/**
+ * queue a canned response as a Gopher+ error
+ *
+ * @param id which response
+ * @param output buffer to queue it on
+ * @returns TRUE on success, FALSE otherwise
+ */
+int gplus_error(response_id_t id, struct evbuffer *output) {
+    const char *data;
+    size_t len;
+    int code;
+
+    /* 1 is "item is not available", 2 "try again later" */
+    switch(id) {
+    case RESPONSE_BUSY:
+    case RESPONSE_EXEC_FAILED:
+    case RESPONSE_UPSTREAM:
+    case RESPONSE_SEARCH_UNAVAILABLE:
+    case RESPONSE_INTERNAL:
+        code = 2;
+        break;
+    default:
+        code = 1;
+        break;
+    }
+
+    /* the text of the canned menu line */
+    data = response_get(id, &len);
+    len = strcspn(data + 1, "\t");
+
+    return evbuffer_add_printf(output, "-%zu\r\n%d %.*s\r\n", len + 4, code,
+                               (int)len, data + 1) > 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _GPLUS_H_
+#define _GPLUS_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <event.h>
+
+#include "chunk.h"
+#include "response.h"
+
+/* what a Gopher+ client asked for, from the character after
+ * the selector's tab */
+#define GPLUS_NONE  0
+#define GPLUS_ITEM  '+'      /* the item, with a length up front */
+#define GPLUS_INFO  '!'      /* the item's attribute block */
+#define GPLUS_DIR   '$'      /* attribute blocks for a whole menu */
+
+struct client_t;
+
+extern int gplus_init(char *host, uint16_t port, char *admin, int entries);
+extern void gplus_deinit(void);
+extern void gplus_parse(struct client_t *client);
+extern chunk_t *gplus_attrs(char *path, int kind, struct stat *st, int *err);
+extern int gplus_header(struct evbuffer *output, int64_t length);
+extern int gplus_splice_header(int fd);
+extern int gplus_add(chunk_t *attrs, const char *wanted, struct evbuffer *output);
+extern int gplus_error(response_id_t id, struct evbuffer *output);
+
+#endif /* _GPLUS_H_ */
@@ -0,0 +1,639 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * hot set snapshots, so a restarted server doesn't start cold.
+ *
+ * Every request served from the filesystem bumps a count for
+ * its selector.  Every hotset_interval seconds (and on the way
+ * out) the hotset_size busiest selectors are written to
+ * hotset_file, busiest first, and the counts are halved so the
+ * set follows what's hot now rather than what was hot once.
+ * Only about four times hotset_size selectors are tracked at
+ * once, Space-Saving style: once that's full, a newcomer takes
+ * the place of the least counted selector and starts from its
+ * count, so anything getting hot mid-interval climbs in rather
+ * than waiting for room.
+ *
+ * On startup a thread reads the last snapshot back and looks
+ * every selector up in order while the loops take traffic:
+ * directories get their menus, indexes and gophermaps loaded,
+ * and files their chunks (while they fit in file_cache_size)
+ * or page cache readahead after that.  Warmup reads at most
+ * hotset_warmup_bytes, no faster than hotset_warmup_rate
+ * bytes a second, so it doesn't starve real requests.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "debug.h"
+#include "chunk.h"
+#include "fs.h"
+#include "hotset.h"
+
+#define HOTSET_MAGIC "evgopherd hotset 1"
+#define HOTSET_TRACK_FACTOR 4
+#define HOTSET_MIN_TRACKED 64
+#define HOTSET_READAHEAD_STEP (1024 * 1024)
+
+typedef struct hotset_entry_t {
+    uint64_t hash;
+    uint32_t count;
+    int slot;                        /* in the heap */
+    struct hotset_entry_t *next;
+    char selector[];
+} hotset_entry_t;
+
+/* what a snapshot writes, copied out from under the lock */
+typedef struct hotset_saved_t {
+    uint32_t count;
+    char *selector;
+} hotset_saved_t;
+
+static pthread_mutex_t g_hotset_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_hotset_cond = PTHREAD_COND_INITIALIZER;
+static hotset_entry_t **g_hotset_hash = NULL;
+static hotset_entry_t **g_hotset_heap = NULL;   /* least counted first */
+static int g_hotset_buckets = 0;
+static int g_hotset_tracked = 0;
+static int g_hotset_max_tracked = 0;
+static int g_hotset_size = 0;
+static int g_hotset_interval = 0;
+static char *g_hotset_file = NULL;
+static int g_hotset_warned = FALSE;
+static int g_hotset_quit = FALSE;
+static pthread_t g_hotset_thread;
+static int g_hotset_started = FALSE;
+
+/* warmup progress, only touched by the hotset thread */
+static size_t g_hotset_warmup_max = 0;
+static size_t g_hotset_warmup_rate = 0;
+static size_t g_hotset_warmed = 0;
+static struct timespec g_hotset_warmup_start;
+
+static uint64_t hotset_hash(char *selector) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*selector) {
+        hash ^= (unsigned char)*selector++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void hotset_heap_set(int slot, hotset_entry_t *entry) {
+    g_hotset_heap[slot] = entry;
+    entry->slot = slot;
+}
+
+static void hotset_heap_up(int slot) {
+    hotset_entry_t *entry = g_hotset_heap[slot];
+    int parent;
+
+    while(slot > 0) {
+        parent = (slot - 1) / 2;
+        if(g_hotset_heap[parent]->count <= entry->count)
+            break;
+        hotset_heap_set(slot, g_hotset_heap[parent]);
+        slot = parent;
+    }
+    hotset_heap_set(slot, entry);
+}
+
+static void hotset_heap_down(int slot) {
+    hotset_entry_t *entry = g_hotset_heap[slot];
+    int child;
+
+    while((child = 2 * slot + 1) < g_hotset_tracked) {
+        if(child + 1 < g_hotset_tracked &&
+           g_hotset_heap[child + 1]->count < g_hotset_heap[child]->count)
+            child++;
+        if(entry->count <= g_hotset_heap[child]->count)
+            break;
+        hotset_heap_set(slot, g_hotset_heap[child]);
+        slot = child;
+    }
+    hotset_heap_set(slot, entry);
+}
+
+/**
+ * take an entry out of its hash chain.  Called with the lock
+ * held.
+ */
+static void hotset_unhash(hotset_entry_t *entry) {
+    hotset_entry_t **pe;
+
+    for(pe = &g_hotset_hash[entry->hash % g_hotset_buckets]; *pe; pe = &(*pe)->next) {
+        if(*pe == entry) {
+            *pe = entry->next;
+            break;
+        }
+    }
+}
+
+/**
+ * count a selector.  Once we're tracking all we can, it
+ * replaces the least counted selector and inherits its count.
+ * Called with the lock held.
+ */
+static void hotset_count(char *selector, uint32_t count) {
+    hotset_entry_t *entry, *least = NULL;
+    uint64_t hash = hotset_hash(selector);
+    int bucket = (int)(hash % g_hotset_buckets);
+    size_t len;
+
+    for(entry = g_hotset_hash[bucket]; entry; entry = entry->next) {
+        if(entry->hash == hash && !strcmp(entry->selector, selector)) {
+            entry->count = entry->count < UINT32_MAX - count ?
+                entry->count + count : UINT32_MAX;
+            hotset_heap_down(entry->slot);
+            return;
+        }
+    }
+
+    len = strlen(selector);
+    if(!(entry = (hotset_entry_t *)malloc(sizeof(hotset_entry_t) + len + 1)))
+        return;
+
+    entry->hash = hash;
+    entry->count = count;
+    memcpy(entry->selector, selector, len + 1);
+
+    if(g_hotset_tracked >= g_hotset_max_tracked) {
+        least = g_hotset_heap[0];
+        entry->count = least->count < UINT32_MAX - count ?
+            least->count + count : UINT32_MAX;
+        hotset_unhash(least);
+        free(least);
+        hotset_heap_set(0, entry);
+        hotset_heap_down(0);
+    } else {
+        hotset_heap_set(g_hotset_tracked++, entry);
+        hotset_heap_up(entry->slot);
+    }
+
+    entry->next = g_hotset_hash[bucket];
+    g_hotset_hash[bucket] = entry;
+}
+
+/**
+ * a selector was served from the filesystem
+ *
+ * @param selector what was asked for
+ */
+void hotset_record(char *selector) {
+    if(!g_hotset_hash)
+        return;
+
+    pthread_mutex_lock(&g_hotset_lock);
+    if(g_hotset_hash)
+        hotset_count(selector, 1);
+    pthread_mutex_unlock(&g_hotset_lock);
+}
+
+/**
+ * halve every count, forgetting anything that reaches zero.
+ * Called with the lock held.
+ */
+static void hotset_decay(void) {
+    hotset_entry_t *entry;
+    int index, kept = 0;
+
+    for(index = 0; index < g_hotset_tracked; index++) {
+        entry = g_hotset_heap[index];
+        if(!(entry->count /= 2)) {
+            hotset_unhash(entry);
+            free(entry);
+            continue;
+        }
+        hotset_heap_set(kept++, entry);
+    }
+
+    /* halving keeps the order, but the gaps have to close */
+    g_hotset_tracked = kept;
+    for(index = kept / 2 - 1; index >= 0; index--)
+        hotset_heap_down(index);
+}
+
+static int hotset_compare(const void *a, const void *b) {
+    const hotset_entry_t *ea = *(const hotset_entry_t * const *)a;
+    const hotset_entry_t *eb = *(const hotset_entry_t * const *)b;
+
+    if(ea->count != eb->count)
+        return ea->count < eb->count ? 1 : -1;
+    return strcmp(ea->selector, eb->selector);
+}
+
+/**
+ * write the busiest selectors out, then age the counts.  They
+ * can be replaced at any time, so the busiest are copied out
+ * under the lock first.
+ */
+static void hotset_save(void) {
+    hotset_entry_t **entries = NULL;
+    hotset_saved_t *saved = NULL;
+    char tmp[PATH_MAX];
+    int count = 0, index, fd;
+    FILE *fp = NULL;
+
+    pthread_mutex_lock(&g_hotset_lock);
+    if(g_hotset_tracked &&
+       (entries = (hotset_entry_t **)malloc(g_hotset_tracked * sizeof(hotset_entry_t *)))) {
+        memcpy(entries, g_hotset_heap, g_hotset_tracked * sizeof(hotset_entry_t *));
+        count = g_hotset_tracked;
+        qsort(entries, count, sizeof(hotset_entry_t *), hotset_compare);
+        if(count > g_hotset_size)
+            count = g_hotset_size;
+
+        if((saved = (hotset_saved_t *)calloc(count, sizeof(hotset_saved_t)))) {
+            for(index = 0; index < count; index++) {
+                saved[index].count = entries[index]->count;
+                if(!(saved[index].selector = strdup(entries[index]->selector)))
+                    break;
+            }
+            count = index;
+        }
+    }
+    pthread_mutex_unlock(&g_hotset_lock);
+
+    free(entries);
+
+    /* nothing served yet -- keep whatever the last run left */
+    if(!count) {
+        free(saved);
+        return;
+    }
+
+    if(!saved) {
+        ERROR("malloc");
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_hotset_file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 || !(fp = fdopen(fd, "w"))) {
+        if(!g_hotset_warned)
+            WARN("Cannot write %s: %s", tmp, strerror(errno));
+        g_hotset_warned = TRUE;
+        if(fd != -1)
+            close(fd);
+    } else {
+        fprintf(fp, "%s\n", HOTSET_MAGIC);
+        for(index = 0; index < count; index++)
+            fprintf(fp, "%u\t%s\n", saved[index].count, saved[index].selector);
+
+        if(ferror(fp) | fclose(fp) || rename(tmp, g_hotset_file) == -1) {
+            if(!g_hotset_warned)
+                WARN("Cannot write %s: %s", g_hotset_file, strerror(errno));
+            g_hotset_warned = TRUE;
+            unlink(tmp);
+        } else {
+            DEBUG("Saved %d hot selectors to %s", count, g_hotset_file);
+            g_hotset_warned = FALSE;
+        }
+    }
+
+    for(index = 0; index < count; index++)
+        free(saved[index].selector);
+    free(saved);
+
+    pthread_mutex_lock(&g_hotset_lock);
+    hotset_decay();
+    pthread_mutex_unlock(&g_hotset_lock);
+}
+
+/**
+ * read the last snapshot, busiest first.  Its counts carry
+ * over, so a short run doesn't wipe out a long one's history,
+ * but no higher than each selector's rank from the bottom, so
+ * a long history can't hold off what's hot now for more than
+ * a few intervals.
+ *
+ * @param count where to put the number of selectors
+ * @returns selectors to be freed, or NULL if there's no snapshot
+ */
+static char **hotset_load(int *count) {
+    char line[MAX_REQUEST_SIZE + 32];
+    char **selectors, *selector, *end;
+    unsigned long hits;
+    size_t len;
+    FILE *fp;
+
+    *count = 0;
+
+    if(!(fp = fopen(g_hotset_file, "r"))) {
+        if(errno != ENOENT)
+            WARN("Cannot read %s: %s", g_hotset_file, strerror(errno));
+        return NULL;
+    }
+
+    if(!fgets(line, sizeof(line), fp) || strcmp(line, HOTSET_MAGIC "\n")) {
+        WARN("Ignoring %s: not a hot set snapshot", g_hotset_file);
+        fclose(fp);
+        return NULL;
+    }
+
+    if(!(selectors = (char **)calloc(g_hotset_size, sizeof(char *)))) {
+        ERROR("malloc");
+        fclose(fp);
+        return NULL;
+    }
+
+    while(*count < g_hotset_size && fgets(line, sizeof(line), fp)) {
+        len = strlen(line);
+        if(!len || line[len - 1] != '\n')
+            break;   /* truncated, or longer than any request */
+        line[len - 1] = '\0';
+
+        hits = strtoul(line, &end, 10);
+        if(end == line || *end != '\t' || !hits)
+            continue;
+        selector = end + 1;
+
+        /* it came from disk, so don't trust it to stay under base_dir */
+        if(strstr(selector, ".."))
+            continue;
+
+        if(!(selectors[*count] = strdup(selector)))
+            break;
+
+        if(hits > (unsigned long)(g_hotset_size - *count))
+            hits = (unsigned long)(g_hotset_size - *count);
+
+        pthread_mutex_lock(&g_hotset_lock);
+        hotset_count(selector, (uint32_t)hits);
+        pthread_mutex_unlock(&g_hotset_lock);
+
+        (*count)++;
+    }
+
+    fclose(fp);
+    return selectors;
+}
+
+/**
+ * account for warmup reads, sleeping off anything over the
+ * rate
+ *
+ * @param bytes just read (or asked the kernel to read)
+ * @returns TRUE to keep warming, FALSE once we're out of
+ *          budget or shutting down
+ */
+static int hotset_pace(size_t bytes) {
+    struct timespec until;
+    uint64_t ns;
+    int quit;
+
+    g_hotset_warmed += bytes;
+
+    if(g_hotset_warmup_rate) {
+        ns = (uint64_t)((double)g_hotset_warmed * 1e9 / g_hotset_warmup_rate);
+        until.tv_sec = g_hotset_warmup_start.tv_sec + (time_t)(ns / 1000000000ULL);
+        until.tv_nsec = g_hotset_warmup_start.tv_nsec + (long)(ns % 1000000000ULL);
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&g_hotset_lock);
+        while(!g_hotset_quit &&
+              pthread_cond_timedwait(&g_hotset_cond, &g_hotset_lock, &until) != ETIMEDOUT)
+            ;
+        pthread_mutex_unlock(&g_hotset_lock);
+    }
+
+    pthread_mutex_lock(&g_hotset_lock);
+    quit = g_hotset_quit;
+    pthread_mutex_unlock(&g_hotset_lock);
+
+    return !quit && g_hotset_warmed < g_hotset_warmup_max;
+}
+
+/**
+ * bring one file into memory: into the file cache while it
+ * fits, else just into the page cache
+ *
+ * @param result lookup of the file
+ * @param cached bytes of the file cache warmup has used so far
+ * @returns TRUE to keep warming, FALSE otherwise
+ */
+static int hotset_warm_file(fs_result_t *result, size_t *cached) {
+    chunk_file_t *file = result->file;
+    ssize_t got;
+    off_t offset;
+    size_t len;
+    int index;
+
+    if(file->chunks && *cached + file->size <= config.file_cache_size) {
+        *cached += file->size;
+        for(index = 0; index < file->chunk_count; index++) {
+            if((got = chunk_file_warm(file, result->fd, index)) < 0)
+                return TRUE;
+            if(got && !hotset_pace(got))
+                return FALSE;
+        }
+        return TRUE;
+    }
+
+    for(offset = 0; offset < file->size; offset += len) {
+        len = HOTSET_READAHEAD_STEP;
+        if(file->size - offset < (off_t)len)
+            len = (size_t)(file->size - offset);
+        if(g_hotset_warmup_max - g_hotset_warmed < len)
+            len = g_hotset_warmup_max - g_hotset_warmed;
+
+#ifdef __linux__
+        readahead(result->fd, offset, len);
+#else
+        posix_fadvise(result->fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+        if(!hotset_pace(len))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * look up the last run's hot set, busiest first
+ */
+static void hotset_warm(void) {
+    char **selectors, path[PATH_MAX];
+    struct timespec done;
+    fs_result_t *result;
+    size_t cached = 0;
+    int count, index, warmed = 0, more = TRUE;
+
+    if(!(selectors = hotset_load(&count)))
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &g_hotset_warmup_start);
+
+    for(index = 0; index < count && more; index++) {
+        if(snprintf(path, sizeof(path), "%s/%s", config.base_dir,
+                    selectors[index]) >= (int)sizeof(path))
+            continue;
+
+        if(!(result = fs_lookup_now(path)))
+            break;
+
+        if(!result->err) {
+            warmed++;
+            if(result->file)
+                more = hotset_warm_file(result, &cached);
+            else if(S_ISDIR(result->st.st_mode))
+                more = hotset_pace((size_t)result->st.st_size);
+        }
+
+        fs_result_unref(result);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &done);
+    INFO("Warmed %d of %d hot selectors (%zu KB) in %.1fs", warmed, count,
+         g_hotset_warmed / 1024,
+         (double)(done.tv_sec - g_hotset_warmup_start.tv_sec) +
+         (double)(done.tv_nsec - g_hotset_warmup_start.tv_nsec) / 1e9);
+
+    for(index = 0; index < count; index++)
+        free(selectors[index]);
+    free(selectors);
+}
+
+/**
+ * warm up, then snapshot every interval until told to stop
+ */
+static void *hotset_thread(void *arg) {
+    struct timespec next;
+
+    if(g_hotset_warmup_max)
+        hotset_warm();
+
+    pthread_mutex_lock(&g_hotset_lock);
+    while(!g_hotset_quit) {
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += g_hotset_interval;
+
+        while(!g_hotset_quit &&
+              pthread_cond_timedwait(&g_hotset_cond, &g_hotset_lock, &next) != ETIMEDOUT)
+            ;
+
+        if(g_hotset_quit)
+            break;
+
+        pthread_mutex_unlock(&g_hotset_lock);
+        hotset_save();
+        pthread_mutex_lock(&g_hotset_lock);
+    }
+    pthread_mutex_unlock(&g_hotset_lock);
+
+    hotset_save();
+    return NULL;
+}
+
+/**
+ * start tracking the hot set, and warm up from the last
+ * snapshot in the background.  Must be called after the
+ * file cache and lookups are set up.
+ *
+ * @param snapshot_file where snapshots go
+ * @param size selectors per snapshot (0 disables)
+ * @param interval seconds between snapshots
+ * @param warmup_bytes most warmup may read (0 skips warmup)
+ * @param warmup_rate warmup bytes/sec (0 for no limit)
+ * @returns TRUE on success, FALSE otherwise
+ */
+int hotset_init(char *snapshot_file, int size, int interval,
+                size_t warmup_bytes, size_t warmup_rate) {
+    if(size <= 0 || !snapshot_file)
+        return TRUE;
+
+    g_hotset_size = size;
+    g_hotset_interval = interval > 0 ? interval : 1;
+    g_hotset_file = snapshot_file;
+    g_hotset_warmup_max = warmup_bytes;
+    g_hotset_warmup_rate = warmup_rate;
+    g_hotset_warmed = 0;
+    g_hotset_quit = FALSE;
+    g_hotset_tracked = 0;
+
+    g_hotset_max_tracked = size * HOTSET_TRACK_FACTOR;
+    if(g_hotset_max_tracked < HOTSET_MIN_TRACKED)
+        g_hotset_max_tracked = HOTSET_MIN_TRACKED;
+    g_hotset_buckets = g_hotset_max_tracked;
+
+    g_hotset_hash = (hotset_entry_t **)calloc(g_hotset_buckets, sizeof(hotset_entry_t *));
+    g_hotset_heap = (hotset_entry_t **)calloc(g_hotset_max_tracked, sizeof(hotset_entry_t *));
+    if(!g_hotset_hash || !g_hotset_heap) {
+        ERROR("malloc");
+        free(g_hotset_hash);
+        free(g_hotset_heap);
+        g_hotset_hash = NULL;
+        g_hotset_heap = NULL;
+        return FALSE;
+    }
+
+    if(pthread_create(&g_hotset_thread, NULL, hotset_thread, NULL)) {
+        ERROR("Could not start hot set thread: %s", strerror(errno));
+        free(g_hotset_hash);
+        free(g_hotset_heap);
+        g_hotset_hash = NULL;
+        g_hotset_heap = NULL;
+        return FALSE;
+    }
+
+    g_hotset_started = TRUE;
+    return TRUE;
+}
+
+/**
+ * stop warming, write a last snapshot and forget the counts
+ */
+void hotset_deinit(void) {
+    int index;
+
+    if(g_hotset_started) {
+        pthread_mutex_lock(&g_hotset_lock);
+        g_hotset_quit = TRUE;
+        pthread_cond_broadcast(&g_hotset_cond);
+        pthread_mutex_unlock(&g_hotset_lock);
+
+        pthread_join(g_hotset_thread, NULL);
+        g_hotset_started = FALSE;
+    }
+
+    pthread_mutex_lock(&g_hotset_lock);
+    for(index = 0; index < g_hotset_tracked; index++)
+        free(g_hotset_heap[index]);
+    free(g_hotset_hash);
+    free(g_hotset_heap);
+    g_hotset_hash = NULL;
+    g_hotset_heap = NULL;
+    g_hotset_tracked = 0;
+    pthread_mutex_unlock(&g_hotset_lock);
+}
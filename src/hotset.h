@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _HOTSET_H_
+#define _HOTSET_H_
+
+#include <stddef.h>
+
+extern int hotset_init(char *snapshot_file, int size, int interval,
+                       size_t warmup_bytes, size_t warmup_rate);
+extern void hotset_deinit(void);
+extern void hotset_record(char *selector);
+
+#endif /* _HOTSET_H_ */
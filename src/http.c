@@ -0,0 +1,711 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * plain HTTP on the gopher port.
+ *
+ * A request whose first line reads "GET /path HTTP/1.x" is a
+ * browser.  Its path becomes the selector and it goes through
+ * the same dispatch, caches and file streaming as anybody
+ * else's.  Only the framing differs: a status line and length
+ * go on ahead of files, and menus are turned into a page of
+ * links on the way out.  Output that's spliced straight to the
+ * socket (exec, proxy) has no length up front, so it's sent
+ * with "Connection: close" instead.
+ *
+ * Connections are kept open between requests when the browser
+ * wants that.  Pipelined requests aren't supported -- anything
+ * sent after the headers closes the connection once the
+ * response is out.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "debug.h"
+#include "fs.h"
+#include "http.h"
+#include "plugin.h"
+#include "response.h"
+
+#define HTTP_HEADER_MAX 256
+
+static char *g_http_host = NULL;
+static char g_http_port[8];
+
+static const struct {
+    const char *ext;
+    const char *type;
+} g_http_types[] = {
+    { "txt", "text/plain; charset=utf-8" },
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css" },
+    { "js", "text/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "gif", "image/gif" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "svg", "image/svg+xml" },
+    { "webp", "image/webp" },
+    { "ico", "image/x-icon" },
+    { "pdf", "application/pdf" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "wav", "audio/wav" },
+    { "mp4", "video/mp4" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "tar", "application/x-tar" },
+};
+
+/**
+ * remember where menus point when they mean us
+ *
+ * @param host hostname we put in menus
+ * @param port port we put in menus
+ * @returns TRUE on success, FALSE otherwise
+ */
+int http_init(char *host, uint16_t port) {
+    http_deinit();
+
+    if(!(g_http_host = strdup(host)))
+        return FALSE;
+
+    snprintf(g_http_port, sizeof(g_http_port), "%u", port);
+    return TRUE;
+}
+
+/**
+ * free what http_init kept
+ */
+void http_deinit(void) {
+    free(g_http_host);
+    g_http_host = NULL;
+}
+
+/**
+ * does the first line read "METHOD target HTTP/1.x"?
+ *
+ * @param line start of the request
+ * @param end the line's end
+ * @returns the minor version, or -1 if it's not HTTP
+ */
+static int http_request_line(const char *line, const char *end) {
+    const char *space = strchr(line, ' ');
+
+    if(end - line < 14 || memcmp(end - 9, " HTTP/1.", 8) ||
+       end[-1] < '0' || end[-1] > '9')
+        return -1;
+
+    /* a method, then a target */
+    if(space == line || space >= end - 9 ||
+       strspn(line, "ABCDEFGHIJKLMNOPQRSTUVWXYZ") != (size_t)(space - line))
+        return -1;
+
+    return end[-1] - '0';
+}
+
+/**
+ * find the blank line ending the headers
+ *
+ * @returns just past it, or NULL if it's not in yet
+ */
+static const char *http_headers_end(const char *request) {
+    const char *end;
+
+    if((end = strstr(request, "\r\n\r\n")))
+        return end + 4;
+    if((end = strstr(request, "\n\n")))
+        return end + 2;
+    return NULL;
+}
+
+/**
+ * is this an HTTP request that still has headers to come?
+ *
+ * @param request what's been read so far
+ * @returns TRUE if it's worth reading on
+ */
+int http_partial(const char *request) {
+    const char *end = strpbrk(request, "\r\n");
+
+    return end && http_request_line(request, end) >= 0 && !http_headers_end(request);
+}
+
+/**
+ * value of a hex digit
+ *
+ * @returns 0-15, or -1 if it isn't one
+ */
+static int http_hex(char c) {
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * undo %XX escapes (and "+" for spaces, in form values)
+ *
+ * @param src escaped text, len bytes
+ * @param dst where to put it, at least len + 1 bytes
+ * @param form TRUE if "+" means a space, FALSE for a path,
+ *        where an escaped "/" isn't allowed either
+ * @returns TRUE on success, FALSE if it decodes to something
+ *          that can't be in a selector
+ */
+static int http_unescape(const char *src, size_t len, char *dst, int form) {
+    const char *end = src + len;
+    int hi, lo;
+    char c;
+
+    while(src < end) {
+        c = *src++;
+        if(c == '%' && end - src >= 2 &&
+           (hi = http_hex(src[0])) >= 0 && (lo = http_hex(src[1])) >= 0) {
+            c = (char)(hi << 4 | lo);
+            src += 2;
+
+            /* a slash that dodges the path's own checks */
+            if(c == '/' && !form)
+                return FALSE;
+        } else if(c == '+' && form) {
+            c = ' ';
+        }
+
+        if(c == '\0' || c == '\t' || c == '\r' || c == '\n')
+            return FALSE;
+
+        *dst++ = c;
+    }
+
+    *dst = '\0';
+    return TRUE;
+}
+
+/**
+ * does this header line say anything about keep-alive?
+ *
+ * @param line header line, not terminated
+ * @param len its length
+ * @param keepalive left alone, or set from a Connection: header
+ */
+static void http_connection(const char *line, size_t len, int *keepalive) {
+    char value[64];
+    size_t skip = sizeof("Connection:") - 1;
+
+    if(len <= skip || strncasecmp(line, "Connection:", skip))
+        return;
+
+    line += skip;
+    len -= skip;
+    if(len >= sizeof(value))
+        len = sizeof(value) - 1;
+
+    memcpy(value, line, len);
+    value[len] = '\0';
+
+    if(strcasestr(value, "close"))
+        *keepalive = FALSE;
+    else if(strcasestr(value, "keep-alive"))
+        *keepalive = TRUE;
+}
+
+/**
+ * recognize a browser's request, and turn it into the selector
+ * (and search query) everything else expects
+ *
+ * @param client client with a request being read
+ * @param reject set to the response to send for HTTP_REJECT
+ * @returns HTTP_GOPHER, HTTP_PARTIAL, HTTP_READY or HTTP_REJECT
+ */
+int http_parse(client_t *client, response_id_t *reject) {
+    char target[MAX_REQUEST_SIZE];
+    char *request = client->request;
+    const char *line, *end, *headers_end, *path, *query, *eol;
+    size_t path_len, len;
+    int minor;
+
+    if(!config.serve_http)
+        return HTTP_GOPHER;
+
+    /* a browser that's kept its connection can only say HTTP */
+    if(!(end = strpbrk(request, "\r\n")))
+        return client->http ? HTTP_PARTIAL : HTTP_GOPHER;
+
+    if((minor = http_request_line(request, end)) < 0) {
+        if(!client->http)
+            return HTTP_GOPHER;
+
+        client->http->keepalive = FALSE;
+        *reject = RESPONSE_NOT_FOUND;
+        return HTTP_REJECT;
+    }
+
+    if(!(headers_end = http_headers_end(request)))
+        return HTTP_PARTIAL;
+
+    if(!client->http) {
+        if(!(client->http = (http_t *)calloc(1, sizeof(http_t))) ||
+           !(client->http->menu = evbuffer_new())) {
+            ERROR("malloc");
+            http_free(client->http);
+            client->http = NULL;
+            *reject = RESPONSE_INTERNAL;
+            return HTTP_REJECT;
+        }
+    }
+
+    client->http->requests++;
+    client->http->keepalive = minor >= 1;
+
+    for(line = end; line < headers_end; line = eol) {
+        line += strspn(line, "\r\n");
+        eol = line + strcspn(line, "\r\n");
+        http_connection(line, eol - line, &client->http->keepalive);
+    }
+
+    /* no pipelining -- answer this one, then hang up */
+    if(*headers_end)
+        client->http->keepalive = FALSE;
+
+    if(strncmp(request, "GET ", 4)) {
+        client->http->keepalive = FALSE;
+        *reject = RESPONSE_NOT_IMPLEMENTED;
+        return HTTP_REJECT;
+    }
+
+    path = request + 4;
+    len = (end - 9) - path;
+
+    /* absolute form, from a browser that thinks we're a proxy */
+    if(len > 7 && !strncasecmp(path, "http://", 7)) {
+        const char *slash = memchr(path + 7, '/', len - 7);
+
+        len -= slash ? (size_t)(slash - path) : len;
+        path = slash;
+    }
+
+    if(!path || !len || *path != '/') {
+        *reject = RESPONSE_NOT_FOUND;
+        return HTTP_REJECT;
+    }
+
+    query = memchr(path, '?', len);
+    path_len = query ? (size_t)(query - path) : len;
+
+    if(!http_unescape(path, path_len, target, FALSE)) {
+        *reject = RESPONSE_NOT_FOUND;
+        return HTTP_REJECT;
+    }
+
+    /* "%2e%2e" is only ".." once it's decoded */
+    if(!fs_selector_ok(target)) {
+        client->http->keepalive = FALSE;
+        *reject = RESPONSE_DENIED;
+        return HTTP_REJECT;
+    }
+
+    /* a search form's value is the type 7 query */
+    if(query) {
+        const char *value = memchr(query, '=', len - path_len);
+
+        value = value ? value + 1 : query + 1;
+        len = path + len - value;
+
+        if(len) {
+            path_len = strlen(target);
+            target[path_len] = '\t';
+            if(!http_unescape(value, len, &target[path_len + 1], TRUE)) {
+                *reject = RESPONSE_NOT_FOUND;
+                return HTTP_REJECT;
+            }
+        }
+    }
+
+    strcpy(request, target);
+    return HTTP_READY;
+}
+
+/**
+ * get ready for the connection's next request
+ *
+ * @param http browser's state
+ */
+void http_reset(http_t *http) {
+    http->header_sent = FALSE;
+    evbuffer_drain(http->menu, evbuffer_get_length(http->menu));
+}
+
+/**
+ * free a browser's state
+ *
+ * @param http state from http_parse(), or NULL
+ */
+void http_free(http_t *http) {
+    if(!http)
+        return;
+
+    if(http->menu)
+        evbuffer_free(http->menu);
+    free(http);
+}
+
+/**
+ * guess a file's type from its extension
+ *
+ * @param selector file's selector
+ * @returns a MIME type
+ */
+const char *http_content_type(const char *selector) {
+    const char *ext = strrchr(selector, '.');
+    size_t index;
+
+    if(ext && !strchr(ext, '/')) {
+        for(index = 0; index < sizeof(g_http_types) / sizeof(g_http_types[0]); index++) {
+            if(!strcasecmp(ext + 1, g_http_types[index].ext))
+                return g_http_types[index].type;
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+/**
+ * text for a status code
+ */
+static const char *http_reason(int status) {
+    switch(status) {
+    case 200: return "OK";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+/**
+ * render a response header
+ *
+ * @returns its length, or -1 if it didn't fit
+ */
+static int http_format_header(http_t *http, char *buf, size_t size, int status,
+                              const char *type, int64_t length) {
+    char length_line[40] = "";
+    int len;
+
+    /* without a length, the end of the connection is the end
+       of the response */
+    if(length < 0)
+        http->keepalive = FALSE;
+    else
+        snprintf(length_line, sizeof(length_line), "Content-Length: %lld\r\n",
+                 (long long)length);
+
+    len = snprintf(buf, size, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n%s"
+                   "Connection: %s\r\n\r\n", status, http_reason(status), type,
+                   length_line, http->keepalive ? "keep-alive" : "close");
+    if(len < 0 || (size_t)len >= size)
+        return -1;
+
+    http->header_sent = TRUE;
+    return len;
+}
+
+/**
+ * queue a response header
+ *
+ * @param http browser's state
+ * @param output buffer to queue it on
+ * @param status HTTP status
+ * @param type content type
+ * @param length body length, or -1 if it isn't known
+ * @returns TRUE on success, FALSE otherwise
+ */
+int http_header(http_t *http, struct evbuffer *output, int status,
+                const char *type, int64_t length) {
+    char buf[HTTP_HEADER_MAX];
+    int len;
+
+    if((len = http_format_header(http, buf, sizeof(buf), status, type, length)) < 0)
+        return FALSE;
+
+    return evbuffer_add(output, buf, len) == 0;
+}
+
+/**
+ * write the header for output about to be spliced to the
+ * socket.  It goes out before anything else, so a fresh
+ * response always has room for it.
+ *
+ * @param http browser's state
+ * @param fd client socket
+ * @returns TRUE on success, FALSE otherwise
+ */
+int http_splice_header(http_t *http, int fd) {
+    char buf[HTTP_HEADER_MAX];
+    int len;
+
+    if((len = http_format_header(http, buf, sizeof(buf), 200,
+                                 "text/plain; charset=utf-8", -1)) < 0)
+        return FALSE;
+
+    return write(fd, buf, len) == len;
+}
+
+/**
+ * add text with HTML special characters escaped
+ */
+static void http_add_html(struct evbuffer *html, const char *text, size_t len) {
+    const char *end = text + len;
+    const char *run;
+
+    while(text < end) {
+        for(run = text; text < end && !strchr("&<>\"", *text); text++)
+            ;
+        evbuffer_add(html, run, text - run);
+
+        if(text == end)
+            break;
+
+        switch(*text++) {
+        case '&': evbuffer_add(html, "&amp;", 5); break;
+        case '<': evbuffer_add(html, "&lt;", 4); break;
+        case '>': evbuffer_add(html, "&gt;", 4); break;
+        case '"': evbuffer_add(html, "&quot;", 6); break;
+        }
+    }
+}
+
+/**
+ * add a selector as a URL path
+ */
+static void http_add_url(struct evbuffer *html, const char *text, size_t len) {
+    static const char *hex = "0123456789ABCDEF";
+    unsigned char c;
+    size_t index;
+
+    for(index = 0; index < len; index++) {
+        c = (unsigned char)text[index];
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || strchr("/-._~", c)) {
+            evbuffer_add(html, &text[index], 1);
+        } else {
+            evbuffer_add_printf(html, "%%%c%c", hex[c >> 4], hex[c & 15]);
+        }
+    }
+}
+
+/**
+ * turn one menu line into a line of the page
+ *
+ * @param html page being built
+ * @param line menu line, without its line ending
+ */
+static void http_menu_line(struct evbuffer *html, char *line) {
+    char *field[4] = { line + 1, "", "", "" };
+    char type = line[0];
+    int local, index;
+
+    for(index = 1; index < 4; index++) {
+        if(!(field[index] = strchr(field[index - 1], '\t'))) {
+            field[index] = "";
+            break;
+        }
+        *field[index]++ = '\0';
+    }
+
+    for(; index < 4; index++)
+        field[index] = "";
+
+    local = (!*field[2] || (g_http_host && !strcmp(field[2], g_http_host))) &&
+            (!*field[3] || !strcmp(field[3], g_http_port));
+
+    switch(type) {
+    case 'i':
+    case '3':
+        http_add_html(html, field[0], strlen(field[0]));
+        break;
+
+    case '7':
+        if(!local)
+            goto text;
+
+        evbuffer_add_printf(html, "<form action=\"");
+        if(*field[1] != '/')
+            evbuffer_add(html, "/", 1);
+        http_add_url(html, field[1], strlen(field[1]));
+        evbuffer_add_printf(html, "\"><input name=\"q\" placeholder=\"");
+        http_add_html(html, field[0], strlen(field[0]));
+        evbuffer_add_printf(html, "\"></form>");
+        break;
+
+    case '8':
+    case 'T':
+    text:
+        http_add_html(html, field[0], strlen(field[0]));
+        break;
+
+    default:
+        evbuffer_add_printf(html, "<a href=\"");
+        if(type == 'h' && !strncmp(field[1], "URL:", 4)) {
+            http_add_html(html, field[1] + 4, strlen(field[1] + 4));
+        } else if(local) {
+            if(*field[1] != '/')
+                evbuffer_add(html, "/", 1);
+            http_add_url(html, field[1], strlen(field[1]));
+        } else {
+            evbuffer_add_printf(html, "gopher://");
+            http_add_html(html, field[2], strlen(field[2]));
+            evbuffer_add_printf(html, ":");
+            http_add_html(html, field[3], strlen(field[3]));
+            evbuffer_add_printf(html, "/%c", type);
+            http_add_url(html, field[1], strlen(field[1]));
+        }
+        evbuffer_add_printf(html, "\">");
+        http_add_html(html, field[0], strlen(field[0]));
+        evbuffer_add_printf(html, "</a>");
+        break;
+    }
+
+    evbuffer_add(html, "\n", 1);
+}
+
+/**
+ * turn what's in http->menu into a page, and queue it
+ *
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int http_render(http_t *http, const char *title, int status,
+                       struct evbuffer *output) {
+    struct evbuffer *html;
+    size_t len;
+    char *line;
+    int res;
+
+    if(!(html = evbuffer_new()))
+        return FALSE;
+
+    evbuffer_add_printf(html, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+                        "<title>");
+    http_add_html(html, title, strlen(title));
+    evbuffer_add_printf(html, "</title></head>\n<body><pre>\n");
+
+    while((line = evbuffer_readln(http->menu, &len, EVBUFFER_EOL_ANY))) {
+        if(!strcmp(line, ".")) {
+            free(line);
+            break;
+        }
+
+        if(len)
+            http_menu_line(html, line);
+        free(line);
+    }
+
+    evbuffer_drain(http->menu, evbuffer_get_length(http->menu));
+
+    evbuffer_add_printf(html, "</pre></body></html>\n");
+
+    res = http_header(http, output, status, "text/html; charset=utf-8",
+                      evbuffer_get_length(html)) &&
+          evbuffer_add_buffer(output, html) == 0;
+
+    evbuffer_free(html);
+    return res;
+}
+
+/**
+ * where a menu gets rendered before http_menu() sends it
+ *
+ * @param http browser's state
+ * @returns its menu buffer
+ */
+struct evbuffer *http_menu_buffer(http_t *http) {
+    return http->menu;
+}
+
+/**
+ * send the menu in http->menu as a page
+ *
+ * @param http browser's state
+ * @param selector what was asked for, for the title
+ * @param output buffer to queue it on
+ * @returns TRUE on success, FALSE otherwise
+ */
+int http_menu(http_t *http, const char *selector, struct evbuffer *output) {
+    return http_render(http, selector, 200, output);
+}
+
+/**
+ * send a canned response as an HTTP error
+ *
+ * @param http browser's state
+ * @param id which response
+ * @param output buffer to queue it on
+ * @returns TRUE on success, FALSE otherwise
+ */
+int http_error(http_t *http, response_id_t id, struct evbuffer *output) {
+    const char *data;
+    size_t len;
+    int status;
+
+    switch(id) {
+    case RESPONSE_NOT_FOUND:
+    case RESPONSE_NO_MATCHES:
+        status = 404;
+        break;
+    case RESPONSE_DENIED:
+    case RESPONSE_UNSUPPORTED:
+        status = 403;
+        break;
+    case RESPONSE_NOT_IMPLEMENTED:
+        status = 501;
+        break;
+    case RESPONSE_EXEC_FAILED:
+    case RESPONSE_UPSTREAM:
+        status = 502;
+        break;
+    case RESPONSE_BUSY:
+    case RESPONSE_SEARCH_UNAVAILABLE:
+        status = 503;
+        break;
+    default:
+        status = 500;
+        break;
+    }
+
+    data = response_get(id, &len);
+    evbuffer_drain(http->menu, evbuffer_get_length(http->menu));
+    evbuffer_add(http->menu, data, len);
+
+    return http_render(http, http_reason(status), status, output);
+}
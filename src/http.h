@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event.h>
+
+#include "response.h"
+
+/* what http_parse() made of a client's request so far */
+#define HTTP_GOPHER   0   /* not HTTP -- a plain selector */
+#define HTTP_PARTIAL  1   /* HTTP, but the headers aren't all in */
+#define HTTP_READY    2   /* request is now the selector (and query) */
+#define HTTP_REJECT   3   /* HTTP we won't serve, answer and close */
+
+/* a browser's connection */
+typedef struct http_t {
+    int keepalive;                /* keep it open after this response */
+    int header_sent;              /* the status line is queued */
+    int requests;                 /* requests read on this connection */
+    struct evbuffer *menu;        /* menus, before they become HTML */
+} http_t;
+
+struct client_t;
+
+extern int http_init(char *host, uint16_t port);
+extern void http_deinit(void);
+extern int http_partial(const char *request);
+extern int http_parse(struct client_t *client, response_id_t *reject);
+extern void http_reset(http_t *http);
+extern void http_free(http_t *http);
+extern const char *http_content_type(const char *selector);
+extern int http_header(http_t *http, struct evbuffer *output, int status,
+                       const char *type, int64_t length);
+extern int http_splice_header(http_t *http, int fd);
+extern struct evbuffer *http_menu_buffer(http_t *http);
+extern int http_menu(http_t *http, const char *selector, struct evbuffer *output);
+extern int http_error(http_t *http, response_id_t id, struct evbuffer *output);
+
+#endif /* _HTTP_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "debug.h"
+#include "epoch.h"
+#include "loop.h"
+
+loop_t **g_loops = NULL;
+int g_loop_count = 0;
+
+/**
+ * somebody posted work (or wants us to notice we're stopping)
+ */
+static void on_loop_notify(int fd, short event, void *arg) {
+    loop_t *loop = (loop_t *)arg;
+    loop_post_t *post, *next;
+    char scratch[64];
+
+    while(read(fd, scratch, sizeof(scratch)) > 0);
+
+    pthread_mutex_lock(&loop->post_lock);
+    post = loop->post_head;
+    loop->post_head = loop->post_tail = NULL;
+    pthread_mutex_unlock(&loop->post_lock);
+
+    for(; post; post = next) {
+        next = post->next;
+        post->fn(post->arg);
+        free(post);
+    }
+}
+
+/**
+ * set up an event loop.  Loop 0 owns the legacy global event
+ * base, so anything still using event_set() alone lands there.
+ *
+ * @param loop loop to set up
+ * @param id loop number
+ * @returns TRUE on success, FALSE otherwise
+ */
+int loop_init(loop_t *loop, int id) {
+    memset(loop, 0, sizeof(loop_t));
+
+    loop->id = id;
+    loop->listen_fd = -1;
+    loop->tls_listen_fd = -1;
+    loop->notify_fd[0] = loop->notify_fd[1] = -1;
+    pthread_mutex_init(&loop->post_lock, NULL);
+
+    loop->base = id ? event_base_new() : event_init();
+    if(!loop->base) {
+        ERROR("Could not get event_base for loop %d", id);
+        return FALSE;
+    }
+
+    if(pipe2(loop->notify_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        ERROR("Could not create notify pipe for loop %d: %s", id, strerror(errno));
+        return FALSE;
+    }
+
+    event_set(&loop->ev_notify, loop->notify_fd[0], EV_READ | EV_PERSIST,
+              on_loop_notify, loop);
+    event_base_set(loop->base, &loop->ev_notify);
+    event_add(&loop->ev_notify, NULL);
+
+    wheel_init(&loop->wheel, loop->base);
+
+    loop->running = TRUE;
+    return TRUE;
+}
+
+/**
+ * tear down a loop's own resources.  Modules clean up their
+ * per-loop state first.
+ */
+void loop_deinit(loop_t *loop) {
+    loop_post_t *post, *next;
+
+    wheel_deinit(&loop->wheel);
+
+    if(loop->notify_fd[0] != -1) {
+        event_del(&loop->ev_notify);
+        close(loop->notify_fd[0]);
+        close(loop->notify_fd[1]);
+    }
+
+    for(post = loop->post_head; post; post = next) {
+        next = post->next;
+        free(post);
+    }
+
+    if(loop->base && loop->id)
+        event_base_free(loop->base);
+
+    pthread_mutex_destroy(&loop->post_lock);
+}
+
+/**
+ * run a loop until loop_stop().  Each pass is also a chance
+ * to free anything shared caches have retired.
+ */
+void loop_run(loop_t *loop) {
+    epoch_register();
+
+    while(__atomic_load_n(&loop->running, __ATOMIC_ACQUIRE)) {
+        event_base_loop(loop->base, EVLOOP_ONCE);
+        epoch_reclaim();
+    }
+}
+
+/**
+ * ask a loop to finish.  Safe from any thread.
+ */
+void loop_stop(loop_t *loop) {
+    __atomic_store_n(&loop->running, FALSE, __ATOMIC_RELEASE);
+    if(write(loop->notify_fd[1], "", 1) < 0) {
+        /* pipe full -- it's awake anyway */
+    }
+}
+
+/**
+ * get a post ready ahead of time, for work that mustn't fail
+ * to be handed over later.  The loop frees it once fn has run.
+ *
+ * @param fn function to run
+ * @param arg opaque argument for fn
+ * @returns the post for loop_post_send(), or NULL on failure
+ */
+loop_post_t *loop_post_new(void (*fn)(void *arg), void *arg) {
+    loop_post_t *post;
+
+    post = (loop_post_t *)malloc(sizeof(loop_post_t));
+    if(!post) {
+        ERROR("malloc");
+        return NULL;
+    }
+
+    post->fn = fn;
+    post->arg = arg;
+    post->next = NULL;
+    return post;
+}
+
+/**
+ * run fn(arg) on a loop's own thread.  Safe from any thread.
+ *
+ * @param loop loop to run on
+ * @param fn function to run
+ * @param arg opaque argument for fn
+ * @returns TRUE on success, FALSE otherwise
+ */
+int loop_post(loop_t *loop, void (*fn)(void *arg), void *arg) {
+    loop_post_t *post;
+
+    if(!(post = loop_post_new(fn, arg)))
+        return FALSE;
+
+    loop_post_send(loop, post);
+    return TRUE;
+}
+
+/**
+ * hand a post from loop_post_new() to a loop.  Can't fail.
+ *
+ * @param loop loop to run on
+ * @param post post to run there
+ */
+void loop_post_send(loop_t *loop, loop_post_t *post) {
+    pthread_mutex_lock(&loop->post_lock);
+    if(loop->post_tail)
+        loop->post_tail->next = post;
+    else
+        loop->post_head = post;
+    loop->post_tail = post;
+    pthread_mutex_unlock(&loop->post_lock);
+
+    if(write(loop->notify_fd[1], "", 1) < 0) {
+        /* pipe full -- it's awake anyway */
+    }
+
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <event.h>
+
+#include "wheel.h"
+
+struct edge_t;
+struct mem_loop_t;
+struct exec_pool_t;
+struct proxy_loop_t;
+
+typedef struct loop_post_t {
+    void (*fn)(void *arg);
+    void *arg;
+    struct loop_post_t *next;
+} loop_post_t;
+
+/* one event loop, and everything that belongs to it.  In the
+ * fork model there is exactly one; in thread mode there is one
+ * per thread, and clients never move between them. */
+typedef struct loop_t {
+    int id;
+    int running;
+    pthread_t thread;
+    struct event_base *base;
+    timer_wheel_t wheel;
+
+    int listen_fd;
+    struct event ev_accept;
+    int tls_listen_fd;               /* -1 without a tls_port */
+    struct event ev_tls_accept;
+    int accept_paused;
+    struct loop_t *steal_from;       /* busier loop we also accept for */
+    struct event ev_steal;
+    struct event ev_rebalance;
+
+    int client_count;                /* read by other loops */
+    size_t output_bytes;             /* queued in client output buffers */
+
+    int notify_fd[2];                /* wakes us for posted work */
+    struct event ev_notify;
+    pthread_mutex_t post_lock;
+    loop_post_t *post_head;
+    loop_post_t *post_tail;
+
+    struct edge_t *edge;             /* NULL when clients use bufferevents */
+    struct mem_loop_t *mem;          /* client memory accounting */
+    struct exec_pool_t *exec;
+    struct proxy_loop_t *proxy;
+} loop_t;
+
+extern loop_t **g_loops;
+extern int g_loop_count;
+
+extern int loop_init(loop_t *loop, int id);
+extern void loop_deinit(loop_t *loop);
+extern void loop_run(loop_t *loop);
+extern void loop_stop(loop_t *loop);
+extern int loop_post(loop_t *loop, void (*fn)(void *arg), void *arg);
+extern loop_post_t *loop_post_new(void (*fn)(void *arg), void *arg);
+extern void loop_post_send(loop_t *loop, loop_post_t *post);
+
+#endif /* _LOOP_H_ */
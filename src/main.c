@@ -16,12 +16,16 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
-#include <dirent.h>
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -34,20 +38,47 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <libdaemon/daemon.h>
 #include <event.h>
 
 #include "main.h"
+#include "conf.h"
 #include "debug.h"
+#include "affinity.h"
+#include "chunk.h"
+#include "dirindex.h"
+#include "edge.h"
+#include "epoch.h"
+#include "exec.h"
+#include "fs.h"
+#include "hotset.h"
+#include "gophermap.h"
+#include "gplus.h"
+#include "http.h"
+#include "loop.h"
+#include "mem.h"
+#include "negcache.h"
+#include "pace.h"
+#include "pack.h"
 #include "plugin.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "readahead.h"
+#include "response.h"
+#include "search.h"
+#include "stats.h"
+#include "tls.h"
+#include "trace.h"
+#include "wheel.h"
 
 
-#define MAX_FILE_BUFFER 1024
-
 
 /* it would be nice to have a loadable module system */
 typedef struct client_module_t {
@@ -59,26 +90,64 @@ typedef struct client_module_t {
 
 typedef struct opaque_file_t {
     int fd;
-    ssize_t bytes_in_buffer;
-    char *buffer;
+    chunk_file_t *file;      /* shared contents */
+    struct evbuffer_file_segment *seg;  /* kernel TLS: sent with sendfile() */
+    int next_chunk;
+    readahead_t ra;
+    pace_t pace;
 } opaque_file_t;
 
-typedef struct opaque_dir_t {
-    DIR *dir;
-    struct dirent *de;
-    char *line;
-} opaque_dir_t;
 
 
 /* Defines */
 #define DEFAULT_CONFIGFILE "/etc/evgopherd.conf"
 #define DEFAULT_DEBUGLEVEL 2
-
-#define CLIENT_STATE_WAITING_REQUEST  0
-#define CLIENT_STATE_WAITING_REPLY    1
-#define CLIENT_STATE_SENDING_RESPONSE 2
-
-#define MAX_REQUEST_SIZE 4096
+#define DEFAULT_EXEC_QUEUE 64
+#define DEFAULT_PROXY_MAX_CONNS 16
+#define DEFAULT_PROXY_QUEUE 64
+#define DEFAULT_PROXY_DNS_TTL 300
+#define DEFAULT_PROXY_FAIL_TTL 5
+#define DEFAULT_REQUEST_TIMEOUT 10
+#define DEFAULT_WRITE_TIMEOUT 60
+#define DEFAULT_CONNECTION_TIMEOUT 3600
+#define DEFAULT_MAX_CLIENTS 10000
+#define DEFAULT_MAX_OUTPUT_BYTES (256 * 1024 * 1024)
+#define DEFAULT_OVERLOAD_ACTION "reject"
+#define DEFAULT_RATELIMIT_BURST 20
+#define DEFAULT_RATELIMIT_SLOTS 65536
+#define DEFAULT_STEAL_MARGIN 16
+#define DEFAULT_CPU_AFFINITY "auto"
+#define DEFAULT_IO_ENGINE "libevent"
+#define DEFAULT_TLS_SESSION_CACHE 20480
+#define DEFAULT_FILE_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_FS_THREADS 4
+#define DEFAULT_NEGCACHE_SIZE 8192
+#define DEFAULT_DIR_INDEX_PATH "/var/cache/evgopherd"
+#define DEFAULT_DIR_INDEX_THRESHOLD 10000
+#define DEFAULT_DIR_PAGE_SIZE 1000
+#define DEFAULT_SEARCH_INDEX "/var/cache/evgopherd/search.idx"
+#define DEFAULT_SEARCH_MAX_FILE_SIZE (1024 * 1024)
+#define DEFAULT_SEARCH_MAX_RESULTS 200
+#define DEFAULT_READAHEAD_MAX (2 * 1024 * 1024)
+#define DEFAULT_READAHEAD_BUDGET (64 * 1024 * 1024)
+#define DEFAULT_READAHEAD_DONTNEED_SIZE (256 * 1024 * 1024)
+#define DEFAULT_SEND_LOW_WATERMARK (64 * 1024)
+#define DEFAULT_SEND_HIGH_WATERMARK (4 * 1024 * 1024)
+#define DEFAULT_TRACE_RING_SIZE 128
+#define DEFAULT_TRACE_SLOW_MS 250
+#define DEFAULT_LOOP_MEMORY_BUDGET (256 * 1024 * 1024)
+#define DEFAULT_CLIENT_OUTPUT_BUDGET (4 * 1024 * 1024)
+#define DEFAULT_SERVE_HTTP 1
+#define DEFAULT_GPLUS_CACHE_SIZE 8192
+#define DEFAULT_STATS_TOP 50
+#define DEFAULT_STATS_HALF_LIFE 60
+#define DEFAULT_HOTSET_FILE "/var/cache/evgopherd/hotset"
+#define DEFAULT_HOTSET_SIZE 1000
+#define DEFAULT_HOTSET_INTERVAL 300
+#define DEFAULT_HOTSET_WARMUP_BYTES (256 * 1024 * 1024)
+#define DEFAULT_HOTSET_WARMUP_RATE (32 * 1024 * 1024)
+
+#define REBALANCE_INTERVAL_MS 100
 
 /* Globals */
 static int g_quitflag = 0;
@@ -87,20 +156,38 @@ gopher_conf_t config;
 /* Forwards */
 void handle_response(client_t *client);
 static void handle_request(client_t *client);
+static void handle_lookup(client_t *client, fs_result_t *result);
 static int setnonblock(int fd);
 static int drop_privs(char *user);
 
-/* finish off connection */
-static void close_client(client_t *client);
 
 /* read/write buffer events */
 static void on_buf_error(struct bufferevent *bev, short what, void *arg);
 static void on_buf_write(struct bufferevent *bev, void *arg);
 static void on_buf_read(struct bufferevent *bev, void *arg);
 
+/* the same, from the epoll engine */
+static void on_client_error(client_t *client, int eof);
+static void on_client_write(client_t *client);
+static void on_client_read(client_t *client);
+static void accept_client(loop_t *loop, int fd, int tls);
+static void client_parse_request(client_t *client);
+static void client_keepalive(client_t *client);
+static void on_buf_output(struct evbuffer *buffer,
+                          const struct evbuffer_cb_info *info, void *arg);
+
+/* client timeouts */
+static void on_io_timeout(wheel_timer_t *timer, void *arg);
+static void on_life_timeout(wheel_timer_t *timer, void *arg);
+
+/* admission control */
+static void admission_resume(loop_t *loop);
+
 /* signal and main socket events */
 static void on_signal(int fd, short event, void *arg);      /* libdaemon signal fd */
 static void on_accept(int fd, short event, void *arg);      /* server fd */
+static void on_tls_accept(int fd, short event, void *arg);  /* tls server fd */
+static void on_rebalance(int fd, short event, void *arg);   /* work stealing */
 static void on_async_read(int fd, short event, void *arg);  /* ldap async pipe */
 
 /**
@@ -117,41 +204,14 @@ void usage_quit(char *name) {
     fprintf(stderr, "  -p <port>         port to listen on\n");
     fprintf(stderr, "  -s <dir>          directory to serve\n");
     fprintf(stderr, "  -k                kill running daemon\n");
+    fprintf(stderr, "  -b <packfile>     build a content pack of the served directory and exit\n");
+    fprintf(stderr, "  -e <engine>       client i/o engine, \"libevent\" or \"epoll\"\n");
 
     fprintf(stderr,"\n\n");
 
     exit(EXIT_FAILURE);
 }
 
-/**
- * determine size of dirent struct, for readdir_r.
- *
- * Code borrowed from http://womble.decadent.org.uk/readdir_r-advisory.html
- */
-size_t dirent_buf_size(DIR *dirp) {
-    long name_max;
-    size_t name_end;
-#   if defined(HAVE_FPATHCONF) && defined(HAVE_DIRFD)   \
-    && defined(_PC_NAME_MAX)
-    name_max = fpathconf(dirfd(dirp), _PC_NAME_MAX);
-    if (name_max == -1)
-#           if defined(NAME_MAX)
-        name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#           else
-    return (size_t)(-1);
-#           endif
-#   else
-#       if defined(NAME_MAX)
-    name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#       else
-#           error "buffer size for readdir_r cannot be determined"
-#       endif
-#   endif
-    name_end = (size_t)offsetof(struct dirent, d_name) + name_max + 1;
-    return (name_end > sizeof(struct dirent)
-            ? name_end : sizeof(struct dirent));
-}
-
 /**
  * drop privs to the specified user (and primary group)
  *
@@ -216,17 +276,223 @@ static int drop_privs(char *user) {
 /*     evbuffer_free(evb); */
 /* } */
 
+/**
+ * where a client's response gets queued
+ *
+ * @param client client to answer
+ * @returns its output buffer
+ */
+static struct evbuffer *client_output(client_t *client) {
+    if(client->buf_ev)
+        return bufferevent_get_output(client->buf_ev);
+    return client->output;
+}
+
+/**
+ * start (or carry on) sending a client's output.  The write
+ * callback comes once no more than lowat of it is left.
+ *
+ * @param client client to answer
+ * @param lowat write low watermark
+ */
+static void client_send(client_t *client, size_t lowat) {
+    if(client->buf_ev) {
+        bufferevent_setwatermark(client->buf_ev, EV_WRITE, lowat, 0);
+        bufferevent_enable(client->buf_ev, EV_WRITE);
+    } else {
+        edge_write(client, lowat);
+    }
+}
+
+/**
+ * turn reading requests from a client on or off
+ *
+ * @param client client to read from
+ * @param enable TRUE to read, FALSE to stop
+ */
+static void client_read(client_t *client, int enable) {
+    if(!client->buf_ev)
+        edge_read(client, enable);
+    else if(enable)
+        bufferevent_enable(client->buf_ev, EV_READ);
+    else
+        bufferevent_disable(client->buf_ev, EV_READ);
+}
+
+/**
+ * where a menu for the client gets rendered: its output for
+ * gopher, or somewhere to wait to become a page for a browser.
+ * A Gopher+ client that asked with "+" is told the menu runs
+ * until we close.
+ *
+ * @param client client to answer
+ * @returns buffer to render the menu into
+ */
+static struct evbuffer *client_menu(client_t *client) {
+    if(client->http)
+        return http_menu_buffer(client->http);
+    if(client->gplus == GPLUS_ITEM)
+        gplus_header(client_output(client), -2);
+    return client_output(client);
+}
+
+/**
+ * a shared reference was just added to the menu from
+ * client_menu().  A browser's page is rendered from it into a
+ * copy of its own, so it's only off the client's charge when the
+ * menu is the client's output.
+ *
+ * @param client client being answered
+ * @param menu buffer from client_menu()
+ * @param before its length before the reference went on
+ */
+static void client_menu_shared(client_t *client, struct evbuffer *menu, size_t before) {
+    if(menu == client_output(client))
+        mem_shared(client, evbuffer_get_length(menu) - before,
+                   evbuffer_get_length(menu));
+}
+
+/**
+ * the menu from client_menu() is complete -- send it
+ *
+ * @param client client to answer
+ */
+static void client_send_menu(client_t *client) {
+    if(client->http && !http_menu(client->http, client->request,
+                                  client_output(client))) {
+        ERROR("Could not render page on fd %d", client->fd);
+        close_client(client);
+        return;
+    }
+
+    client_send(client, 0);
+}
+
+/**
+ * output is about to be spliced straight to a client's socket.
+ * A browser, or a Gopher+ client, needs its header first.
+ *
+ * @param client client about to be written to directly
+ */
+void client_splice_begin(client_t *client) {
+    if((client->http && !http_splice_header(client->http, client->fd)) ||
+       (client->gplus == GPLUS_ITEM && !gplus_splice_header(client->fd))) {
+        /* the splice will fail, and finish the client off */
+        ERROR("Could not send header on fd %d", client->fd);
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * give a client plain socket i/o: the loop's epoll set if it
+ * has one, a bufferevent if not
+ *
+ * @param client client with its fd and loop set
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int client_attach(client_t *client) {
+    if(client->loop->edge)
+        return edge_add(client);
+
+    client->buf_ev = bufferevent_new(client->fd, on_buf_read, on_buf_write,
+                                     on_buf_error, (void*)client);
+    if(!client->buf_ev)
+        return FALSE;
+
+    bufferevent_base_set(client->loop->base, client->buf_ev);
+    return TRUE;
+}
+
+/**
+ * a TLS client's request is in.  If the kernel took over
+ * encryption during the handshake, drop down to the plain
+ * socket so the response goes out like anyone else's.
+ *
+ * @param client client on a TLS bufferevent
+ * @returns TRUE to carry on, FALSE if the client was closed
+ */
+static int client_tls_handoff(client_t *client) {
+    struct bufferevent *bev = client->buf_ev;
+
+    if(!tls_kernel_send(client->tls)) {
+        DEBUG("Encrypting fd %d in user space", client->fd);
+        return TRUE;
+    }
+
+    DEBUG("Kernel TLS on fd %d", client->fd);
+
+    /* a browser's next request would come in as raw records
+     * unless the kernel is decrypting those too */
+    if(client->http && !tls_kernel_recv(client->tls))
+        client->http->keepalive = FALSE;
+
+    /* nothing's been queued yet, so there's nothing to move */
+    evbuffer_remove_cb(bufferevent_get_output(bev), on_buf_output, client);
+    client->buf_ev = NULL;
+    bufferevent_free(bev);
+
+    if(!client_attach(client)) {
+        ERROR("Could not switch fd %d to kernel TLS", client->fd);
+        close_client(client);
+        return FALSE;
+    }
+
+    if(client->output)
+        edge_read(client, FALSE);
+
+    evbuffer_add_cb(client_output(client), on_buf_output, client);
+    return TRUE;
+}
+
+/**
+ * can a module write to the client's socket itself (splicing
+ * exec or proxy output), or does everything have to go through
+ * its output buffer?
+ *
+ * @param client client to check
+ * @returns TRUE if the socket can be written directly
+ */
+int client_can_splice(client_t *client) {
+    return !client->tls || tls_kernel_send(client->tls);
+}
+
+/**
+ * the whole response is out -- close, and let a TLS client
+ * know it got all of it
+ *
+ * @param client client that's done
+ */
+void client_finish(client_t *client) {
+    /* an empty menu still makes a page */
+    if(client->http && !client->http->header_sent &&
+       !http_menu(client->http, client->request, client_output(client))) {
+        close_client(client);
+        return;
+    }
+
+    /* a header with nothing after it still has to go out */
+    if(evbuffer_get_length(client_output(client))) {
+        client_send(client, 0);
+        return;
+    }
+
+    if(client->http && client->http->keepalive) {
+        client_keepalive(client);
+        return;
+    }
+
+    if(client->tls)
+        tls_close_notify(client->tls);
+    close_client(client);
+}
+
 /**
  * Spin out an error item to the client.
  *
  * @param client placeholder with client request
- * @param text error message text
+ * @param id canned response to send
  */
-void handle_error(client_t *client, internal_type_t type, char *text) {
-    struct evbuffer *evb;
-    char *buffer;
-    char gopher_type;
-
+void handle_error(client_t *client, response_id_t id) {
     assert(client);
     assert(client->request);
 
@@ -236,86 +502,195 @@ void handle_error(client_t *client, internal_type_t type, char *text) {
         return;
     }
 
-    switch(type) {
-    case TYPE_DIR:
-        gopher_type='i';
-        break;
-    case TYPE_FILE:
-        gopher_type='3';
-        break;
-    default:
-        gopher_type='i';
-        break;
+    /* too late to tell a browser, the status line is out */
+    if(client->http && client->http->header_sent) {
+        close_client(client);
+        return;
     }
 
-    evb = evbuffer_new();
-
-    buffer = (char*)malloc(strlen(text) + 10);  /* "3%s\t\t\t\n\r.\n\r", text */
-    if(!buffer) {
-        ERROR("malloc error");
-        evbuffer_free(evb);
+    if(client->http ? !http_error(client->http, id, client_output(client)) :
+       client->gplus ? !gplus_error(id, client_output(client)) :
+       !response_add(client_output(client), id)) {
+        ERROR("Could not queue response on fd %d", client->fd);
         close_client(client);
         return;
     }
 
-    sprintf(buffer, "%c%s\t\t\t\n\r.\n\r", gopher_type, text);
-    evbuffer_add(evb, (void*)buffer, strlen(buffer));
+    client_send(client, 0);
+}
+
+
+/**
+ * queue the next chunk's worth of a file to go out with
+ * sendfile(), straight from the page cache
+ *
+ * @param of file being sent on a kernel TLS socket
+ * @param output client output to queue it on
+ * @returns bytes queued, 0 at end of file, -1 on error
+ */
+static ssize_t stream_segment(opaque_file_t *of, struct evbuffer *output) {
+    off_t offset = (off_t)of->next_chunk * CHUNK_SIZE;
+    off_t len = MIN((off_t)CHUNK_SIZE, of->file->size - offset);
+
+    if(len <= 0)
+        return 0;
+
+    if(evbuffer_add_file_segment(output, of->seg, offset, len) < 0)
+        return -1;
+
+    return (ssize_t)len;
+}
+
+/**
+ * top up a client's output with as much of its file as its
+ * connection can use
+ *
+ * @returns bytes queued, 0 when the whole file is queued, -1 on error
+ */
+static ssize_t stream_file(client_t *client) {
+    opaque_file_t *of = (opaque_file_t *)client->opaque_client;
+    struct evbuffer *output = client_output(client);
+    ssize_t res, total = 0;
+    size_t target;
+
+    if((off_t)of->next_chunk * CHUNK_SIZE >= of->file->size)
+        return 0;
+
+    target = pace_refill(&of->pace, client->fd, evbuffer_get_length(output));
+    target = mem_refill_limit(client, target);
+
+    do {
+        readahead_advance(&of->ra, of->fd, (off_t)of->next_chunk * CHUNK_SIZE,
+                          of->file->size, chunk_file_shared(of->file));
+
+        if(of->seg)
+            res = stream_segment(of, output);
+        else
+            res = chunk_file_add(of->file, of->fd, of->next_chunk, output);
+        if(res <= 0)
+            break;
+
+        of->next_chunk++;
+        total += res;
+    } while(evbuffer_get_length(output) < target);
 
-    DEBUG("Queueing %d bytes for write on fd %d", strlen(buffer),
-          client->fd);
+    pace_filled(&of->pace, total);
+    if(total)
+        mem_shared(client, total, evbuffer_get_length(output));
+
+    if(res < 0)
+        return -1;
 
-    /* write low-water should already be zero */
-    bufferevent_enable(client->buf_ev, EV_WRITE);
-    bufferevent_write_buffer(client->buf_ev, evb);
-    evbuffer_free(evb);
+    if(total) {
+        /* come back for more when it's half gone */
+        client_send(client, target / 2);
+    }
 
-    return;
+    return total;
 }
 
+/**
+ * answer a search from the index
+ *
+ * @param client client with the search string in query
+ */
+static void handle_search(client_t *client) {
+    int matches;
+
+    client->request_type = TYPE_DIR;
+    client->state = CLIENT_STATE_SENDING_RESPONSE;
+
+    matches = search_query(client->query ? client->query : "",
+                           client_menu(client));
+    if(matches < 0) {
+        handle_error(client, RESPONSE_SEARCH_UNAVAILABLE);
+        return;
+    }
+
+    if(!matches) {
+        handle_error(client, RESPONSE_NO_MATCHES);
+        return;
+    }
+
+    client_send_menu(client);
+}
 
 /**
- * given a string, event it up and poke out a bufferevent
+ * show what's hot right now
+ *
+ * @param client client that asked for the stats selector
  */
-static void stream_string(struct bufferevent *buf_ev, char *str) {
-    struct evbuffer *evb;
+static void handle_stats(client_t *client) {
+    client->request_type = TYPE_DIR;
+    client->state = CLIENT_STATE_SENDING_RESPONSE;
 
-    evb = evbuffer_new();
-    if(!evb) {
-        ERROR("malloc");
+    if(!stats_allowed(client)) {
+        handle_error(client, RESPONSE_DENIED);
+        return;
+    }
+
+    if(!stats_render(client, client_menu(client))) {
+        handle_error(client, RESPONSE_INTERNAL);
         return;
     }
 
-    evbuffer_add(evb, str, strlen(str));
-    bufferevent_enable(buf_ev, EV_WRITE);
-    bufferevent_write_buffer(buf_ev, evb);
-    evbuffer_free(evb);
+    client_send_menu(client);
 }
 
 /**
- * given a file, event up a chunk of data and throw it
- * at the bufferevent
+ * answer a request from the content pack
+ *
+ * @param client client to answer
  */
-static int stream_fd(int source_fd, struct bufferevent *buf_ev,
-                     char *buffer, ssize_t len) {
-    int bytes_read = 0;
-    struct evbuffer *evb;
+static void handle_pack(client_t *client) {
+    const pack_entry_t *entry;
+    struct evbuffer *output;
+    size_t before;
 
-    evb = evbuffer_new();
-    if(!evb) {
-        ERROR("malloc");
-        return -1;
+    client->request_type = TYPE_PACK;
+    client->state = CLIENT_STATE_SENDING_RESPONSE;
+
+    /* a pack has no files to stat for attributes */
+    if(client->gplus == GPLUS_INFO || client->gplus == GPLUS_DIR) {
+        handle_error(client, RESPONSE_NOT_IMPLEMENTED);
+        return;
+    }
+
+    if(!(entry = pack_lookup(client->request)) || client->page > 1) {
+        handle_error(client, RESPONSE_NOT_FOUND);
+        return;
+    }
+
+    if(client->gplus == GPLUS_ITEM && entry->type != PACK_DIR &&
+       !gplus_header(client_output(client), entry->data_len)) {
+        handle_error(client, RESPONSE_INTERNAL);
+        return;
+    }
+
+    if(client->http && entry->type != PACK_DIR &&
+       !http_header(client->http, client_output(client), 200,
+                    http_content_type(client->request), entry->data_len)) {
+        handle_error(client, RESPONSE_INTERNAL);
+        return;
     }
 
-    bytes_read = read(source_fd, buffer, len);
-    if(bytes_read < 1)
-        return bytes_read;
+    if(!entry->data_len) {
+        client_finish(client);
+        return;
+    }
 
-    evbuffer_add(evb, buffer, bytes_read);
-    bufferevent_enable(buf_ev, EV_WRITE);
-    bufferevent_write_buffer(buf_ev, evb);
-    evbuffer_free(evb);
+    output = entry->type == PACK_DIR ? client_menu(client) : client_output(client);
+    before = evbuffer_get_length(output);
+    if(!pack_add(entry, output)) {
+        handle_error(client, RESPONSE_INTERNAL);
+        return;
+    }
+    client_menu_shared(client, output, before);
 
-    return bytes_read;
+    if(entry->type == PACK_DIR)
+        client_send_menu(client);
+    else
+        client_send(client, 0);
 }
 
 /**
@@ -325,7 +700,7 @@ static int stream_fd(int source_fd, struct bufferevent *buf_ev,
  * @param client placeholder with client request.
  */
 static void handle_request(client_t *client) {
-    struct stat st;
+    char *page;
 
     assert(client);
     assert(client->request);
@@ -338,10 +713,18 @@ static void handle_request(client_t *client) {
         close_client(client);
     }
 
+    client->trace.request_us = trace_now();
+    TRACE_PROBE2(request, client->fd, client->request);
+
     /* we don't really care about read events any more, so we'll
      * disable those, but we'll keep the bufferevent around because
      * we'll eventually be pushing a write out to this fd. */
-    bufferevent_disable(client->buf_ev, EV_READ);
+    client_read(client, FALSE);
+
+    /* a kept connection was handed off on its first request */
+    if(client->tls && (!client->http || client->http->requests == 1) &&
+       !client_tls_handoff(client))
+        return;
 
     /* figure out what handler type the request is for
        and pass it through */
@@ -350,88 +733,248 @@ static void handle_request(client_t *client) {
         free(client->request);
         client->request = strdup("/");
         if(!client->request) {
-            handle_error(client, TYPE_DIR, "Internal Error");
+            handle_error(client, RESPONSE_INTERNAL);
         }
     }
 
+    /* type 7 search string, or anything else tacked on after a tab */
+    if((client->query = strchr(client->request, '\t'))) {
+        *client->query++ = '\0';
+    }
+
+    /* nothing gets joined onto base_dir that could climb out */
+    if(!fs_selector_ok(client->request)) {
+        DEBUG("Refusing %s on fd %d", client->request, client->fd);
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+        gplus_parse(client);    /* so a Gopher+ client gets its kind of error */
+        handle_error(client, RESPONSE_DENIED);
+        return;
+    }
+
+    stats_record(client);
+
+    if(stats_selector(client->request)) {
+        handle_stats(client);
+        return;
+    }
+
+    /* selectors routed to another gopher hole */
+    if(proxy_dispatch(client)) {
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+        return;
+    }
+
+    /* a page of a large directory -- only ours; a proxied
+     * selector goes upstream with its page intact */
+    if((page = strstr(client->request, "/?page=")) &&
+       strspn(page + 7, "0123456789") == strlen(page + 7) && page[7]) {
+        client->page = atoi(page + 7);
+        page[1] = '\0';
+    }
+
+    /* type 7 full text search */
+    if(search_selector(client->request)) {
+        handle_search(client);
+        return;
+    }
+
+    /* Gopher+: "+", "!" or "$" after the selector */
+    gplus_parse(client);
+
+    /* serving a pack, so no filesystem at all */
+    if(pack_enabled()) {
+        handle_pack(client);
+        return;
+    }
+
+    /* already know there's nothing there */
+    if(negcache_check(client->request)) {
+        DEBUG("Known missing: %s", client->request);
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+        handle_error(client, RESPONSE_NOT_FOUND);
+        return;
+    }
+
     asprintf(&client->full_path, "%s/%s", config.base_dir, client->request);
 
-    /* stat this thing */
-    if(stat(client->full_path, &st) == -1) {
-        char *str_error = strerror(errno);
-        ERROR("Stat error: %s", str_error);
-        handle_error(client, TYPE_DIR, str_error);
+    /* the rest happens once the filesystem has answered */
+    fs_lookup(client, handle_lookup);
+}
+
+/**
+ * a client's path has been looked up -- send what we found
+ *
+ * @param client client waiting on the lookup
+ * @param result what the lookup found
+ */
+static void handle_lookup(client_t *client, fs_result_t *result) {
+    struct stat *st = &result->st;
+    struct evbuffer *menu;
+    size_t before;
+
+    client->trace.lookup_us = trace_now();
+    TRACE_PROBE2(lookup_done, client->fd, result->err);
+
+    if(result->err) {
+        /* misses are mostly scanners, not worth a log line */
+        if(result->err != ENOENT)
+            ERROR("Stat error: %s", strerror(result->err));
+        handle_error(client, response_errno(result->err));
         return;
     }
 
-    if(S_ISDIR(st.st_mode)) {
-        /* dir handler */
-        size_t size;
-        opaque_dir_t *od;
+    /* Gopher+ attributes, worked out by the lookup */
+    if(result->attrs) {
+        client->request_type = TYPE_DIR;
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+
+        if(!gplus_add(result->attrs, client->query + 1, client_output(client))) {
+            close_client(client);
+            return;
+        }
+
+        client_send(client, 0);
+        return;
+    }
 
+    if(S_ISDIR(st->st_mode)) {
+        /* dir handler -- the listing was rendered once, for
+           everyone who asked for it */
         client->request_type = TYPE_DIR;
         client->state = CLIENT_STATE_SENDING_RESPONSE;
+        hotset_record(client->request);
+
+        /* hand written menus win over listings */
+        if(result->map) {
+            if(client->page > 1) {
+                handle_error(client, RESPONSE_NOT_FOUND);
+                return;
+            }
+
+            if(!result->map->len) {
+                client_finish(client);
+                return;
+            }
+
+            if(!gophermap_add(result->map, client_menu(client))) {
+                close_client(client);
+                return;
+            }
 
-        od = (opaque_dir_t *)malloc(sizeof(opaque_dir_t));
-        if(!od) {
-            handle_error(client, TYPE_DIR, "malloc");
+            client_send_menu(client);
             return;
         }
 
-        memset((void*)od, 0, sizeof(opaque_dir_t));
+        /* large ones come a page at a time, straight from the index */
+        if(result->index) {
+            menu = client_menu(client);
+            before = evbuffer_get_length(menu);
+            if(!dirindex_add(result->index, client->page ? client->page : 1, menu)) {
+                handle_error(client, RESPONSE_NOT_FOUND);
+                return;
+            }
+            client_menu_shared(client, menu, before);
 
-        client->opaque_client = od;
+            client_send_menu(client);
+            return;
+        }
 
-        od->dir = opendir(client->full_path);
-        size = dirent_buf_size(od->dir);
+        if(client->page > 1) {
+            handle_error(client, RESPONSE_NOT_FOUND);
+            return;
+        }
 
-        if(size == -1) {
-            ERROR("Cannot determine size");
-            handle_error(client, TYPE_DIR, "no size");
+        if(!result->menu->len) {
+            client_finish(client);
             return;
         }
 
-        od->de = (struct dirent *)malloc(size);
+        menu = client_menu(client);
+        before = evbuffer_get_length(menu);
+        if(!chunk_add(result->menu, menu)) {
+            close_client(client);
+            return;
+        }
+        client_menu_shared(client, menu, before);
 
-        bufferevent_enable(client->buf_ev, EV_WRITE);
-    } else if(S_ISREG(st.st_mode)) {
-        /* okay, so grab a block at a time, in 1k chunks,
-           throw them on the bufev */
+        client_send_menu(client);
+    } else if(S_ISREG(st->st_mode) && exec_enabled(client->loop) &&
+              (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        /* executable -- run it on the worker pool and
+           splice its output back */
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+        exec_dispatch(client);
+    } else if(S_ISREG(st->st_mode)) {
+        /* hand out the file a chunk at a time, sharing the
+           chunks with anyone else sending the same file */
         opaque_file_t *of;
+        ssize_t res;
+
         client->request_type = TYPE_FILE;
         client->state = CLIENT_STATE_SENDING_RESPONSE;
+        hotset_record(client->request);
 
         of = (opaque_file_t *)malloc(sizeof(opaque_file_t));
         if (!of) {
-            handle_error(client, TYPE_DIR, "Malloc");
+            handle_error(client, RESPONSE_INTERNAL);
             return;
         }
 
         memset((void*)of, 0, sizeof(opaque_file_t));
 
         client->opaque_client = of;
-        of->buffer = (char *)malloc(MAX_FILE_BUFFER);
-        if(!of->buffer) {
-            handle_error(client, TYPE_DIR, "Malloc");
+        client->opaque_bytes = sizeof(opaque_file_t);
+        of->fd = result->fd == -1 ? -1 : fcntl(result->fd, F_DUPFD_CLOEXEC, 0);
+        if(of->fd == -1 || !result->file) {
+            handle_error(client, RESPONSE_INTERNAL);
+            return;
+        }
+
+        of->file = chunk_file_ref(result->file);
+
+        /* the kernel encrypts, so there's no need to hold the
+         * file in memory -- send it from the page cache.  The
+         * segment gets its own fd, as it can outlive ours. */
+        if(client->tls && tls_kernel_send(client->tls) && of->file->size) {
+            int seg_fd = fcntl(of->fd, F_DUPFD_CLOEXEC, 0);
+
+            if(seg_fd == -1 ||
+               !(of->seg = evbuffer_file_segment_new(seg_fd, 0, of->file->size,
+                                                     EVBUF_FS_CLOSE_ON_FREE))) {
+                if(seg_fd != -1)
+                    close(seg_fd);
+                handle_error(client, RESPONSE_INTERNAL);
+                return;
+            }
+        }
+
+        if(client->http &&
+           !http_header(client->http, client_output(client), 200,
+                        http_content_type(client->request), of->file->size)) {
+            close_client(client);
             return;
         }
 
-        of->fd = open(client->full_path, O_RDONLY);
-        if(of->fd == -1) {
-            handle_error(client, TYPE_DIR, "open error");
+        if(client->gplus == GPLUS_ITEM &&
+           !gplus_header(client_output(client), of->file->size)) {
+            close_client(client);
             return;
         }
 
-        of->bytes_in_buffer = stream_fd(
-            of->fd, client->buf_ev, of->buffer, MAX_FILE_BUFFER);
+        readahead_start(&of->ra, of->fd, of->file->size);
+        pace_start(&of->pace, client->fd);
 
-        if(of->bytes_in_buffer < 0) {
+        res = stream_file(client);
+        if(res < 0) {
             close_client(client);
+        } else if(!res) {
+            /* an empty file -- that's all there is */
+            client_finish(client);
         }
     } else {
         /* some kind of strange file... should flag
            on S_IFLNK */
-        handle_error(client, TYPE_DIR, "This is some kind of crazy file!");
+        handle_error(client, RESPONSE_UNSUPPORTED);
     }
 }
 
@@ -458,45 +1001,15 @@ static int setnonblock(int fd) {
 
 
 /**
- * handle terminating a client connection
+ * free whatever a client's last request left behind
  *
- * @param client client connection to terminate
+ * @param client client done with its request
  */
-static void close_client(client_t *client) {
-    int fd;
-
-    assert(client);
-
-    if(!client)
-        return;
-
-    fd = client->fd;
-
-    if(fd) {
-        DEBUG("Closing fd %d", fd);
-
-        shutdown(client->fd, SHUT_RDWR);
-        close(client->fd);
-    } else {
-        ERROR("Probably bad client in close_client");
-    }
-
-    if(client->buf_ev) {
-        bufferevent_disable(client->buf_ev, EV_READ);
-        bufferevent_disable(client->buf_ev, EV_WRITE);
-        bufferevent_free(client->buf_ev);
-        client->buf_ev = NULL;
-    }
-
-    if(client->request) {
-        free(client->request);
-        client->request = NULL;
-    }
-
-    if(client->full_path) {
-        free(client->full_path);
-        client->full_path = NULL;
-    }
+static void client_request_free(client_t *client) {
+    if(client->full_path) {
+        free(client->full_path);
+        client->full_path = NULL;
+    }
 
     /* this should probably best be handled
      * by free functions in a pluggable handler,
@@ -508,8 +1021,11 @@ static void close_client(client_t *client) {
         if(client->opaque_client) {
             opaque_file_t *of = (opaque_file_t*)(client->opaque_client);
             if(of) {
-                if(of->buffer)
-                    free(of->buffer);
+                readahead_stop(&of->ra);
+                pace_stop(&of->pace, client->fd);
+                chunk_file_close(of->file);
+                if(of->seg)
+                    evbuffer_file_segment_free(of->seg);
 
                 if(of->fd > 0) {
                     close(of->fd);
@@ -521,25 +1037,129 @@ static void close_client(client_t *client) {
         }
         break;
 
-    case TYPE_DIR: /* passthrough */
-        if(client->opaque_client) {
-            opaque_dir_t *od = (opaque_dir_t*)(client->opaque_client);
-            if(od) {
-                if(od->line) {
-                    free(od->line);
-                    od->line = NULL;
-                }
+    case TYPE_LOOKUP:
+        fs_client_free(client);
+        break;
 
-                free(od);
-                client->opaque_client = NULL;
-            }
-        }
+    case TYPE_EXEC:
+        exec_client_free(client);
+        break;
+
+    case TYPE_PROXY:
+        proxy_client_free(client);
         break;
 
     case TYPE_UNKNOWN:
     default: /* passthrough */
         break;
     }
+}
+
+/**
+ * a browser's response is all out, and it wants to keep the
+ * connection -- wait for its next request
+ *
+ * @param client client that's done with a request
+ */
+static void client_keepalive(client_t *client) {
+    loop_t *loop = client->loop;
+
+    DEBUG("Keeping fd %d open for another request", client->fd);
+
+    trace_close(client);
+    client_request_free(client);
+
+    memset(&client->trace, 0, sizeof(client->trace));
+    memset(client->request, 0, MAX_REQUEST_SIZE);
+    client->query = NULL;
+    client->page = 0;
+    client->gplus = GPLUS_NONE;
+    client->request_type = TYPE_UNKNOWN;
+    client->opaque_bytes = 0;
+    client->state = CLIENT_STATE_WAITING_REQUEST;
+    http_reset(client->http);
+    client->mem_shared = 0;
+    mem_account(client, 0);
+
+    if(config.request_timeout > 0)
+        wheel_timer_add(&loop->wheel, &client->io_timer, config.request_timeout * 1000);
+    else
+        wheel_timer_del(&loop->wheel, &client->io_timer);
+
+    client_read(client, TRUE);
+}
+
+/**
+ * handle terminating a client connection
+ *
+ * @param client client connection to terminate
+ */
+void close_client(client_t *client) {
+    loop_t *loop;
+    int fd;
+
+    assert(client);
+
+    if(!client)
+        return;
+
+    fd = client->fd;
+    loop = client->loop;
+
+    /* out of the epoll set while the fd is still ours */
+    if(client->output)
+        edge_del(client);
+
+    if(fd) {
+        DEBUG("Closing fd %d", fd);
+
+        shutdown(client->fd, SHUT_RDWR);
+        close(client->fd);
+    } else {
+        ERROR("Probably bad client in close_client");
+    }
+
+    wheel_timer_del(&loop->wheel, &client->io_timer);
+    wheel_timer_del(&loop->wheel, &client->life_timer);
+
+    trace_close(client);
+
+    if(client->buf_ev || client->output) {
+        struct evbuffer *output = client_output(client);
+
+        evbuffer_remove_cb(output, on_buf_output, client);
+        __atomic_sub_fetch(&loop->output_bytes, evbuffer_get_length(output),
+                           __ATOMIC_RELAXED);
+    }
+
+    mem_detach(client);
+
+    if(client->buf_ev) {
+        bufferevent_disable(client->buf_ev, EV_READ);
+        bufferevent_disable(client->buf_ev, EV_WRITE);
+        bufferevent_free(client->buf_ev);
+        client->buf_ev = NULL;
+    }
+
+    if(client->output) {
+        evbuffer_free(client->output);
+        client->output = NULL;
+    }
+
+    if(client->tls) {
+        tls_free(client->tls);
+        client->tls = NULL;
+    }
+
+    if(client->request) {
+        free(client->request);
+        client->request = NULL;
+    }
+
+    client_request_free(client);
+
+    http_free(client->http);
+    client->http = NULL;
 
     /* if(client->response) { */
     /*     free(client->response); */
@@ -548,6 +1168,9 @@ static void close_client(client_t *client) {
 
     free(client);
 
+    __atomic_sub_fetch(&loop->client_count, 1, __ATOMIC_RELAXED);
+    admission_resume(loop);
+
     DEBUG("Closed fd %d", fd);
 }
 
@@ -558,11 +1181,23 @@ static void close_client(client_t *client) {
  * the thing to do is probably punt the connection.
  */
 static void on_buf_error(struct bufferevent *bev, short what, void *arg) {
-    client_t *client = (client_t *)arg;
+    /* a TLS handshake finishing isn't news */
+    if(what & BEV_EVENT_CONNECTED)
+        return;
 
+    on_client_error((client_t *)arg, what & EVBUFFER_EOF);
+}
+
+/**
+ * a client connection failed or went away
+ *
+ * @param client client to drop
+ * @param eof TRUE if the client closed it
+ */
+static void on_client_error(client_t *client, int eof) {
     DEBUG("Caught an error on event buffer");
 
-    if(what & EVBUFFER_EOF) {
+    if(eof) {
         DEBUG("Client closed connection on fd %d", client->fd);
     } else {
         ERROR("Socket error on fd %d", client->fd);
@@ -577,12 +1212,19 @@ static void on_buf_error(struct bufferevent *bev, short what, void *arg) {
  * socket is written out.  In this case, we're done.
  */
 static void on_buf_write(struct bufferevent *bev, void *arg) {
+    on_client_write((client_t *)arg);
+}
+
+/**
+ * a client's output is down to its write watermark -- top up
+ * a file, or finish
+ *
+ * @param client client being answered
+ */
+static void on_client_write(client_t *client) {
     /* we finished our write.  We done. */
-    client_t *client = (client_t *)arg;
     opaque_file_t *of;
-    opaque_dir_t *od;
-    struct dirent *de;
-    int res;
+    ssize_t sent;
 
     assert(client);
 
@@ -598,64 +1240,34 @@ static void on_buf_write(struct bufferevent *bev, void *arg) {
             of = (opaque_file_t *)client->opaque_client;
 
             assert(of);
-            assert(of->buffer);
+            assert(of->file);
 
-            if((!of) || (!of->buffer)) {
+            if((!of) || (!of->file)) {
                 close_client(client);
                 return;
             }
 
-            if(of->bytes_in_buffer == 0)  /* done */
-                break;
-
-            of->bytes_in_buffer = stream_fd(
-                of->fd, client->buf_ev, of->buffer, MAX_FILE_BUFFER);
-
-            if(of->bytes_in_buffer < 0) {
+            sent = stream_file(client);
+            if(sent < 0) {
                 ERROR("Read error on fd %d: %s", client->fd, strerror(errno));
                 close_client(client);
                 return;
             }
-            break;
-        case TYPE_DIR:
-            od = (opaque_dir_t *)client->opaque_client;
-
-            assert(od);
-            assert(od->dir);
-
-            if((!od) || (!od->dir)) {
-                ERROR("Bad dir request on fd %d", client->fd);
-                break;
-            }
-
-            if(od->line) {
-                free(od->line);
-                od->line = NULL;
-            }
 
-            /* readdir_r here and jet out the links */
-            while(1) {
-                res = readdir_r(od->dir, od->de, &de);
-                if(res == -1) {
-                    ERROR("readdir_r error on fd %d", client->fd);
-                    break;
-                }
-
-                if(de == NULL)
-                    break;
-
-                if(od->de->d_name[0] == '.')
-                    continue;
-
-                asprintf(&(od->line), "0%s\t%s\tlocalhost\t70\n\r",
-                         od->de->d_name, od->de->d_name);
+            if(sent > 0)
+                return;
 
-                stream_string(client->buf_ev, od->line);
+            /* all queued -- finish once the last of it is out */
+            if(evbuffer_get_length(client_output(client))) {
+                client_send(client, 0);
                 return;
             }
-
-            closedir(od->dir);
-            /* fall through to close and log */
+            break;
+        case TYPE_DIR:
+            /* the whole listing went out in one go */
+            break;
+        case TYPE_PACK:
+            /* as did anything from a pack */
             break;
         default:
             break;
@@ -666,6 +1278,73 @@ static void on_buf_write(struct bufferevent *bev, void *arg) {
     }
 
     DEBUG("Finished write on fd %d", client->fd);
+    client_finish(client);
+}
+
+/**
+ * the response is moving, so push the write stall timeout
+ * back out.  Also used by modules that write to the client
+ * fd directly.
+ *
+ * @param client client that made progress
+ */
+void client_progress(client_t *client) {
+    trace_first_byte(client);
+
+    if(config.write_timeout > 0) {
+        wheel_timer_add(&client->loop->wheel, &client->io_timer,
+                        config.write_timeout * 1000);
+    } else {
+        wheel_timer_del(&client->loop->wheel, &client->io_timer);
+    }
+}
+
+/**
+ * bytes were queued for the client, or left for the socket
+ */
+static void on_buf_output(struct evbuffer *buffer,
+                          const struct evbuffer_cb_info *info, void *arg) {
+    client_t *client = (client_t *)arg;
+    loop_t *loop = client->loop;
+
+    if(info->n_added)
+        __atomic_add_fetch(&loop->output_bytes, info->n_added, __ATOMIC_RELAXED);
+
+    if(info->n_deleted) {
+        __atomic_sub_fetch(&loop->output_bytes, info->n_deleted, __ATOMIC_RELAXED);
+
+        if(client->state != CLIENT_STATE_WAITING_REQUEST)
+            client_progress(client);
+
+        admission_resume(loop);
+    }
+
+    mem_account(client, evbuffer_get_length(buffer));
+}
+
+/**
+ * client took too long to send a request, or stopped
+ * reading the response
+ */
+static void on_io_timeout(wheel_timer_t *timer, void *arg) {
+    client_t *client = (client_t *)arg;
+
+    if(client->state == CLIENT_STATE_WAITING_REQUEST) {
+        INFO("Timed out waiting for request on fd %d", client->fd);
+    } else {
+        INFO("Timed out writing response on fd %d", client->fd);
+    }
+
+    close_client(client);
+}
+
+/**
+ * connection has been open too long, whatever it's doing
+ */
+static void on_life_timeout(wheel_timer_t *timer, void *arg) {
+    client_t *client = (client_t *)arg;
+
+    INFO("Connection timeout on fd %d", client->fd);
     close_client(client);
 }
 
@@ -675,7 +1354,6 @@ static void on_buf_write(struct bufferevent *bev, void *arg) {
 static void on_buf_read(struct bufferevent *bev, void *arg) {
     client_t *client = (client_t *)arg;
     size_t buffer_left, bytes_read;
-    char *end;
 
     assert(client);
     assert(client->fd > 0);
@@ -713,21 +1391,106 @@ static void on_buf_read(struct bufferevent *bev, void *arg) {
 
     DEBUG("Read %d bytes on fd %d", bytes_read, client->fd);
 
-    end = client->request;
-    while(*end && (*end != '\n') && (*end != '\r')) {
-        end++;
+    client_parse_request(client);
+}
+
+/**
+ * the epoll engine's read callback.  It's edge-triggered, so
+ * keep reading until the socket is empty or we have a whole
+ * request line.
+ *
+ * @param client client waiting on a request
+ */
+static void on_client_read(client_t *client) {
+    size_t len = strlen(client->request);
+    ssize_t got;
+
+    DEBUG("Read event (state %d) on fd %d", client->state, client->fd);
+
+    while(TRUE) {
+        if(len >= MAX_REQUEST_SIZE - 1) {
+            ERROR("Out of request space on fd %d.  Aborting.", client->fd);
+            close_client(client);
+            return;
+        }
+
+        got = read(client->fd, &client->request[len], MAX_REQUEST_SIZE - 1 - len);
+        if(got < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            on_client_error(client, FALSE);
+            return;
+        }
+
+        if(!got) {
+            on_client_error(client, TRUE);
+            return;
+        }
+
+        DEBUG("Read %zd bytes on fd %d", got, client->fd);
+
+        len += got;
+        client->request[len] = '\0';
+        if(strpbrk(&client->request[len - got], "\r\n") &&
+           !http_partial(client->request))
+            break;
     }
 
-    if(*end) {
-        *end = '\0';
-        client->state = CLIENT_STATE_WAITING_REPLY;
-        DEBUG("Got client request on fd %d: %s", client->fd, client->request);
+    client_parse_request(client);
+}
 
-        /* hand this off to set up a response object */
-        handle_request(client);
-    } else {
+/**
+ * act on the request line, once we have all of it
+ *
+ * @param client client waiting on a request
+ */
+static void client_parse_request(client_t *client) {
+    response_id_t reject;
+    char *end;
+    int http;
+
+    http = http_parse(client, &reject);
+    if(http == HTTP_GOPHER) {
+        end = client->request;
+        while(*end && (*end != '\n') && (*end != '\r')) {
+            end++;
+        }
+
+        if(*end)
+            *end = '\0';
+        else
+            http = HTTP_PARTIAL;
+    }
+
+    if(http == HTTP_PARTIAL) {
         DEBUG("Partial request read on fd %d", client->fd);
+        return;
+    }
+
+    client->state = CLIENT_STATE_WAITING_REPLY;
+    mem_account(client, 0);
+    DEBUG("Got %s request on fd %d: %s", client->http ? "HTTP" : "client",
+          client->fd, client->request);
+    client->trace.read_us = trace_now();
+    if(!client->trace.accept_us)
+        client->trace.accept_us = client->trace.read_us;
+    TRACE_PROBE2(request_read, client->fd, client->request);
+
+    /* from here on, we're watching for write stalls */
+    client_progress(client);
+
+    if(http == HTTP_REJECT) {
+        client_read(client, FALSE);
+        client->state = CLIENT_STATE_SENDING_RESPONSE;
+        handle_error(client, reject);
+        return;
     }
+
+    /* hand this off to set up a response object */
+    handle_request(client);
 }
 
 /**
@@ -740,6 +1503,7 @@ static void on_buf_read(struct bufferevent *bev, void *arg) {
 static void on_signal(int fd, short event, void *arg) {
     //    struct event *ev = arg;
     int sig;
+    int index;
 
     while((sig = daemon_signal_next()) > 0) {
         switch(sig) {
@@ -752,6 +1516,9 @@ static void on_signal(int fd, short event, void *arg) {
         case SIGHUP:
             INFO("Got HUP");
             break;
+        case SIGUSR1:
+            trace_dump();
+            break;
         case SIGPIPE:
             INFO("Got SIGPIPE");
             break;
@@ -762,26 +1529,170 @@ static void on_signal(int fd, short event, void *arg) {
         ERROR("daemon_signal_next() failed: %s.  Aborting", strerror(errno));
         g_quitflag = 1;
     }
+
+    if(g_quitflag) {
+        for(index = 0; index < g_loop_count; index++)
+            loop_stop(g_loops[index]);
+    }
+}
+
+/**
+ * total connections across every loop
+ */
+static int client_count(void) {
+    int index, count = 0;
+
+    for(index = 0; index < g_loop_count; index++)
+        count += __atomic_load_n(&g_loops[index]->client_count, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+/**
+ * total queued output across every loop
+ */
+static size_t output_bytes(void) {
+    size_t bytes = 0;
+    int index;
+
+    for(index = 0; index < g_loop_count; index++)
+        bytes += __atomic_load_n(&g_loops[index]->output_bytes, __ATOMIC_RELAXED);
+
+    return bytes;
+}
+
+/**
+ * are we over any of the configured load limits?
+ */
+static int overloaded(void) {
+    if(config.max_clients && client_count() >= config.max_clients)
+        return TRUE;
+
+    if(config.max_output_bytes && output_bytes() >= config.max_output_bytes)
+        return TRUE;
+
+    return FALSE;
+}
+
+/**
+ * start accepting again if we paused, once we're comfortably
+ * (90%) back under every limit
+ *
+ * @param loop loop that may have paused
+ */
+static void admission_resume(loop_t *loop) {
+    if(!loop->accept_paused)
+        return;
+
+    if(config.max_clients &&
+       client_count() > config.max_clients - config.max_clients / 10)
+        return;
+
+    if(config.max_output_bytes &&
+       output_bytes() > config.max_output_bytes - config.max_output_bytes / 10)
+        return;
+
+    INFO("Load is down, accepting connections again");
+    loop->accept_paused = FALSE;
+    event_add(&loop->ev_accept, NULL);
+    if(loop->tls_listen_fd != -1)
+        event_add(&loop->ev_tls_accept, NULL);
+    if(loop->steal_from)
+        event_add(&loop->ev_steal, NULL);
+}
+
+/**
+ * we're over a limit -- either stop accepting for a while, or
+ * take the connection just long enough to say we're busy
+ *
+ * @param loop loop the connection came in on
+ * @param fd listening socket with a pending connection
+ * @param tls whether it's a TLS listener
+ */
+static void admission_shed(loop_t *loop, int fd, int tls) {
+    const char *busy;
+    size_t busy_len;
+    int client_fd;
+
+    if(!strcasecmp(config.overload_action, "pause")) {
+        WARN("Overloaded (%d clients, %zu bytes queued), pausing accepts",
+             client_count(), output_bytes());
+        loop->accept_paused = TRUE;
+        event_del(&loop->ev_accept);
+        if(loop->tls_listen_fd != -1)
+            event_del(&loop->ev_tls_accept);
+        if(loop->steal_from)
+            event_del(&loop->ev_steal);
+        return;
+    }
+
+    client_fd = accept(fd, NULL, NULL);
+    if(client_fd == -1)
+        return;
+
+    DEBUG("Overloaded, rejecting fd %d", client_fd);
+
+    /* no time for a handshake, so TLS clients just get hung up on */
+    if(!tls) {
+        busy = response_get(RESPONSE_BUSY, &busy_len);
+        send(client_fd, busy, busy_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(client_fd);
 }
 
 /**
- * handle the case of an accept on the gopher server socket
+ * handle the case of an accept on the gopher server socket.
+ * This may be our own listener, or a busier loop's that we're
+ * helping out with -- either way the client is ours from here.
  */
 static void on_accept(int fd, short event, void *arg) {
+    accept_client((loop_t *)arg, fd, FALSE);
+}
+
+/**
+ * an accept on the TLS listener
+ */
+static void on_tls_accept(int fd, short event, void *arg) {
+    accept_client((loop_t *)arg, fd, TRUE);
+}
+
+/**
+ * take a new connection, and start waiting for its request
+ *
+ * @param loop loop that will own the client
+ * @param fd listening socket with a pending connection
+ * @param tls whether to handshake first
+ */
+static void accept_client(loop_t *loop, int fd, int tls) {
     int client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(struct sockaddr_in);
+    struct sockaddr_storage client_addr;
+    socklen_t client_len = sizeof(struct sockaddr_storage);
     client_t *client = NULL;
 
     DEBUG("Incoming connection...");
 
+    if(overloaded()) {
+        admission_shed(loop, fd, tls);
+        return;
+    }
+
     client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
     if(client_fd == -1) {
-        ERROR("Accept failed: %s", strerror(errno));
+        /* another loop watching this listener may have beaten us */
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            ERROR("Accept failed: %s", strerror(errno));
         return;
     }
 
-    DEBUG("Accepted connection on fd %d", client_fd);
+    DEBUG("Accepted connection on fd %d (loop %d)", client_fd, loop->id);
+    TRACE_PROBE2(accept, client_fd, loop->id);
+
+    /* abusive peers go away before we spend anything on them */
+    if(!ratelimit_allow((struct sockaddr *)&client_addr)) {
+        DEBUG("Rate limited fd %d", client_fd);
+        close(client_fd);
+        return;
+    }
 
     if(setnonblock(client_fd) < 0) {
         ERROR("Can't set client socket nonblocking.  Terminating");
@@ -798,10 +1709,10 @@ static void on_accept(int fd, short event, void *arg) {
         return;
     }
 
-    /* set up read/write events */
     client->fd = client_fd;
-    client->buf_ev = bufferevent_new(client_fd, on_buf_read,
-                                     on_buf_write, on_buf_error, (void*)client);
+    client->loop = loop;
+    client->trace.accept_us = trace_now();
+    client->subnet = stats_subnet((struct sockaddr *)&client_addr);
     client->state = CLIENT_STATE_WAITING_REQUEST;
 
     client->request = (char*)calloc(1, MAX_REQUEST_SIZE);
@@ -813,7 +1724,251 @@ static void on_accept(int fd, short event, void *arg) {
         return;
     }
 
-    bufferevent_enable(client->buf_ev, EV_READ);
+    /* set up read/write events */
+    if(tls) {
+        client->buf_ev = tls_bufferevent(loop->base, client_fd, &client->tls);
+        if(client->buf_ev)
+            bufferevent_setcb(client->buf_ev, on_buf_read, on_buf_write,
+                              on_buf_error, (void*)client);
+    }
+
+    if(tls ? !client->buf_ev : !client_attach(client)) {
+        shutdown(client_fd, SHUT_RDWR);
+        close(client_fd);
+        free(client->request);
+        free(client);
+        return;
+    }
+
+    __atomic_add_fetch(&loop->client_count, 1, __ATOMIC_RELAXED);
+    mem_attach(client);
+    evbuffer_add_cb(client_output(client), on_buf_output, client);
+
+    wheel_timer_init(&client->io_timer, on_io_timeout, client);
+    wheel_timer_init(&client->life_timer, on_life_timeout, client);
+
+    if(config.request_timeout > 0)
+        wheel_timer_add(&loop->wheel, &client->io_timer, config.request_timeout * 1000);
+    if(config.connection_timeout > 0)
+        wheel_timer_add(&loop->wheel, &client->life_timer, config.connection_timeout * 1000);
+
+    if(client->buf_ev)
+        bufferevent_enable(client->buf_ev, EV_READ);
+    else
+        edge_read(client, TRUE);
+}
+
+/**
+ * see whether some other loop is a lot busier than we are, and
+ * if so, also accept from its listener until things even out.
+ * Connections never move once accepted, so this is the only
+ * place load gets shifted around.
+ */
+static void on_rebalance(int fd, short event, void *arg) {
+    loop_t *loop = (loop_t *)arg;
+    loop_t *busiest = NULL;
+    int mine, load, most = 0;
+    int index;
+
+    /* a paused loop may be waiting on load that drained elsewhere */
+    admission_resume(loop);
+
+    mine = __atomic_load_n(&loop->client_count, __ATOMIC_RELAXED);
+
+    for(index = 0; index < g_loop_count; index++) {
+        if(g_loops[index] == loop)
+            continue;
+
+        load = __atomic_load_n(&g_loops[index]->client_count, __ATOMIC_RELAXED);
+        if(load > most) {
+            most = load;
+            busiest = g_loops[index];
+        }
+    }
+
+    if(busiest && most > 2 * mine + config.steal_margin) {
+        if(loop->steal_from == busiest)
+            return;
+
+        if(loop->steal_from)
+            event_del(&loop->ev_steal);
+
+        DEBUG("Loop %d (%d clients) helping loop %d (%d clients)",
+              loop->id, mine, busiest->id, most);
+
+        event_set(&loop->ev_steal, busiest->listen_fd, EV_READ | EV_PERSIST,
+                  on_accept, loop);
+        event_base_set(loop->base, &loop->ev_steal);
+        if(!loop->accept_paused)
+            event_add(&loop->ev_steal, NULL);
+        loop->steal_from = busiest;
+    } else if(loop->steal_from) {
+        DEBUG("Loop %d done helping loop %d", loop->id, loop->steal_from->id);
+        event_del(&loop->ev_steal);
+        loop->steal_from = NULL;
+    }
+}
+
+/**
+ * make a listening socket.  With several loops, each gets
+ * its own, and the kernel spreads connections between them.
+ *
+ * @param reuseport whether to share the port with other listeners
+ * @returns listening fd, or -1 on error
+ */
+static int listen_socket(int port, int reuseport) {
+    struct sockaddr_in server_address;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd == -1) {
+        ERROR("Cannot create server socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if(reuseport &&
+       setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        ERROR("Cannot set SO_REUSEPORT: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = INADDR_ANY;
+    server_address.sin_port = htons(port);
+
+    if(bind(fd, (struct sockaddr*)&server_address, (socklen_t)sizeof(server_address)) < 0) {
+        ERROR("Bind error: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if(listen(fd, config.socket_backlog) < 0) {
+        ERROR("Listen error: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if(setnonblock(fd) < 0) {
+        ERROR("Could not set server socket to non-blocking: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * set up everything a loop needs to serve clients: its
+ * listener, exec workers and proxy state.  Exec workers are
+ * forked here, so this all happens before any threads start.
+ *
+ * @param loop loop to set up (already loop_init'ed)
+ * @returns TRUE on success, FALSE otherwise
+ */
+static int loop_serve_init(loop_t *loop) {
+    struct timeval tv;
+    int workers;
+
+    if(!mem_loop_init(loop))
+        return FALSE;
+
+    loop->listen_fd = listen_socket(config.port, g_loop_count > 1);
+    if(loop->listen_fd == -1)
+        return FALSE;
+
+    affinity_listen(loop->listen_fd, loop->id);
+
+    if(!strcasecmp(config.io_engine, "epoll") &&
+       !edge_init(loop, on_client_read, on_client_write, on_client_error))
+        return FALSE;
+
+    event_set(&loop->ev_accept, loop->listen_fd, EV_READ | EV_PERSIST,
+              on_accept, loop);
+    event_base_set(loop->base, &loop->ev_accept);
+    event_add(&loop->ev_accept, NULL);
+
+    if(config.tls_port) {
+        loop->tls_listen_fd = listen_socket(config.tls_port, g_loop_count > 1);
+        if(loop->tls_listen_fd == -1)
+            return FALSE;
+
+        affinity_listen(loop->tls_listen_fd, loop->id);
+
+        event_set(&loop->ev_tls_accept, loop->tls_listen_fd, EV_READ | EV_PERSIST,
+                  on_tls_accept, loop);
+        event_base_set(loop->base, &loop->ev_tls_accept);
+        event_add(&loop->ev_tls_accept, NULL);
+    }
+
+    if(g_loop_count > 1) {
+        tv.tv_sec = REBALANCE_INTERVAL_MS / 1000;
+        tv.tv_usec = (REBALANCE_INTERVAL_MS % 1000) * 1000;
+        event_set(&loop->ev_rebalance, -1, EV_PERSIST, on_rebalance, loop);
+        event_base_set(loop->base, &loop->ev_rebalance);
+        event_add(&loop->ev_rebalance, &tv);
+    }
+
+    /* split the workers up, rounding so nobody gets none */
+    workers = (config.exec_workers + g_loop_count - 1) / g_loop_count;
+    if(!exec_pool_init(loop, workers, config.exec_queue)) {
+        ERROR("Could not start exec worker pool");
+        return FALSE;
+    }
+
+    if(!proxy_init(loop)) {
+        ERROR("Could not start proxy");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * undo loop_serve_init, and the loop itself
+ */
+static void loop_serve_deinit(loop_t *loop) {
+    if(!loop->base)
+        return;
+
+    exec_pool_deinit(loop);
+    proxy_deinit(loop);
+    edge_deinit(loop);
+
+    if(loop->steal_from)
+        event_del(&loop->ev_steal);
+    if(g_loop_count > 1)
+        event_del(&loop->ev_rebalance);
+
+    if(loop->listen_fd != -1) {
+        event_del(&loop->ev_accept);
+        shutdown(loop->listen_fd, SHUT_RDWR);
+        close(loop->listen_fd);
+        loop->listen_fd = -1;
+    }
+
+    if(loop->tls_listen_fd != -1) {
+        event_del(&loop->ev_tls_accept);
+        shutdown(loop->tls_listen_fd, SHUT_RDWR);
+        close(loop->tls_listen_fd);
+        loop->tls_listen_fd = -1;
+    }
+
+    mem_loop_deinit(loop);
+    loop_deinit(loop);
+}
+
+/**
+ * thread body for loops other than the first
+ */
+static void *loop_thread(void *arg) {
+    loop_t *loop = (loop_t *)arg;
+
+    affinity_pin(loop->id);
+    loop_run(loop);
+    return NULL;
 }
 
 
@@ -823,12 +1978,12 @@ static void on_accept(int fd, short event, void *arg) {
  * watchdog to maintain continuity.
  */
 static int do_child_process(void) {
-    int server_sockfd;
-    struct sockaddr_in server_address;
-    struct event_base *pbase = NULL;
     struct event evsignal;   /* libdaemon's signal fd */
-    struct event evaccept;   /* server socket */
+    int signal_set = FALSE;
+    int fs_started = FALSE;
+    int started = 0;
     int retval = 1;
+    int index;
 
     /* if(lookup_config.drop_core) { */
     /*     const struct rlimit rlim = { */
@@ -840,66 +1995,193 @@ static int do_child_process(void) {
     /*     prctl(PR_SET_DUMPABLE, 1); */
     /* } */
 
-    server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(server_sockfd == -1) {
-        ERROR("Cannot create server socket: %s", strerror(errno));
+    g_loop_count = config.threads > 0 ? config.threads : 1;
+    if(!affinity_init(config.cpu_affinity, g_loop_count, config.threads > 0))
+        goto finish;
+
+    g_loops = (loop_t **)calloc(g_loop_count, sizeof(loop_t *));
+    if(!g_loops) {
+        ERROR("malloc");
         goto finish;
     }
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(config.port);
+    /* each loop's own state lives on its own node */
+    for(index = 0; index < g_loop_count; index++) {
+        g_loops[index] = (loop_t *)affinity_alloc(sizeof(loop_t), affinity_node(index));
+        if(!g_loops[index]) {
+            ERROR("malloc");
+            goto finish;
+        }
+    }
 
-    if(bind(server_sockfd, (struct sockaddr*)&server_address, (socklen_t)sizeof(server_address)) < 0) {
-        ERROR("Bind error: %s", strerror(errno));
+    /* FIXME: drop privs */
+
+    /* set up events.  Loop 0 runs on this thread, and owns
+     * the signal fd. */
+    for(index = 0; index < g_loop_count; index++) {
+        if(!loop_init(g_loops[index], index)) {
+            ERROR("Could not get event_base.  Failing");
+            goto finish;
+        }
+    }
+
+    /* set up event for libdaemon's signal fd */
+    event_set(&evsignal, daemon_signal_fd(), EV_READ | EV_PERSIST, on_signal, &evsignal);
+    event_base_set(g_loops[0]->base, &evsignal);
+    event_add(&evsignal, NULL);
+    signal_set = TRUE;
+
+    if(config.tls_port &&
+       !tls_init(config.tls_cert, config.tls_key, config.tls_session_cache)) {
+        ERROR("Could not set up TLS");
         goto finish;
     }
 
-    if(listen(server_sockfd, config.socket_backlog) < 0) {
-        ERROR("Listen error: %s", strerror(errno));
+    mem_init(config.loop_memory_budget, config.client_output_budget,
+             config.send_low_watermark);
+
+    /* forks, so before anything starts a thread */
+    if(!exec_init(config.exec_workers)) {
+        ERROR("Could not start exec workers");
         goto finish;
     }
 
-    if(setnonblock(server_sockfd) < 0) {
-        ERROR("Could not set server socket to non-blocking: %s", strerror(errno));
+    for(index = 0; index < g_loop_count; index++) {
+        if(!loop_serve_init(g_loops[index]))
+            goto finish;
+    }
+
+    if(g_loop_count > 1) {
+        affinity_steer(g_loops[0]->listen_fd, g_loop_count);
+        if(config.tls_port)
+            affinity_steer(g_loops[0]->tls_listen_fd, g_loop_count);
+    }
+
+    if(!response_init(config.server_name, config.port) ||
+       !http_init(config.server_name, config.port) ||
+       !gplus_init(config.server_name, config.port, config.gplus_admin,
+                   config.gplus_cache_size)) {
+        ERROR("Could not render responses");
         goto finish;
     }
 
-    /* FIXME: drop privs */
+    if(!dirindex_init(config.dir_index_path, config.dir_index_threshold,
+                      config.dir_page_size)) {
+        ERROR("Could not set up directory indexing");
+        goto finish;
+    }
 
-    /* set up events */
-    pbase = event_init();
-    if(!pbase) {
-        ERROR("Could not get event_base.  Failing");
+    if(config.pack_file && !pack_open(config.pack_file)) {
+        ERROR("Could not open content pack");
         goto finish;
     }
 
-    /* set up event for libdaemon's signal fd */
-    event_set(&evsignal, daemon_signal_fd(), EV_READ | EV_PERSIST, on_signal, &evsignal);
-    event_add(&evsignal, NULL);
+    if(!search_init(config.search_selector, config.search_index,
+                    config.search_max_file_size, config.search_max_results)) {
+        ERROR("Could not set up search");
+        goto finish;
+    }
 
-    /* set up events for listening AF_INET socket */
-    event_set(&evaccept, server_sockfd, EV_READ | EV_PERSIST, on_accept, &evaccept);
-    event_add(&evaccept, NULL);
+    if(!trace_init(config.trace_ring_size, config.trace_slow_ms)) {
+        ERROR("Could not set up the flight recorder");
+        goto finish;
+    }
 
+    if(!stats_init(config.stats_selector, config.stats_top, config.stats_half_life)) {
+        ERROR("Could not set up stats");
+        goto finish;
+    }
 
-    while(!g_quitflag) {
-        event_base_loop(pbase, EVLOOP_ONCE);
+    if(!ratelimit_init(config.ratelimit_rate, config.ratelimit_burst,
+                       config.ratelimit_slots)) {
+        ERROR("Could not set up rate limiting");
+        goto finish;
+    }
+
+    readahead_init(config.readahead_max, config.readahead_budget,
+                   config.readahead_dontneed_size);
+    pace_init(config.send_low_watermark, config.send_high_watermark);
+
+    if(!chunk_cache_init(config.file_cache_size)) {
+        ERROR("Could not set up file cache");
+        goto finish;
+    }
+
+    if(!negcache_init(config.negcache_size, g_loops[0]->base)) {
+        ERROR("Could not set up negative cache");
+        goto finish;
+    }
+
+    /* no more forking (bar exec worker restarts) from here on */
+    if(!fs_init(config.fs_threads)) {
+        ERROR("Could not start lookup threads");
+        goto finish;
+    }
+    fs_started = TRUE;
+
+    if(!pack_enabled() &&
+       !hotset_init(config.hotset_file, config.hotset_size, config.hotset_interval,
+                    config.hotset_warmup_bytes, config.hotset_warmup_rate)) {
+        ERROR("Could not set up hot set snapshots");
+        goto finish;
+    }
+
+    for(started = 1; started < g_loop_count; started++) {
+        if(pthread_create(&g_loops[started]->thread, NULL, loop_thread,
+                          g_loops[started])) {
+            ERROR("Could not start loop %d", started);
+            break;
+        }
+    }
+
+    if(g_loop_count > 1)
+        INFO("Running %d event loops", started);
+
+    if(started == g_loop_count) {
+        affinity_pin(0);
+        loop_run(g_loops[0]);
+    }
+
+    for(index = 1; index < started; index++) {
+        loop_stop(g_loops[index]);
+        pthread_join(g_loops[index]->thread, NULL);
     }
 
-    retval = 0;
+    if(started == g_loop_count)
+        retval = 0;
 
  finish:
-    if(pbase) {
-        event_del(&evaccept);
+    hotset_deinit();
+    if(fs_started)
+        fs_deinit();
+    dirindex_deinit();
+    search_deinit();
+    pack_close();
+    gophermap_deinit();
+
+    ratelimit_deinit();
+    stats_deinit();
+    trace_deinit();
+    pace_deinit();
+    negcache_deinit();
+    response_deinit();
+    http_deinit();
+    gplus_deinit();
+    tls_deinit();
+    chunk_cache_deinit();
+
+    if(signal_set)
         event_del(&evsignal);
-    }
 
-    if(server_sockfd != -1) {
-        shutdown(server_sockfd, SHUT_RDWR);
-        close(server_sockfd);
+    for(index = g_loop_count - 1; g_loops && index >= 0; index--) {
+        if(g_loops[index]) {
+            loop_serve_deinit(g_loops[index]);
+            affinity_free(g_loops[index], sizeof(loop_t));
+        }
     }
 
+    exec_deinit();
+
     exit(retval);
 }
 
@@ -914,16 +2196,66 @@ int main(int argc, char *argv[]) {
     pid_t pid;
     int kill=0;
     int ret;
+    int cmdline_port = 0;
+    char *cmdline_base_dir = NULL;
+    char *build_pack = NULL;
+    char *cmdline_io_engine = NULL;
+    int config_required = FALSE;
 
     /* set some sane config defaults */
     memset((void*)&config, 0, sizeof(gopher_conf_t));
 
     config.port = 70;
     config.base_dir = ".";
+    config.server_name = "localhost";
     config.socket_backlog = 5;
     config.config_file = DEFAULT_CONFIGFILE;
-
-    while((option = getopt(argc, argv, "d:c:fp:s:k")) != -1) {
+    config.exec_queue = DEFAULT_EXEC_QUEUE;
+    config.proxy_max_conns = DEFAULT_PROXY_MAX_CONNS;
+    config.proxy_queue = DEFAULT_PROXY_QUEUE;
+    config.proxy_dns_ttl = DEFAULT_PROXY_DNS_TTL;
+    config.proxy_fail_ttl = DEFAULT_PROXY_FAIL_TTL;
+    config.request_timeout = DEFAULT_REQUEST_TIMEOUT;
+    config.write_timeout = DEFAULT_WRITE_TIMEOUT;
+    config.connection_timeout = DEFAULT_CONNECTION_TIMEOUT;
+    config.max_clients = DEFAULT_MAX_CLIENTS;
+    config.max_output_bytes = DEFAULT_MAX_OUTPUT_BYTES;
+    config.overload_action = DEFAULT_OVERLOAD_ACTION;
+    config.ratelimit_burst = DEFAULT_RATELIMIT_BURST;
+    config.ratelimit_slots = DEFAULT_RATELIMIT_SLOTS;
+    config.steal_margin = DEFAULT_STEAL_MARGIN;
+    config.cpu_affinity = DEFAULT_CPU_AFFINITY;
+    config.io_engine = DEFAULT_IO_ENGINE;
+    config.serve_http = DEFAULT_SERVE_HTTP;
+    config.gplus_cache_size = DEFAULT_GPLUS_CACHE_SIZE;
+    config.tls_session_cache = DEFAULT_TLS_SESSION_CACHE;
+    config.file_cache_size = DEFAULT_FILE_CACHE_SIZE;
+    config.fs_threads = DEFAULT_FS_THREADS;
+    config.negcache_size = DEFAULT_NEGCACHE_SIZE;
+    config.dir_index_path = DEFAULT_DIR_INDEX_PATH;
+    config.dir_index_threshold = DEFAULT_DIR_INDEX_THRESHOLD;
+    config.dir_page_size = DEFAULT_DIR_PAGE_SIZE;
+    config.search_index = DEFAULT_SEARCH_INDEX;
+    config.search_max_file_size = DEFAULT_SEARCH_MAX_FILE_SIZE;
+    config.search_max_results = DEFAULT_SEARCH_MAX_RESULTS;
+    config.readahead_max = DEFAULT_READAHEAD_MAX;
+    config.readahead_budget = DEFAULT_READAHEAD_BUDGET;
+    config.readahead_dontneed_size = DEFAULT_READAHEAD_DONTNEED_SIZE;
+    config.send_low_watermark = DEFAULT_SEND_LOW_WATERMARK;
+    config.send_high_watermark = DEFAULT_SEND_HIGH_WATERMARK;
+    config.trace_ring_size = DEFAULT_TRACE_RING_SIZE;
+    config.trace_slow_ms = DEFAULT_TRACE_SLOW_MS;
+    config.loop_memory_budget = DEFAULT_LOOP_MEMORY_BUDGET;
+    config.client_output_budget = DEFAULT_CLIENT_OUTPUT_BUDGET;
+    config.stats_top = DEFAULT_STATS_TOP;
+    config.stats_half_life = DEFAULT_STATS_HALF_LIFE;
+    config.hotset_file = DEFAULT_HOTSET_FILE;
+    config.hotset_size = DEFAULT_HOTSET_SIZE;
+    config.hotset_interval = DEFAULT_HOTSET_INTERVAL;
+    config.hotset_warmup_bytes = DEFAULT_HOTSET_WARMUP_BYTES;
+    config.hotset_warmup_rate = DEFAULT_HOTSET_WARMUP_RATE;
+
+    while((option = getopt(argc, argv, "d:c:fp:s:kb:e:")) != -1) {
         switch(option) {
         case 'd':
             cmdline_debug_level = atoi(optarg);
@@ -934,18 +2266,26 @@ int main(int argc, char *argv[]) {
             break;
         case 'c':
             config.config_file = optarg;
+            config_required = TRUE;
             break;
         case 'f':
             foreground = 1;
             break;
         case 'p':
-            config.port = atoi(optarg);
+            cmdline_port = atoi(optarg);
             break;
         case 's':
-            config.base_dir = optarg;
+            cmdline_base_dir = optarg;
+            break;
         case 'k':
             kill = 1;
             break;
+        case 'b':
+            build_pack = optarg;
+            break;
+        case 'e':
+            cmdline_io_engine = optarg;
+            break;
         default:
             usage_quit(argv[0]);
         }
@@ -964,14 +2304,51 @@ int main(int argc, char *argv[]) {
         exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    if((pid = daemon_pid_file_is_running()) >= 0) {
+    if(!build_pack && (pid = daemon_pid_file_is_running()) >= 0) {
         ERROR("Daemon already running as pid %u", pid);
         exit(EXIT_FAILURE);
     }
 
-    /* TODO: read the config file and verify sufficient config */
+    if(!conf_read(config.config_file, config_required)) {
+        ERROR("Error reading config file %s", config.config_file);
+        exit(EXIT_FAILURE);
+    }
+
+    /* command line wins over the config file */
+    if(cmdline_port)
+        config.port = cmdline_port;
+    if(cmdline_base_dir)
+        config.base_dir = cmdline_base_dir;
+    if(cmdline_io_engine)
+        config.io_engine = cmdline_io_engine;
+
+    if(strcasecmp(config.io_engine, "libevent") &&
+       (strcasecmp(config.io_engine, "epoll") || !edge_available())) {
+        ERROR("Unsupported io_engine \"%s\"", config.io_engine);
+        exit(EXIT_FAILURE);
+    }
+
+    if(strcasecmp(config.overload_action, "reject") &&
+       strcasecmp(config.overload_action, "pause")) {
+        ERROR("Unknown overload_action \"%s\"", config.overload_action);
+        exit(EXIT_FAILURE);
+    }
 
-    debug_level(cmdline_debug_level);
+    if(config.tls_port < 0 || config.tls_port > 65535) {
+        ERROR("Bad port for tls_port: %d", config.tls_port);
+        exit(EXIT_FAILURE);
+    }
+
+    debug_level(cmdline_debug_level ? cmdline_debug_level :
+                (config.debug_level ? config.debug_level : DEFAULT_DEBUGLEVEL));
+
+    /* build a pack, rather than serving anything */
+    if(build_pack) {
+        ret = response_init(config.server_name, config.port) &&
+            pack_build(config.base_dir, build_pack);
+        response_deinit();
+        exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
     /* daemonize, or check for background daemon */
     if(!foreground) {
@@ -999,7 +2376,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if(daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, SIGPIPE, 0) < 0) {
+    if(daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, SIGPIPE, SIGUSR1, 0) < 0) {
         ERROR("Could not set up signal handlers: %s", strerror(errno));
         goto finish;
     }
@@ -19,6 +19,7 @@
 #ifndef _MAIN_H_
 #define _MAIN_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef TRUE
@@ -31,13 +32,70 @@ typedef struct gopher_conf_t {
     char *unpriv_user;
     uint16_t port;
     char *base_dir;
+    char *server_name;    /* hostname we put in menus */
     int debug_level;
     int drop_core;
     int socket_backlog;
+    int threads;          /* event loop threads, 0 for one loop, no threads */
+    int steal_margin;     /* connections a loop may lag before helping out */
+    char *cpu_affinity;   /* loop pinning policy, see affinity.h */
+    char *io_engine;      /* "libevent" or "epoll" */
+    int serve_http;       /* answer browsers on the gopher port too */
+    char *gplus_admin;    /* Gopher+ +ADMIN contact, NULL for root@server */
+    int gplus_cache_size; /* items' attribute blocks kept, 0 disables */
+    int tls_port;         /* gophers listener, 0 for none */
+    char *tls_cert;       /* PEM certificate chain */
+    char *tls_key;        /* PEM private key */
+    int tls_session_cache; /* TLS sessions kept for resumption */
+    size_t file_cache_size;  /* file data shared between downloads */
+    size_t readahead_max;    /* deepest readahead for one download */
+    size_t readahead_budget; /* readahead across downloads, 0 disables */
+    size_t readahead_dontneed_size; /* bigger files aren't kept cached */
+    size_t send_low_watermark;  /* least queued per download */
+    size_t send_high_watermark; /* most queued per download */
+    char *hotset_file;    /* busiest selectors, kept across restarts */
+    int hotset_size;      /* selectors per snapshot, 0 disables */
+    int hotset_interval;  /* seconds between snapshots */
+    size_t hotset_warmup_bytes; /* most warmup reads after a restart */
+    size_t hotset_warmup_rate;  /* warmup bytes/sec, 0 for no limit */
+    int fs_threads;       /* threads doing filesystem lookups */
+    int negcache_size;    /* missing selectors to remember */
+    char *dir_index_path; /* where large directory indexes live */
+    int dir_index_threshold; /* entries before a directory is paged */
+    int dir_page_size;    /* menu entries per page */
+    char *search_selector;   /* where type 7 searches go, NULL disables */
+    char *search_index;   /* full text index file */
+    size_t search_max_file_size; /* bigger files aren't indexed */
+    int search_max_results;  /* matches returned per search */
+    char *pack_file;      /* serve this content pack instead of base_dir */
+    int exec_workers;     /* pooled workers for executables, 0 disables */
+    int exec_queue;       /* requests that may wait for a free worker */
+    int proxy_max_conns;  /* concurrent connections per upstream */
+    int proxy_queue;      /* requests that may wait for an upstream slot */
+    int proxy_dns_ttl;    /* seconds to trust a resolved upstream */
+    int proxy_fail_ttl;   /* seconds to fail fast after a connect error */
+    int request_timeout;  /* seconds to get a selector after accept */
+    int write_timeout;    /* seconds a response may go without progress */
+    int connection_timeout; /* seconds a connection may live at all */
+    int max_clients;      /* concurrent clients, 0 for no limit */
+    size_t max_output_bytes; /* queued output across clients, 0 for no limit */
+    char *overload_action;   /* "reject" or "pause" */
+    int ratelimit_rate;   /* connections/sec per address, 0 disables */
+    int ratelimit_burst;  /* connections an address may bank */
+    int ratelimit_slots;  /* addresses tracked at once */
+    char *stats_selector; /* where hot selectors/subnets are shown, NULL disables */
+    int stats_top;        /* entries shown of each */
+    int stats_half_life;  /* seconds for a hit to count half as much */
+    int trace_ring_size;  /* slow requests each loop remembers, 0 disables */
+    int trace_slow_ms;    /* requests this slow are remembered */
+    size_t loop_memory_budget;   /* most each loop's clients hold, 0 for no limit */
+    size_t client_output_budget; /* most one download queues, 0 for no limit */
 } gopher_conf_t;
 
 extern struct gopher_conf_t config;
 
+#define MAX_REQUEST_SIZE 4096
+
 #define UNUSED(a) { (void)(a); };
 #define MAX(a,b) ((a) > (b)) ? (a) : (b)
 #define MIN(a,b) ((a) < (b)) ? (a) : (b)
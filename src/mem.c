@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * client memory accounting and budgets.
+ *
+ * Each client is charged for itself, its request buffer, its
+ * per-request state and whatever it has queued of its own, and
+ * the charge is kept per loop, by client state.  Cached file
+ * chunks, directory menus, index pages and the pack are queued
+ * by reference and shared between clients; they're not charged
+ * to any of them.  Shared references always end a response, so
+ * a client only needs to know how long that shared tail of its
+ * output is -- whatever's queued past it is its own.
+ *
+ * Two budgets apply.  No client's file refills go past
+ * client_output_budget.  Once a loop's clients hold
+ * loop_memory_budget between them, refills drop to the
+ * minimum until it's back under; past a quarter over, the
+ * biggest clients are dropped until the loop is under budget
+ * again.  Dropping happens from the loop's own post queue,
+ * never from inside a client's callbacks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "debug.h"
+#include "loop.h"
+#include "mem.h"
+#include "plugin.h"
+
+static size_t g_mem_loop_budget = 0;
+static size_t g_mem_client_budget = 0;
+static size_t g_mem_min_refill = 0;
+
+static const char *g_mem_state_names[CLIENT_STATES] = {
+    [CLIENT_STATE_WAITING_REQUEST] = "reading request",
+    [CLIENT_STATE_WAITING_REPLY] = "waiting on reply",
+    [CLIENT_STATE_SENDING_RESPONSE] = "sending response",
+};
+
+/**
+ * set the budgets
+ *
+ * @param loop_budget most each loop's clients may hold (0 for no limit)
+ * @param client_budget most one client's refills may queue (0 for no limit)
+ * @param min_refill what refills drop to when a loop is over budget
+ */
+void mem_init(size_t loop_budget, size_t client_budget, size_t min_refill) {
+    g_mem_loop_budget = loop_budget;
+    g_mem_client_budget = client_budget;
+    g_mem_min_refill = min_refill;
+}
+
+/**
+ * set up a loop's accounting
+ *
+ * @param loop loop to account for
+ * @returns TRUE on success, FALSE otherwise
+ */
+int mem_loop_init(loop_t *loop) {
+    loop->mem = (mem_loop_t *)calloc(1, sizeof(mem_loop_t));
+    if(!loop->mem) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * free a loop's accounting
+ *
+ * @param loop loop from mem_loop_init()
+ */
+void mem_loop_deinit(loop_t *loop) {
+    if(loop->mem && loop->mem->shed)
+        INFO("Loop %d: dropped %u clients for memory, peak %zu KB", loop->id,
+             loop->mem->shed, loop->mem->peak / 1024);
+
+    free(loop->mem);
+    loop->mem = NULL;
+}
+
+/**
+ * drop the biggest clients until the loop is back under
+ * budget.  Runs from the loop's post queue.
+ */
+static void mem_shed(void *arg) {
+    loop_t *loop = (loop_t *)arg;
+    mem_loop_t *mem = loop->mem;
+    client_t *client, *biggest;
+
+    while(__atomic_load_n(&mem->total, __ATOMIC_RELAXED) > g_mem_loop_budget) {
+        /* dropping a client that holds nothing of its own frees nothing */
+        biggest = NULL;
+        for(client = mem->head; client; client = client->mem_next) {
+            if(client->mem_bytes > sizeof(client_t) + MAX_REQUEST_SIZE &&
+               (!biggest || client->mem_bytes > biggest->mem_bytes))
+                biggest = client;
+        }
+
+        if(!biggest)
+            break;
+
+        WARN("Loop %d over its memory budget (%zu KB), dropping fd %d holding %zu KB",
+             loop->id, mem->total / 1024, biggest->fd, biggest->mem_bytes / 1024);
+        mem->shed++;
+        close_client(biggest);
+    }
+
+    mem->shedding = FALSE;
+}
+
+/**
+ * start charging a new client to its loop
+ *
+ * @param client freshly accepted client
+ */
+void mem_attach(client_t *client) {
+    mem_loop_t *mem = client->loop->mem;
+
+    client->mem_prev = NULL;
+    client->mem_next = mem->head;
+    if(mem->head)
+        mem->head->mem_prev = client;
+    mem->head = client;
+
+    client->mem_bytes = 0;
+    client->mem_shared = 0;
+    client->mem_state = client->state;
+    __atomic_add_fetch(&mem->clients[client->state], 1, __ATOMIC_RELAXED);
+    mem_account(client, 0);
+}
+
+/**
+ * bring a client's charge up to date, after its output or
+ * state changed
+ *
+ * @param client client to charge
+ * @param queued bytes in its output buffer
+ */
+void mem_account(client_t *client, size_t queued) {
+    loop_t *loop = client->loop;
+    mem_loop_t *mem = loop->mem;
+    size_t bytes, total;
+
+    /* the shared tail drains last, so it's what's left longest */
+    queued -= client->mem_shared < queued ? client->mem_shared : queued;
+    bytes = sizeof(client_t) + MAX_REQUEST_SIZE + client->opaque_bytes + queued;
+
+    __atomic_sub_fetch(&mem->bytes[client->mem_state], client->mem_bytes, __ATOMIC_RELAXED);
+    if(client->mem_state != client->state) {
+        __atomic_sub_fetch(&mem->clients[client->mem_state], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mem->clients[client->state], 1, __ATOMIC_RELAXED);
+        client->mem_state = client->state;
+    }
+    __atomic_add_fetch(&mem->bytes[client->mem_state], bytes, __ATOMIC_RELAXED);
+
+    total = mem->total - client->mem_bytes + bytes;
+    __atomic_store_n(&mem->total, total, __ATOMIC_RELAXED);
+    client->mem_bytes = bytes;
+
+    if(total > mem->peak)
+        mem->peak = total;
+
+    if(g_mem_loop_budget && total > g_mem_loop_budget + g_mem_loop_budget / 4 &&
+       !mem->shedding) {
+        mem->shedding = TRUE;
+        if(!loop_post(loop, mem_shed, loop))
+            mem->shedding = FALSE;
+    }
+}
+
+/**
+ * note that what was just added to a client's output is a
+ * reference to shared memory, and take it back off its charge
+ *
+ * @param client client whose output it went on
+ * @param bytes length of the reference
+ * @param queued bytes in its output buffer, reference included
+ */
+void mem_shared(client_t *client, size_t bytes, size_t queued) {
+    client->mem_shared += bytes;
+    mem_account(client, queued);
+}
+
+/**
+ * stop charging a client that's closing
+ *
+ * @param client client being closed
+ */
+void mem_detach(client_t *client) {
+    mem_loop_t *mem = client->loop->mem;
+
+    if(client->mem_prev)
+        client->mem_prev->mem_next = client->mem_next;
+    else
+        mem->head = client->mem_next;
+    if(client->mem_next)
+        client->mem_next->mem_prev = client->mem_prev;
+
+    __atomic_sub_fetch(&mem->bytes[client->mem_state], client->mem_bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem->clients[client->mem_state], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&mem->total, mem->total - client->mem_bytes, __ATOMIC_RELAXED);
+    client->mem_bytes = 0;
+}
+
+/**
+ * how much a file refill may queue, given the budgets
+ *
+ * @param client client being refilled
+ * @param target what pacing would like queued
+ * @returns what it gets
+ */
+size_t mem_refill_limit(client_t *client, size_t target) {
+    if(g_mem_client_budget && target > g_mem_client_budget)
+        target = g_mem_client_budget;
+
+    if(g_mem_loop_budget && client->loop->mem->total >= g_mem_loop_budget &&
+       target > g_mem_min_refill)
+        target = g_mem_min_refill;
+
+    return target;
+}
+
+/**
+ * render memory by client state, across loops, as menu info
+ * lines
+ *
+ * @param output buffer to render into
+ */
+void mem_render(struct evbuffer *output) {
+    size_t bytes, total = 0;
+    unsigned int shed = 0;
+    int state, index, clients;
+
+    evbuffer_add_printf(output, "iClient memory by state (budget %zu KB per loop)\t\t\t\n\r",
+                        g_mem_loop_budget / 1024);
+
+    for(state = 0; state < CLIENT_STATES; state++) {
+        bytes = 0;
+        clients = 0;
+        for(index = 0; index < g_loop_count; index++) {
+            bytes += __atomic_load_n(&g_loops[index]->mem->bytes[state], __ATOMIC_RELAXED);
+            clients += __atomic_load_n(&g_loops[index]->mem->clients[state], __ATOMIC_RELAXED);
+        }
+        total += bytes;
+        evbuffer_add_printf(output, "i%10zu KB  %d %s\t\t\t\n\r", bytes / 1024,
+                            clients, g_mem_state_names[state]);
+    }
+
+    for(index = 0; index < g_loop_count; index++)
+        shed += __atomic_load_n(&g_loops[index]->mem->shed, __ATOMIC_RELAXED);
+
+    evbuffer_add_printf(output, "i%10zu KB  total, %u clients dropped for memory\t\t\t\n\r",
+                        total / 1024, shed);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stddef.h>
+
+#include <event.h>
+
+#include "loop.h"
+#include "plugin.h"
+
+/* what a loop's clients are holding, by client state */
+typedef struct mem_loop_t {
+    size_t bytes[CLIENT_STATES];     /* read by other loops */
+    int clients[CLIENT_STATES];
+    size_t total;
+    size_t peak;
+    unsigned int shed;               /* clients dropped for memory */
+    int shedding;                    /* a shed is already posted */
+    client_t *head;                  /* every client, for shedding */
+} mem_loop_t;
+
+extern void mem_init(size_t loop_budget, size_t client_budget, size_t min_refill);
+extern int mem_loop_init(loop_t *loop);
+extern void mem_loop_deinit(loop_t *loop);
+extern void mem_attach(client_t *client);
+extern void mem_account(client_t *client, size_t queued);
+extern void mem_shared(client_t *client, size_t bytes, size_t queued);
+extern void mem_detach(client_t *client);
+extern size_t mem_refill_limit(client_t *client, size_t target);
+extern void mem_render(struct evbuffer *output);
+
+#endif /* _MEM_H_ */
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * remembers selectors that didn't exist, so scanners probing
+ * for junk don't cost us a filesystem lookup every time.
+ *
+ * A Bloom filter sits in front of an exact set: most requests
+ * for real files never get past the filter, and a filter hit
+ * is confirmed in the set.  The set holds a fixed number of
+ * entries, oldest going first.  Each entry is tied to an
+ * inotify watch on the deepest directory of its path that does
+ * exist; anything being created (or moved) in that directory
+ * drops every entry tied to it.  The filter can't forget, so
+ * it is rebuilt from the set once enough entries have gone.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "negcache.h"
+
+#define NEGCACHE_BLOOM_BITS 16   /* per entry */
+#define NEGCACHE_BLOOM_HASHES 4
+#define NEGCACHE_WATCH_BUCKETS 256
+#define NEGCACHE_WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | \
+                             IN_MOVE_SELF | IN_ONLYDIR)
+
+struct negcache_watch_t;
+
+typedef struct negcache_entry_t {
+    char *selector;
+    uint64_t hash;
+    struct negcache_watch_t *watch;
+    struct negcache_entry_t *hash_next;
+    struct negcache_entry_t *watch_next;
+    struct negcache_entry_t *watch_prev;
+    int slot;                        /* in the age ring */
+} negcache_entry_t;
+
+typedef struct negcache_watch_t {
+    int wd;
+    uint32_t gen;                    /* bumped on every invalidation */
+    negcache_entry_t *entries;
+    struct negcache_watch_t *next;
+} negcache_watch_t;
+
+static pthread_mutex_t g_negcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *g_negcache_bloom = NULL;
+static uint64_t g_negcache_bloom_bits = 0;
+static negcache_entry_t **g_negcache_hash = NULL;
+static negcache_entry_t **g_negcache_ring = NULL;   /* entries by age */
+static int g_negcache_size = 0;
+static int g_negcache_next = 0;                     /* next ring slot */
+static int g_negcache_dropped = 0;                  /* since last rebuild */
+static negcache_watch_t *g_negcache_watches[NEGCACHE_WATCH_BUCKETS];
+static int g_negcache_fd = -1;
+static struct event g_negcache_ev;
+
+static uint64_t negcache_hash(char *selector) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*selector) {
+        hash ^= (unsigned char)*selector++;
+        hash *= 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* double hashing: bit i is h1 + i * h2 */
+#define BLOOM_BIT(hash, i) \
+    (((uint32_t)(hash) + (i) * (uint32_t)((hash) >> 32 | 1)) % g_negcache_bloom_bits)
+
+static void negcache_bloom_set(uint64_t hash) {
+    uint64_t bit;
+    int i;
+
+    for(i = 0; i < NEGCACHE_BLOOM_HASHES; i++) {
+        bit = BLOOM_BIT(hash, i);
+        __atomic_or_fetch(&g_negcache_bloom[bit / 64], 1ULL << (bit % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+static int negcache_bloom_test(uint64_t hash) {
+    uint64_t bit;
+    int i;
+
+    for(i = 0; i < NEGCACHE_BLOOM_HASHES; i++) {
+        bit = BLOOM_BIT(hash, i);
+        if(!(__atomic_load_n(&g_negcache_bloom[bit / 64], __ATOMIC_RELAXED) &
+             (1ULL << (bit % 64))))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * rebuild the filter from what's still in the set.  Called
+ * with the lock held.  Readers may see a false negative while
+ * this runs, which just costs them a real lookup.
+ */
+static void negcache_bloom_rebuild(void) {
+    int index;
+
+    memset(g_negcache_bloom, 0, g_negcache_bloom_bits / 8);
+    for(index = 0; index < g_negcache_size; index++) {
+        if(g_negcache_ring[index])
+            negcache_bloom_set(g_negcache_ring[index]->hash);
+    }
+
+    g_negcache_dropped = 0;
+}
+
+static negcache_watch_t *negcache_watch_find(int wd) {
+    negcache_watch_t *watch;
+
+    for(watch = g_negcache_watches[wd % NEGCACHE_WATCH_BUCKETS]; watch; watch = watch->next) {
+        if(watch->wd == wd)
+            return watch;
+    }
+
+    return NULL;
+}
+
+/**
+ * drop an entry.  Called with the lock held.
+ */
+static void negcache_remove(negcache_entry_t *entry) {
+    negcache_entry_t **pe;
+
+    for(pe = &g_negcache_hash[entry->hash % g_negcache_size]; *pe; pe = &(*pe)->hash_next) {
+        if(*pe == entry) {
+            *pe = entry->hash_next;
+            break;
+        }
+    }
+
+    if(entry->watch_prev)
+        entry->watch_prev->watch_next = entry->watch_next;
+    else
+        entry->watch->entries = entry->watch_next;
+    if(entry->watch_next)
+        entry->watch_next->watch_prev = entry->watch_prev;
+
+    g_negcache_ring[entry->slot] = NULL;
+
+    if(++g_negcache_dropped > g_negcache_size / 2)
+        negcache_bloom_rebuild();
+
+    free(entry->selector);
+    free(entry);
+}
+
+/**
+ * forget a watch and everything tied to it.  Called with the
+ * lock held.
+ *
+ * @param rm whether the kernel still has the watch
+ */
+static void negcache_watch_free(negcache_watch_t *watch, int rm) {
+    negcache_watch_t **pw;
+
+    watch->gen++;
+    while(watch->entries)
+        negcache_remove(watch->entries);
+
+    for(pw = &g_negcache_watches[watch->wd % NEGCACHE_WATCH_BUCKETS]; *pw; pw = &(*pw)->next) {
+        if(*pw == watch) {
+            *pw = watch->next;
+            break;
+        }
+    }
+
+    if(rm)
+        inotify_rm_watch(g_negcache_fd, watch->wd);
+    free(watch);
+}
+
+/**
+ * drop every entry and watch.  Called with the lock held.
+ */
+static void negcache_clear(void) {
+    negcache_watch_t *watch;
+    int index;
+
+    for(index = 0; index < NEGCACHE_WATCH_BUCKETS; index++) {
+        while((watch = g_negcache_watches[index]))
+            negcache_watch_free(watch, TRUE);
+    }
+}
+
+/**
+ * something appeared in a watched directory (or the directory
+ * itself went away)
+ */
+static void on_negcache_event(int fd, short event, void *arg) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    negcache_watch_t *watch;
+    ssize_t len;
+    char *p;
+
+    while((len = read(fd, buffer, sizeof(buffer))) > 0) {
+        pthread_mutex_lock(&g_negcache_lock);
+
+        for(p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *)p;
+
+            if(ev->mask & IN_Q_OVERFLOW) {
+                /* lost track, start over */
+                negcache_clear();
+                continue;
+            }
+
+            /* no point keeping an empty watch around */
+            if((watch = negcache_watch_find(ev->wd)))
+                negcache_watch_free(watch, !(ev->mask & IN_IGNORED));
+        }
+
+        pthread_mutex_unlock(&g_negcache_lock);
+    }
+}
+
+/**
+ * set up the cache.  Must be called after the event base
+ * is set up.
+ *
+ * @param entries selectors to remember (0 disables)
+ * @param base event base to watch for changes on
+ * @returns TRUE on success, FALSE otherwise
+ */
+int negcache_init(int entries, struct event_base *base) {
+    if(entries <= 0)
+        return TRUE;
+
+    g_negcache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(g_negcache_fd == -1) {
+        WARN("Cannot watch for new files (%s), not caching misses", strerror(errno));
+        return TRUE;
+    }
+
+    g_negcache_size = entries;
+    g_negcache_bloom_bits = ((uint64_t)entries * NEGCACHE_BLOOM_BITS + 63) & ~63ULL;
+    g_negcache_bloom = (uint64_t *)calloc(g_negcache_bloom_bits / 64, sizeof(uint64_t));
+    g_negcache_hash = (negcache_entry_t **)calloc(entries, sizeof(negcache_entry_t *));
+    g_negcache_ring = (negcache_entry_t **)calloc(entries, sizeof(negcache_entry_t *));
+
+    if(!g_negcache_bloom || !g_negcache_hash || !g_negcache_ring) {
+        ERROR("malloc");
+        negcache_deinit();
+        return FALSE;
+    }
+
+    event_set(&g_negcache_ev, g_negcache_fd, EV_READ | EV_PERSIST, on_negcache_event, NULL);
+    event_base_set(base, &g_negcache_ev);
+    event_add(&g_negcache_ev, NULL);
+    return TRUE;
+}
+
+/**
+ * tear down the cache
+ */
+void negcache_deinit(void) {
+    if(g_negcache_fd == -1)
+        return;
+
+    event_del(&g_negcache_ev);
+
+    pthread_mutex_lock(&g_negcache_lock);
+    negcache_clear();
+
+    free(g_negcache_bloom);
+    free(g_negcache_hash);
+    free(g_negcache_ring);
+    g_negcache_bloom = NULL;
+    g_negcache_hash = NULL;
+    g_negcache_ring = NULL;
+    g_negcache_size = 0;
+    pthread_mutex_unlock(&g_negcache_lock);
+
+    close(g_negcache_fd);
+    g_negcache_fd = -1;
+}
+
+/**
+ * is this a selector we know doesn't exist?
+ *
+ * @param selector client selector
+ * @returns TRUE if it is known not to exist
+ */
+int negcache_check(char *selector) {
+    negcache_entry_t *entry;
+    uint64_t hash;
+    int found = FALSE;
+
+    if(!g_negcache_size)
+        return FALSE;
+
+    hash = negcache_hash(selector);
+    if(!negcache_bloom_test(hash))
+        return FALSE;
+
+    pthread_mutex_lock(&g_negcache_lock);
+    for(entry = g_negcache_hash[hash % g_negcache_size]; entry; entry = entry->hash_next) {
+        if(entry->hash == hash && !strcmp(entry->selector, selector)) {
+            found = TRUE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_negcache_lock);
+
+    return found;
+}
+
+/**
+ * remember that a selector doesn't exist.  Called from the
+ * lookup threads, right after a stat() came back ENOENT.
+ *
+ * @param selector client selector
+ * @param full_path path it maps to
+ */
+void negcache_add(char *selector, char *full_path) {
+    negcache_entry_t *entry, *old;
+    negcache_watch_t *watch, *old_watch;
+    char dir[PATH_MAX];
+    struct stat st;
+    uint32_t gen;
+    char *slash;
+    int wd = -1;
+
+    if(!g_negcache_size || strlen(full_path) >= sizeof(dir))
+        return;
+
+    /* watch the deepest directory that's actually there */
+    strcpy(dir, full_path);
+    while((slash = strrchr(dir, '/'))) {
+        *slash = '\0';
+        wd = inotify_add_watch(g_negcache_fd, *dir ? dir : "/", NEGCACHE_WATCH_MASK);
+        if(wd != -1 || (errno != ENOENT && errno != ENOTDIR))
+            break;
+    }
+
+    if(wd == -1)
+        return;
+
+    pthread_mutex_lock(&g_negcache_lock);
+    if(!(watch = negcache_watch_find(wd))) {
+        watch = (negcache_watch_t *)calloc(1, sizeof(negcache_watch_t));
+        if(!watch) {
+            pthread_mutex_unlock(&g_negcache_lock);
+            return;
+        }
+
+        watch->wd = wd;
+        watch->next = g_negcache_watches[wd % NEGCACHE_WATCH_BUCKETS];
+        g_negcache_watches[wd % NEGCACHE_WATCH_BUCKETS] = watch;
+    }
+    gen = watch->gen;
+    pthread_mutex_unlock(&g_negcache_lock);
+
+    /* it may have turned up before the watch was in place */
+    entry = NULL;
+    if(stat(full_path, &st) == -1 && errno == ENOENT) {
+        entry = (negcache_entry_t *)calloc(1, sizeof(negcache_entry_t));
+        if(entry && !(entry->selector = strdup(selector))) {
+            free(entry);
+            entry = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&g_negcache_lock);
+
+    /* make sure nothing happened while we weren't looking */
+    if(!entry || !(watch = negcache_watch_find(wd)) || watch->gen != gen) {
+        if(!entry && (watch = negcache_watch_find(wd)) && !watch->entries)
+            negcache_watch_free(watch, TRUE);
+        pthread_mutex_unlock(&g_negcache_lock);
+        if(entry) {
+            free(entry->selector);
+            free(entry);
+        }
+        return;
+    }
+
+    entry->hash = negcache_hash(selector);
+
+    if((old = g_negcache_ring[g_negcache_next])) {
+        old_watch = old->watch;
+        negcache_remove(old);
+        if(old_watch != watch && !old_watch->entries)
+            negcache_watch_free(old_watch, TRUE);
+    }
+
+    entry->slot = g_negcache_next;
+    g_negcache_ring[entry->slot] = entry;
+    g_negcache_next = (g_negcache_next + 1) % g_negcache_size;
+
+    entry->watch = watch;
+    entry->watch_next = watch->entries;
+    if(watch->entries)
+        watch->entries->watch_prev = entry;
+    watch->entries = entry;
+
+    entry->hash_next = g_negcache_hash[entry->hash % g_negcache_size];
+    g_negcache_hash[entry->hash % g_negcache_size] = entry;
+
+    negcache_bloom_set(entry->hash);
+    pthread_mutex_unlock(&g_negcache_lock);
+}
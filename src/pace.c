@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * send sizing for file streaming.
+ *
+ * Sockets streaming files get TCP_NOTSENT_LOWAT set to
+ * send_low_watermark, so the kernel only holds about that much
+ * unsent data and the rest waits in our output buffer, where
+ * it's just references to shared chunks.
+ *
+ * How much we keep queued follows how fast the connection
+ * really delivers: each refill works out what has left the
+ * socket (queued, less what's still in our buffer or the
+ * kernel's) and sizes the queue to cover PACE_HORIZON_MS at
+ * that rate, between send_low_watermark and send_high_watermark,
+ * at most doubling per refill.
+ * A refill that finds both our buffer and the kernel's empty
+ * means the link sat idle waiting for us -- that's a stall,
+ * and the queue doubles straight away.  Stalls against refills
+ * is how well we're keeping up, and the stats selector shows
+ * it along with how many downloads never stalled at all.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+
+#include "main.h"
+#include "debug.h"
+#include "chunk.h"
+#include "pace.h"
+
+#define PACE_HORIZON_MS 200
+#define PACE_MIN_SAMPLE_US 10000
+
+static size_t g_pace_low = 0;
+static size_t g_pace_high = 0;
+
+/* totals across connections, for stats and the shutdown summary */
+static uint64_t g_pace_refills = 0;
+static uint64_t g_pace_stalls = 0;
+static uint64_t g_pace_streams = 0;       /* downloads finished */
+static uint64_t g_pace_steady = 0;        /* ...without a single stall */
+static uint64_t g_pace_delivered = 0;     /* bytes they delivered */
+static uint64_t g_pace_rate_total = 0;    /* their final rates, summed */
+
+static uint64_t pace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * round up to whole chunks, which is what we queue in
+ */
+static size_t pace_round(size_t bytes) {
+    return (bytes + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+}
+
+/**
+ * set the limits
+ *
+ * @param low least to queue, and most for the kernel to hold unsent
+ * @param high most to queue for one connection
+ */
+void pace_init(size_t low, size_t high) {
+    g_pace_low = pace_round(low ? low : CHUNK_SIZE);
+    g_pace_high = pace_round(high);
+    if(g_pace_high < g_pace_low)
+        g_pace_high = g_pace_low;
+}
+
+/**
+ * report how well refills kept up
+ */
+void pace_deinit(void) {
+    uint64_t refills = __atomic_load_n(&g_pace_refills, __ATOMIC_RELAXED);
+    uint64_t stalls = __atomic_load_n(&g_pace_stalls, __ATOMIC_RELAXED);
+
+    if(refills)
+        INFO("Send pacing: %llu refills, %llu stalled (%llu%%)",
+             (unsigned long long)refills, (unsigned long long)stalls,
+             (unsigned long long)(stalls * 100 / refills));
+}
+
+/**
+ * a connection is starting to stream
+ *
+ * @param pace connection state to set up
+ * @param fd client socket
+ */
+void pace_start(pace_t *pace, int fd) {
+#ifdef TCP_NOTSENT_LOWAT
+    int lowat = (int)g_pace_low;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                  &lowat, sizeof(lowat)) < 0 && errno != EOPNOTSUPP &&
+       errno != ENOPROTOOPT)
+        DEBUG("Can't set TCP_NOTSENT_LOWAT on fd %d: %s", fd, strerror(errno));
+#endif
+
+    memset(pace, 0, sizeof(pace_t));
+    pace->target = g_pace_low;
+    pace->last_us = pace_now();
+}
+
+/**
+ * how much of what we've written the kernel still holds
+ *
+ * @param fd client socket
+ * @param unsent set to bytes not yet sent at all
+ * @returns bytes not yet acknowledged (sent or not)
+ */
+static size_t pace_kernel_queue(int fd, size_t *unsent) {
+    int bytes = 0;
+
+    *unsent = 0;
+
+#ifdef SIOCOUTQNSD
+    if(ioctl(fd, SIOCOUTQNSD, &bytes) == 0 && bytes > 0)
+        *unsent = bytes;
+#endif
+#ifdef SIOCOUTQ
+    if(ioctl(fd, SIOCOUTQ, &bytes) == 0 && bytes > 0)
+        return bytes;
+#endif
+
+    return *unsent;
+}
+
+/**
+ * the output buffer is running low -- work out how full to
+ * top it up to
+ *
+ * @param pace connection state
+ * @param fd client socket
+ * @param queued bytes still in the output buffer
+ * @returns bytes the output buffer should hold after refilling
+ */
+size_t pace_refill(pace_t *pace, int fd, size_t queued) {
+    uint64_t now = pace_now();
+    uint64_t elapsed = now - pace->last_us;
+    uint64_t delivered, sample, want;
+    size_t held, unsent;
+
+    held = queued + pace_kernel_queue(fd, &unsent);
+    delivered = pace->added > held ? pace->added - held : 0;
+
+    if(!pace->refills++) {
+        /* nothing to go on yet */
+        pace->delivered = delivered;
+        pace->last_us = now;
+        __atomic_add_fetch(&g_pace_refills, 1, __ATOMIC_RELAXED);
+        return pace->target;
+    }
+
+    __atomic_add_fetch(&g_pace_refills, 1, __ATOMIC_RELAXED);
+
+    /* what the socket buffer soaked up doesn't count -- only
+     * what actually got to the other end */
+    if(delivered > pace->delivered && elapsed >= PACE_MIN_SAMPLE_US) {
+        sample = (delivered - pace->delivered) * 1000000 / elapsed;
+        pace->rate = pace->rate ? (pace->rate * 3 + sample) / 4 : sample;
+        pace->delivered = delivered;
+        pace->last_us = now;
+    }
+
+    want = pace->rate * PACE_HORIZON_MS / 1000;
+
+    /* grow gradually, however good the estimate looks */
+    if(want > (uint64_t)pace->target * 2)
+        want = (uint64_t)pace->target * 2;
+
+    if(!queued && !unsent) {
+        /* the link went idle waiting on us */
+        pace->stalls++;
+        __atomic_add_fetch(&g_pace_stalls, 1, __ATOMIC_RELAXED);
+        want = (uint64_t)pace->target * 2;
+    }
+
+    if(want < g_pace_low)
+        want = g_pace_low;
+    if(want > g_pace_high)
+        want = g_pace_high;
+
+    pace->target = pace_round((size_t)want);
+    return pace->target;
+}
+
+/**
+ * a refill is done
+ *
+ * @param pace connection state
+ * @param added bytes it queued
+ */
+void pace_filled(pace_t *pace, size_t added) {
+    pace->added += added;
+}
+
+/**
+ * a connection is done streaming
+ *
+ * @param pace connection state
+ * @param fd client socket
+ */
+void pace_stop(pace_t *pace, int fd) {
+    if(!pace->refills)
+        return;
+
+    __atomic_add_fetch(&g_pace_streams, 1, __ATOMIC_RELAXED);
+    if(!pace->stalls)
+        __atomic_add_fetch(&g_pace_steady, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_pace_delivered, pace->delivered, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_pace_rate_total, pace->rate, __ATOMIC_RELAXED);
+
+    DEBUG("Paced fd %d: %llu bytes delivered at %llu KB/s, "
+          "%u refills, %u stalled",
+          fd, (unsigned long long)pace->delivered,
+          (unsigned long long)(pace->rate / 1024),
+          pace->refills, pace->stalls);
+}
+
+/**
+ * render how well downloads were kept fed, as info lines for
+ * the stats menu
+ *
+ * @param output buffer to render into
+ */
+void pace_render(struct evbuffer *output) {
+    uint64_t refills = __atomic_load_n(&g_pace_refills, __ATOMIC_RELAXED);
+    uint64_t stalls = __atomic_load_n(&g_pace_stalls, __ATOMIC_RELAXED);
+    uint64_t streams = __atomic_load_n(&g_pace_streams, __ATOMIC_RELAXED);
+    uint64_t steady = __atomic_load_n(&g_pace_steady, __ATOMIC_RELAXED);
+    uint64_t delivered = __atomic_load_n(&g_pace_delivered, __ATOMIC_RELAXED);
+    uint64_t rate_total = __atomic_load_n(&g_pace_rate_total, __ATOMIC_RELAXED);
+
+    evbuffer_add_printf(output, "iSend pacing (queue %zu KB to %zu KB)\t\t\t\n\r",
+                        g_pace_low / 1024, g_pace_high / 1024);
+    evbuffer_add_printf(output, "i%10llu refills, %llu stalled (%llu%%)\t\t\t\n\r",
+                        (unsigned long long)refills, (unsigned long long)stalls,
+                        (unsigned long long)(refills ? stalls * 100 / refills : 0));
+    evbuffer_add_printf(output, "i%10llu downloads, %llu kept pace (%llu%%)\t\t\t\n\r",
+                        (unsigned long long)streams, (unsigned long long)steady,
+                        (unsigned long long)(streams ? steady * 100 / streams : 0));
+    evbuffer_add_printf(output, "i%10llu KB delivered, %llu KB/s average rate\t\t\t\n\r",
+                        (unsigned long long)(delivered / 1024),
+                        (unsigned long long)(streams ? rate_total / streams / 1024 : 0));
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _PACE_H_
+#define _PACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event.h>
+
+/* per connection send sizing */
+typedef struct pace_t {
+    size_t target;           /* bytes to keep queued */
+    uint64_t added;          /* queued so far */
+    uint64_t delivered;      /* out of the socket as of the last refill */
+    uint64_t last_us;        /* when that was */
+    uint64_t rate;           /* smoothed delivery rate, bytes/sec */
+    unsigned int refills;
+    unsigned int stalls;     /* refills that found the link idle */
+} pace_t;
+
+extern void pace_init(size_t low, size_t high);
+extern void pace_deinit(void);
+extern void pace_start(pace_t *pace, int fd);
+extern size_t pace_refill(pace_t *pace, int fd, size_t queued);
+extern void pace_filled(pace_t *pace, size_t added);
+extern void pace_stop(pace_t *pace, int fd);
+extern void pace_render(struct evbuffer *output);
+
+#endif /* _PACE_H_ */
@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * content packs: a whole served tree in one read-only file,
+ * for static mirrors.
+ *
+ * "evgopherd -b <file>" walks base_dir into a pack: a header,
+ * a table of every selector sorted by name, the selector
+ * strings, then the body of every entry -- file contents, or
+ * the rendered menu (or gophermap) for a directory -- each
+ * starting on a page boundary so it can go out with sendfile().
+ *
+ * With pack_file set, the server maps the pack at startup and
+ * resolves selectors by binary search over the table.  Nothing
+ * under base_dir is touched while serving.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <event.h>
+#include <event2/buffer.h>
+
+#include "main.h"
+#include "debug.h"
+#include "gophermap.h"
+#include "pack.h"
+#include "response.h"
+
+#define PACK_MAGIC "EGPACK1"
+#define PACK_ALIGN 4096
+
+typedef struct pack_header_t {
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t pad;
+    uint64_t entries_off;
+    uint64_t strings_off;
+    uint64_t size;
+} pack_header_t;
+
+/* what the builder collects before writing */
+typedef struct pack_item_t {
+    char *selector;
+    int type;
+    char *path;              /* files */
+    off_t size;
+    struct evbuffer *menu;   /* directories */
+} pack_item_t;
+
+typedef struct pack_build_t {
+    pack_item_t *items;
+    size_t count;
+    size_t size;
+    int failed;
+} pack_build_t;
+
+static int g_pack_fd = -1;
+static void *g_pack_map = NULL;
+static size_t g_pack_len = 0;
+static const pack_header_t *g_pack_header = NULL;
+static const pack_entry_t *g_pack_entries = NULL;
+
+static int pack_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int pack_item_cmp(const void *a, const void *b) {
+    return strcmp(((const pack_item_t *)a)->selector, ((const pack_item_t *)b)->selector);
+}
+
+static pack_item_t *pack_item_new(pack_build_t *build, char *selector, int type) {
+    pack_item_t *grown, *item;
+
+    if(build->count == build->size) {
+        build->size = build->size ? build->size * 2 : 256;
+        grown = (pack_item_t *)realloc(build->items, build->size * sizeof(pack_item_t));
+        if(!grown) {
+            build->failed = TRUE;
+            return NULL;
+        }
+        build->items = grown;
+    }
+
+    item = &build->items[build->count];
+    memset(item, 0, sizeof(pack_item_t));
+    if(!(item->selector = strdup(selector))) {
+        build->failed = TRUE;
+        return NULL;
+    }
+
+    item->type = type;
+    build->count++;
+    return item;
+}
+
+/**
+ * add a directory and everything under it.  Symlinks to
+ * files are followed, symlinks to directories aren't.
+ */
+static void pack_walk(pack_build_t *build, char *path, char *selector) {
+    char child_path[PATH_MAX], child_sel[PATH_MAX];
+    char **names = NULL, **grown;
+    size_t count = 0, size = 0, index, tail_len;
+    pack_item_t *item;
+    struct dirent *de;
+    struct stat st;
+    const char *tail;
+    DIR *dir;
+
+    if(!(dir = opendir(path))) {
+        WARN("Cannot read %s: %s", path, strerror(errno));
+        return;
+    }
+
+    while((de = readdir(dir))) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        if(count == size) {
+            size = size ? size * 2 : 64;
+            if(!(grown = (char **)realloc(names, size * sizeof(char *))))
+                break;
+            names = grown;
+        }
+
+        if(!(names[count] = strdup(de->d_name)))
+            break;
+        count++;
+    }
+    closedir(dir);
+
+    if(de)
+        build->failed = TRUE;
+
+    qsort(names, count, sizeof(char *), pack_name_cmp);
+
+    tail = response_menu_tail(&tail_len);
+    if((item = pack_item_new(build, *selector ? selector : "/", PACK_DIR)) &&
+       !(item->menu = evbuffer_new()))
+        build->failed = TRUE;
+
+    /* a gophermap stands in for the listing */
+    if(item && item->menu && gophermap_render(path, item->menu))
+        item = NULL;
+
+    /* full selectors -- pack_lookup only knows "/a/b" */
+    for(index = 0; index < count && item && item->menu; index++) {
+        /* only real directories are packed, so only they are menus */
+        if(snprintf(child_path, sizeof(child_path), "%s/%s", path, names[index]) <
+           (int)sizeof(child_path) && lstat(child_path, &st) == 0 && S_ISDIR(st.st_mode))
+            evbuffer_add(item->menu, "1", 1);
+        else
+            evbuffer_add(item->menu, "0", 1);
+        evbuffer_add(item->menu, names[index], strlen(names[index]));
+        evbuffer_add(item->menu, "\t", 1);
+        evbuffer_add(item->menu, selector, strlen(selector));
+        evbuffer_add(item->menu, "/", 1);
+        evbuffer_add(item->menu, names[index], strlen(names[index]));
+        evbuffer_add(item->menu, tail, tail_len);
+    }
+
+    for(index = 0; index < count && !build->failed; index++) {
+        if(snprintf(child_path, sizeof(child_path), "%s/%s", path, names[index]) >=
+           (int)sizeof(child_path) ||
+           snprintf(child_sel, sizeof(child_sel), "%s/%s", selector, names[index]) >=
+           (int)sizeof(child_sel))
+            continue;
+
+        if(lstat(child_path, &st) == -1)
+            continue;
+
+        if(S_ISDIR(st.st_mode)) {
+            pack_walk(build, child_path, child_sel);
+        } else if((S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) &&
+                  stat(child_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if((item = pack_item_new(build, child_sel, PACK_FILE))) {
+                item->size = st.st_size;
+                if(!(item->path = strdup(child_path)))
+                    build->failed = TRUE;
+            }
+        }
+    }
+
+    for(index = 0; index < count; index++)
+        free(names[index]);
+    free(names);
+}
+
+/**
+ * copy a file into the pack, exactly len bytes of it
+ */
+static int pack_copy(FILE *fp, char *path, off_t len) {
+    char buffer[65536];
+    ssize_t res;
+    off_t done = 0;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        WARN("Cannot read %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    while(done < len && (res = read(fd, buffer, MIN((off_t)sizeof(buffer), len - done))) > 0) {
+        fwrite(buffer, 1, res, fp);
+        done += res;
+    }
+    close(fd);
+
+    /* shrank under us -- pad it out to what the table says */
+    memset(buffer, 0, sizeof(buffer));
+    while(done < len) {
+        res = MIN((off_t)sizeof(buffer), len - done);
+        fwrite(buffer, 1, res, fp);
+        done += res;
+    }
+
+    return TRUE;
+}
+
+static void pack_pad(FILE *fp, uint64_t *pos) {
+    static const char zeros[PACK_ALIGN];
+    size_t pad = (PACK_ALIGN - (*pos % PACK_ALIGN)) % PACK_ALIGN;
+
+    fwrite(zeros, 1, pad, fp);
+    *pos += pad;
+}
+
+/**
+ * build a pack of everything under a directory
+ *
+ * @param base_dir directory to pack
+ * @param pack_file where to write it
+ * @returns TRUE on success, FALSE otherwise
+ */
+int pack_build(char *base_dir, char *pack_file) {
+    char tmp[PATH_MAX + 16], *data;
+    pack_build_t build = { 0 };
+    pack_header_t header;
+    pack_entry_t entry;
+    uint64_t pos, data_pos, strings_len = 0;
+    size_t index, len;
+    int retval = FALSE;
+    FILE *fp = NULL;
+
+    pack_walk(&build, base_dir, "");
+    if(build.failed) {
+        ERROR("Out of memory building pack");
+        goto done;
+    }
+
+    qsort(build.items, build.count, sizeof(pack_item_t), pack_item_cmp);
+
+    for(index = 0; index < build.count; index++)
+        strings_len += strlen(build.items[index].selector);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.entry_count = build.count;
+    header.entries_off = sizeof(header);
+    header.strings_off = header.entries_off + build.count * sizeof(pack_entry_t);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", pack_file, getpid());
+    if(!(fp = fopen(tmp, "w"))) {
+        ERROR("Cannot write %s: %s", tmp, strerror(errno));
+        goto done;
+    }
+
+    /* lay the bodies out after the strings, page aligned */
+    fwrite(&header, sizeof(header), 1, fp);
+    data_pos = header.strings_off + strings_len;
+    pos = header.strings_off;
+    for(index = 0; index < build.count; index++) {
+        memset(&entry, 0, sizeof(entry));
+        entry.selector_off = pos;
+        entry.selector_len = strlen(build.items[index].selector);
+        entry.type = build.items[index].type;
+        entry.data_len = build.items[index].menu ?
+            evbuffer_get_length(build.items[index].menu) : (uint64_t)build.items[index].size;
+        data_pos = (data_pos + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+        entry.data_off = data_pos;
+        data_pos += entry.data_len;
+        pos += entry.selector_len;
+        fwrite(&entry, sizeof(entry), 1, fp);
+    }
+
+    for(index = 0; index < build.count; index++)
+        fwrite(build.items[index].selector, 1, strlen(build.items[index].selector), fp);
+
+    for(index = 0; index < build.count; index++) {
+        pack_pad(fp, &pos);
+        if(build.items[index].menu) {
+            len = evbuffer_get_length(build.items[index].menu);
+            if(len && (data = (char *)evbuffer_pullup(build.items[index].menu, -1)))
+                fwrite(data, 1, len, fp);
+            pos += len;
+        } else {
+            pack_copy(fp, build.items[index].path, build.items[index].size);
+            pos += build.items[index].size;
+        }
+    }
+
+    /* the size goes last, so a truncated pack won't open */
+    header.size = pos;
+    fseeko(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    if(ferror(fp) | fclose(fp) || rename(tmp, pack_file) == -1) {
+        fp = NULL;
+        ERROR("Cannot write %s: %s", pack_file, strerror(errno));
+        unlink(tmp);
+        goto done;
+    }
+    fp = NULL;
+
+    INFO("Packed %zu selectors from %s into %s (%llu bytes)", build.count,
+         base_dir, pack_file, (unsigned long long)pos);
+    retval = TRUE;
+
+ done:
+    if(fp) {
+        fclose(fp);
+        unlink(tmp);
+    }
+
+    for(index = 0; index < build.count; index++) {
+        free(build.items[index].selector);
+        free(build.items[index].path);
+        if(build.items[index].menu)
+            evbuffer_free(build.items[index].menu);
+    }
+    free(build.items);
+    return retval;
+}
+
+/**
+ * map a pack for serving
+ *
+ * @param pack_file pack to serve
+ * @returns TRUE on success, FALSE otherwise
+ */
+int pack_open(char *pack_file) {
+    const pack_header_t *header;
+    struct stat st;
+    uint32_t index;
+
+    if((g_pack_fd = open(pack_file, O_RDONLY | O_CLOEXEC)) == -1) {
+        ERROR("Cannot open pack %s: %s", pack_file, strerror(errno));
+        return FALSE;
+    }
+
+    if(fstat(g_pack_fd, &st) == -1 || st.st_size < (off_t)sizeof(pack_header_t)) {
+        ERROR("Pack %s is truncated", pack_file);
+        pack_close();
+        return FALSE;
+    }
+
+    g_pack_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, g_pack_fd, 0);
+    if(g_pack_map == MAP_FAILED) {
+        g_pack_map = NULL;
+        ERROR("Cannot map pack %s: %s", pack_file, strerror(errno));
+        pack_close();
+        return FALSE;
+    }
+    g_pack_len = st.st_size;
+
+    header = (const pack_header_t *)g_pack_map;
+    if(memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) ||
+       header->size != (uint64_t)st.st_size ||
+       header->entries_off + (uint64_t)header->entry_count * sizeof(pack_entry_t) >
+       header->strings_off || header->strings_off > header->size) {
+        ERROR("%s is not a usable pack", pack_file);
+        pack_close();
+        return FALSE;
+    }
+
+    g_pack_header = header;
+    g_pack_entries = (const pack_entry_t *)((char *)g_pack_map + header->entries_off);
+
+    /* check once here, so lookups needn't */
+    for(index = 0; index < header->entry_count; index++) {
+        if(g_pack_entries[index].selector_off + g_pack_entries[index].selector_len > g_pack_len ||
+           g_pack_entries[index].data_off + g_pack_entries[index].data_len > g_pack_len) {
+            ERROR("%s is damaged", pack_file);
+            pack_close();
+            return FALSE;
+        }
+    }
+
+    INFO("Serving %u selectors from pack %s", header->entry_count, pack_file);
+    return TRUE;
+}
+
+/**
+ * stop serving from the pack
+ */
+void pack_close(void) {
+    if(g_pack_map)
+        munmap(g_pack_map, g_pack_len);
+    if(g_pack_fd != -1)
+        close(g_pack_fd);
+
+    g_pack_map = NULL;
+    g_pack_len = 0;
+    g_pack_fd = -1;
+    g_pack_header = NULL;
+    g_pack_entries = NULL;
+}
+
+/**
+ * are we serving from a pack?
+ */
+int pack_enabled(void) {
+    return g_pack_header != NULL;
+}
+
+/**
+ * find a selector in the pack
+ *
+ * @param selector client selector
+ * @returns its entry, or NULL if it isn't there
+ */
+const pack_entry_t *pack_lookup(char *selector) {
+    const pack_entry_t *entry;
+    uint32_t lo = 0, hi, mid;
+    size_t len;
+    int cmp;
+
+    /* the pack has "/", "/a", "/a/b" */
+    while(selector[0] == '/' && selector[1] == '/')
+        selector++;
+    len = strlen(selector);
+    while(len > 1 && selector[len - 1] == '/')
+        len--;
+
+    if(!len || selector[0] != '/')
+        return NULL;
+
+    hi = g_pack_header->entry_count;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &g_pack_entries[mid];
+
+        cmp = memcmp((char *)g_pack_map + entry->selector_off, selector,
+                     MIN(entry->selector_len, len));
+        if(!cmp)
+            cmp = (entry->selector_len > len) - (entry->selector_len < len);
+
+        if(!cmp)
+            return entry;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/**
+ * queue an entry's body, to go out with sendfile() where the
+ * platform has it
+ *
+ * @param entry entry from pack_lookup
+ * @param output buffer to add it to
+ * @returns TRUE on success, FALSE otherwise
+ */
+int pack_add(const pack_entry_t *entry, struct evbuffer *output) {
+    struct evbuffer_file_segment *seg;
+    int res;
+
+    seg = evbuffer_file_segment_new(g_pack_fd, entry->data_off, entry->data_len, 0);
+    if(!seg)
+        return FALSE;
+
+    res = evbuffer_add_file_segment(output, seg, 0, -1);
+    evbuffer_file_segment_free(seg);
+    return res == 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stdint.h>
+
+#include <event.h>
+
+#define PACK_DIR  1
+#define PACK_FILE 2
+
+/* one selector in a pack.  Offsets are from the start of the file. */
+typedef struct pack_entry_t {
+    uint64_t selector_off;
+    uint32_t selector_len;
+    uint32_t type;           /* PACK_DIR or PACK_FILE */
+    uint64_t data_off;       /* page aligned */
+    uint64_t data_len;
+} pack_entry_t;
+
+extern int pack_build(char *base_dir, char *pack_file);
+extern int pack_open(char *pack_file);
+extern void pack_close(void);
+extern int pack_enabled(void);
+extern const pack_entry_t *pack_lookup(char *selector);
+extern int pack_add(const pack_entry_t *entry, struct evbuffer *output);
+
+#endif /* _PACK_H_ */
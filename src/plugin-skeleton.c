@@ -34,5 +34,5 @@ int deinit(void) {
 
 static void handler(client_t *client, char *resource) {
     DEBUG("Handling resource %s with module %s", resource, MODULE_NAME);
-    handle_error(client, "Not implemented");
+    handle_error(client, RESPONSE_NOT_IMPLEMENTED);
 }
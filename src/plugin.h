@@ -18,6 +18,13 @@
 #ifndef _PLUGIN_H_
 #define _PLUGIN_H_
 
+#include <stdint.h>
+
+#include "loop.h"
+#include "response.h"
+#include "trace.h"
+#include "wheel.h"
+
 #ifndef TRUE
 #define TRUE 1
 #endif
@@ -30,22 +37,57 @@ typedef enum internal_type_t {
     TYPE_UNKNOWN=0,
     TYPE_DIR,
     TYPE_FILE,
+    TYPE_EXEC,
+    TYPE_PROXY,
+    TYPE_LOOKUP,
+    TYPE_PACK,
 } internal_type_t;
 
+#define CLIENT_STATE_WAITING_REQUEST  0
+#define CLIENT_STATE_WAITING_REPLY    1
+#define CLIENT_STATE_SENDING_RESPONSE 2
+#define CLIENT_STATES                 3
+
 typedef struct client_t {
     int fd;
     int state;
+    struct loop_t *loop;     /* loop that accepted us, and owns us */
     internal_type_t request_type;
     char *request;
+    char *query;             /* search string after the tab, if any */
+    int page;                /* N from "dir/?page=N", 0 if not paged */
     char *full_path;
     struct bufferevent *buf_ev;
+    struct evbuffer *output;     /* response queue, without a buf_ev */
+    unsigned int edge_flags;     /* edge engine state */
+    size_t edge_lowat;           /* write callback once output is this low */
+    struct client_t *edge_prev;  /* edge engine ready list */
+    struct client_t *edge_next;
     void *opaque_client;
+    void *tls;                   /* TLS connection, from tls_port */
+    struct http_t *http;         /* browser state, NULL for gopher */
+    int gplus;                   /* Gopher+ request kind, see gplus.h */
+    uint64_t subnet;             /* peer's /24 or /48, see stats.c */
+    trace_t trace;               /* when each phase happened */
+    size_t opaque_bytes;         /* size of opaque_client */
+    size_t mem_bytes;            /* accounted to the loop, see mem.c */
+    size_t mem_shared;           /* shared references ending its output */
+    int mem_state;               /* state it's accounted under */
+    struct client_t *mem_prev;   /* every client on the loop */
+    struct client_t *mem_next;
+    wheel_timer_t io_timer;      /* request read, then write stall */
+    wheel_timer_t life_timer;    /* whole connection */
 } client_t;
 
 extern int register_module(char *name,
                            void (*dispatch_fn)(client_t *client,
                                                char *resource));
 
-extern void handle_error(client_t *client, internal_type_t type, char *text);
+extern void handle_error(client_t *client, response_id_t id);
+extern void close_client(client_t *client);
+extern void client_finish(client_t *client);
+extern int client_can_splice(client_t *client);
+extern void client_splice_begin(client_t *client);
+extern void client_progress(client_t *client);
 
 #endif /* _PLUGIN_H_ */
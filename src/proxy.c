@@ -0,0 +1,587 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <event.h>
+#include <event2/dns.h>
+
+#include "main.h"
+#include "debug.h"
+#include "epoch.h"
+#include "loop.h"
+#include "plugin.h"
+#include "relay.h"
+#include "proxy.h"
+
+#define MAX_PROXY_ROUTES 32
+
+struct opaque_proxy_t;
+
+/* a resolved upstream address.  Shared by all loops, and
+ * never changed once published -- a fresh resolution
+ * replaces it, and the old one is freed by epoch. */
+typedef struct proxy_addr_t {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    time_t expires;
+} proxy_addr_t;
+
+/* one upstream gopher hole, and what every loop knows about it */
+typedef struct proxy_route_t {
+    char *prefix;
+    size_t prefix_len;
+    char *host;
+    char *port;
+
+    proxy_addr_t *addr;              /* cached resolution */
+    time_t fail_until;               /* cached connect failure */
+} proxy_route_t;
+
+/* what one loop is doing with a route */
+typedef struct proxy_target_t {
+    proxy_route_t *route;
+    struct proxy_loop_t *pl;
+    int resolving;
+
+    int active;                      /* open upstream connections */
+    int queue_len;
+    struct opaque_proxy_t *queue_head;
+    struct opaque_proxy_t *queue_tail;
+} proxy_target_t;
+
+typedef struct proxy_loop_t {
+    loop_t *loop;
+    struct evdns_base *dns;
+    int max_conns;                   /* our share of proxy_max_conns */
+    proxy_target_t targets[MAX_PROXY_ROUTES];
+} proxy_loop_t;
+
+typedef struct opaque_proxy_t {
+    client_t *client;
+    proxy_target_t *target;
+    int fd;                          /* upstream socket */
+    int queued;
+    struct event ev;                 /* connect completion */
+    relay_t *relay;                  /* upstream -> client */
+    struct opaque_proxy_t *next;     /* target wait queue */
+} opaque_proxy_t;
+
+static proxy_route_t g_proxy_routes[MAX_PROXY_ROUTES];
+static int g_proxy_route_count = 0;
+
+static void proxy_target_run(proxy_target_t *target);
+
+/**
+ * add a route from a "proxy = <prefix> <host>:<port>"
+ * config line
+ *
+ * @param value config value
+ * @returns TRUE on success, FALSE otherwise
+ */
+int proxy_conf(char *value) {
+    proxy_route_t *route;
+    char prefix[MAX_REQUEST_SIZE];
+    char hostport[MAX_REQUEST_SIZE];
+    char *colon;
+
+    if(g_proxy_route_count == MAX_PROXY_ROUTES) {
+        ERROR("Too many proxy routes (max %d)", MAX_PROXY_ROUTES);
+        return FALSE;
+    }
+
+    if(sscanf(value, "%4095s %4095s", prefix, hostport) != 2 ||
+       !(colon = strrchr(hostport, ':')) || colon == hostport || !colon[1]) {
+        ERROR("Proxy route should be '<prefix> <host>:<port>': %s", value);
+        return FALSE;
+    }
+
+    *colon = '\0';
+
+    route = &g_proxy_routes[g_proxy_route_count];
+    memset(route, 0, sizeof(proxy_route_t));
+
+    route->prefix = strdup(prefix);
+    route->prefix_len = strlen(prefix);
+    route->host = strdup(hostport);
+    route->port = strdup(colon + 1);
+
+    if(!route->prefix || !route->host || !route->port) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    g_proxy_route_count++;
+    DEBUG("Proxying %s to %s:%s", route->prefix, route->host, route->port);
+    return TRUE;
+}
+
+/**
+ * set up a loop's resolver and upstream slots.  Must be
+ * called after the loop's event base is set up.
+ *
+ * @param loop loop to set up
+ * @returns TRUE on success, FALSE otherwise
+ */
+int proxy_init(loop_t *loop) {
+    proxy_loop_t *pl;
+    int index;
+
+    if(!g_proxy_route_count)
+        return TRUE;
+
+    pl = (proxy_loop_t *)calloc(1, sizeof(proxy_loop_t));
+    if(!pl) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    pl->dns = evdns_base_new(loop->base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+    if(!pl->dns) {
+        ERROR("Cannot set up resolver for proxy");
+        free(pl);
+        return FALSE;
+    }
+
+    /* the connection limit is per upstream, split between loops */
+    pl->loop = loop;
+    pl->max_conns = config.proxy_max_conns / g_loop_count;
+    if(pl->max_conns < 1)
+        pl->max_conns = 1;
+
+    for(index = 0; index < g_proxy_route_count; index++) {
+        pl->targets[index].route = &g_proxy_routes[index];
+        pl->targets[index].pl = pl;
+    }
+
+    loop->proxy = pl;
+
+    if(!loop->id)
+        INFO("Proxying %d selector prefixes", g_proxy_route_count);
+    return TRUE;
+}
+
+/**
+ * tear down a loop's resolver
+ *
+ * @param loop loop to tear down
+ */
+void proxy_deinit(loop_t *loop) {
+    proxy_loop_t *pl = loop->proxy;
+
+    if(!pl)
+        return;
+
+    evdns_base_free(pl->dns, 1);
+    free(pl);
+    loop->proxy = NULL;
+}
+
+/**
+ * get a route's cached address, if it has a live one
+ *
+ * @param route route to look up
+ * @param addr filled in with the address
+ * @param addr_len filled in with the address length
+ * @returns TRUE if there was a live address, FALSE otherwise
+ */
+static int proxy_addr_get(proxy_route_t *route, struct sockaddr_storage *addr,
+                          socklen_t *addr_len) {
+    proxy_addr_t *pa;
+    int found = FALSE;
+
+    epoch_enter();
+    pa = __atomic_load_n(&route->addr, __ATOMIC_ACQUIRE);
+    if(pa && pa->expires > time(NULL)) {
+        memcpy(addr, &pa->addr, pa->addr_len);
+        *addr_len = pa->addr_len;
+        found = TRUE;
+    }
+    epoch_exit();
+
+    return found;
+}
+
+/**
+ * publish a fresh address for a route
+ */
+static void proxy_addr_set(proxy_route_t *route, struct sockaddr *addr,
+                           socklen_t addr_len) {
+    proxy_addr_t *pa, *old;
+
+    pa = (proxy_addr_t *)calloc(1, sizeof(proxy_addr_t));
+    if(!pa) {
+        ERROR("malloc");
+        return;
+    }
+
+    memcpy(&pa->addr, addr, addr_len);
+    pa->addr_len = addr_len;
+    pa->expires = time(NULL) + config.proxy_dns_ttl;
+
+    old = __atomic_exchange_n(&route->addr, pa, __ATOMIC_ACQ_REL);
+    if(old)
+        epoch_retire(old, free);
+}
+
+/**
+ * remember that a route's upstream is down
+ */
+static void proxy_route_failed(proxy_route_t *route) {
+    __atomic_store_n(&route->fail_until, time(NULL) + config.proxy_fail_ttl,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * longest route prefix matching a selector, on a path
+ * component boundary
+ *
+ * @param selector client selector
+ * @returns index of the matching route, or -1
+ */
+static int proxy_route(char *selector) {
+    proxy_route_t *route;
+    int best = -1;
+    char next;
+    int index;
+
+    for(index = 0; index < g_proxy_route_count; index++) {
+        route = &g_proxy_routes[index];
+
+        if(strncmp(selector, route->prefix, route->prefix_len))
+            continue;
+
+        next = selector[route->prefix_len];
+        if(next && next != '/' && route->prefix[route->prefix_len - 1] != '/')
+            continue;
+
+        if(best == -1 || route->prefix_len > g_proxy_routes[best].prefix_len)
+            best = index;
+    }
+
+    return best;
+}
+
+/**
+ * take a request off a target's wait queue
+ */
+static void proxy_unqueue(opaque_proxy_t *op) {
+    proxy_target_t *target = op->target;
+    opaque_proxy_t *cur, *prev = NULL;
+
+    if(!op->queued)
+        return;
+
+    for(cur = target->queue_head; cur && cur != op; cur = cur->next)
+        prev = cur;
+
+    if(cur) {
+        if(prev)
+            prev->next = op->next;
+        else
+            target->queue_head = op->next;
+
+        if(target->queue_tail == op)
+            target->queue_tail = prev;
+
+        target->queue_len--;
+    }
+
+    op->queued = FALSE;
+    op->next = NULL;
+}
+
+/**
+ * bytes made it to the client -- it isn't stalled
+ */
+static void on_proxy_relay_progress(relay_t *relay, void *arg) {
+    opaque_proxy_t *op = (opaque_proxy_t *)arg;
+
+    client_progress(op->client);
+}
+
+/**
+ * the upstream is done sending (or the client went away)
+ */
+static void on_proxy_relay_done(relay_t *relay, int error, void *arg) {
+    opaque_proxy_t *op = (opaque_proxy_t *)arg;
+
+    if(error)
+        close_client(op->client);
+    else
+        client_finish(op->client);
+}
+
+/**
+ * upstream connect finished -- send the selector and start
+ * relaying the reply
+ */
+static void on_proxy_connect(int fd, short event, void *arg) {
+    opaque_proxy_t *op = (opaque_proxy_t *)arg;
+    proxy_route_t *route = op->target->route;
+    client_t *client = op->client;
+    char line[2 * MAX_REQUEST_SIZE + 4];
+    char *selector;
+    socklen_t len = sizeof(int);
+    int err = 0;
+    int line_len;
+
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if(err) {
+        ERROR("Cannot connect to %s:%s: %s", route->host, route->port,
+              strerror(err));
+        proxy_route_failed(route);
+        handle_error(client, RESPONSE_UPSTREAM);
+        return;
+    }
+
+    selector = client->request + route->prefix_len;
+    if(client->query) {
+        line_len = snprintf(line, sizeof(line), "%s\t%s\r\n", selector, client->query);
+    } else {
+        line_len = snprintf(line, sizeof(line), "%s\r\n", selector);
+    }
+
+    /* a fresh socket always has room for one selector */
+    if(write(fd, line, line_len) != line_len) {
+        ERROR("Cannot send selector to %s:%s", route->host, route->port);
+        handle_error(client, RESPONSE_UPSTREAM);
+        return;
+    }
+
+    DEBUG("Relaying %s:%s%s to fd %d", route->host, route->port,
+          selector, client->fd);
+
+    client_splice_begin(client);
+    op->relay = relay_new(client->loop->base, op->fd, client->fd, on_proxy_relay_done, op);
+    if(!op->relay) {
+        close_client(client);
+        return;
+    }
+
+    op->relay->progress_fn = on_proxy_relay_progress;
+    op->fd = -1;  /* the relay owns it now */
+}
+
+/**
+ * open an upstream connection for a request
+ *
+ * @param op request to connect
+ * @param addr upstream address
+ * @param addr_len length of addr
+ * @returns TRUE if the connect is under way, FALSE otherwise
+ */
+static int proxy_connect(opaque_proxy_t *op, struct sockaddr_storage *addr,
+                         socklen_t addr_len) {
+    proxy_target_t *target = op->target;
+    proxy_route_t *route = target->route;
+    int fd;
+
+    fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        ERROR("Cannot create upstream socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    if(connect(fd, (struct sockaddr *)addr, addr_len) < 0 &&
+       errno != EINPROGRESS) {
+        ERROR("Cannot connect to %s:%s: %s", route->host, route->port,
+              strerror(errno));
+        proxy_route_failed(route);
+        close(fd);
+        return FALSE;
+    }
+
+    op->fd = fd;
+    target->active++;
+
+    event_set(&op->ev, fd, EV_WRITE, on_proxy_connect, op);
+    event_base_set(target->pl->loop->base, &op->ev);
+    event_add(&op->ev, NULL);
+    return TRUE;
+}
+
+/**
+ * upstream name resolved (or not)
+ */
+static void on_proxy_resolve(int result, struct evutil_addrinfo *res, void *arg) {
+    proxy_target_t *target = (proxy_target_t *)arg;
+    proxy_route_t *route = target->route;
+
+    target->resolving = FALSE;
+
+    if(result || !res) {
+        ERROR("Cannot resolve %s: %s", route->host, evutil_gai_strerror(result));
+        proxy_route_failed(route);
+    } else {
+        proxy_addr_set(route, res->ai_addr, res->ai_addrlen);
+        DEBUG("Resolved %s", route->host);
+    }
+
+    if(res)
+        evutil_freeaddrinfo(res);
+
+    proxy_target_run(target);
+}
+
+/**
+ * start as many waiting requests as the target allows, resolving
+ * it first if we need to.
+ *
+ * @param target target with waiting requests
+ */
+static void proxy_target_run(proxy_target_t *target) {
+    proxy_route_t *route = target->route;
+    struct evutil_addrinfo hints;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    opaque_proxy_t *op;
+
+    if(!target->queue_head || target->resolving)
+        return;
+
+    if(__atomic_load_n(&route->fail_until, __ATOMIC_RELAXED) > time(NULL)) {
+        /* it was down a moment ago -- don't pile on */
+        while((op = target->queue_head)) {
+            proxy_unqueue(op);
+            handle_error(op->client, RESPONSE_UPSTREAM);
+        }
+        return;
+    }
+
+    if(!proxy_addr_get(route, &addr, &addr_len)) {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        target->resolving = TRUE;
+        evdns_getaddrinfo(target->pl->dns, route->host, route->port, &hints,
+                          on_proxy_resolve, target);
+        return;
+    }
+
+    while(target->active < target->pl->max_conns && (op = target->queue_head)) {
+        proxy_unqueue(op);
+        if(!proxy_connect(op, &addr, addr_len))
+            handle_error(op->client, RESPONSE_UPSTREAM);
+    }
+}
+
+/**
+ * hand a request off to an upstream, if it matches a route
+ *
+ * @param client client with request (and query) parsed
+ * @returns TRUE if the proxy took the request, FALSE otherwise
+ */
+int proxy_dispatch(client_t *client) {
+    proxy_target_t *target;
+    opaque_proxy_t *op;
+    int index;
+
+    if(!g_proxy_route_count)
+        return FALSE;
+
+    if((index = proxy_route(client->request)) == -1)
+        return FALSE;
+
+    /* upstream replies are spliced straight to the socket */
+    if(!client_can_splice(client)) {
+        handle_error(client, RESPONSE_UNSUPPORTED);
+        return TRUE;
+    }
+
+    target = &client->loop->proxy->targets[index];
+
+    op = (opaque_proxy_t *)calloc(1, sizeof(opaque_proxy_t));
+    if(!op) {
+        handle_error(client, RESPONSE_INTERNAL);
+        return TRUE;
+    }
+
+    op->client = client;
+    op->target = target;
+    op->fd = -1;
+    client->request_type = TYPE_PROXY;
+    client->opaque_client = op;
+    client->opaque_bytes = sizeof(opaque_proxy_t);
+
+    if(target->queue_len >= config.proxy_queue) {
+        WARN("Proxy queue for %s full, rejecting fd %d", target->route->prefix,
+             client->fd);
+        handle_error(client, RESPONSE_BUSY);
+        return TRUE;
+    }
+
+    op->queued = TRUE;
+    if(target->queue_tail)
+        target->queue_tail->next = op;
+    else
+        target->queue_head = op;
+    target->queue_tail = op;
+    target->queue_len++;
+
+    proxy_target_run(target);
+    return TRUE;
+}
+
+/**
+ * release proxy state when a client is closed, and let
+ * the next waiter have its upstream slot
+ *
+ * @param client client being closed
+ */
+void proxy_client_free(client_t *client) {
+    opaque_proxy_t *op = (opaque_proxy_t *)client->opaque_client;
+    proxy_target_t *target;
+    int had_slot;
+
+    if(!op)
+        return;
+
+    target = op->target;
+    proxy_unqueue(op);
+
+    had_slot = (op->fd != -1) || op->relay;
+
+    if(op->fd != -1) {
+        event_del(&op->ev);
+        close(op->fd);
+    }
+
+    relay_free(op->relay);
+    free(op);
+    client->opaque_client = NULL;
+
+    if(had_slot) {
+        target->active--;
+        proxy_target_run(target);
+    }
+}
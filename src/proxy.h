@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <event.h>
+
+#include "loop.h"
+#include "plugin.h"
+
+extern int proxy_conf(char *value);
+extern int proxy_init(loop_t *loop);
+extern void proxy_deinit(loop_t *loop);
+extern int proxy_dispatch(client_t *client);
+extern void proxy_client_free(client_t *client);
+
+#endif /* _PROXY_H_ */
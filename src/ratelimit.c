@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * per-address token buckets in a fixed size, open addressing
+ * hash table.  Each slot is two 64 bit words -- the hashed
+ * address and the bucket state (milli-tokens and a timestamp
+ * packed together) -- so every update is a single CAS and no
+ * locks are needed.  When a probe sequence is full, the slot
+ * that's gone longest without a connection attempt is recycled,
+ * which keeps memory fixed no matter how many addresses we see.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "main.h"
+#include "debug.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_PROBES 8
+
+typedef struct ratelimit_slot_t {
+    uint64_t key;      /* hashed address, 0 when empty */
+    uint64_t state;    /* milli-tokens << 32 | last update (ms) */
+} ratelimit_slot_t;
+
+static ratelimit_slot_t *g_ratelimit_table = NULL;
+static uint32_t g_ratelimit_mask = 0;
+static uint32_t g_ratelimit_rate = 0;      /* tokens per second */
+static uint32_t g_ratelimit_max = 0;       /* burst, in milli-tokens */
+static uint64_t g_ratelimit_seed = 0;
+
+#define STATE_TOKENS(state) ((uint32_t)((state) >> 32))
+#define STATE_STAMP(state)  ((uint32_t)(state))
+#define STATE(tokens, stamp) (((uint64_t)(tokens) << 32) | (uint32_t)(stamp))
+
+/**
+ * milliseconds on a monotonic clock, truncated to 32 bits.  All
+ * the math on these is done modulo 2^32, so wrapping is fine.
+ */
+static uint32_t ratelimit_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * hash an address (v4, or v6 with v4-mapped folded into v4)
+ * into a non-zero key
+ */
+static uint64_t ratelimit_key(struct sockaddr *addr) {
+    struct sockaddr_in6 *sin6;
+    unsigned char *bytes;
+    uint64_t hash = g_ratelimit_seed ^ 0xcbf29ce484222325ULL;
+    size_t len;
+    size_t index;
+
+    switch(addr->sa_family) {
+    case AF_INET:
+        bytes = (unsigned char *)&((struct sockaddr_in *)addr)->sin_addr;
+        len = 4;
+        break;
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *)addr;
+        bytes = (unsigned char *)&sin6->sin6_addr;
+        len = 16;
+        if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            bytes += 12;
+            len = 4;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    for(index = 0; index < len; index++) {
+        hash ^= bytes[index];
+        hash *= 0x100000001b3ULL;
+    }
+
+    /* finalize, so the low bits are usable as a table index */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash ? hash : 1;
+}
+
+/**
+ * set up the table
+ *
+ * @param rate tokens per second per address (0 disables)
+ * @param burst bucket size
+ * @param slots table size, rounded up to a power of two
+ * @returns TRUE on success, FALSE otherwise
+ */
+int ratelimit_init(int rate, int burst, int slots) {
+    uint32_t size = 1;
+
+    if(rate <= 0)
+        return TRUE;
+
+    if(burst < 1)
+        burst = 1;
+    if(burst > 1000000)
+        burst = 1000000;
+
+    while(size < (uint32_t)slots && size < (1U << 30))
+        size <<= 1;
+
+    g_ratelimit_table = (ratelimit_slot_t *)calloc(size, sizeof(ratelimit_slot_t));
+    if(!g_ratelimit_table) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    g_ratelimit_mask = size - 1;
+    g_ratelimit_rate = (uint32_t)rate;
+    g_ratelimit_max = (uint32_t)burst * 1000;
+    g_ratelimit_seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^
+        (uint64_t)(uintptr_t)g_ratelimit_table;
+
+    INFO("Rate limiting to %d/s (burst %d) per address, %u slots",
+         rate, burst, size);
+    return TRUE;
+}
+
+/**
+ * free the table
+ */
+void ratelimit_deinit(void) {
+    free(g_ratelimit_table);
+    g_ratelimit_table = NULL;
+}
+
+/**
+ * find (or claim) the slot for a key
+ *
+ * @param key hashed address
+ * @param now current time
+ * @returns slot for the key, or NULL if another thread took
+ *          the one we were recycling
+ */
+static ratelimit_slot_t *ratelimit_slot(uint64_t key, uint32_t now) {
+    ratelimit_slot_t *slot, *victim = NULL;
+    uint64_t found, expected;
+    uint32_t age, victim_age = 0;
+    uint32_t index;
+    int probe;
+
+    for(probe = 0; probe < RATELIMIT_PROBES; probe++) {
+        index = ((uint32_t)key + probe) & g_ratelimit_mask;
+        slot = &g_ratelimit_table[index];
+
+        found = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if(found == key)
+            return slot;
+
+        if(!found) {
+            expected = 0;
+            if(__atomic_compare_exchange_n(&slot->key, &expected, key, FALSE,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&slot->state, STATE(g_ratelimit_max, now),
+                                 __ATOMIC_RELEASE);
+                return slot;
+            }
+
+            if(expected == key)  /* somebody beat us to it */
+                return slot;
+            continue;
+        }
+
+        age = now - STATE_STAMP(__atomic_load_n(&slot->state, __ATOMIC_RELAXED));
+        if(!victim || age > victim_age) {
+            victim = slot;
+            victim_age = age;
+        }
+    }
+
+    /* probe sequence is full -- recycle the stalest slot.  A racing
+     * update to the old owner may land on us; that costs a token
+     * or two of accuracy, never memory.  If someone else recycled
+     * it first, it's theirs, and this address goes unlimited this
+     * once. */
+    expected = __atomic_load_n(&victim->key, __ATOMIC_ACQUIRE);
+    if(!__atomic_compare_exchange_n(&victim->key, &expected, key, FALSE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return expected == key ? victim : NULL;
+
+    __atomic_store_n(&victim->state, STATE(g_ratelimit_max, now), __ATOMIC_RELEASE);
+    return victim;
+}
+
+/**
+ * take a token for this address, if it has one
+ *
+ * @param addr peer address, straight from accept()
+ * @returns TRUE if the connection may proceed, FALSE if it's over its rate
+ */
+int ratelimit_allow(struct sockaddr *addr) {
+    ratelimit_slot_t *slot;
+    uint64_t key, state, next;
+    uint64_t tokens;
+    uint32_t now;
+
+    if(!g_ratelimit_table)
+        return TRUE;
+
+    if(!(key = ratelimit_key(addr)))
+        return TRUE;
+
+    now = ratelimit_now();
+    if(!(slot = ratelimit_slot(key, now)))
+        return TRUE;
+
+    state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    do {
+        /* ms * tokens/s is exactly milli-tokens */
+        tokens = STATE_TOKENS(state) +
+            (uint64_t)(uint32_t)(now - STATE_STAMP(state)) * g_ratelimit_rate;
+        if(tokens > g_ratelimit_max)
+            tokens = g_ratelimit_max;
+
+        /* still stamp it, so an address being turned away never
+         * looks stale enough to recycle (and come back full).  The
+         * refill is banked as it is, so nothing is lost. */
+        if(tokens < 1000) {
+            __atomic_compare_exchange_n(&slot->state, &state, STATE(tokens, now),
+                                        FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            return FALSE;
+        }
+
+        next = STATE(tokens - 1000, now);
+    } while(!__atomic_compare_exchange_n(&slot->state, &state, next, TRUE,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return TRUE;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * readahead policy for file streaming.
+ *
+ * Each stream keeps the kernel hinted a window ahead of where
+ * it's reading.  The window starts small and doubles each time
+ * it's topped up, up to readahead_max, so a long sequential
+ * read gets deep readahead without a short one paying for it.
+ * What's been hinted but not yet read is counted against
+ * readahead_budget across all streams; once that's spent,
+ * streams read without hints until others catch up.
+ *
+ * Files of readahead_dontneed_size or more that only one
+ * client is reading are dropped from the page cache behind the
+ * reader, so one big download doesn't push out everything else.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "debug.h"
+#include "readahead.h"
+
+#define READAHEAD_MIN_WINDOW (128 * 1024)
+#define READAHEAD_DROP_BATCH (1024 * 1024)
+
+static off_t g_readahead_max = 0;
+static off_t g_readahead_budget = 0;
+static off_t g_readahead_dontneed = 0;
+static off_t g_readahead_outstanding = 0;   /* hinted, not yet read */
+
+/**
+ * set the policy
+ *
+ * @param max_window deepest readahead for one stream
+ * @param budget hinted-but-unread bytes across streams (0 disables)
+ * @param dontneed_size files this big aren't kept cached (0 disables)
+ */
+void readahead_init(size_t max_window, size_t budget, size_t dontneed_size) {
+    g_readahead_max = MAX((off_t)max_window, READAHEAD_MIN_WINDOW);
+    g_readahead_budget = budget;
+    g_readahead_dontneed = dontneed_size;
+}
+
+/**
+ * a stream is starting on a file
+ *
+ * @param ra stream state to set up
+ * @param fd file
+ * @param size file size
+ */
+void readahead_start(readahead_t *ra, int fd, off_t size) {
+    ra->pos = 0;
+    ra->issued = 0;
+    ra->window = READAHEAD_MIN_WINDOW;
+    ra->dropped = 0;
+    ra->dontneed = g_readahead_dontneed && size >= g_readahead_dontneed;
+
+    if(g_readahead_budget)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * take hinted bytes back out of the budget
+ */
+static void readahead_consume(readahead_t *ra, off_t pos) {
+    off_t consumed, end;
+
+    if(pos <= ra->pos)
+        return;
+
+    end = pos < ra->issued ? pos : ra->issued;
+    consumed = end - ra->pos;
+    if(consumed > 0)
+        __atomic_sub_fetch(&g_readahead_outstanding, consumed, __ATOMIC_RELAXED);
+    ra->pos = pos;
+}
+
+/**
+ * a stream is about to read at pos -- hint what's coming and
+ * drop what's gone
+ *
+ * @param ra stream state
+ * @param fd file
+ * @param pos offset about to be read
+ * @param size file size
+ * @param shared whether anyone else is reading the file
+ */
+void readahead_advance(readahead_t *ra, int fd, off_t pos, off_t size, int shared) {
+    off_t target, want, outstanding;
+
+    readahead_consume(ra, pos);
+
+    if(ra->dontneed && !shared && pos - ra->dropped >= READAHEAD_DROP_BATCH) {
+        posix_fadvise(fd, ra->dropped, pos - ra->dropped, POSIX_FADV_DONTNEED);
+        ra->dropped = pos;
+    }
+
+    if(!g_readahead_budget || ra->issued >= size)
+        return;
+
+    /* top up once we're halfway through what was hinted */
+    if(ra->issued > pos && ra->issued - pos > ra->window / 2)
+        return;
+
+    if(ra->issued < pos)
+        ra->issued = pos;
+
+    target = MIN(pos + ra->window, size);
+    if((want = target - ra->issued) <= 0)
+        return;
+
+    outstanding = __atomic_add_fetch(&g_readahead_outstanding, want, __ATOMIC_RELAXED);
+    if(outstanding > g_readahead_budget) {
+        /* only take what's left */
+        off_t over = MIN(outstanding - g_readahead_budget, want);
+        __atomic_sub_fetch(&g_readahead_outstanding, over, __ATOMIC_RELAXED);
+        want -= over;
+        if(want <= 0)
+            return;
+    }
+
+#ifdef __linux__
+    readahead(fd, ra->issued, want);
+#else
+    posix_fadvise(fd, ra->issued, want, POSIX_FADV_WILLNEED);
+#endif
+
+    ra->issued += want;
+    ra->window = MIN(ra->window * 2, g_readahead_max);
+}
+
+/**
+ * a stream is done -- return whatever it had hinted but
+ * never read
+ *
+ * @param ra stream state
+ */
+void readahead_stop(readahead_t *ra) {
+    if(ra->issued > ra->pos)
+        __atomic_sub_fetch(&g_readahead_outstanding, ra->issued - ra->pos, __ATOMIC_RELAXED);
+    ra->pos = ra->issued = 0;
+}
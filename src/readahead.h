@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <sys/types.h>
+
+/* per stream readahead state */
+typedef struct readahead_t {
+    off_t pos;               /* where the stream has read to */
+    off_t issued;            /* hinted up to here */
+    off_t window;            /* how far ahead to keep hinted */
+    off_t dropped;           /* dropped from the page cache up to here */
+    int dontneed;            /* too big to be worth caching */
+} readahead_t;
+
+extern void readahead_init(size_t max_window, size_t budget, size_t dontneed_size);
+extern void readahead_start(readahead_t *ra, int fd, off_t size);
+extern void readahead_advance(readahead_t *ra, int fd, off_t pos, off_t size,
+                              int shared);
+extern void readahead_stop(readahead_t *ra);
+
+#endif /* _READAHEAD_H_ */
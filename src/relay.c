@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "debug.h"
+#include "relay.h"
+
+#define RELAY_CHUNK 65536
+
+static void on_relay_event(int fd, short event, void *arg);
+
+/**
+ * push as much as we can from the source pipe to the
+ * destination, then wait on whichever side is holding us up.
+ *
+ * @param relay relay to advance
+ */
+static void relay_run_direct(relay_t *relay) {
+    ssize_t moved;
+    size_t start = relay->bytes;
+    int pending = 0;
+
+    while(1) {
+        moved = splice(relay->src_fd, NULL, relay->dst_fd, NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if(moved > 0) {
+            relay->bytes += moved;
+            continue;
+        }
+
+        if(moved == 0) {
+            DEBUG("Relay %d -> %d finished after %zu bytes",
+                  relay->src_fd, relay->dst_fd, relay->bytes);
+            if(relay->bytes != start && relay->progress_fn)
+                relay->progress_fn(relay, relay->arg);
+            relay->done_fn(relay, 0, relay->arg);
+            return;
+        }
+
+        if(errno == EINTR)
+            continue;
+
+        if(errno != EAGAIN) {
+            ERROR("Splice error on fd %d: %s", relay->dst_fd, strerror(errno));
+            relay->done_fn(relay, errno, relay->arg);
+            return;
+        }
+
+        break;
+    }
+
+    if(relay->bytes != start && relay->progress_fn)
+        relay->progress_fn(relay, relay->arg);
+
+    /* EAGAIN is either an empty pipe or a full socket */
+    if(ioctl(relay->src_fd, FIONREAD, &pending) == 0 && pending > 0) {
+        event_add(&relay->ev_dst, NULL);
+    } else {
+        event_add(&relay->ev_src, NULL);
+    }
+}
+
+/**
+ * socket to socket: fill our pipe from the source and drain
+ * it into the destination, then wait on whichever side is
+ * holding us up.
+ *
+ * @param relay relay to advance
+ */
+static void relay_run_pipe(relay_t *relay) {
+    ssize_t moved;
+    size_t start = relay->bytes;
+    int progress;
+
+    do {
+        progress = FALSE;
+
+        if(!relay->src_eof && relay->pipe_bytes < RELAY_CHUNK) {
+            moved = splice(relay->src_fd, NULL, relay->pipe_fd[1], NULL,
+                           RELAY_CHUNK - relay->pipe_bytes,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(moved > 0) {
+                relay->pipe_bytes += moved;
+                progress = TRUE;
+            } else if(moved == 0) {
+                relay->src_eof = TRUE;
+            } else if(errno != EAGAIN && errno != EINTR) {
+                ERROR("Splice error on fd %d: %s", relay->src_fd, strerror(errno));
+                relay->done_fn(relay, errno, relay->arg);
+                return;
+            }
+        }
+
+        if(relay->pipe_bytes) {
+            moved = splice(relay->pipe_fd[0], NULL, relay->dst_fd, NULL,
+                           relay->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(moved > 0) {
+                relay->pipe_bytes -= moved;
+                relay->bytes += moved;
+                progress = TRUE;
+            } else if(moved == -1 && errno != EAGAIN && errno != EINTR) {
+                ERROR("Splice error on fd %d: %s", relay->dst_fd, strerror(errno));
+                relay->done_fn(relay, errno, relay->arg);
+                return;
+            }
+        }
+
+        if(relay->src_eof && !relay->pipe_bytes) {
+            DEBUG("Relay %d -> %d finished after %zu bytes",
+                  relay->src_fd, relay->dst_fd, relay->bytes);
+            if(relay->bytes != start && relay->progress_fn)
+                relay->progress_fn(relay, relay->arg);
+            relay->done_fn(relay, 0, relay->arg);
+            return;
+        }
+    } while(progress);
+
+    if(relay->bytes != start && relay->progress_fn)
+        relay->progress_fn(relay, relay->arg);
+
+    /* anything still in the pipe means the destination is full */
+    if(relay->pipe_bytes) {
+        event_add(&relay->ev_dst, NULL);
+    } else {
+        event_add(&relay->ev_src, NULL);
+    }
+}
+
+/**
+ * either side of the relay became ready
+ */
+static void on_relay_event(int fd, short event, void *arg) {
+    relay_t *relay = (relay_t *)arg;
+
+    if(relay->pipe_fd[0] == -1) {
+        relay_run_direct(relay);
+    } else {
+        relay_run_pipe(relay);
+    }
+}
+
+/**
+ * start relaying a pipe or socket to a (non-blocking) socket.
+ * done_fn is called once on EOF or error, and is expected to
+ * relay_free().
+ *
+ * @param base event base of the loop owning both fds
+ * @param src_fd read end of a pipe, or a socket
+ * @param dst_fd socket to write to
+ * @param done_fn completion callback
+ * @param arg opaque argument for done_fn
+ * @returns new relay, or NULL on error
+ */
+relay_t *relay_new(struct event_base *base, int src_fd, int dst_fd,
+                   void (*done_fn)(relay_t *relay, int error, void *arg),
+                   void *arg) {
+    relay_t *relay;
+    struct stat st;
+    int flags;
+
+    relay = (relay_t *)calloc(1, sizeof(relay_t));
+    if(!relay) {
+        ERROR("malloc");
+        return NULL;
+    }
+
+    flags = fcntl(src_fd, F_GETFL);
+    if(flags >= 0)
+        fcntl(src_fd, F_SETFL, flags | O_NONBLOCK);
+
+    relay->pipe_fd[0] = relay->pipe_fd[1] = -1;
+    if(fstat(src_fd, &st) == 0 && !S_ISFIFO(st.st_mode)) {
+        if(pipe2(relay->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+            ERROR("Cannot create relay pipe: %s", strerror(errno));
+            free(relay);
+            return NULL;
+        }
+    }
+
+    relay->src_fd = src_fd;
+    relay->dst_fd = dst_fd;
+    relay->done_fn = done_fn;
+    relay->arg = arg;
+
+    event_set(&relay->ev_src, src_fd, EV_READ, on_relay_event, relay);
+    event_set(&relay->ev_dst, dst_fd, EV_WRITE, on_relay_event, relay);
+    event_base_set(base, &relay->ev_src);
+    event_base_set(base, &relay->ev_dst);
+
+    /* wait for the first bytes rather than running inline, so
+     * done_fn never fires before the caller has the relay */
+    event_add(&relay->ev_src, NULL);
+    return relay;
+}
+
+/**
+ * stop a relay and close the source fd (and our pipe, if we
+ * made one).  The destination belongs to the caller.
+ *
+ * @param relay relay to free
+ */
+void relay_free(relay_t *relay) {
+    if(!relay)
+        return;
+
+    event_del(&relay->ev_src);
+    event_del(&relay->ev_dst);
+
+    if(relay->src_fd != -1)
+        close(relay->src_fd);
+
+    if(relay->pipe_fd[0] != -1) {
+        close(relay->pipe_fd[0]);
+        close(relay->pipe_fd[1]);
+    }
+
+    free(relay);
+}
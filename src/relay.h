@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <event.h>
+
+/* move bytes from one fd to another with splice(), so they
+ * never get copied up into user space.  Sources that aren't
+ * pipes go through an intermediate pipe of our own. */
+typedef struct relay_t {
+    int src_fd;
+    int dst_fd;
+    int pipe_fd[2];        /* -1 when src_fd is already a pipe */
+    size_t pipe_bytes;     /* bytes sitting in pipe_fd */
+    int src_eof;
+    size_t bytes;
+    struct event ev_src;
+    struct event ev_dst;
+    void (*done_fn)(struct relay_t *relay, int error, void *arg);
+    void (*progress_fn)(struct relay_t *relay, void *arg);  /* optional */
+    void *arg;
+} relay_t;
+
+extern relay_t *relay_new(struct event_base *base, int src_fd, int dst_fd,
+                          void (*done_fn)(relay_t *relay, int error, void *arg),
+                          void *arg);
+extern void relay_free(relay_t *relay);
+
+#endif /* _RELAY_H_ */
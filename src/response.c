@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "response.h"
+
+#define RESPONSE(type, text) { type text "\t\t\t\n\r.\n\r", sizeof(type text "\t\t\t\n\r.\n\r") - 1 }
+
+static const struct {
+    const char *data;
+    size_t len;
+} g_responses[RESPONSE_COUNT] = {
+    [RESPONSE_NOT_FOUND]       = RESPONSE("i", "No such file or directory"),
+    [RESPONSE_DENIED]          = RESPONSE("i", "Permission denied"),
+    [RESPONSE_INTERNAL]        = RESPONSE("i", "Internal Error"),
+    [RESPONSE_UNSUPPORTED]     = RESPONSE("i", "This is some kind of crazy file!"),
+    [RESPONSE_BUSY]            = RESPONSE("3", "Server busy"),
+    [RESPONSE_EXEC_FAILED]     = RESPONSE("3", "Exec failed"),
+    [RESPONSE_UPSTREAM]        = RESPONSE("3", "Upstream unavailable"),
+    [RESPONSE_NOT_IMPLEMENTED] = RESPONSE("i", "Not implemented"),
+    [RESPONSE_NO_MATCHES]      = RESPONSE("i", "No matches"),
+    [RESPONSE_SEARCH_UNAVAILABLE] = RESPONSE("3", "Search index not ready"),
+};
+
+/* "\thost\tport\n\r", ending every menu line we generate */
+static char *g_menu_tail = NULL;
+static size_t g_menu_tail_len = 0;
+
+/**
+ * render the responses that depend on configuration
+ *
+ * @param host hostname to put in menus
+ * @param port port to put in menus
+ * @returns TRUE on success, FALSE otherwise
+ */
+int response_init(char *host, uint16_t port) {
+    int len;
+
+    response_deinit();
+
+    len = asprintf(&g_menu_tail, "\t%s\t%d\n\r", host, port);
+    if(len < 0) {
+        g_menu_tail = NULL;
+        return FALSE;
+    }
+
+    g_menu_tail_len = len;
+    return TRUE;
+}
+
+/**
+ * free what response_init rendered
+ */
+void response_deinit(void) {
+    free(g_menu_tail);
+    g_menu_tail = NULL;
+    g_menu_tail_len = 0;
+}
+
+/**
+ * get a canned response
+ *
+ * @param id which one
+ * @param len set to its length
+ * @returns response bytes (not NUL terminated on the wire)
+ */
+const char *response_get(response_id_t id, size_t *len) {
+    if(id >= RESPONSE_COUNT)
+        id = RESPONSE_INTERNAL;
+
+    *len = g_responses[id].len;
+    return g_responses[id].data;
+}
+
+/**
+ * queue a canned response without copying it
+ *
+ * @param output buffer to add it to
+ * @param id which one
+ * @returns TRUE on success, FALSE otherwise
+ */
+int response_add(struct evbuffer *output, response_id_t id) {
+    const char *data;
+    size_t len;
+
+    data = response_get(id, &len);
+    return evbuffer_add_reference(output, data, len, NULL, NULL) == 0;
+}
+
+/**
+ * pick the response for a failed lookup
+ *
+ * @param err errno from the lookup
+ * @returns response to send
+ */
+response_id_t response_errno(int err) {
+    switch(err) {
+    case ENOENT:
+    case ENOTDIR:
+    case ENAMETOOLONG:
+        return RESPONSE_NOT_FOUND;
+    case EACCES:
+    case EPERM:
+        return RESPONSE_DENIED;
+    default:
+        return RESPONSE_INTERNAL;
+    }
+}
+
+/**
+ * get the fragment that finishes off a menu line
+ *
+ * @param len set to its length
+ * @returns "\thost\tport\n\r" for this server
+ */
+const char *response_menu_tail(size_t *len) {
+    *len = g_menu_tail_len;
+    return g_menu_tail;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event.h>
+
+/*
+ * canned responses.  Everything here is rendered once, at
+ * startup, and handed to clients by reference.
+ */
+typedef enum response_id_t {
+    RESPONSE_NOT_FOUND = 0,
+    RESPONSE_DENIED,
+    RESPONSE_INTERNAL,
+    RESPONSE_UNSUPPORTED,
+    RESPONSE_BUSY,
+    RESPONSE_EXEC_FAILED,
+    RESPONSE_UPSTREAM,
+    RESPONSE_NOT_IMPLEMENTED,
+    RESPONSE_NO_MATCHES,
+    RESPONSE_SEARCH_UNAVAILABLE,
+    RESPONSE_COUNT
+} response_id_t;
+
+extern int response_init(char *host, uint16_t port);
+extern void response_deinit(void);
+extern const char *response_get(response_id_t id, size_t *len);
+extern int response_add(struct evbuffer *output, response_id_t id);
+extern response_id_t response_errno(int err);
+extern const char *response_menu_tail(size_t *len);
+
+#endif /* _RESPONSE_H_ */
@@ -0,0 +1,1115 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * full text search (gopher type 7) over everything under
+ * base_dir.
+ *
+ * A background thread keeps an inverted index of every text
+ * file, and writes it out as a single file: a table of
+ * documents, a sorted term dictionary, then each term's
+ * postings (document ids, delta and varint encoded).  The
+ * loops map that file and answer a query by looking its terms
+ * up in the dictionary and intersecting their postings --
+ * files are never read at query time.
+ *
+ * The indexer watches the tree with inotify.  Changed files
+ * are re-read and the index rewritten a couple of seconds
+ * later; anything that moves or removes a directory costs a
+ * full walk.  A new index is swapped in with the old one
+ * retired through the epoch code, so queries never block on
+ * the indexer.  The last index written is picked up again at
+ * startup while the first walk runs.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <event.h>
+
+#include "main.h"
+#include "debug.h"
+#include "epoch.h"
+#include "gophermap.h"
+#include "response.h"
+#include "search.h"
+
+#define SEARCH_MAGIC "EGSRCH1"
+#define SEARCH_TERM_MIN 2
+#define SEARCH_TERM_MAX 32
+#define SEARCH_QUERY_TERMS 16
+#define SEARCH_TERM_BUCKETS 65536
+#define SEARCH_DOC_BUCKETS 16384
+#define SEARCH_WATCH_BUCKETS 1024
+#define SEARCH_DEBOUNCE_MS 2000
+#define SEARCH_BINARY_PROBE 4096    /* a NUL in here and it's not text */
+#define SEARCH_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                           IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* on disk.  All offsets are from the start of the file. */
+typedef struct search_header_t {
+    char magic[8];
+    uint32_t doc_count;
+    uint32_t term_count;
+    uint64_t docs_off;       /* uint32_t selector offsets */
+    uint64_t terms_off;      /* search_term_entry_t, sorted */
+    uint64_t postings_off;
+    uint64_t strings_off;
+    uint64_t size;
+} search_header_t;
+
+typedef struct search_term_entry_t {
+    uint32_t str_off;        /* from strings_off */
+    uint32_t str_len;
+    uint32_t post_off;       /* from postings_off */
+    uint32_t post_count;
+} search_term_entry_t;
+
+/* a mapped index, as the loops see it */
+typedef struct search_index_t {
+    void *map;
+    size_t len;
+    const search_header_t *header;
+    const uint32_t *docs;
+    const search_term_entry_t *terms;
+    const unsigned char *postings;
+    const char *strings;
+} search_index_t;
+
+/* the indexer's working state */
+typedef struct search_doc_t {
+    char *selector;
+    time_t mtime;
+    off_t size;
+    int alive;
+    int hash_next;           /* doc id, -1 ends */
+} search_doc_t;
+
+typedef struct search_term_t {
+    char *term;
+    uint32_t *ids;           /* ascending, may include dead docs */
+    uint32_t count;
+    uint32_t size;
+    struct search_term_t *next;
+} search_term_t;
+
+typedef struct search_watch_t {
+    int wd;
+    char *path;
+    struct search_watch_t *next;
+} search_watch_t;
+
+typedef struct search_pending_t {
+    char *path;
+    struct search_pending_t *next;
+} search_pending_t;
+
+static char *g_search_selector = NULL;
+static char *g_search_file = NULL;
+static size_t g_search_max_file_size = 0;
+static int g_search_max_results = 0;
+static search_index_t *g_search_index = NULL;   /* published */
+
+static pthread_t g_search_thread;
+static int g_search_started = FALSE;
+static int g_search_wake[2] = { -1, -1 };
+static int g_search_fd = -1;
+
+/* indexer thread only from here down */
+static search_doc_t *g_search_docs = NULL;
+static uint32_t g_search_doc_count = 0;
+static uint32_t g_search_doc_size = 0;
+static uint32_t g_search_dead = 0;
+static int g_search_doc_hash[SEARCH_DOC_BUCKETS];
+static search_term_t *g_search_terms[SEARCH_TERM_BUCKETS];
+static uint32_t g_search_term_count = 0;
+static search_watch_t *g_search_watches[SEARCH_WATCH_BUCKETS];
+static search_pending_t *g_search_pending = NULL;
+static int g_search_full = FALSE;     /* need a full walk */
+static uint64_t g_search_due = 0;     /* ms, when there's work */
+
+static uint64_t search_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t search_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261U;
+
+    while(len--) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static int search_word_char(unsigned char c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+/**
+ * split text into terms, calling fn for each
+ */
+static void search_tokenize(const char *text, size_t len,
+                            void (*fn)(char *term, size_t len, void *arg),
+                            void *arg) {
+    char term[SEARCH_TERM_MAX + 1];
+    size_t pos = 0, term_len;
+
+    while(pos < len) {
+        while(pos < len && !search_word_char(text[pos]))
+            pos++;
+
+        term_len = 0;
+        while(pos < len && search_word_char(text[pos])) {
+            if(term_len <= SEARCH_TERM_MAX)
+                term[term_len] = tolower((unsigned char)text[pos]);
+            term_len++;
+            pos++;
+        }
+
+        if(term_len >= SEARCH_TERM_MIN && term_len <= SEARCH_TERM_MAX) {
+            term[term_len] = '\0';
+            fn(term, term_len, arg);
+        }
+    }
+}
+
+/* ---- the mapped index, used from the loops ---- */
+
+static void search_index_free(void *ptr) {
+    search_index_t *index = (search_index_t *)ptr;
+
+    munmap(index->map, index->len);
+    free(index);
+}
+
+/**
+ * check every offset in an index stays inside it, so a damaged
+ * file can't send a search off the end of the map.  Selectors
+ * have to be NUL terminated in the strings; terms just have to
+ * fit.
+ *
+ * @param header header, already checked
+ * @param map the whole file
+ * @returns TRUE if it's safe to use, FALSE otherwise
+ */
+static int search_index_check(const search_header_t *header, const void *map) {
+    const uint32_t *docs = (const uint32_t *)((const char *)map + header->docs_off);
+    const search_term_entry_t *terms =
+        (const search_term_entry_t *)((const char *)map + header->terms_off);
+    const char *strings = (const char *)map + header->strings_off;
+    uint64_t strings_len = header->size - header->strings_off;
+    uint64_t postings_len = header->strings_off - header->postings_off;
+    uint32_t index;
+
+    for(index = 0; index < header->doc_count; index++) {
+        if(docs[index] >= strings_len ||
+           !memchr(strings + docs[index], '\0', strings_len - docs[index]))
+            return FALSE;
+    }
+
+    /* every posting takes at least a byte */
+    for(index = 0; index < header->term_count; index++) {
+        if((uint64_t)terms[index].str_off + terms[index].str_len > strings_len ||
+           terms[index].post_off > postings_len ||
+           terms[index].post_count > postings_len - terms[index].post_off)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * map an index file, checking it hangs together
+ *
+ * @returns index, or NULL if it's missing or damaged
+ */
+static search_index_t *search_index_map(char *file) {
+    const search_header_t *header;
+    search_index_t *index;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(search_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    header = (const search_header_t *)map;
+    if(memcmp(header->magic, SEARCH_MAGIC, sizeof(header->magic)) ||
+       header->size != (uint64_t)st.st_size ||
+       header->docs_off < sizeof(search_header_t) ||
+       header->docs_off % sizeof(uint32_t) || header->terms_off % sizeof(uint32_t) ||
+       header->docs_off + (uint64_t)header->doc_count * sizeof(uint32_t) > header->terms_off ||
+       header->terms_off + (uint64_t)header->term_count * sizeof(search_term_entry_t) >
+       header->postings_off ||
+       header->postings_off > header->strings_off ||
+       header->strings_off > header->size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if(!search_index_check(header, map)) {
+        WARN("Search index %s is damaged, ignoring it", file);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if(!(index = (search_index_t *)calloc(1, sizeof(search_index_t)))) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    index->map = map;
+    index->len = st.st_size;
+    index->header = header;
+    index->docs = (const uint32_t *)((char *)map + header->docs_off);
+    index->terms = (const search_term_entry_t *)((char *)map + header->terms_off);
+    index->postings = (const unsigned char *)map + header->postings_off;
+    index->strings = (const char *)map + header->strings_off;
+    return index;
+}
+
+/**
+ * swap in a new index
+ */
+static void search_index_publish(search_index_t *index) {
+    search_index_t *old;
+
+    old = __atomic_exchange_n(&g_search_index, index, __ATOMIC_ACQ_REL);
+    if(old)
+        epoch_retire(old, search_index_free);
+}
+
+/**
+ * find a term in the dictionary
+ */
+static const search_term_entry_t *search_index_find(search_index_t *index,
+                                                    char *term, size_t len) {
+    const search_term_entry_t *entry;
+    uint32_t lo = 0, hi = index->header->term_count, mid;
+    int cmp;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = &index->terms[mid];
+
+        cmp = memcmp(index->strings + entry->str_off, term, MIN(entry->str_len, len));
+        if(!cmp)
+            cmp = (entry->str_len > len) - (entry->str_len < len);
+
+        if(!cmp)
+            return entry;
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/**
+ * walk a postings list.  Returns FALSE at the end.
+ */
+static int search_postings_next(const unsigned char **p, const unsigned char *end,
+                                uint32_t *id, int first) {
+    uint32_t delta = 0;
+    int shift = 0;
+
+    do {
+        if(*p >= end || shift > 28)
+            return FALSE;
+        delta |= (uint32_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while(*(*p)++ & 0x80);
+
+    *id = first ? delta : *id + delta;
+    return TRUE;
+}
+
+typedef struct search_query_t {
+    search_index_t *index;
+    const search_term_entry_t *terms[SEARCH_QUERY_TERMS];
+    int count;
+    int missing;
+} search_query_t;
+
+static void search_query_term(char *term, size_t len, void *arg) {
+    search_query_t *q = (search_query_t *)arg;
+    const search_term_entry_t *entry;
+
+    if(q->count == SEARCH_QUERY_TERMS)
+        return;
+
+    if(!(entry = search_index_find(q->index, term, len)))
+        q->missing = TRUE;
+    else
+        q->terms[q->count++] = entry;
+}
+
+/**
+ * does a request name the search selector?
+ *
+ * @param request client selector
+ * @returns TRUE if it's a search
+ */
+int search_selector(char *request) {
+    return g_search_selector && !strcmp(request, g_search_selector);
+}
+
+/**
+ * run a search, adding matching documents to output as menu
+ * lines
+ *
+ * @param query the words searched for
+ * @param output buffer to render results into
+ * @returns number of matches, or -1 if there's no index yet
+ */
+int search_query(char *query, struct evbuffer *output) {
+    const unsigned char *p, *end;
+    const char *tail, *selector;
+    search_index_t *index;
+    search_query_t q;
+    uint32_t *ids, id;
+    size_t tail_len;
+    int count, kept, index_term, smallest, pos, first;
+
+    epoch_enter();
+
+    if(!(index = __atomic_load_n(&g_search_index, __ATOMIC_ACQUIRE))) {
+        epoch_exit();
+        return -1;
+    }
+
+    memset(&q, 0, sizeof(q));
+    q.index = index;
+    search_tokenize(query, strlen(query), search_query_term, &q);
+
+    if(q.missing || !q.count) {
+        epoch_exit();
+        return 0;
+    }
+
+    /* start from the rarest term... */
+    smallest = 0;
+    for(index_term = 1; index_term < q.count; index_term++) {
+        if(q.terms[index_term]->post_count < q.terms[smallest]->post_count)
+            smallest = index_term;
+    }
+
+    if(!(ids = (uint32_t *)malloc(q.terms[smallest]->post_count * sizeof(uint32_t)))) {
+        epoch_exit();
+        return -1;
+    }
+
+    end = index->postings + (index->header->strings_off - index->header->postings_off);
+    p = index->postings + q.terms[smallest]->post_off;
+    for(count = 0, first = TRUE; count < (int)q.terms[smallest]->post_count &&
+            search_postings_next(&p, end, &id, first); count++, first = FALSE)
+        ids[count] = id;
+
+    /* ...and knock out anything missing from the others */
+    for(index_term = 0; index_term < q.count && count; index_term++) {
+        if(index_term == smallest)
+            continue;
+
+        p = index->postings + q.terms[index_term]->post_off;
+        first = TRUE;
+        kept = 0;
+        pos = 0;
+        while(pos < count && search_postings_next(&p, end, &id, first)) {
+            first = FALSE;
+            while(pos < count && ids[pos] < id)
+                pos++;
+            if(pos < count && ids[pos] == id)
+                ids[kept++] = ids[pos++];
+        }
+        count = kept;
+    }
+
+    if(count > g_search_max_results)
+        count = g_search_max_results;
+
+    tail = response_menu_tail(&tail_len);
+    for(pos = 0; pos < count; pos++) {
+        if(ids[pos] >= index->header->doc_count)
+            continue;
+        selector = index->strings + index->docs[ids[pos]];
+        evbuffer_add(output, "0", 1);
+        evbuffer_add(output, selector, strlen(selector));
+        evbuffer_add(output, "\t", 1);
+        evbuffer_add(output, selector, strlen(selector));
+        evbuffer_add(output, tail, tail_len);
+    }
+
+    epoch_exit();
+    free(ids);
+    return count;
+}
+
+/* ---- the indexer ---- */
+
+static void search_doc_term(char *term, size_t len, void *arg) {
+    uint32_t id = *(uint32_t *)arg;
+    uint32_t hash = search_hash(term, len);
+    search_term_t *st;
+    uint32_t *grown;
+
+    for(st = g_search_terms[hash % SEARCH_TERM_BUCKETS]; st; st = st->next) {
+        if(!strcmp(st->term, term))
+            break;
+    }
+
+    if(!st) {
+        if(!(st = (search_term_t *)calloc(1, sizeof(search_term_t))))
+            return;
+        if(!(st->term = strdup(term))) {
+            free(st);
+            return;
+        }
+        st->next = g_search_terms[hash % SEARCH_TERM_BUCKETS];
+        g_search_terms[hash % SEARCH_TERM_BUCKETS] = st;
+        g_search_term_count++;
+    }
+
+    /* once per document */
+    if(st->count && st->ids[st->count - 1] == id)
+        return;
+
+    if(st->count == st->size) {
+        st->size = st->size ? st->size * 2 : 4;
+        if(!(grown = (uint32_t *)realloc(st->ids, st->size * sizeof(uint32_t)))) {
+            st->size = st->count;
+            return;
+        }
+        st->ids = grown;
+    }
+
+    st->ids[st->count++] = id;
+}
+
+static int search_doc_find(char *selector) {
+    int id;
+
+    id = g_search_doc_hash[search_hash(selector, strlen(selector)) % SEARCH_DOC_BUCKETS];
+    for(; id != -1; id = g_search_docs[id].hash_next) {
+        if(g_search_docs[id].alive && !strcmp(g_search_docs[id].selector, selector))
+            return id;
+    }
+
+    return -1;
+}
+
+static void search_doc_kill(int id) {
+    g_search_docs[id].alive = FALSE;
+    g_search_dead++;
+}
+
+/**
+ * read a file into the index, under a new document id
+ */
+static void search_doc_add(char *path, char *selector, struct stat *st) {
+    search_doc_t *grown, *doc;
+    ssize_t res;
+    size_t len = 0;
+    uint32_t id, bucket;
+    char *text;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+
+    if(!(text = (char *)malloc(st->st_size + 1))) {
+        close(fd);
+        return;
+    }
+
+    while(len < (size_t)st->st_size &&
+          (res = read(fd, text + len, st->st_size - len)) > 0)
+        len += res;
+    close(fd);
+
+    /* text only */
+    if(memchr(text, '\0', MIN(len, (size_t)SEARCH_BINARY_PROBE))) {
+        free(text);
+        return;
+    }
+
+    if(g_search_doc_count == g_search_doc_size) {
+        g_search_doc_size = g_search_doc_size ? g_search_doc_size * 2 : 256;
+        grown = (search_doc_t *)realloc(g_search_docs, g_search_doc_size * sizeof(search_doc_t));
+        if(!grown) {
+            g_search_doc_size = g_search_doc_count;
+            free(text);
+            return;
+        }
+        g_search_docs = grown;
+    }
+
+    id = g_search_doc_count;
+    doc = &g_search_docs[id];
+    if(!(doc->selector = strdup(selector))) {
+        free(text);
+        return;
+    }
+
+    doc->mtime = st->st_mtime;
+    doc->size = st->st_size;
+    doc->alive = TRUE;
+    bucket = search_hash(selector, strlen(selector)) % SEARCH_DOC_BUCKETS;
+    doc->hash_next = g_search_doc_hash[bucket];
+    g_search_doc_hash[bucket] = id;
+    g_search_doc_count++;
+
+    search_tokenize(text, len, search_doc_term, &id);
+    free(text);
+}
+
+/**
+ * bring one path's document up to date
+ */
+static void search_doc_update(char *path) {
+    char *selector = path + strlen(config.base_dir);
+    char *name = strrchr(path, '/');
+    struct stat st;
+    int id;
+
+    while(selector[0] == '/' && selector[1] == '/')
+        selector++;
+
+    id = search_doc_find(selector);
+
+    /* a gophermap is served as its directory's menu, never as
+     * a text file of its own */
+    if((name && !strcmp(name + 1, GOPHERMAP_NAME)) ||
+       stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+       (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) ||
+       (size_t)st.st_size > g_search_max_file_size) {
+        if(id != -1)
+            search_doc_kill(id);
+        return;
+    }
+
+    if(id != -1) {
+        if(g_search_docs[id].mtime == st.st_mtime && g_search_docs[id].size == st.st_size)
+            return;
+        search_doc_kill(id);
+    }
+
+    search_doc_add(path, selector, &st);
+}
+
+static void search_watch_add(char *path) {
+    search_watch_t *watch;
+    int wd;
+
+    if((wd = inotify_add_watch(g_search_fd, path, SEARCH_WATCH_MASK)) == -1) {
+        WARN("Cannot watch %s for search: %s", path, strerror(errno));
+        return;
+    }
+
+    for(watch = g_search_watches[wd % SEARCH_WATCH_BUCKETS]; watch; watch = watch->next) {
+        if(watch->wd == wd)
+            return;
+    }
+
+    if(!(watch = (search_watch_t *)calloc(1, sizeof(search_watch_t))) ||
+       !(watch->path = strdup(path))) {
+        free(watch);
+        return;
+    }
+
+    watch->wd = wd;
+    watch->next = g_search_watches[wd % SEARCH_WATCH_BUCKETS];
+    g_search_watches[wd % SEARCH_WATCH_BUCKETS] = watch;
+}
+
+static search_watch_t *search_watch_find(int wd) {
+    search_watch_t *watch;
+
+    for(watch = g_search_watches[wd % SEARCH_WATCH_BUCKETS]; watch; watch = watch->next) {
+        if(watch->wd == wd)
+            return watch;
+    }
+
+    return NULL;
+}
+
+/**
+ * index everything under a directory, watching as we go
+ */
+static void search_walk(char *path) {
+    char child[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+
+    search_watch_add(path);
+
+    if(!(dir = opendir(path)))
+        return;
+
+    while((de = readdir(dir))) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        if(snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child))
+            continue;
+
+        if(lstat(child, &st) == -1)
+            continue;
+
+        if(S_ISDIR(st.st_mode))
+            search_walk(child);
+        else if(S_ISREG(st.st_mode))
+            search_doc_update(child);
+    }
+
+    closedir(dir);
+}
+
+/**
+ * throw away all indexer state
+ */
+static void search_reset(void) {
+    search_term_t *st;
+    search_watch_t *watch;
+    uint32_t index;
+
+    for(index = 0; index < SEARCH_TERM_BUCKETS; index++) {
+        while((st = g_search_terms[index])) {
+            g_search_terms[index] = st->next;
+            free(st->term);
+            free(st->ids);
+            free(st);
+        }
+    }
+
+    for(index = 0; index < SEARCH_WATCH_BUCKETS; index++) {
+        while((watch = g_search_watches[index])) {
+            g_search_watches[index] = watch->next;
+            if(g_search_fd != -1)
+                inotify_rm_watch(g_search_fd, watch->wd);
+            free(watch->path);
+            free(watch);
+        }
+    }
+
+    for(index = 0; index < g_search_doc_count; index++)
+        free(g_search_docs[index].selector);
+    free(g_search_docs);
+
+    g_search_docs = NULL;
+    g_search_doc_count = g_search_doc_size = 0;
+    g_search_dead = 0;
+    g_search_term_count = 0;
+    memset(g_search_doc_hash, 0xff, sizeof(g_search_doc_hash));
+}
+
+static int search_term_cmp(const void *a, const void *b) {
+    return strcmp((*(search_term_t * const *)a)->term, (*(search_term_t * const *)b)->term);
+}
+
+/**
+ * growable byte buffer for building sections
+ */
+typedef struct search_buf_t {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int failed;
+} search_buf_t;
+
+static void search_buf_add(search_buf_t *buf, const void *data, size_t len) {
+    unsigned char *grown;
+    size_t size;
+
+    if(buf->failed)
+        return;
+
+    if(buf->len + len > buf->size) {
+        size = buf->size ? buf->size : 4096;
+        while(size < buf->len + len)
+            size *= 2;
+        if(!(grown = (unsigned char *)realloc(buf->data, size))) {
+            buf->failed = TRUE;
+            return;
+        }
+        buf->data = grown;
+        buf->size = size;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void search_buf_varint(search_buf_t *buf, uint32_t value) {
+    unsigned char byte;
+
+    do {
+        byte = value & 0x7f;
+        value >>= 7;
+        if(value)
+            byte |= 0x80;
+        search_buf_add(buf, &byte, 1);
+    } while(value);
+}
+
+/**
+ * write the live documents and terms out as an index file
+ * and swap it in
+ */
+static void search_write(void) {
+    search_buf_t docs = { 0 }, terms = { 0 }, postings = { 0 }, strings = { 0 };
+    search_term_entry_t entry;
+    search_header_t header;
+    search_term_t **sorted = NULL, *st;
+    search_index_t *index;
+    uint32_t *remap = NULL, id, last, off, bucket, count = 0, live = 0;
+    char tmp[PATH_MAX + 16];
+    FILE *fp;
+
+    /* dead documents drop out and the rest are renumbered */
+    remap = (uint32_t *)malloc((g_search_doc_count + 1) * sizeof(uint32_t));
+    sorted = (search_term_t **)malloc((g_search_term_count + 1) * sizeof(search_term_t *));
+    if(!remap || !sorted)
+        goto done;
+
+    for(id = 0; id < g_search_doc_count; id++) {
+        if(!g_search_docs[id].alive) {
+            remap[id] = UINT32_MAX;
+            continue;
+        }
+        remap[id] = live++;
+        off = strings.len;
+        search_buf_add(&docs, &off, sizeof(off));
+        search_buf_add(&strings, g_search_docs[id].selector,
+                       strlen(g_search_docs[id].selector) + 1);
+    }
+
+    for(bucket = 0; bucket < SEARCH_TERM_BUCKETS; bucket++) {
+        for(st = g_search_terms[bucket]; st; st = st->next)
+            sorted[count++] = st;
+    }
+    qsort(sorted, count, sizeof(search_term_t *), search_term_cmp);
+
+    for(bucket = 0; bucket < count; bucket++) {
+        st = sorted[bucket];
+
+        memset(&entry, 0, sizeof(entry));
+        entry.post_off = postings.len;
+        for(id = 0, last = 0; id < st->count; id++) {
+            if(remap[st->ids[id]] == UINT32_MAX)
+                continue;
+            search_buf_varint(&postings, remap[st->ids[id]] - (entry.post_count ? last : 0));
+            last = remap[st->ids[id]];
+            entry.post_count++;
+        }
+
+        if(!entry.post_count)
+            continue;
+
+        entry.str_off = strings.len;
+        entry.str_len = strlen(st->term);
+        search_buf_add(&strings, st->term, entry.str_len);
+        search_buf_add(&terms, &entry, sizeof(entry));
+    }
+
+    if(docs.failed || terms.failed || postings.failed || strings.failed) {
+        ERROR("Out of memory writing search index");
+        goto done;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_MAGIC, sizeof(header.magic));
+    header.doc_count = live;
+    header.term_count = terms.len / sizeof(search_term_entry_t);
+    header.docs_off = sizeof(header);
+    header.terms_off = header.docs_off + docs.len;
+    header.postings_off = header.terms_off + terms.len;
+    header.strings_off = header.postings_off + postings.len;
+    header.size = header.strings_off + strings.len;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", g_search_file, getpid());
+    if(!(fp = fopen(tmp, "w"))) {
+        WARN("Cannot write %s: %s", tmp, strerror(errno));
+        goto done;
+    }
+
+    fwrite(&header, sizeof(header), 1, fp);
+    if(docs.len)
+        fwrite(docs.data, docs.len, 1, fp);
+    if(terms.len)
+        fwrite(terms.data, terms.len, 1, fp);
+    if(postings.len)
+        fwrite(postings.data, postings.len, 1, fp);
+    if(strings.len)
+        fwrite(strings.data, strings.len, 1, fp);
+
+    if(ferror(fp) | fclose(fp) || rename(tmp, g_search_file) == -1) {
+        WARN("Cannot write %s: %s", g_search_file, strerror(errno));
+        unlink(tmp);
+        goto done;
+    }
+
+    if((index = search_index_map(g_search_file))) {
+        search_index_publish(index);
+        DEBUG("Search index: %u documents, %u terms, %zu bytes of postings",
+              live, header.term_count, postings.len);
+    }
+
+ done:
+    free(remap);
+    free(sorted);
+    free(docs.data);
+    free(terms.data);
+    free(postings.data);
+    free(strings.data);
+}
+
+/**
+ * make sense of a batch of inotify events
+ */
+static void search_events(char *buffer, ssize_t len) {
+    char path[PATH_MAX];
+    struct inotify_event *ev;
+    search_pending_t *pending;
+    search_watch_t *watch;
+    char *p;
+
+    for(p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ev->len) {
+        ev = (struct inotify_event *)p;
+
+        if(!g_search_due)
+            g_search_due = search_now() + SEARCH_DEBOUNCE_MS;
+
+        if(ev->mask & IN_Q_OVERFLOW) {
+            g_search_full = TRUE;
+            continue;
+        }
+
+        if(!(watch = search_watch_find(ev->wd)))
+            continue;
+
+        /* directories moving around: just start over */
+        if((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) ||
+           ((ev->mask & IN_ISDIR) && (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))) {
+            g_search_full = TRUE;
+            continue;
+        }
+
+        if(!ev->len || ev->name[0] == '.')
+            continue;
+
+        if(snprintf(path, sizeof(path), "%s/%s", watch->path, ev->name) >= (int)sizeof(path))
+            continue;
+
+        /* new directories get walked now, files wait for the batch */
+        if(ev->mask & IN_ISDIR) {
+            search_walk(path);
+            continue;
+        }
+
+        if(!(pending = (search_pending_t *)calloc(1, sizeof(search_pending_t))) ||
+           !(pending->path = strdup(path))) {
+            free(pending);
+            g_search_full = TRUE;
+            continue;
+        }
+
+        pending->next = g_search_pending;
+        g_search_pending = pending;
+    }
+}
+
+/**
+ * indexer thread
+ */
+static void *search_thread(void *arg) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    search_pending_t *pending;
+    struct pollfd pfd[2];
+    uint64_t now;
+    ssize_t len;
+    int timeout;
+
+    pfd[0].fd = g_search_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_search_wake[0];
+    pfd[1].events = POLLIN;
+
+    g_search_full = TRUE;
+    g_search_due = search_now();
+
+    while(1) {
+        now = search_now();
+        if(g_search_due && g_search_due <= now) {
+            g_search_due = 0;
+
+            /* lots of churn costs as much as a fresh walk */
+            if(g_search_full || g_search_dead > g_search_doc_count / 2 + 1024) {
+                search_reset();
+                search_walk(config.base_dir);
+                g_search_full = FALSE;
+            }
+
+            while((pending = g_search_pending)) {
+                g_search_pending = pending->next;
+                search_doc_update(pending->path);
+                free(pending->path);
+                free(pending);
+            }
+
+            search_write();
+        }
+
+        /* wake now and then to free retired indexes */
+        epoch_reclaim();
+        now = search_now();
+        timeout = g_search_due ? (g_search_due > now ? (int)(g_search_due - now) : 0) : 1000;
+        if(timeout > 1000)
+            timeout = 1000;
+
+        if(poll(pfd, 2, timeout) == -1 && errno != EINTR)
+            break;
+
+        if(pfd[1].revents && read(g_search_wake[0], buffer, sizeof(buffer)) == 0)
+            break;
+
+        while((len = read(g_search_fd, buffer, sizeof(buffer))) > 0)
+            search_events(buffer, len);
+    }
+
+    while((pending = g_search_pending)) {
+        g_search_pending = pending->next;
+        free(pending->path);
+        free(pending);
+    }
+
+    search_reset();
+    return NULL;
+}
+
+/**
+ * start the search indexer.  Must be called after any forking
+ * is done.
+ *
+ * @param selector selector searches are sent to (NULL disables)
+ * @param index_file where the index is kept
+ * @param max_file_size largest file worth indexing
+ * @param max_results most matches returned for a query
+ * @returns TRUE on success, FALSE otherwise
+ */
+int search_init(char *selector, char *index_file, size_t max_file_size,
+                int max_results) {
+    search_index_t *index;
+
+    if(!selector || !*selector)
+        return TRUE;
+
+    g_search_max_file_size = max_file_size;
+    g_search_max_results = max_results > 0 ? max_results : 1;
+    memset(g_search_doc_hash, 0xff, sizeof(g_search_doc_hash));
+
+    g_search_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(g_search_fd == -1 || pipe2(g_search_wake, O_NONBLOCK | O_CLOEXEC) == -1 ||
+       !(g_search_file = strdup(index_file)) || !(g_search_selector = strdup(selector))) {
+        ERROR("Cannot set up search: %s", strerror(errno));
+        search_deinit();
+        return FALSE;
+    }
+
+    /* whatever we had last time will do until the first walk */
+    if((index = search_index_map(g_search_file))) {
+        INFO("Using existing search index %s", g_search_file);
+        search_index_publish(index);
+    }
+
+    if(pthread_create(&g_search_thread, NULL, search_thread, NULL)) {
+        ERROR("Cannot start search indexer");
+        search_deinit();
+        return FALSE;
+    }
+
+    g_search_started = TRUE;
+    return TRUE;
+}
+
+/**
+ * stop the indexer.  Must be called once the loops are done.
+ */
+void search_deinit(void) {
+    search_index_t *index;
+
+    if(g_search_wake[1] != -1) {
+        close(g_search_wake[1]);
+        g_search_wake[1] = -1;
+    }
+
+    if(g_search_started) {
+        pthread_join(g_search_thread, NULL);
+        g_search_started = FALSE;
+    }
+
+    if(g_search_wake[0] != -1) {
+        close(g_search_wake[0]);
+        g_search_wake[0] = -1;
+    }
+
+    if(g_search_fd != -1) {
+        close(g_search_fd);
+        g_search_fd = -1;
+    }
+
+    if((index = __atomic_exchange_n(&g_search_index, NULL, __ATOMIC_ACQ_REL)))
+        search_index_free(index);
+
+    free(g_search_file);
+    free(g_search_selector);
+    g_search_file = NULL;
+    g_search_selector = NULL;
+}
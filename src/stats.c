@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * what's hot right now: the busiest selectors and client
+ * subnets (/24 for v4, /48 for v6), counted as requests come
+ * in and decayed with a half life of stats_half_life seconds.
+ *
+ * Each loop counts into its own trackers (see topk.c), so the
+ * request path never contends with another loop.  A request
+ * for stats_selector merges them and answers with the top
+ * stats_top of each, as a menu of info lines.  Since that
+ * shows client addresses, it's only answered to loopback.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "main.h"
+#include "debug.h"
+#include "loop.h"
+#include "mem.h"
+#include "pace.h"
+#include "stats.h"
+#include "topk.h"
+
+#define STATS_SKETCH_WIDTH 4096
+
+typedef struct stats_loop_t {
+    topk_t *selectors;
+    topk_t *subnets;
+} stats_loop_t;
+
+static char *g_stats_selector = NULL;
+static int g_stats_top = 0;
+static int g_stats_half_life = 0;
+static stats_loop_t *g_stats = NULL;
+
+/**
+ * set up a pair of trackers for each loop.  Must be called
+ * once the loops exist.
+ *
+ * @param selector where stats are served (NULL disables)
+ * @param top entries to show of each
+ * @param half_life seconds for a count to halve
+ * @returns TRUE on success, FALSE otherwise
+ */
+int stats_init(char *selector, int top, int half_life) {
+    int index;
+
+    if(!selector || top <= 0)
+        return TRUE;
+
+    g_stats_top = top;
+    g_stats_half_life = half_life > 0 ? half_life : 1;
+
+    g_stats = (stats_loop_t *)calloc(g_loop_count, sizeof(stats_loop_t));
+    if(!g_stats || !(g_stats_selector = strdup(selector))) {
+        ERROR("malloc");
+        stats_deinit();
+        return FALSE;
+    }
+
+    for(index = 0; index < g_loop_count; index++) {
+        g_stats[index].selectors = topk_new(top, STATS_SKETCH_WIDTH, g_stats_half_life);
+        g_stats[index].subnets = topk_new(top, STATS_SKETCH_WIDTH, g_stats_half_life);
+        if(!g_stats[index].selectors || !g_stats[index].subnets) {
+            stats_deinit();
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * free the trackers
+ */
+void stats_deinit(void) {
+    int index;
+
+    for(index = 0; g_stats && index < g_loop_count; index++) {
+        topk_free(g_stats[index].selectors);
+        topk_free(g_stats[index].subnets);
+    }
+
+    free(g_stats);
+    free(g_stats_selector);
+    g_stats = NULL;
+    g_stats_selector = NULL;
+}
+
+/**
+ * the subnet an address is in, packed as family, then the
+ * network bytes: 3 for v4, 6 for v6.  v4-mapped v6 counts
+ * as v4.
+ *
+ * @param addr peer address
+ * @returns subnet key, 0 for anything else
+ */
+uint64_t stats_subnet(struct sockaddr *addr) {
+    struct sockaddr_in6 *sin6;
+    unsigned char key[8] = { 0 };
+    uint64_t subnet;
+
+    switch(addr->sa_family) {
+    case AF_INET:
+        key[0] = 4;
+        memcpy(key + 1, &((struct sockaddr_in *)addr)->sin_addr, 3);
+        break;
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *)addr;
+        if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            key[0] = 4;
+            memcpy(key + 1, (unsigned char *)&sin6->sin6_addr + 12, 3);
+        } else {
+            key[0] = 6;
+            memcpy(key + 1, &sin6->sin6_addr, 6);
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    memcpy(&subnet, key, sizeof(subnet));
+    return subnet;
+}
+
+static double stats_now(client_t *client) {
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(client->loop->base, &tv);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+}
+
+/**
+ * count a request against its selector and subnet.  Only
+ * touches the client's own loop's trackers.
+ *
+ * @param client client with its request read
+ */
+void stats_record(client_t *client) {
+    stats_loop_t *stats;
+    double now;
+
+    if(!g_stats)
+        return;
+
+    stats = &g_stats[client->loop->id];
+    now = stats_now(client);
+
+    topk_add(stats->selectors, client->request, strlen(client->request), now);
+    if(client->subnet)
+        topk_add(stats->subnets, &client->subnet, sizeof(client->subnet), now);
+}
+
+/**
+ * does a request name the stats selector?
+ *
+ * @param request client selector
+ * @returns TRUE if it's a stats request
+ */
+int stats_selector(char *request) {
+    return g_stats_selector && !strcmp(request, g_stats_selector);
+}
+
+/**
+ * may this client see the stats?  Only if it's on loopback.
+ *
+ * @param client client asking
+ * @returns TRUE if so
+ */
+int stats_allowed(client_t *client) {
+    unsigned char key[8];
+
+    memcpy(key, &client->subnet, sizeof(key));
+
+    if(key[0] == 4)
+        return key[1] == 127;
+
+    /* ::1 is in ::/48 -- nothing else in there can reach us */
+    return key[0] == 6 && !key[1] && !key[2] && !key[3] &&
+        !key[4] && !key[5] && !key[6];
+}
+
+static void stats_render_subnet(const topk_entry_t *entry, char *buf, size_t len) {
+    const unsigned char *key = (const unsigned char *)entry->key;
+
+    if(key[0] == 4) {
+        snprintf(buf, len, "%u.%u.%u.0/24", key[1], key[2], key[3]);
+    } else {
+        snprintf(buf, len, "%x:%x:%x::/48", key[1] << 8 | key[2],
+                 key[3] << 8 | key[4], key[5] << 8 | key[6]);
+    }
+}
+
+/**
+ * render one tracker kind, merged across loops
+ */
+static int stats_render_top(struct evbuffer *output, const char *title,
+                            int subnets, double now) {
+    topk_t **trackers;
+    topk_entry_t *top;
+    char name[64];
+    int count, index;
+
+    trackers = (topk_t **)calloc(g_loop_count, sizeof(topk_t *));
+    top = (topk_entry_t *)calloc(g_stats_top, sizeof(topk_entry_t));
+    if(!trackers || !top) {
+        ERROR("malloc");
+        free(trackers);
+        free(top);
+        return FALSE;
+    }
+
+    for(index = 0; index < g_loop_count; index++)
+        trackers[index] = subnets ? g_stats[index].subnets : g_stats[index].selectors;
+
+    count = topk_merge(trackers, g_loop_count, now, top, g_stats_top);
+
+    evbuffer_add_printf(output, "i%s\t\t\t\n\r", title);
+    for(index = 0; index < count; index++) {
+        if(subnets) {
+            stats_render_subnet(&top[index], name, sizeof(name));
+            evbuffer_add_printf(output, "i%10.1f  %s\t\t\t\n\r", top[index].count, name);
+        } else {
+            evbuffer_add_printf(output, "i%10.1f  %.*s%s\t\t\t\n\r", top[index].count,
+                                (int)top[index].len, top[index].key,
+                                top[index].len == TOPK_KEY_MAX ? "..." : "");
+        }
+    }
+
+    free(trackers);
+    free(top);
+    return TRUE;
+}
+
+/**
+ * render the current top selectors and subnets as a menu
+ *
+ * @param client client asking (for the time)
+ * @param output buffer to render into
+ * @returns TRUE on success, FALSE otherwise
+ */
+int stats_render(client_t *client, struct evbuffer *output) {
+    char title[80];
+    double now = stats_now(client);
+
+    snprintf(title, sizeof(title), "Hot selectors (requests, %ds half life)",
+             g_stats_half_life);
+    if(!stats_render_top(output, title, FALSE, now))
+        return FALSE;
+
+    evbuffer_add_printf(output, "i\t\t\t\n\r");
+
+    snprintf(title, sizeof(title), "Hot client subnets (requests, %ds half life)",
+             g_stats_half_life);
+    if(!stats_render_top(output, title, TRUE, now))
+        return FALSE;
+
+    evbuffer_add_printf(output, "i\t\t\t\n\r");
+    mem_render(output);
+    evbuffer_add_printf(output, "i\t\t\t\n\r");
+    pace_render(output);
+    return TRUE;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <event.h>
+
+#include "plugin.h"
+
+extern int stats_init(char *selector, int top, int half_life);
+extern void stats_deinit(void);
+extern uint64_t stats_subnet(struct sockaddr *addr);
+extern void stats_record(client_t *client);
+extern int stats_selector(char *request);
+extern int stats_allowed(client_t *client);
+extern int stats_render(client_t *client, struct evbuffer *output);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * TLS ("gophers") for the second listener.
+ *
+ * Connections are handshaken and their request read through a
+ * libevent OpenSSL bufferevent.  The context asks OpenSSL for
+ * kernel TLS, so where the kernel supports the negotiated
+ * cipher, record encryption moves into the socket during the
+ * handshake.  Once the request is in, a client whose socket
+ * encrypts for itself drops back to a plain bufferevent (or
+ * the epoll engine) and is answered exactly like a plain one --
+ * chunk references, sendfile()d pack segments and spliced
+ * exec/proxy output all go straight to the socket.  Where the
+ * kernel can't, the client stays on the OpenSSL bufferevent and
+ * the response is encrypted in user space; executables and
+ * proxied selectors can't be relayed that way, and are refused.
+ *
+ * Sessions are resumable both from the server side cache
+ * (tls_session_cache entries) and with session tickets.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event.h>
+
+#ifdef HAVE_OPENSSL
+# include <openssl/err.h>
+# include <openssl/ssl.h>
+# include <event2/bufferevent_ssl.h>
+#endif
+
+#include "main.h"
+#include "debug.h"
+#include "tls.h"
+
+/**
+ * was TLS support built in?
+ *
+ * @returns TRUE if so, FALSE otherwise
+ */
+int tls_available(void) {
+#ifdef HAVE_OPENSSL
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+#ifdef HAVE_OPENSSL
+
+#define TLS_SESSION_CONTEXT "evgopherd"
+
+static SSL_CTX *g_tls_ctx = NULL;
+
+/**
+ * log whatever OpenSSL has queued up
+ */
+static void tls_log_errors(const char *what) {
+    unsigned long err;
+    char buffer[256];
+
+    while((err = ERR_get_error())) {
+        ERR_error_string_n(err, buffer, sizeof(buffer));
+        ERROR("%s: %s", what, buffer);
+    }
+}
+
+/**
+ * set up the server context
+ *
+ * @param cert certificate chain (PEM)
+ * @param key private key (PEM)
+ * @param cache_size sessions to keep for resumption
+ * @returns TRUE on success, FALSE otherwise
+ */
+int tls_init(char *cert, char *key, int cache_size) {
+    if(!cert || !key) {
+        ERROR("tls_port needs tls_cert and tls_key");
+        return FALSE;
+    }
+
+    g_tls_ctx = SSL_CTX_new(TLS_server_method());
+    if(!g_tls_ctx) {
+        tls_log_errors("SSL_CTX_new");
+        return FALSE;
+    }
+
+    SSL_CTX_set_min_proto_version(g_tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(g_tls_ctx, SSL_OP_NO_COMPRESSION |
+                        SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(g_tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    /* most connections see one request, and kept ones are handed
+     * to the kernel or go quiet between requests, so buffers can
+     * go whenever they're empty */
+    SSL_CTX_set_mode(g_tls_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    SSL_CTX_set_session_cache_mode(g_tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(g_tls_ctx, cache_size);
+    SSL_CTX_set_session_id_context(g_tls_ctx, (const unsigned char *)TLS_SESSION_CONTEXT,
+                                   strlen(TLS_SESSION_CONTEXT));
+
+    if(SSL_CTX_use_certificate_chain_file(g_tls_ctx, cert) != 1) {
+        tls_log_errors(cert);
+        tls_deinit();
+        return FALSE;
+    }
+
+    if(SSL_CTX_use_PrivateKey_file(g_tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(g_tls_ctx) != 1) {
+        tls_log_errors(key);
+        tls_deinit();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * drop the server context
+ */
+void tls_deinit(void) {
+    if(g_tls_ctx) {
+        SSL_CTX_free(g_tls_ctx);
+        g_tls_ctx = NULL;
+    }
+}
+
+/**
+ * start a handshake on a freshly accepted socket
+ *
+ * @param base loop's event base
+ * @param fd client socket
+ * @param tls set to the connection, to be tls_free()d after the
+ *            bufferevent (which doesn't own it)
+ * @returns bufferevent to read the request from, or NULL
+ */
+struct bufferevent *tls_bufferevent(struct event_base *base, int fd, void **tls) {
+    struct bufferevent *bev;
+    SSL *ssl;
+
+    if(!(ssl = SSL_new(g_tls_ctx))) {
+        tls_log_errors("SSL_new");
+        return NULL;
+    }
+
+    bev = bufferevent_openssl_socket_new(base, fd, ssl, BUFFEREVENT_SSL_ACCEPTING, 0);
+    if(!bev) {
+        ERROR("Could not set up TLS on fd %d", fd);
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    /* the client may just hang up when it has its answer */
+    bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+
+    *tls = ssl;
+    return bev;
+}
+
+/**
+ * is the kernel encrypting what we write to the socket?
+ *
+ * @param tls connection from tls_bufferevent()
+ * @returns TRUE if so, FALSE otherwise
+ */
+int tls_kernel_send(void *tls) {
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio((SSL *)tls)) == 1;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * is the kernel decrypting what we read from the socket?
+ *
+ * @param tls connection from tls_bufferevent()
+ * @returns TRUE if so, FALSE otherwise
+ */
+int tls_kernel_recv(void *tls) {
+#ifdef BIO_get_ktls_recv
+    return BIO_get_ktls_recv(SSL_get_rbio((SSL *)tls)) == 1;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * the response is complete -- tell the client so, since gopher
+ * has nothing else to tell a whole response from a cut off one
+ *
+ * @param tls connection from tls_bufferevent()
+ */
+void tls_close_notify(void *tls) {
+    SSL_shutdown((SSL *)tls);
+    ERR_clear_error();
+}
+
+/**
+ * done with a connection
+ *
+ * @param tls connection from tls_bufferevent()
+ */
+void tls_free(void *tls) {
+    SSL_free((SSL *)tls);
+}
+
+#else /* !HAVE_OPENSSL */
+
+int tls_init(char *cert, char *key, int cache_size) {
+    ERROR("Not built with TLS support");
+    return FALSE;
+}
+
+void tls_deinit(void) {
+}
+
+struct bufferevent *tls_bufferevent(struct event_base *base, int fd, void **tls) {
+    return NULL;
+}
+
+int tls_kernel_send(void *tls) {
+    return FALSE;
+}
+
+int tls_kernel_recv(void *tls) {
+    return FALSE;
+}
+
+void tls_close_notify(void *tls) {
+}
+
+void tls_free(void *tls) {
+}
+
+#endif /* HAVE_OPENSSL */
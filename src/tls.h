@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <event.h>
+
+extern int tls_available(void);
+extern int tls_init(char *cert, char *key, int cache_size);
+extern void tls_deinit(void);
+extern struct bufferevent *tls_bufferevent(struct event_base *base, int fd,
+                                           void **tls);
+extern int tls_kernel_send(void *tls);
+extern int tls_kernel_recv(void *tls);
+extern void tls_close_notify(void *tls);
+extern void tls_free(void *tls);
+
+#endif /* _TLS_H_ */
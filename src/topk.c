@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * streaming heavy hitters.
+ *
+ * A Count-Min sketch (TOPK_DEPTH rows of width counters, with
+ * conservative update) estimates how often any key has been
+ * seen, in fixed memory however many keys there are.  A small
+ * min-heap keeps the keys with the biggest estimates; a new
+ * key gets in once its estimate beats the smallest one there.
+ *
+ * Counts decay exponentially with half_life.  Rather than
+ * touching every counter as time passes, each hit adds a
+ * weight that doubles every half_life (forward decay), and
+ * reading divides by the current weight.  When the weight gets
+ * big, everything is scaled back down and it starts from 1.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "debug.h"
+#include "topk.h"
+
+#define TOPK_DEPTH 4
+#define TOPK_RESCALE 65536.0
+
+static uint64_t topk_hash(const void *key, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)key;
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(len--) {
+        hash ^= *bytes++;
+        hash *= 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* double hashing: row i uses h1 + i * h2 */
+#define TOPK_CELL(topk, hash, i) \
+    ((i) * (topk)->width + \
+     (((uint32_t)(hash) + (i) * (uint32_t)((hash) >> 32 | 1)) & ((topk)->width - 1)))
+
+static double topk_weight(topk_t *topk, double now) {
+    double age = now - topk->epoch;
+
+    return age > 0 ? exp2(age / topk->half_life) : 1.0;
+}
+
+static double topk_estimate(topk_t *topk, uint64_t hash) {
+    double est = topk->cells[TOPK_CELL(topk, hash, 0)];
+    int i;
+
+    for(i = 1; i < TOPK_DEPTH; i++) {
+        if(topk->cells[TOPK_CELL(topk, hash, i)] < est)
+            est = topk->cells[TOPK_CELL(topk, hash, i)];
+    }
+
+    return est;
+}
+
+static void topk_swap(topk_entry_t *a, topk_entry_t *b) {
+    topk_entry_t tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+static void topk_sift_up(topk_t *topk, int index) {
+    int parent;
+
+    while(index && topk->heap[(parent = (index - 1) / 2)].count > topk->heap[index].count) {
+        topk_swap(&topk->heap[parent], &topk->heap[index]);
+        index = parent;
+    }
+}
+
+static void topk_sift_down(topk_t *topk, int index) {
+    int child, least;
+
+    for(;;) {
+        least = index;
+        child = index * 2 + 1;
+        if(child < topk->used && topk->heap[child].count < topk->heap[least].count)
+            least = child;
+        child++;
+        if(child < topk->used && topk->heap[child].count < topk->heap[least].count)
+            least = child;
+        if(least == index)
+            return;
+        topk_swap(&topk->heap[least], &topk->heap[index]);
+        index = least;
+    }
+}
+
+/**
+ * bring every count back to weight 1 as of now
+ */
+static void topk_rescale(topk_t *topk, double weight, double now) {
+    uint32_t index;
+    int entry;
+
+    for(index = 0; index < TOPK_DEPTH * topk->width; index++)
+        topk->cells[index] = (float)(topk->cells[index] / weight);
+    for(entry = 0; entry < topk->used; entry++)
+        topk->heap[entry].count /= weight;
+
+    topk->epoch = now;
+}
+
+/**
+ * make a tracker
+ *
+ * @param size keys to keep in the top
+ * @param width sketch columns, rounded up to a power of two
+ * @param half_life seconds for a count to fall by half
+ * @returns tracker to be topk_free()d, or NULL
+ */
+topk_t *topk_new(int size, uint32_t width, double half_life) {
+    topk_t *topk;
+    uint32_t columns = 64;
+
+    while(columns < width)
+        columns *= 2;
+
+    if(!(topk = (topk_t *)calloc(1, sizeof(topk_t)))) {
+        ERROR("malloc");
+        return NULL;
+    }
+
+    pthread_mutex_init(&topk->lock, NULL);
+
+    if(!(topk->cells = (float *)calloc(TOPK_DEPTH * columns, sizeof(float))) ||
+       !(topk->heap = (topk_entry_t *)calloc(size, sizeof(topk_entry_t)))) {
+        ERROR("malloc");
+        topk_free(topk);
+        return NULL;
+    }
+
+    topk->width = columns;
+    topk->size = size;
+    topk->half_life = half_life > 0 ? half_life : 1;
+    topk->epoch = -1;   /* set by the first hit */
+    return topk;
+}
+
+/**
+ * free a tracker
+ *
+ * @param topk tracker from topk_new(), or NULL
+ */
+void topk_free(topk_t *topk) {
+    if(!topk)
+        return;
+
+    pthread_mutex_destroy(&topk->lock);
+    free(topk->cells);
+    free(topk->heap);
+    free(topk);
+}
+
+/**
+ * count one hit on a key
+ *
+ * @param topk tracker
+ * @param key key bytes
+ * @param len key length
+ * @param now seconds, on any clock that only goes forward
+ */
+void topk_add(topk_t *topk, const void *key, size_t len, double now) {
+    uint64_t hash = topk_hash(key, len);
+    uint32_t cell;
+    double weight, est;
+    int i;
+
+    pthread_mutex_lock(&topk->lock);
+
+    if(topk->epoch < 0)
+        topk->epoch = now;
+
+    weight = topk_weight(topk, now);
+    if(weight > TOPK_RESCALE) {
+        topk_rescale(topk, weight, now);
+        weight = 1.0;
+    }
+
+    /* conservative update: only raise the counters that are
+     * holding the estimate down */
+    est = topk_estimate(topk, hash) + weight;
+    for(i = 0; i < TOPK_DEPTH; i++) {
+        cell = TOPK_CELL(topk, hash, i);
+        if(topk->cells[cell] < est)
+            topk->cells[cell] = (float)est;
+    }
+
+    /* estimates only grow, so a key already in the top is
+     * always above its least */
+    if(topk->used == topk->size && (!topk->size || est <= topk->heap[0].count)) {
+        pthread_mutex_unlock(&topk->lock);
+        return;
+    }
+
+    for(i = 0; i < topk->used; i++) {
+        if(topk->heap[i].hash == hash) {
+            topk->heap[i].count = est;
+            topk_sift_down(topk, i);
+            pthread_mutex_unlock(&topk->lock);
+            return;
+        }
+    }
+
+    if(topk->used < topk->size) {
+        i = topk->used++;
+    } else {
+        i = 0;
+    }
+
+    topk->heap[i].hash = hash;
+    topk->heap[i].count = est;
+    topk->heap[i].len = len < TOPK_KEY_MAX ? len : TOPK_KEY_MAX;
+    memcpy(topk->heap[i].key, key, topk->heap[i].len);
+
+    if(i)
+        topk_sift_up(topk, i);
+    else
+        topk_sift_down(topk, 0);
+
+    pthread_mutex_unlock(&topk->lock);
+}
+
+static int topk_compare(const void *a, const void *b) {
+    const topk_entry_t *ea = (const topk_entry_t *)a;
+    const topk_entry_t *eb = (const topk_entry_t *)b;
+
+    if(ea->count != eb->count)
+        return ea->count < eb->count ? 1 : -1;
+    return 0;
+}
+
+/**
+ * the current top across several trackers of the same kind
+ * of key (one per loop, say), biggest first.  Counts come
+ * back decayed to now, summed over every tracker's sketch.
+ *
+ * @param trackers trackers to combine (NULL ones are skipped)
+ * @param count how many
+ * @param now seconds, on the clock passed to topk_add()
+ * @param out where to put the top keys
+ * @param max room in out
+ * @returns keys in out
+ */
+int topk_merge(topk_t **trackers, int count, double now,
+               topk_entry_t *out, int max) {
+    topk_entry_t *candidates;
+    int total = 0, found = 0, index, entry, seen;
+    topk_t *topk;
+    double weight;
+
+    for(index = 0; index < count; index++) {
+        if(trackers[index])
+            total += trackers[index]->size;
+    }
+
+    if(!total || max <= 0)
+        return 0;
+
+    if(!(candidates = (topk_entry_t *)malloc(total * sizeof(topk_entry_t)))) {
+        ERROR("malloc");
+        return 0;
+    }
+
+    /* every key that's in any tracker's top */
+    for(index = 0; index < count; index++) {
+        if(!(topk = trackers[index]))
+            continue;
+
+        pthread_mutex_lock(&topk->lock);
+        for(entry = 0; entry < topk->used; entry++) {
+            for(seen = 0; seen < found; seen++) {
+                if(candidates[seen].hash == topk->heap[entry].hash)
+                    break;
+            }
+            if(seen == found) {
+                candidates[found] = topk->heap[entry];
+                candidates[found++].count = 0;
+            }
+        }
+        pthread_mutex_unlock(&topk->lock);
+    }
+
+    /* ...and how often each of them has been seen, everywhere */
+    for(index = 0; index < count; index++) {
+        if(!(topk = trackers[index]))
+            continue;
+
+        pthread_mutex_lock(&topk->lock);
+        if(topk->epoch >= 0) {
+            weight = topk_weight(topk, now);
+            for(entry = 0; entry < found; entry++)
+                candidates[entry].count += topk_estimate(topk, candidates[entry].hash) / weight;
+        }
+        pthread_mutex_unlock(&topk->lock);
+    }
+
+    qsort(candidates, found, sizeof(topk_entry_t), topk_compare);
+    if(found > max)
+        found = max;
+    memcpy(out, candidates, found * sizeof(topk_entry_t));
+    free(candidates);
+
+    return found;
+}
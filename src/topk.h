@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TOPK_H_
+#define _TOPK_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TOPK_KEY_MAX 128
+
+typedef struct topk_entry_t {
+    uint64_t hash;
+    double count;            /* scaled by the tracker's weight */
+    size_t len;
+    char key[TOPK_KEY_MAX];  /* truncated, for show */
+} topk_entry_t;
+
+/* heavy hitters over a decaying stream of keys, in fixed
+ * memory.  Updated by one loop; read by anyone, under lock. */
+typedef struct topk_t {
+    pthread_mutex_t lock;
+    uint32_t width;          /* sketch columns, a power of two */
+    float *cells;            /* TOPK_DEPTH rows of width */
+    topk_entry_t *heap;      /* the current top, least first */
+    int size;
+    int used;
+    double half_life;        /* seconds */
+    double epoch;            /* when weights were last 1 */
+} topk_t;
+
+extern topk_t *topk_new(int size, uint32_t width, double half_life);
+extern void topk_free(topk_t *topk);
+extern void topk_add(topk_t *topk, const void *key, size_t len, double now);
+extern int topk_merge(topk_t **trackers, int count, double now,
+                      topk_entry_t *out, int max);
+
+#endif /* _TOPK_H_ */
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * request phase timing, and a flight recorder of slow requests.
+ *
+ * Every client carries the time it passed each phase: accept,
+ * request read, dispatch, filesystem lookup, first byte out.
+ * When one that took trace_slow_ms or more closes, its phases
+ * go into its loop's ring of the last trace_ring_size slow
+ * requests.  Rings are only ever touched by their own loop, so
+ * recording costs a few clock reads and no locking.  SIGUSR1
+ * asks every loop to log its ring.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "debug.h"
+#include "loop.h"
+#include "plugin.h"
+#include "trace.h"
+
+#define TRACE_SELECTOR_MAX 96
+
+typedef struct trace_record_t {
+    time_t when;             /* wall clock at close */
+    uint32_t read_us;        /* phases, from accept; 0 if never */
+    uint32_t request_us;
+    uint32_t lookup_us;
+    uint32_t first_byte_us;
+    uint32_t total_us;
+    internal_type_t type;
+    char selector[TRACE_SELECTOR_MAX];
+} trace_record_t;
+
+typedef struct trace_ring_t {
+    trace_record_t *records;
+    uint64_t recorded;       /* ever, so also the next slot */
+} trace_ring_t;
+
+static const char *g_trace_types[] = {
+    [TYPE_UNKNOWN] = "-",
+    [TYPE_DIR] = "dir",
+    [TYPE_FILE] = "file",
+    [TYPE_EXEC] = "exec",
+    [TYPE_PROXY] = "proxy",
+    [TYPE_LOOKUP] = "lookup",
+    [TYPE_PACK] = "pack",
+};
+
+static trace_ring_t *g_trace_rings = NULL;
+static int g_trace_ring_size = 0;
+static uint64_t g_trace_slow_us = 0;
+
+/**
+ * set up a ring for each loop.  Must be called once the loops
+ * exist.
+ *
+ * @param ring_size slow requests each loop remembers (0 disables)
+ * @param slow_ms requests this slow get recorded
+ * @returns TRUE on success, FALSE otherwise
+ */
+int trace_init(int ring_size, int slow_ms) {
+    int index;
+
+    if(ring_size <= 0)
+        return TRUE;
+
+    g_trace_ring_size = ring_size;
+    g_trace_slow_us = slow_ms > 0 ? (uint64_t)slow_ms * 1000 : 0;
+
+    g_trace_rings = (trace_ring_t *)calloc(g_loop_count, sizeof(trace_ring_t));
+    if(!g_trace_rings) {
+        ERROR("malloc");
+        return FALSE;
+    }
+
+    for(index = 0; index < g_loop_count; index++) {
+        g_trace_rings[index].records =
+            (trace_record_t *)calloc(ring_size, sizeof(trace_record_t));
+        if(!g_trace_rings[index].records) {
+            ERROR("malloc");
+            trace_deinit();
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * free the rings
+ */
+void trace_deinit(void) {
+    int index;
+
+    for(index = 0; g_trace_rings && index < g_loop_count; index++)
+        free(g_trace_rings[index].records);
+
+    free(g_trace_rings);
+    g_trace_rings = NULL;
+}
+
+/**
+ * @returns microseconds on the monotonic clock
+ */
+uint64_t trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * response bytes have left us.  Only the first time after the
+ * request was dispatched counts.
+ *
+ * @param client client making progress
+ */
+void trace_first_byte(client_t *client) {
+    trace_t *trace = &client->trace;
+
+    if(trace->first_byte_us || !trace->request_us)
+        return;
+
+    trace->first_byte_us = trace_now();
+    TRACE_PROBE2(first_byte, client->fd, trace->first_byte_us - trace->accept_us);
+}
+
+static uint32_t trace_since(trace_t *trace, uint64_t stamp) {
+    return stamp ? (uint32_t)(stamp - trace->accept_us) : 0;
+}
+
+/**
+ * a client is closing, or is done with a request on a kept
+ * connection -- keep its phases if it was slow
+ *
+ * @param client client being closed
+ */
+void trace_close(client_t *client) {
+    trace_t *trace = &client->trace;
+    trace_record_t *record;
+    trace_ring_t *ring;
+    uint64_t total;
+
+    /* a kept connection that's idle between requests */
+    if(!trace->accept_us)
+        return;
+
+    total = trace_now() - trace->accept_us;
+    TRACE_PROBE2(close, client->fd, total);
+
+    if(!g_trace_rings || total < g_trace_slow_us)
+        return;
+
+    ring = &g_trace_rings[client->loop->id];
+    record = &ring->records[ring->recorded++ % g_trace_ring_size];
+
+    record->when = time(NULL);
+    record->read_us = trace_since(trace, trace->read_us);
+    record->request_us = trace_since(trace, trace->request_us);
+    record->lookup_us = trace_since(trace, trace->lookup_us);
+    record->first_byte_us = trace_since(trace, trace->first_byte_us);
+    record->total_us = (uint32_t)total;
+    record->type = client->request_type;
+    strncpy(record->selector, client->request ? client->request : "",
+            sizeof(record->selector) - 1);
+    record->selector[sizeof(record->selector) - 1] = '\0';
+}
+
+/**
+ * log one loop's ring, oldest first.  Runs on that loop.
+ */
+static void trace_dump_loop(void *arg) {
+    loop_t *loop = (loop_t *)arg;
+    trace_ring_t *ring = &g_trace_rings[loop->id];
+    trace_record_t *record;
+    uint64_t index, first;
+    struct tm tm;
+    char when[32];
+
+    first = ring->recorded > (uint64_t)g_trace_ring_size ?
+        ring->recorded - g_trace_ring_size : 0;
+
+    WARN("Loop %d: %llu slow requests, last %llu follow (ms from accept: "
+         "read/dispatch/lookup/first byte/close)", loop->id,
+         (unsigned long long)ring->recorded,
+         (unsigned long long)(ring->recorded - first));
+
+    for(index = first; index < ring->recorded; index++) {
+        record = &ring->records[index % g_trace_ring_size];
+        localtime_r(&record->when, &tm);
+        strftime(when, sizeof(when), "%H:%M:%S", &tm);
+        WARN("Loop %d: %s %.1f/%.1f/%.1f/%.1f/%.1f %s %s", loop->id, when,
+             record->read_us / 1000.0, record->request_us / 1000.0,
+             record->lookup_us / 1000.0, record->first_byte_us / 1000.0,
+             record->total_us / 1000.0, g_trace_types[record->type],
+             record->selector);
+    }
+}
+
+/**
+ * have every loop log its flight recorder.  Safe from any
+ * thread.
+ */
+void trace_dump(void) {
+    int index;
+
+    if(!g_trace_rings) {
+        WARN("Flight recorder is off");
+        return;
+    }
+
+    for(index = 0; index < g_loop_count; index++) {
+        if(!loop_post(g_loops[index], trace_dump_loop, g_loops[index]))
+            ERROR("Could not dump loop %d's flight recorder", index);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* USDT probes, one per request phase.  Each is a single nop
+ * until a tracer attaches:
+ *
+ *   accept(fd, loop)            connection taken
+ *   request_read(fd, selector)  whole request line read
+ *   request(fd, selector)       dispatching the request
+ *   lookup_done(fd, errno)      filesystem lookup answered
+ *   first_byte(fd, usec)        first response bytes left us
+ *   close(fd, usec)             connection closed
+ */
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(evgopherd, name, a, b)
+#else
+#define TRACE_PROBE2(name, a, b) do { } while(0)
+#endif
+
+/* when a client passed each phase, in microseconds on the
+ * monotonic clock, 0 if it hasn't */
+typedef struct trace_t {
+    uint64_t accept_us;
+    uint64_t read_us;
+    uint64_t request_us;
+    uint64_t lookup_us;
+    uint64_t first_byte_us;
+} trace_t;
+
+struct client_t;
+
+extern int trace_init(int ring_size, int slow_ms);
+extern void trace_deinit(void);
+extern uint64_t trace_now(void);
+extern void trace_first_byte(struct client_t *client);
+extern void trace_close(struct client_t *client);
+extern void trace_dump(void);
+
+#endif /* _TRACE_H_ */
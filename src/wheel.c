@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "debug.h"
+#include "wheel.h"
+
+static void on_wheel_tick(int fd, short event, void *arg);
+
+/**
+ * monotonic milliseconds
+ */
+static uint64_t wheel_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * unlink a timer from whatever list it's on
+ */
+static void wheel_unlink(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * append a timer to a list
+ */
+static void wheel_link(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * schedule the next tick
+ */
+static void wheel_schedule(timer_wheel_t *wheel) {
+    struct timeval tv;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = WHEEL_TICK_MS * 1000;
+    event_add(&wheel->ev, &tv);
+}
+
+/**
+ * set up an empty wheel.  The wheel only ticks while there
+ * are timers on it.
+ *
+ * @param wheel wheel to set up
+ * @param base event base to tick on
+ */
+void wheel_init(timer_wheel_t *wheel, struct event_base *base) {
+    int index;
+
+    memset(wheel, 0, sizeof(timer_wheel_t));
+    for(index = 0; index < WHEEL_SLOTS; index++) {
+        wheel->slots[index].next = &wheel->slots[index];
+        wheel->slots[index].prev = &wheel->slots[index];
+    }
+
+    event_set(&wheel->ev, -1, 0, on_wheel_tick, wheel);
+    event_base_set(base, &wheel->ev);
+}
+
+/**
+ * stop ticking.  Timers still on the wheel are abandoned.
+ */
+void wheel_deinit(timer_wheel_t *wheel) {
+    event_del(&wheel->ev);
+}
+
+/**
+ * set up a timer that isn't on any wheel yet
+ *
+ * @param timer timer to set up
+ * @param fn expiry callback
+ * @param arg opaque argument for fn
+ */
+void wheel_timer_init(wheel_timer_t *timer,
+                      void (*fn)(wheel_timer_t *timer, void *arg),
+                      void *arg) {
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+/**
+ * (re)arm a timer to fire ms from now, to the resolution
+ * of a tick
+ *
+ * @param wheel wheel to arm on
+ * @param timer timer to arm
+ * @param ms milliseconds from now
+ */
+void wheel_timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, int ms) {
+    uint32_t ticks;
+
+    wheel_timer_del(wheel, timer);
+
+    ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if(!ticks)
+        ticks = 1;
+
+    timer->rounds = (ticks - 1) / WHEEL_SLOTS;
+    wheel_link(&wheel->slots[(wheel->current + ticks) & (WHEEL_SLOTS - 1)], timer);
+
+    if(!wheel->armed++) {
+        wheel->last_tick_ms = wheel_now();
+        wheel_schedule(wheel);
+    }
+}
+
+/**
+ * disarm a timer, if it is armed
+ *
+ * @param wheel wheel it is armed on
+ * @param timer timer to disarm
+ */
+void wheel_timer_del(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if(!timer->next)
+        return;
+
+    wheel_unlink(timer);
+    if(!--wheel->armed)
+        event_del(&wheel->ev);
+}
+
+/**
+ * advance the wheel one slot, firing anything that's due
+ */
+static void wheel_advance(timer_wheel_t *wheel) {
+    wheel_timer_t expired;
+    wheel_timer_t *head, *timer, *next;
+
+    expired.next = expired.prev = &expired;
+
+    wheel->current = (wheel->current + 1) & (WHEEL_SLOTS - 1);
+    head = &wheel->slots[wheel->current];
+
+    for(timer = head->next; timer != head; timer = next) {
+        next = timer->next;
+        if(timer->rounds) {
+            timer->rounds--;
+            continue;
+        }
+
+        wheel_unlink(timer);
+        wheel_link(&expired, timer);
+    }
+
+    /* callbacks are free to add or remove any timer, including
+     * the ones still waiting on the expired list */
+    while((timer = expired.next) != &expired) {
+        wheel_unlink(timer);
+        wheel->armed--;
+        timer->fn(timer, timer->arg);
+    }
+}
+
+/**
+ * tick callback -- catch up on however many ticks have
+ * actually gone by
+ */
+static void on_wheel_tick(int fd, short event, void *arg) {
+    timer_wheel_t *wheel = (timer_wheel_t *)arg;
+    uint64_t now = wheel_now();
+
+    while(wheel->armed && now - wheel->last_tick_ms >= WHEEL_TICK_MS) {
+        wheel->last_tick_ms += WHEEL_TICK_MS;
+        wheel_advance(wheel);
+    }
+
+    if(wheel->armed) {
+        wheel_schedule(wheel);
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 Ron Pedde (ron@pedde.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+#include <event.h>
+
+#define WHEEL_SLOTS 512      /* power of two */
+#define WHEEL_TICK_MS 100
+
+/* a timer on a hashed timing wheel.  Embed one of these in
+ * whatever needs timing out -- arming and disarming are O(1). */
+typedef struct wheel_timer_t {
+    struct wheel_timer_t *next;
+    struct wheel_timer_t *prev;
+    uint32_t rounds;          /* full turns left before firing */
+    void (*fn)(struct wheel_timer_t *timer, void *arg);
+    void *arg;
+} wheel_timer_t;
+
+typedef struct timer_wheel_t {
+    wheel_timer_t slots[WHEEL_SLOTS];   /* list heads */
+    uint32_t current;
+    uint64_t last_tick_ms;
+    int armed;                          /* timers on the wheel */
+    struct event ev;
+} timer_wheel_t;
+
+extern void wheel_init(timer_wheel_t *wheel, struct event_base *base);
+extern void wheel_deinit(timer_wheel_t *wheel);
+extern void wheel_timer_init(wheel_timer_t *timer,
+                             void (*fn)(wheel_timer_t *timer, void *arg),
+                             void *arg);
+extern void wheel_timer_add(timer_wheel_t *wheel, wheel_timer_t *timer, int ms);
+extern void wheel_timer_del(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+#endif /* _WHEEL_H_ */